@@ -6,6 +6,26 @@ from math import sqrt
 
 imgsiz = (640, 480)
 
+def decode_mcld(dat):
+    """ decode an MCLd chunk into an Nx4 array of (x, y, theta, heading) """
+    n, qxy, qtheta = struct.unpack("=Iff", dat[:12])
+    vals = []
+    u, shift = 0, 0
+    for b in bytearray(dat[12:]):
+        u |= (b & 0x7f) << shift
+        shift += 7
+        if not (b & 0x80):
+            vals.append((u >> 1) ^ -(u & 1))
+            u, shift = 0, 0
+    d = np.array(vals[:4*n], np.int64).reshape((n, 4))
+    q = np.cumsum(d[:, :3], axis=0)
+    p = np.zeros((n, 4), np.float32)
+    p[:, 0:2] = q[:, 0:2] * qxy
+    p[:, 2] = q[:, 2] * qtheta
+    p[:, 3] = (q[:, 2] + d[:, 3]) * qtheta
+    return p
+
+
 def read_frame(f):
     try:
         ck = chunk.Chunk(f, False, False, True)
@@ -40,6 +60,13 @@ def read_frame(f):
             framedata['carstate'] = (throttle, steering, accel, gyro, servo, wheels, periods)
         elif n == b'MCL4':  # monte carlo localization, 4-float state (particles w/ heading)
             framedata['particles'] = np.frombuffer(ick.read(), np.float32).reshape((-1, 4))
+        elif n == b'MCLd':  # delta+varint coded particles, likeliest first
+            framedata['particles'] = decode_mcld(ick.read())
+        elif n == b'MCLs':  # particle cloud summary
+            dat = struct.unpack("=I13f", ick.read())
+            framedata['particle_count'] = dat[0]
+            framedata['particle_mean'] = np.float32(dat[1:5])
+            framedata['particle_cov'] = np.float32(dat[5:14]).reshape((3, 3))
         elif n == b'aCDF':  # activation CDF, new thing
             framedata['activations'] = np.frombuffer(ick.read(), np.int32)
         elif n == b'LM01':  # expected landmark location
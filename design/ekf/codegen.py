@@ -1,4 +1,5 @@
 import sympy as sp
+from sympy.codegen.ast import real, float32
 from sympy.printing.python import PythonPrinter
 
 C_UFs = {
@@ -19,7 +20,10 @@ pyprint = PythonPrinter(None)
 
 
 def ccode(expr):
-    return sp.ccode(expr, user_functions=C_UFs)
+    # print single-precision functions and literals (sinf, 0.5F), otherwise
+    # every expression gets promoted to double and back
+    return sp.ccode(expr, user_functions=C_UFs, standard='c99',
+                    type_aliases={real: float32})
 
 
 def pycode(expr):
@@ -53,53 +57,55 @@ class EKFGen:
         self.fcc = None
         self.fpy = None
 
-    def open(self, outdir_cc, outdir_py, x0, P0):
-        # FIXME: make class name, file name, path flexible
-        self.fh = open("%s/ekf.h" % outdir_cc, "w")
-        self.fcc = open("%s/ekf.cc" % outdir_cc, "w")
+    def open(self, outdir_cc, outdir_py, x0, P0, name="ekf", classname="EKF",
+             guard="MODEL_EKF_H_"):
+        ''' Start writing <name>.h, <name>.cc and ekf.py. The C++ class
+        uses only fixed-size Eigen types, so none of its methods touch the
+        heap. '''
+        self.fh = open("%s/%s.h" % (outdir_cc, name), "w")
+        self.fcc = open("%s/%s.cc" % (outdir_cc, name), "w")
         self.fpy = open("%s/ekf.py" % outdir_py, "w")
+        self.classname = classname
+        self.guard = guard
         N = self.N
 
-        print('''#ifndef MODEL_EKF_H_
-#define MODEL_EKF_H_
+        print('''#ifndef %s
+#define %s
 #include <Eigen/Dense>
 
 // This file is auto-generated by ekf/codegen.py. DO NOT EDIT.
 
 
-class EKF {
+class %s {
  public:
-  EKF();
-  
-  void Reset();
-''', file=self.fh)
-        print('''#include <Eigen/Dense>
-#include "ekf.h"
+  typedef Eigen::Matrix<float, %d, 1> State;
+  typedef Eigen::Matrix<float, %d, %d> Covariance;
 
-// This file is auto-generated by ekf/codegen.py. DO NOT EDIT.
+  %s();
 
-using Eigen::VectorXf;
-using Eigen::MatrixXf;
+  void Reset();
+''' % (guard, guard, classname, N, N, N, classname), file=self.fh)
+        print('''#include <math.h>
+#include <Eigen/Dense>
+#include "%s.h"
 
-#define Min(x, y) fminf(x, y)
-#define Max(x, y) fmaxf(x, y)
+// This file is auto-generated by ekf/codegen.py. DO NOT EDIT.
 
-static inline float Heaviside(float x) {
-  return x < 0 ? 0 : 1;
+static inline float Heaviside(float x, float h0 = 1) {
+  return x < 0 ? 0 : x > 0 ? 1 : h0;
 }
 
 static inline float DiracDelta(float x) {
   return x == 0;
 }
 
-EKF::EKF() : x_(%d), P_(%d, %d) {
+%s::%s() {
   Reset();
 }
-
-''' % (N, N, N), file=self.fcc)
-        print('void EKF::Reset() {', file=self.fcc)
+''' % (name, classname, classname), file=self.fcc)
+        print('void %s::Reset() {' % classname, file=self.fcc)
         print('  x_ <<', ccode_matrix(x0, 8), file=self.fcc)
-        print('  P_.setIdentity();', file=self.fcc)
+        print('  P_.setZero();', file=self.fcc)
         print('  P_.diagonal() <<', ccode_matrix(P0, 4), file=self.fcc)
         print('}\n', file=self.fcc)
 
@@ -130,17 +136,18 @@ def initial_state():''', file=self.fpy)
 
     def close(self):
         print('''
+  State& GetState() { return x_; }
+  Covariance& GetCovariance() { return P_; }
 
-  Eigen::VectorXf& GetState() { return x_; }
-  Eigen::MatrixXf& GetCovariance() { return P_; }
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
  private:
-  Eigen::VectorXf x_;
-  Eigen::MatrixXf P_;
+  State x_;
+  Covariance P_;
 };
 
-#endif  // MODEL_EKF_H_
-''', file=self.fh)
+#endif  // %s
+''' % self.guard, file=self.fh)
         self.fh.close()
         self.fcc.close()
         self.fpy.close()
@@ -179,7 +186,7 @@ def initial_state():''', file=self.fpy)
                 print('    F[%d, %d] += %s' % (
                     i / N, i % N, pycode(term)), file=self.fpy)
 
-        if Q.is_Matrix:
+        if Q.shape[1] > 1:
             print('\n    Q = np.zeros((%d, %d))' % (N, N), file=self.fpy)
             for i, term in enumerate(es[2]):
                 if term != 0:
@@ -187,14 +194,14 @@ def initial_state():''', file=self.fpy)
                         i / N, i % N, pycode(term)), file=self.fpy)
 
         else:
-            print('    Q = np.float32([', ', '.join(
-                [ccode(x*x) for x in es[2]]) + '])', file=self.fpy)
+            print('\n    Q = np.float32([', ', '.join(
+                [pycode(x*x) for x in es[2]]) + '])', file=self.fpy)
 
         for i, term in enumerate(es[1]):
             if term != 0:
                 print('    x[%d] += %s' % (i, pycode(term)), file=self.fpy)
 
-        if Q.is_Matrix:
+        if Q.shape[1] > 1:
             print('\n    P = np.dot(F, np.dot(P, F.T)) + Delta_t * Q', file=self.fpy)
         else:
             print('\n    P = np.dot(F, np.dot(P, F.T)) + Delta_t * np.diag(Q)', file=self.fpy)
@@ -233,13 +240,14 @@ def initial_state():''', file=self.fpy)
 
     def generate_predict_cc(self, f, u, Q, dt, N, F, vs, es):
         N = self.N
+        cls = self.classname
 
         arglist = ["float " + ccode(dt)] + ["float " + ccode(ui) for ui in u]
-        print("void EKF::Predict(%s) {" % ', '.join(arglist), file=self.fcc)
+        print("void %s::Predict(%s) {" % (cls, ', '.join(arglist)), file=self.fcc)
         print('  void Predict(%s);' % ', '.join(arglist), file=self.fh)
 
         for i, elem in enumerate(self.X):
-            if elem in (f - self.X).free_symbols:
+            if elem in (f - self.X).free_symbols or elem in Q.free_symbols:
                 print("  float %s = x_[%d];" % (ccode(elem), i), file=self.fcc)
 
         print("", file=self.fcc)
@@ -247,24 +255,43 @@ def initial_state():''', file=self.fpy)
         for x in vs:
             print('  float %s = %s;' % (ccode(x[0]), ccode(x[1])), file=self.fcc)
 
-        print('\n  MatrixXf F(%d, %d);' % (N, N), file=self.fcc)
-        print('  F.setIdentity();', file=self.fcc)
-        for i, term in enumerate(es[0]):
-            if term != 0:
-                print('  F(%d, %d) += %s;' % (i / N, i % N, ccode(term)), file=self.fcc)
-
-        print('\n  VectorXf Q(%d);' % N, file=self.fcc)
-        print('  Q <<', ', '.join([ccode(x*x) for x in es[2]]) + ';', file=self.fcc)
+        # F = I + dF is mostly identity, so rather than multiplying out a dense
+        # F P F^T, add dF(i, j) times row j of P into row i, then the same for
+        # the columns of the result
+        dF = [(i // N, i % N, term) for i, term in enumerate(es[0]) if term != 0]
+        if dF:
+            print('', file=self.fcc)
+            for i, j, term in dF:
+                print('  float F_%d_%d = %s;' % (i, j, ccode(term)), file=self.fcc)
+            print('  Covariance FP = P_;', file=self.fcc)
+            for i, j, term in dF:
+                print('  FP.row(%d) += F_%d_%d * P_.row(%d);' % (i, i, j, j),
+                      file=self.fcc)
+            print('  P_ = FP;', file=self.fcc)
+            for i, j, term in dF:
+                print('  P_.col(%d) += F_%d_%d * FP.col(%d);' % (i, i, j, j),
+                      file=self.fcc)
+
+        # Q is either a full covariance matrix or a vector of standard
+        # deviations along the diagonal
+        print('', file=self.fcc)
+        if Q.shape[1] > 1:
+            for k, term in enumerate(es[2]):
+                if term != 0:
+                    print('  P_(%d, %d) += %s;' % (
+                        k // N, k % N, ccode(dt * term)), file=self.fcc)
+        else:
+            for k, term in enumerate(es[2]):
+                if term != 0:
+                    print('  P_(%d, %d) += %s;' % (
+                        k, k, ccode(dt * term**2)), file=self.fcc)
 
+        print('', file=self.fcc)
         for i, term in enumerate(es[1]):
             if term != 0:
                 print('  x_[%d] += %s;' % (i, ccode(term)), file=self.fcc)
-        
-        print('\n  P_ = F * P_ * F.transpose();', file=self.fcc)
-        print('  P_.diagonal() += ' + ccode(dt) + ' * Q;', file=self.fcc)
         print('}\n', file=self.fcc)
 
-
     def generate_measurement(self, name, h_x, h_z, z_k, R_k):
         H = h_x.jacobian(self.X)
         M = h_z.jacobian(z_k) + h_x.jacobian(z_k)
@@ -291,60 +318,75 @@ def initial_state():''', file=self.fpy)
         '''
 
         N = self.N
+        cls = self.classname
+        Ny, Nz = y_k.shape[0], len(z_k)
+
+        # measurement noise is given in terms of z_k (Rz), and mapped through
+        # Mk to the measurement residual (Rk) unless that's the identity
+        Rname = 'Rk' if M.is_Identity else 'Rz'
         arglist = ["float " + ccode(ui) for ui in z_k]
         if not R_k.is_Matrix and R_k.is_Symbol:
-            arglist.append("Eigen::MatrixXf Rk")
+            arglist.append("const Eigen::Matrix<float, %d, %d> &%s" % (
+                Nz, Nz, Rname))
         name = name[0].upper() + name[1:]
-        print('bool EKF::Update%s(%s) {' % (name, ', '.join(arglist)), file=self.fcc)
+        print('bool %s::Update%s(%s) {' % (cls, name, ', '.join(arglist)), file=self.fcc)
         print('  bool Update%s(%s);' % (name, ', '.join(arglist)), file=self.fh)
 
+        Rsyms = R_k.free_symbols if R_k.is_Matrix else set()
         for i, elem in enumerate(self.X):
-            if elem in h_x.free_symbols:
+            if elem in h_x.free_symbols or elem in Rsyms:
                 print("  float %s = x_[%d];" % (ccode(elem), i), file=self.fcc)
 
         for x in vs:
             print('  float %s = %s;' % (ccode(x[0]), ccode(x[1])), file=self.fcc)
 
-        print("", file=self.fcc)
-
-        print('\n  VectorXf yk(%d);' % (y_k.shape[0]), file=self.fcc)
+        print('\n  Eigen::Matrix<float, %d, 1> yk;' % Ny, file=self.fcc)
         print('  yk <<', ccode_matrix(es[0], 8), file=self.fcc)
 
-        print('\n  MatrixXf Hk(%d, %d);' % H.shape, file=self.fcc)
+        print('\n  Eigen::Matrix<float, %d, %d> Hk;' % (Ny, N), file=self.fcc)
         print('  Hk <<', ccode_matrix(es[1], 8), file=self.fcc)
 
         if R_k.is_Matrix:
+            print('\n  Eigen::Matrix<float, %d, %d> %s;' % (Nz, Nz, Rname),
+                  file=self.fcc)
             if R_k.shape[1] > 1:
-                print('\n  MatrixXf Rk(%d, %d);' % R_k.shape, file=self.fcc)
-                print('  Rk <<', ccode_matrix(R_k, 8), file=self.fcc)
+                print('  %s <<' % Rname, ccode_matrix(R_k, 8), file=self.fcc)
             else:
-                print('\n  VectorXf Rk(%d);' % R_k.shape[0], file=self.fcc)
                 # in this case we need to square it also
-                # print >>self.fcc, '  Rk <<', ccode_matrix(R_k, 8)
-                print('  Rk <<', ', '.join([ccode(x*x) for x in R_k]) + ';', file=self.fcc)
+                print('  %s.setZero();' % Rname, file=self.fcc)
+                print('  %s.diagonal() <<' % Rname, ', '.join(
+                    [ccode(x*x) for x in R_k]) + ';', file=self.fcc)
 
         if not M.is_Identity:
-            print('  MatrixXf Mk(%d, %d);' % M.shape, file=self.fcc)
+            print('\n  Eigen::Matrix<float, %d, %d> Mk;' % (Ny, Nz), file=self.fcc)
             print('  Mk <<', ccode_matrix(es[2], 8), file=self.fcc)
-            print('  Rk = Mk * Rk * Mk.transpose();', file=self.fcc)
-
-        Sshape = es[1].shape[0]
-        if Sshape >= 2 and Sshape <= 6:
-            Sshape = str(Sshape)
-        else:
-            Sshape = 'X'
-        if R_k.is_Matrix and R_k.shape[1] == 1:
-            print('\n  Eigen::Matrix%sf S = Hk * P_ * Hk.transpose();' % (
-                    Sshape), file=self.fcc)
-            print('  S.diagonal() += Rk;', file=self.fcc)
-        else:
-            print('\n  Eigen::Matrix%sf S = Hk * P_ * Hk.transpose() + Rk;' % (
-                    Sshape), file=self.fcc)
-        print('  MatrixXf K = P_ * Hk.transpose() * S.inverse();', file=self.fcc)
-        # FIXME: return false if S is not invertible?
-
+            print('  Eigen::Matrix<float, %d, %d> Rk = Mk * Rz * Mk.transpose();' % (
+                Ny, Ny), file=self.fcc)
+
+        print('\n  Eigen::Matrix<float, %d, %d> PHt = P_ * Hk.transpose();' % (
+            N, Ny), file=self.fcc)
+        print('  Eigen::Matrix<float, %d, %d> S = Hk * PHt + Rk;' % (
+            Ny, Ny), file=self.fcc)
+        print('  Eigen::Matrix<float, %d, %d> K;' % (N, Ny), file=self.fcc)
+        # S is a covariance, so Cholesky doubles as the invertibility check;
+        # a determinant threshold would reject legitimately small ones
+        print('  Eigen::LLT<Eigen::Matrix<float, %d, %d> > llt(S);' % (
+            Ny, Ny), file=self.fcc)
+        print('  if (llt.info() != Eigen::Success) {', file=self.fcc)
+        print('    return false;', file=self.fcc)
+        print('  }', file=self.fcc)
+        print('  K.noalias() = llt.solve(PHt.transpose()).transpose();',
+              file=self.fcc)
+
+        # Joseph form: P = (I - K Hk) P (I - K Hk)^T + K Rk K^T stays
+        # symmetric positive definite in single precision, where the short
+        # form (I - K Hk) P slowly loses symmetry
         print('\n  x_.noalias() += K * yk;', file=self.fcc)
-        print('  P_ = (MatrixXf::Identity(%d, %d) - K*Hk) * P_;' % (N, N), file=self.fcc)
+        print('  Covariance IKH = Covariance::Identity();', file=self.fcc)
+        print('  IKH.noalias() -= K * Hk;', file=self.fcc)
+        print('  Covariance P = IKH * P_ * IKH.transpose();', file=self.fcc)
+        print('  P.noalias() += K * Rk * K.transpose();', file=self.fcc)
+        print('  P_ = P;', file=self.fcc)
 
         print('  return true;', file=self.fcc)
         print('}\n', file=self.fcc)
@@ -392,8 +434,8 @@ def initial_state():''', file=self.fpy)
         # FIXME: return false if S is not invertible?
 
         print('''    x += np.dot(K, yk)
-    KHk = np.dot(K, Hk)
-    P = np.dot((np.eye(len(x)) - KHk), P)
+    IKH = np.eye(len(x)) - np.dot(K, Hk)
+    P = np.dot(IKH, np.dot(P, IKH.T)) + np.dot(K, np.dot(Rk, K.T))
     return x, P, LL
 
 ''', file=self.fpy)
@@ -1,7 +1,7 @@
 #!/usr/bin/env python
 import numpy as np
 from numpy import sin, cos, tan, exp, sqrt, sign, arctan as atan, arctan2 as atan2, abs as Abs
-from __builtin__ import min as Min, max as Max
+from builtins import min as Min, max as Max
 
 # This file is auto-generated by ekf/codegen.py. DO NOT EDIT.
 
@@ -16,7 +16,7 @@ def DiracDelta(x, v=1):
 
 def initial_state():
     x = np.float32(
-        [0.0, 0.0, 0.0]
+        [0, 0, 0]
     )
     P = np.diag(
         [0.0100000, 0.0100000, 0.0100000]
@@ -34,11 +34,11 @@ def predict(x, P, Delta_t, u_x, u_theta):
     tmp3 = tmp2*u_x
     tmp4 = cos(tmp1)
     tmp5 = tmp4*u_x
-    tmp6 = 0.25*u_theta
-    tmp7 = tmp2**2
-    tmp8 = 200*u_x
-    tmp9 = tmp4**2
-    tmp10 = -(tmp6 - tmp8)*sin(2*theta + tmp0)/2
+    tmp6 = tmp2**2
+    tmp7 = 0.25*u_theta
+    tmp8 = tmp4**2
+    tmp9 = 200*u_x
+    tmp10 = -(tmp7 - tmp9)*sin(2*theta + tmp0)/2
 
     F = np.eye(3)
     F[0, 2] += -tmp3
@@ -90,26 +90,23 @@ def update_lm_bearing(x, P, l_px, l_x, l_y, Rk):
     p_x = x[0]
     p_y = x[1]
     theta = x[2]
-    tmp0 = cos(theta)
-    tmp1 = l_y - p_y
-    tmp2 = tmp0*tmp1
-    tmp3 = sin(theta)
-    tmp4 = l_x - p_x
-    tmp5 = tmp3*tmp4
-    tmp6 = tmp0*tmp4 + tmp1*tmp3
-    tmp7 = -tmp2 + tmp5
-    tmp8 = 1/(tmp6**2 + tmp7**2)
-    tmp9 = tmp3*tmp6
-    tmp10 = tmp0*tmp7
-    tmp11 = tmp8*(tmp0*tmp6 + tmp3*tmp7)
+    tmp0 = sin(theta)
+    tmp1 = l_x - p_x
+    tmp2 = cos(theta)
+    tmp3 = l_y - p_y
+    tmp4 = tmp0*tmp1 - tmp2*tmp3
+    tmp5 = tmp0*tmp3 + tmp1*tmp2
+    tmp6 = 1/(tmp4**2 + tmp5**2)
+    tmp7 = -tmp0*tmp5 + tmp2*tmp4
+    tmp8 = tmp6*(tmp0*tmp4 + tmp2*tmp5)
 
     yk = np.float32(
-        [l_px - atan2(tmp2 - tmp5, tmp6)])
+        [l_px - atan2(-tmp4, tmp5)])
 
     Hk = np.float32([
-        [tmp8*(-tmp10 + tmp9), -tmp11, -1]])
+        [-tmp6*tmp7, -tmp8, -1]])
     Mk = np.float32([
-        [1, tmp8*(tmp10 - tmp9), tmp11]])
+        [1, tmp6*tmp7, tmp8]])
     Rk = np.dot(Mk, np.dot(Rk, Mk.T))
 
     S = np.dot(Hk, np.dot(P, Hk.T)) + Rk
@@ -117,8 +114,8 @@ def update_lm_bearing(x, P, l_px, l_x, l_y, Rk):
     LL = -np.dot(yk, np.dot(np.linalg.inv(S), yk)) - 0.5 * np.log((2 * np.pi)**3 * np.linalg.det(S))
     K = np.linalg.lstsq(S, np.dot(Hk, P))[0].T
     x += np.dot(K, yk)
-    KHk = np.dot(K, Hk)
-    P = np.dot((np.eye(len(x)) - KHk), P)
+    IKH = np.eye(len(x)) - np.dot(K, Hk)
+    P = np.dot(IKH, np.dot(P, IKH.T)) + np.dot(K, np.dot(Rk, K.T))
     return x, P, LL
 
 
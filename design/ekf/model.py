@@ -39,7 +39,7 @@ X = sp.Matrix([v, delta, y_e, psi_e, kappa,
                ml_1, ml_2, ml_3, ml_4,
                srv_a, srv_b, srv_r, srvfb_a, srvfb_b, o_g])
 
-print "state variables:"
+print("state variables:")
 sp.pprint(X.T)
 
 ekfgen = codegen.EKFGen(X)
@@ -161,7 +161,7 @@ f = sp.Matrix([
     o_g
 ])
 
-print "state transition: x +="
+print("state transition: x +=")
 sp.pprint(f - X)
 
 # Our prediction error AKA process noise is kinda seat of the pants, but tuned
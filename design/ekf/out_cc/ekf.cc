@@ -1,45 +1,39 @@
+#include <math.h>
 #include <Eigen/Dense>
 #include "ekf.h"
 
 // This file is auto-generated by ekf/codegen.py. DO NOT EDIT.
 
-using Eigen::VectorXf;
-using Eigen::MatrixXf;
-
-#define Min(x, y) fminf(x, y)
-#define Max(x, y) fmaxf(x, y)
-
-static inline float Heaviside(float x) {
-  return x < 0 ? 0 : 1;
+static inline float Heaviside(float x, float h0 = 1) {
+  return x < 0 ? 0 : x > 0 ? 1 : h0;
 }
 
 static inline float DiracDelta(float x) {
   return x == 0;
 }
 
-EKF::EKF() : x_(8), P_(8, 8) {
+EKF::EKF() {
   Reset();
 }
 
-
 void EKF::Reset() {
-  x_ << 0.0,
-        0.0,
-        1.0,
-        0.05000000074505806,
-        0.029999999329447746,
-        1.0,
-        0.0,
-        1.0;
-  P_.setIdentity();
-  P_.diagonal() << 1.0,
-    1.0,
-    1.0,
-    0.010000000707805157,
-    0.010000000707805157,
-    1.0,
-    1.0,
-    1.0;
+  x_ << 0,
+        0,
+        1.0F,
+        0.0500000007F,
+        0.0299999993F,
+        1.0F,
+        0,
+        1.0F;
+  P_.setZero();
+  P_.diagonal() << 1.0F,
+    1.0F,
+    1.0F,
+    0.0100000007F,
+    0.0100000007F,
+    1.0F,
+    1.0F,
+    1.0F;
 }
 
 void EKF::Predict(float Delta_t, float u_M, float u_delta) {
@@ -54,76 +48,110 @@ void EKF::Predict(float Delta_t, float u_M, float u_delta) {
 
   float tmp0 = fabsf(u_M);
   float tmp1 = k2*tmp0;
-  float tmp2 = tmp0*Heaviside(u_M);
+  float tmp2 = tmp0*Heaviside(u_M, 1.0F/2.0F);
   float tmp3 = Delta_t*v;
   float tmp4 = Delta_t*srv_r;
   float tmp5 = -delta + srv_a*u_delta + srv_b;
 
-  MatrixXf F(8, 8);
-  F.setIdentity();
-  F(0, 0) += -Delta_t*(k3 + tmp1);
-  F(0, 2) += Delta_t*tmp2;
-  F(0, 3) += -tmp0*tmp3;
-  F(0, 4) += -tmp3;
-  F(1, 1) += -tmp4;
-  F(1, 5) += tmp4*u_delta;
-  F(1, 6) += tmp4;
-  F(1, 7) += Delta_t*tmp5;
-
-  VectorXf Q(8);
-  Q << 0.25, 1.0000000000000002e-10, 9.0000000000000002e-6, 9.9999999999999998e-13, 9.9999999999999998e-13, 0, 0, 0;
+  float F_0_0 = -Delta_t*(k3 + tmp1);
+  float F_0_2 = Delta_t*tmp2;
+  float F_0_3 = -tmp0*tmp3;
+  float F_0_4 = -tmp3;
+  float F_1_1 = -tmp4;
+  float F_1_5 = tmp4*u_delta;
+  float F_1_6 = tmp4;
+  float F_1_7 = Delta_t*tmp5;
+  Covariance FP = P_;
+  FP.row(0) += F_0_0 * P_.row(0);
+  FP.row(0) += F_0_2 * P_.row(2);
+  FP.row(0) += F_0_3 * P_.row(3);
+  FP.row(0) += F_0_4 * P_.row(4);
+  FP.row(1) += F_1_1 * P_.row(1);
+  FP.row(1) += F_1_5 * P_.row(5);
+  FP.row(1) += F_1_6 * P_.row(6);
+  FP.row(1) += F_1_7 * P_.row(7);
+  P_ = FP;
+  P_.col(0) += F_0_0 * FP.col(0);
+  P_.col(0) += F_0_2 * FP.col(2);
+  P_.col(0) += F_0_3 * FP.col(3);
+  P_.col(0) += F_0_4 * FP.col(4);
+  P_.col(1) += F_1_1 * FP.col(1);
+  P_.col(1) += F_1_5 * FP.col(5);
+  P_.col(1) += F_1_6 * FP.col(6);
+  P_.col(1) += F_1_7 * FP.col(7);
+
+  P_(0, 0) += 0.25F*Delta_t;
+  P_(1, 1) += 1.0e-10F*Delta_t;
+  P_(2, 2) += 9.0e-6F*Delta_t;
+  P_(3, 3) += 1.0e-12F*Delta_t;
+  P_(4, 4) += 1.0e-12F*Delta_t;
+
   x_[0] += -Delta_t*(-k1*tmp2 + k3*v + tmp1*v);
   x_[1] += tmp4*tmp5;
-
-  P_ = F * P_ * F.transpose();
-  P_.diagonal() += Delta_t * Q;
 }
 
 bool EKF::UpdateIMU(float g_z) {
   float v = x_[0];
   float delta = x_[1];
 
-
-  VectorXf yk(1);
+  Eigen::Matrix<float, 1, 1> yk;
   yk << -delta*v + g_z;
 
-  MatrixXf Hk(1, 8);
+  Eigen::Matrix<float, 1, 8> Hk;
   Hk << delta, v, 0, 0, 0, 0, 0, 0;
 
-  VectorXf Rk(1);
-  Rk << pow(v + 0.001, 2);
+  Eigen::Matrix<float, 1, 1> Rk;
+  Rk.setZero();
+  Rk.diagonal() << powf(v + 0.001F, 2);
 
-  Eigen::MatrixXf S = Hk * P_ * Hk.transpose();
-  S.diagonal() += Rk;
-  MatrixXf K = P_ * Hk.transpose() * S.inverse();
+  Eigen::Matrix<float, 8, 1> PHt = P_ * Hk.transpose();
+  Eigen::Matrix<float, 1, 1> S = Hk * PHt + Rk;
+  Eigen::Matrix<float, 8, 1> K;
+  Eigen::LLT<Eigen::Matrix<float, 1, 1> > llt(S);
+  if (llt.info() != Eigen::Success) {
+    return false;
+  }
+  K.noalias() = llt.solve(PHt.transpose()).transpose();
 
   x_.noalias() += K * yk;
-  P_ = (MatrixXf::Identity(8, 8) - K*Hk) * P_;
+  Covariance IKH = Covariance::Identity();
+  IKH.noalias() -= K * Hk;
+  Covariance P = IKH * P_ * IKH.transpose();
+  P.noalias() += K * Rk * K.transpose();
+  P_ = P;
   return true;
 }
 
 bool EKF::UpdateEncoders(float dsdt, float wperiod) {
   float v = x_[0];
-  float tmp0 = -v;
-
 
-  VectorXf yk(2);
-  yk << dsdt + tmp0,
-        tmp0 + wperiod;
+  Eigen::Matrix<float, 2, 1> yk;
+  yk << dsdt - v,
+        -v + wperiod;
 
-  MatrixXf Hk(2, 8);
+  Eigen::Matrix<float, 2, 8> Hk;
   Hk << 1, 0, 0, 0, 0, 0, 0, 0,
         1, 0, 0, 0, 0, 0, 0, 0;
 
-  VectorXf Rk(2);
-  Rk << 13.690000000000001, 12.25;
+  Eigen::Matrix<float, 2, 2> Rk;
+  Rk.setZero();
+  Rk.diagonal() << 13.69F, 12.25F;
 
-  Eigen::Matrix2f S = Hk * P_ * Hk.transpose();
-  S.diagonal() += Rk;
-  MatrixXf K = P_ * Hk.transpose() * S.inverse();
+  Eigen::Matrix<float, 8, 2> PHt = P_ * Hk.transpose();
+  Eigen::Matrix<float, 2, 2> S = Hk * PHt + Rk;
+  Eigen::Matrix<float, 8, 2> K;
+  Eigen::LLT<Eigen::Matrix<float, 2, 2> > llt(S);
+  if (llt.info() != Eigen::Success) {
+    return false;
+  }
+  K.noalias() = llt.solve(PHt.transpose()).transpose();
 
   x_.noalias() += K * yk;
-  P_ = (MatrixXf::Identity(8, 8) - K*Hk) * P_;
+  Covariance IKH = Covariance::Identity();
+  IKH.noalias() -= K * Hk;
+  Covariance P = IKH * P_ * IKH.transpose();
+  P.noalias() += K * Rk * K.transpose();
+  P_ = P;
   return true;
 }
 
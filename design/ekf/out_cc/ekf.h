@@ -7,21 +7,25 @@
 
 class EKF {
  public:
+  typedef Eigen::Matrix<float, 8, 1> State;
+  typedef Eigen::Matrix<float, 8, 8> Covariance;
+
   EKF();
-  
+
   void Reset();
 
   void Predict(float Delta_t, float u_M, float u_delta);
   bool UpdateIMU(float g_z);
   bool UpdateEncoders(float dsdt, float wperiod);
 
+  State& GetState() { return x_; }
+  Covariance& GetCovariance() { return P_; }
 
-  Eigen::VectorXf& GetState() { return x_; }
-  Eigen::MatrixXf& GetCovariance() { return P_; }
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
  private:
-  Eigen::VectorXf x_;
-  Eigen::MatrixXf P_;
+  State x_;
+  Covariance P_;
 };
 
 #endif  // MODEL_EKF_H_
@@ -16,7 +16,7 @@ def DiracDelta(x, v=1):
 
 def initial_state():
     x = np.float32(
-        [0.0, 0.0, 1.00000, 0.0500000, 0.0300000, 1.00000, 0.0, 1.00000]
+        [0, 0, 1.00000, 0.0500000, 0.0300000, 1.00000, 0, 1.00000]
     )
     P = np.diag(
         [1.00000, 1.00000, 1.00000, 0.0100000, 0.0100000, 1.00000, 1.00000, 1.00000]
@@ -45,16 +45,11 @@ def predict(x, P, Delta_t, u_M, u_delta):
     F[1, 6] += tmp4
     F[1, 7] += Delta_t*tmp5
 
-    Q = np.zeros((8, 8))
-    Q[0, 0] = 0.500000000000000
-    Q[0, 1] = 1.00000000000000e-5
-    Q[0, 2] = 0.00300000000000000
-    Q[0, 3] = 1.00000000000000e-6
-    Q[0, 4] = 1.00000000000000e-6
+    Q = np.float32([ 0.250000000000000, 1.00000000000000e-10, 9.00000000000000e-6, 1.00000000000000e-12, 1.00000000000000e-12, 0, 0, 0])
     x[0] += -Delta_t*(-k1*tmp2 + k3*v + tmp1*v)
     x[1] += tmp4*tmp5
 
-    P = np.dot(F, np.dot(P, F.T)) + Delta_t * Q
+    P = np.dot(F, np.dot(P, F.T)) + Delta_t * np.diag(Q)
     return x, P
 
 
@@ -107,17 +102,16 @@ def update_IMU(x, P, g_z):
     LL = -np.dot(yk, np.dot(np.linalg.inv(S), yk)) - 0.5 * np.log((2 * np.pi)**8 * np.linalg.det(S))
     K = np.linalg.lstsq(S, np.dot(Hk, P))[0].T
     x += np.dot(K, yk)
-    KHk = np.dot(K, Hk)
-    P = np.dot((np.eye(len(x)) - KHk), P)
+    IKH = np.eye(len(x)) - np.dot(K, Hk)
+    P = np.dot(IKH, np.dot(P, IKH.T)) + np.dot(K, np.dot(Rk, K.T))
     return x, P, LL
 
 
 def update_encoders(x, P, dsdt, wperiod):
     v = x[0]
-    tmp0 = -v
 
     yk = np.float32(
-        [dsdt + tmp0, tmp0 + wperiod])
+        [dsdt - v, -v + wperiod])
 
     Hk = np.float32([
         [1, 0, 0, 0, 0, 0, 0, 0],
@@ -131,8 +125,8 @@ def update_encoders(x, P, dsdt, wperiod):
     LL = -np.dot(yk, np.dot(np.linalg.inv(S), yk)) - 0.5 * np.log((2 * np.pi)**8 * np.linalg.det(S))
     K = np.linalg.lstsq(S, np.dot(Hk, P))[0].T
     x += np.dot(K, yk)
-    KHk = np.dot(K, Hk)
-    P = np.dot((np.eye(len(x)) - KHk), P)
+    IKH = np.eye(len(x)) - np.dot(K, Hk)
+    P = np.dot(IKH, np.dot(P, IKH.T)) + np.dot(K, np.dot(Rk, K.T))
     return x, P, LL
 
 
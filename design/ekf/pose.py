@@ -0,0 +1,72 @@
+import numpy as np
+import sympy as sp
+import codegen
+import os
+
+
+# Pose estimator for the drive controller: dead-reckons at the control rate
+# from the gyro and wheel encoders, and takes absolute poses from the
+# localizers (ceiltrack, coneslam) at the camera rate.
+
+sp.init_printing()
+try:
+    os.mkdir("pose_py")
+except Exception:
+    pass
+
+# Define our model's state variables:
+(x, y, theta,  # pose in track coordinates (m, m, rad)
+ b_w  # gyro bias (rad/s); the absolute heading fixes make this observable
+ ) = sp.symbols("p_x p_y theta b_w", real=True)
+
+# dt, wheel speed, gyro yaw rate
+(Delta_t, u_v, u_w) = sp.symbols("Delta_t u_v u_w")
+
+X = sp.Matrix([x, y, theta, b_w])
+
+ekfgen = codegen.EKFGen(X)
+
+# initial state and covariance; the driver resets the pose to wherever the
+# localizers think we are before starting
+x0 = np.float32([0, 0, 0, 0])
+P0 = np.float32([0.1, 0.1, 0.1, 0.02])**2
+
+ekfgen.open("../../src/localization/ekf", "pose_py",
+            sp.Matrix(x0), sp.Matrix(P0), name="pose_ekf",
+            classname="PoseEKF", guard="LOCALIZATION_EKF_POSE_EKF_H_")
+
+# Prediction: midpoint integration of the unicycle model over one control
+# period, with the gyro bias removed
+w = u_w - b_w
+theta1 = theta + Delta_t * w / 2
+f = sp.Matrix([
+    x + Delta_t * u_v * sp.cos(theta1),
+    y + Delta_t * u_v * sp.sin(theta1),
+    theta + Delta_t * w,
+    b_w
+])
+
+# process noise, as standard deviations per sqrt(second): wheel slip grows
+# with speed, the gyro is good but not perfect, and the bias wanders slowly
+Q = sp.Matrix([
+    0.1*u_v + 0.01,
+    0.1*u_v + 0.01,
+    0.05,
+    0.002,
+])
+
+print("state transition: x +=")
+sp.pprint(f - X)
+
+ekfgen.generate_predict(f, sp.Matrix([u_v, u_w]), Q, Delta_t)
+
+
+# Absolute pose from a localizer, with its covariance. The heading residual
+# isn't wrapped here; the caller must pass m_theta within pi of theta.
+m_x, m_y, m_theta = sp.symbols("m_x m_y m_theta")
+h_x_pose = sp.Matrix([x, y, theta])
+h_z_pose = sp.Matrix([m_x, m_y, m_theta])
+ekfgen.generate_measurement(
+    "pose", h_x_pose, h_z_pose, h_z_pose, sp.symbols("R_pose"))
+
+ekfgen.close()
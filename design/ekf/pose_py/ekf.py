@@ -0,0 +1,114 @@
+#!/usr/bin/env python
+import numpy as np
+from numpy import sin, cos, tan, exp, sqrt, sign, arctan as atan, arctan2 as atan2, abs as Abs
+from builtins import min as Min, max as Max
+
+# This file is auto-generated by ekf/codegen.py. DO NOT EDIT.
+
+
+def Heaviside(x):
+    return 1 * (x > 0)
+
+
+def DiracDelta(x, v=1):
+    return x == 0 and v or 0
+
+
+def initial_state():
+    x = np.float32(
+        [0, 0, 0, 0]
+    )
+    P = np.diag(
+        [0.0100000, 0.0100000, 0.0100000, 0.000400000]
+    )
+
+    return x, P
+
+
+def predict(x, P, Delta_t, u_v, u_w):
+    (p_x, p_y, theta, b_w) = x
+
+    tmp0 = Delta_t*(b_w - u_w)
+    tmp1 = -theta + tmp0/2
+    tmp2 = sin(tmp1)
+    tmp3 = Delta_t*u_v
+    tmp4 = tmp2*tmp3
+    tmp5 = Delta_t**2*u_v/2
+    tmp6 = cos(tmp1)
+    tmp7 = tmp3*tmp6
+    tmp8 = 0.1*u_v + 0.01
+
+    F = np.eye(4)
+    F[0, 2] += tmp4
+    F[0, 3] += -tmp2*tmp5
+    F[1, 2] += tmp7
+    F[1, 3] += -tmp5*tmp6
+    F[2, 3] += -Delta_t
+
+    Q = np.float32([ tmp8**2, tmp8**2, 0.00250000000000000, 4.00000000000000e-6])
+    x[0] += tmp7
+    x[1] += -tmp4
+    x[2] += -tmp0
+
+    P = np.dot(F, np.dot(P, F.T)) + Delta_t * np.diag(Q)
+    return x, P
+
+
+def step(x, u, Delta_t):
+    (p_x, p_y, theta, b_w) = x
+    (u_v, u_w) = u
+
+    tmp0 = Delta_t*(b_w - u_w)
+    tmp1 = -theta + tmp0/2
+    tmp2 = cos(tmp1)
+    tmp3 = Delta_t*tmp2
+    tmp4 = tmp3*u_v
+    tmp5 = sin(tmp1)
+    tmp6 = Delta_t*tmp5
+    tmp7 = tmp6*u_v
+    tmp8 = Delta_t**2*u_v/2
+    tmp9 = tmp5*tmp8
+    tmp10 = tmp2*tmp8
+
+    F = np.eye(4)
+    F[0, 2] += tmp7
+    F[0, 3] += -tmp9
+    F[1, 2] += tmp4
+    F[1, 3] += -tmp10
+    F[2, 3] += -Delta_t
+
+    J = np.zeros((4, 2))
+    J[0, 0] = tmp3
+    J[0, 1] = tmp9
+    J[1, 0] = -tmp6
+    J[1, 1] = tmp10
+    J[2, 1] = Delta_t
+    x[0] += tmp4
+    x[1] += -tmp7
+    x[2] += -tmp0
+    return x, F, J
+
+
+def update_pose(x, P, m_x, m_y, m_theta, Rk):
+    p_x = x[0]
+    p_y = x[1]
+    theta = x[2]
+
+    yk = np.float32(
+        [m_x - p_x, m_y - p_y, m_theta - theta])
+
+    Hk = np.float32([
+        [1, 0, 0, 0],
+        [0, 1, 0, 0],
+        [0, 0, 1, 0]])
+
+    S = np.dot(Hk, np.dot(P, Hk.T)) + Rk
+
+    LL = -np.dot(yk, np.dot(np.linalg.inv(S), yk)) - 0.5 * np.log((2 * np.pi)**4 * np.linalg.det(S))
+    K = np.linalg.lstsq(S, np.dot(Hk, P))[0].T
+    x += np.dot(K, yk)
+    IKH = np.eye(len(x)) - np.dot(K, Hk)
+    P = np.dot(IKH, np.dot(P, IKH.T)) + np.dot(K, np.dot(Rk, K.T))
+    return x, P, LL
+
+
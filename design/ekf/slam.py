@@ -6,7 +6,6 @@ import os
 
 sp.init_printing()
 try:
-    os.mkdir("localize_cc")
     os.mkdir("localize_py")
 except Exception:
     pass
@@ -29,7 +28,10 @@ x0 = np.float32([0, 0, 0])
 # but assume we're placed somewhere "near" the start, pointing "mostly" forward for now
 P0 = np.float32([0.1, 0.1, 0.1])**2
 
-ekfgen.open("localize_cc", "localize_py", sp.Matrix(x0), sp.Matrix(P0))
+# the C++ half is built into the tree
+ekfgen.open("../../src/localization/ekf", "localize_py",
+            sp.Matrix(x0), sp.Matrix(P0), name="localize_ekf",
+            classname="LocalizeEKF", guard="LOCALIZATION_EKF_LOCALIZE_EKF_H_")
 
 # Prediction update
 # "predictions" are done based on gyro and encoder measurements
@@ -54,7 +56,7 @@ Q = sp.Matrix([
     [0, 0, Qgyro],
 ])
 
-print "state transition: x +="
+print("state transition: x +=")
 sp.pprint(f - X)
 
 ekfgen.generate_predict(f, sp.Matrix([u_x, u_theta]), Q, Delta_t)
@@ -8,6 +8,9 @@
 #include "hw/imu/imu.h"
 #include "hw/input/js.h"
 #include "inih/cpp/INIReader.h"
+#include "io/binlog.h"
+#include "io/flushthread.h"
+#include "io/telemetryring.h"
 
 #include "controlloop/fit.h"
 #include "controlloop/pid.h"
@@ -24,15 +27,26 @@ const float V_SCALE = WHEEL_DIAMETER*M_PI / DRIVE_RATIO / MOTOR_POLES;
 using Eigen::Vector3f;
 using Eigen::Matrix3f;
 
+// one control loop tick, as logged in a CFL1 chunk
+struct CFSample {
+  float dt;
+  int16_t js_throttle, js_steering;
+  float u_esc, u_steer;
+  float ds, v;
+  float gyro[3], accel[3];
+};
+
 class CFIR : public JoystickListener, public ControlListener {
  public:
-  CFIR(IMU *imu, JoystickInput *js) {
+  CFIR(FlushThread *flush, IMU *imu, JoystickInput *js)
+      : log_(flush), samples_("CFL1") {
     imu_ = imu;
     js_ = js;
     js_throttle_ = 0;
     js_steering_ = 0;
     exit_ = false;
-    recording_ = NULL;
+    samples_.Init(256);
+    log_.AddSource(&samples_);
     mode_ = Control;
   }
   virtual ~CFIR() {}
@@ -65,28 +79,28 @@ class CFIR : public JoystickListener, public ControlListener {
     }
   }
 
+  // the log is binary; tools/logconv/log2txt.py gives back the text
   void StartRecording() {
-    if (recording_) {
+    if (log_.IsOpen()) {
       StopRecording();
     }
     char fnamebuf[256];
-    snprintf(fnamebuf, sizeof(fnamebuf), "log-%ld.txt", time(NULL));
-    recording_ = fopen(fnamebuf, "w");
-    if (recording_ == NULL) {
+    snprintf(fnamebuf, sizeof(fnamebuf), "log-%ld.bin", time(NULL));
+    if (!log_.Open(fnamebuf)) {
       perror(fnamebuf);
       return;
     }
-    // setlinebuf(recording_);
-    fprintf(recording_, "# dt u_esc u_steer dw wperiod gx gy gz ax ay az\n");
     fprintf(stderr, "recording %s\n", fnamebuf);
   }
 
   void StopRecording() {
-    if (recording_ == NULL) {
+    if (!log_.IsOpen()) {
       return;
     }
-    fclose(recording_);
-    recording_ = NULL;
+    log_.Close();
+    if (samples_.Dropped() > 0) {
+      fprintf(stderr, "%d log samples dropped so far\n", samples_.Dropped());
+    }
     fprintf(stderr, "stopped recording\n");
   }
 
@@ -96,7 +110,8 @@ class CFIR : public JoystickListener, public ControlListener {
   int16_t js_throttle_;
   int16_t js_steering_;
   bool exit_;
-  FILE *recording_;
+  BinaryLog log_;
+  TelemetryRing<CFSample> samples_;
 
   bool was_learning = false;
 
@@ -110,7 +125,7 @@ class CFIR : public JoystickListener, public ControlListener {
 
   int n = 0;
 
-  virtual bool OnControlFrame(CarHW *car, float dt) {
+  virtual bool OnControlFrame(CarHW *car, float dt, int64_t t) {
     Vector3f accel, gyro;
 
     js_->ReadInput(this);
@@ -183,11 +198,23 @@ class CFIR : public JoystickListener, public ControlListener {
       fprintf(stderr, "SetControls returned false?\n");
     }
 
-    if (recording_) {
-      fprintf(recording_, "%0.3f %d %d %f %f %f %f %f %f %f %f %f %f\n",
-          dt, Throttle(), Steering(), u_esc, u_steer, ds, v,
-          gyro[0], gyro[1], gyro[2],
-          accel[0], accel[1], accel[2]);
+    if (log_.IsOpen()) {
+      CFSample s;
+      s.dt = dt;
+      s.js_throttle = Throttle();
+      s.js_steering = Steering();
+      s.u_esc = u_esc;
+      s.u_steer = u_steer;
+      s.ds = ds;
+      s.v = v;
+      for (int i = 0; i < 3; i++) {
+        s.gyro[i] = gyro[i];
+        s.accel[i] = accel[i];
+      }
+      samples_.Push(s);
+      if ((n & 15) == 0) {
+        log_.Flush();
+      }
     }
 
     n++;
@@ -277,6 +304,7 @@ void controltest() {
 */
 
 int main(int argc, char *argv[]) {
+  FlushThread flush;
   JoystickInput js;
   INIReader ini("cycloid.ini");
   I2C i2c;
@@ -291,6 +319,9 @@ int main(int argc, char *argv[]) {
   if (!js.Open(ini)) {
     return 1;
   }
+  if (!flush.Init()) {
+    return 1;
+  }
   if (!car->Init()) {
     return 1;
   }
@@ -306,10 +337,11 @@ int main(int argc, char *argv[]) {
   uint16_t wpos, wperiod;
   uint16_t last_wpos = 0;
 
-  CFIR ir(imu, &js);
+  CFIR ir(&flush, imu, &js);
 
   setlinebuf(stdout);
 
   car->RunMainLoop(&ir);
+  ir.StopRecording();
 }
 
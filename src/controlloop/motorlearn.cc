@@ -11,7 +11,7 @@ class ControlRamp : public ControlListener {
  public:
   ControlRamp() { frameno = 0; }
 
-  bool OnControlFrame(CarHW *car, float dt) override {
+  bool OnControlFrame(CarHW *car, float dt, int64_t t) override {
     float ds, v;
     car->GetWheelMotion(&ds, &v);
     printf("%f %f\n", frameno * 1.0f / maxframes, v);
@@ -38,7 +38,7 @@ class AccelTest : public ControlListener {
     u = 0;
   }
 
-  bool OnControlFrame(CarHW *car, float dt) override {
+  bool OnControlFrame(CarHW *car, float dt, int64_t t) override {
     Eigen::Vector3f accel, gyro;
     float ds, v;
     car->GetWheelMotion(&ds, &v);
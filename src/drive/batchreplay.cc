@@ -0,0 +1,547 @@
+// Replay recordings through the car's own localization, obstacle detection
+// and planning, with no hardware, a recording per core at a time:
+//
+//   batchreplay [-j threads] [-c driverconf.txt] [-i cycloid.ini] [-o dir]
+//               [-b] file.rec...
+//
+// Each frame is localized, checked for obstacles and planned from as the car
+// would have, with the control ticks recorded ahead of it (TLM1, see
+// drive/driver.h) fed to the controller in between; recordings from before
+// those were kept get one tick per frame from its CSt1 car state. The
+// driver configuration is the one each recording was made with unless -c
+// gives one.
+//
+// For each file.rec, dir/file.replay.csv gets a line per frame with the
+// pose, the controller's state and plan and how long each stage took (or
+// with -b, dir/file.replay.bin the same as packed ReplaySamples in an RPL1
+// chunk after the configuration used), and dir/laps.csv the lap times.
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <Eigen/Dense>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "drive/config.h"
+#include "drive/controller.h"
+#include "drive/course.h"
+#include "drive/driver.h"
+#include "drive/obstacle.h"
+#include "inih/cpp/INIReader.h"
+#include "io/recordfile.h"
+#include "lens/fisheye.h"
+#include "localization/fusion/ceiltrack_localizer.h"
+#include "localization/fusion/coneslam_localizer.h"
+#include "localization/fusion/fusion.h"
+#include "timing/clock.h"
+
+// one replayed frame, as written with -b
+struct ReplaySample {
+  int64_t t;  // capture, CLOCK_MONOTONIC microseconds
+  int32_t frame;
+  uint8_t fix;  // whether the localizers had one
+  uint8_t pad[3];
+  float x, y, theta;     // fused localizer pose
+  float cx, cy, ctheta;  // the controller's pose after correcting with it
+  float target_k, target_v, target_ax, target_ay;
+  float u_throttle, u_steering;  // the last control tick's outputs
+  // microseconds spent in each stage on this frame
+  int32_t us_decode, us_localize, us_obstacle, us_plan, us_control;
+  uint32_t pad2;
+};
+
+static const char *kStageNames[] = {
+  "decode", "localize", "obstacle", "plan", "control",
+};
+static const int kStages = 5;
+
+struct ReplayResult {
+  bool ok;
+  int frames, fixes, ticks;
+  std::vector<float> laps;
+  int64_t us[kStages];
+  int64_t wall_us;
+};
+
+// command line
+static const char *conf_path = NULL;
+static const char *out_dir = ".";
+static bool binary_out = false;
+
+static std::vector<const char *> files;
+static std::vector<ReplayResult> results;
+static std::atomic<int> next_file;
+static INIReader *ini;
+
+// a worker thread's pipeline, reset for each recording
+class Replayer {
+ public:
+  Replayer() : ceiltrack_(NULL), coneslam_(NULL), yuv_(NULL) {}
+  ~Replayer() {
+    delete ceiltrack_;
+    delete coneslam_;
+    delete[] yuv_;
+  }
+
+  bool Init();
+  bool Replay(const char *path, ReplayResult *result);
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+ private:
+  // run the controller through one control tick
+  void Tick(const DriverConfig &config, const ControlSample &s, int frame);
+
+  bool OpenOutput(const char *path, const DriverConfig &config);
+  void Output(const ReplaySample &s);
+  void CloseOutput();
+
+  FisheyeLens lens_;
+  CeilTrackLocalizer *ceiltrack_;
+  ConeSLAMLocalizer *coneslam_;
+  LocalizerFusion localizers_;
+  ObstacleDetector obstacledetect_;
+  DriveController controller_;
+  uint8_t *yuv_;
+
+  float u_throttle_, u_steering_;
+  FILE *out_;
+  const char *name_;
+  std::vector<ReplaySample> samples_;
+};
+
+// the same pipeline Driver::Init sets up from cycloid.ini
+bool Replayer::Init() {
+  float fx, fy, cx, cy, k1;
+  std::string camcal = ini->GetString("camera", "calibration", "");
+  if (sscanf(camcal.c_str(), "%f %f %f %f %f", &fx, &fy, &cx, &cy, &k1) != 5) {
+    fprintf(stderr, "missing or invalid [camera].calibration in .ini file!\n");
+    return false;
+  }
+  // adjust for 640x480
+  lens_.SetCalibration(fx/4.05, fy/4.05, cx/4.05, cy/4.05, k1);
+  float camrot = ini->GetReal("camera", "rotation", 22) * M_PI / 180.0;
+
+  if (ini->GetBoolean("localization", "ceiltrack", true)) {
+    ceiltrack_ = new CeilTrackLocalizer(
+        CEIL_HEIGHT, CEIL_X_GRID * CEIL_HEIGHT, CEIL_Y_GRID * CEIL_HEIGHT,
+        -CEILHOME_X * CEIL_HEIGHT, -CEILHOME_Y * CEIL_HEIGHT, -CEILHOME_THETA);
+    if (!ceiltrack_->Init(lens_, camrot)) {
+      fprintf(stderr, "ceiltrack init failure\n");
+      return false;
+    }
+    localizers_.Add(ceiltrack_);
+  }
+  if (ini->GetBoolean("localization", "coneslam", false)) {
+    // the other cores are busy with other recordings
+    coneslam_ = new ConeSLAMLocalizer(
+        ini->GetInteger("localization", "particles", 1000), 1,
+        ini->GetReal("localization", "temperature", 0.01));
+    std::string lmfile = ini->GetString("localization", "landmarks", "lm.txt");
+    if (!coneslam_->Init(lens_, camrot, lmfile.c_str())) {
+      fprintf(stderr, "coneslam init failure\n");
+      return false;
+    }
+    // no fix unless the particles are within max_spread meters RMS
+    coneslam_->SetMaxSpread(
+        ini->GetReal("localization", "max_spread",
+                    ConeSLAMLocalizer::kDefaultMaxSpread));
+    // KLD-sampling as in Driver::Init
+    int min_particles = ini->GetInteger("localization", "min_particles", 0);
+    if (min_particles > 0) {
+      coneslam_->SetAdaptiveParticleCount(
+          min_particles, ini->GetReal("localization", "kld_epsilon", 0.05),
+          ini->GetReal("localization", "kld_bin_xy", 0.2),
+          ini->GetReal("localization", "kld_bin_theta", 10) * M_PI / 180.0);
+    }
+    localizers_.Add(coneslam_);
+  }
+  if (localizers_.NumLocalizers() == 0) {
+    fprintf(stderr, "no localizers enabled in [localization] in .ini file!\n");
+    return false;
+  }
+  if (!obstacledetect_.Open("floorlut.bin")) {
+    fprintf(stderr, "can't open floorlut.bin, obstacle detection lookup table\n");
+    return false;
+  }
+  yuv_ = new uint8_t[640 * 480 * 3 / 2];
+  return true;
+}
+
+void Replayer::Tick(const DriverConfig &config, const ControlSample &s,
+                    int frame) {
+  Eigen::Vector3f accel(s.accel[0], s.accel[1], s.accel[2]);
+  Eigen::Vector3f gyro(s.gyro[0], s.gyro[1], s.gyro[2]);
+  controller_.UpdateState(config, accel, gyro, s.wheel_v, s.dt, s.t);
+  // as Driver::OnControlFrame, starting from the last tick's controls
+  controller_.GetControl(config, s.js_throttle / 32767.0,
+                         s.js_steering / 32767.0, &u_throttle_, &u_steering_,
+                         s.dt, s.flags & ControlSample::kSampleAutodrive,
+                         frame);
+}
+
+// every control tick recorded in f, in order
+static void ReadTicks(const RecordFile &f, std::vector<ControlSample> *out) {
+  std::vector<RecordChunk> chunks;
+  out->clear();
+  for (int i = 0; i <= f.NumFrames(); i++) {
+    f.ChunksBefore(i, "TLM1", &chunks);
+    for (size_t j = 0; j < chunks.size(); j++) {
+      uint16_t size;
+      memcpy(&size, chunks[j].data, 2);
+      if (size != sizeof(ControlSample) || chunks[j].len < 8) {
+        continue;
+      }
+      for (size_t k = 8; k + size <= chunks[j].len; k += size) {
+        ControlSample s;
+        memcpy(&s, chunks[j].data + k, size);
+        out->push_back(s);
+      }
+    }
+  }
+}
+
+bool Replayer::Replay(const char *path, ReplayResult *result) {
+  RecordFile f;
+  if (!f.Open(path)) {
+    return false;
+  }
+  const char *slash = strrchr(path, '/');
+  name_ = slash ? slash + 1 : path;
+
+  DriverConfig config;
+  size_t hdrlen;
+  const uint8_t *hdr = f.Header(&hdrlen);
+  if (conf_path != NULL) {
+    if (!config.Load(conf_path)) {
+      return false;
+    }
+  } else if (hdr != NULL && hdrlen == sizeof(config)) {
+    memcpy(&config, hdr, sizeof(config));
+  } else {
+    fprintf(stderr, "%s: no driver configuration recorded; using defaults\n",
+            path);
+  }
+
+  std::vector<ControlSample> ticks;
+  ReadTicks(f, &ticks);
+  bool legacy = ticks.empty();
+
+  Eigen::Vector3f pose;
+  Eigen::Matrix3f posecov;
+  localizers_.Reset();
+  localizers_.GetPose(&pose, &posecov);
+  controller_.ResetState();
+  controller_.ResetLocation(pose);
+  u_throttle_ = u_steering_ = 0;
+  if (!OpenOutput(path, config)) {
+    return false;
+  }
+
+  size_t next_tick = 0;
+  float last_wheel_dist = 0;
+  int64_t last_capture = 0, last_lap = 0;
+  int64_t t_start = MonotonicMicros();
+  for (int i = 0; i < f.NumFrames(); i++) {
+    RecordFrame fr;
+    if (!f.Frame(i, &fr)) {
+      fprintf(stderr, "%s: frame %d unreadable, stopping there\n", path, i);
+      break;
+    }
+    // recordings from before TMon only have the wall clock
+    const RecTimes *times = fr.Times();
+    int64_t t_capture = times != NULL ? times->capture :
+        fr.tv_sec * 1000000LL + fr.tv_usec;
+    float dt = last_capture != 0 ? (t_capture - last_capture) * 1e-6 : 0;
+    last_capture = t_capture;
+
+    ReplaySample s;
+    memset(&s, 0, sizeof(s));
+    s.t = t_capture;
+    s.frame = i;
+
+    // the control ticks since the last frame, or a stand-in for them
+    int64_t t0 = MonotonicMicros();
+    float ds = 0, w = 0;
+    if (!legacy) {
+      for (; next_tick < ticks.size() && ticks[next_tick].t <= t_capture;
+           next_tick++) {
+        const ControlSample &tick = ticks[next_tick];
+        Tick(config, tick, i);
+        ds += tick.wheel_ds;
+        w = tick.gyro[2];
+        result->ticks++;
+      }
+    } else if (fr.CarState() != NULL) {
+      const RecCarState *cs = fr.CarState();
+      ControlSample tick;
+      memset(&tick, 0, sizeof(tick));
+      tick.t = t_capture;
+      tick.dt = dt;
+      memcpy(tick.accel, cs->accel, sizeof(tick.accel));
+      memcpy(tick.gyro, cs->gyro, sizeof(tick.gyro));
+      tick.wheel_v = cs->wheel_v;
+      tick.flags = ControlSample::kSampleAutodrive;
+      Tick(config, tick, i);
+      ds = i > 0 ? cs->wheel_dist - last_wheel_dist : 0;
+      last_wheel_dist = cs->wheel_dist;
+      w = cs->gyro[2];
+      result->ticks++;
+    }
+    int64_t t1 = MonotonicMicros();
+
+    if (!fr.DecodeImage(yuv_)) {
+      fprintf(stderr, "%s: frame %d has no image, stopping there\n", path, i);
+      break;
+    }
+    int64_t t2 = MonotonicMicros();
+
+    localizers_.GetPose(&pose, &posecov);
+    float prevxy[2] = {pose[0], pose[1]};
+    localizers_.Predict(ds, w, dt);
+    bool fix = localizers_.Update(yuv_);
+    localizers_.GetPose(&pose, &posecov);
+    float xytheta[3] = {pose[0], pose[1], pose[2]};
+    if (CrossedFinish(prevxy, xytheta)) {
+      if (last_lap != 0) {
+        result->laps.push_back((t_capture - last_lap) * 1e-6);
+      }
+      last_lap = t_capture;
+    }
+    int64_t t3 = MonotonicMicros();
+
+    obstacledetect_.Update(yuv_, config.black_thresh, config.orange_thresh);
+    int64_t t4 = MonotonicMicros();
+
+    if (fix) {
+      controller_.UpdateLocation(config, pose, posecov, t_capture);
+      result->fixes++;
+    }
+    controller_.Plan(config, obstacledetect_.GetCarPenalties(),
+                     obstacledetect_.GetConePenalties());
+    int64_t t5 = MonotonicMicros();
+
+    s.fix = fix;
+    s.x = xytheta[0];
+    s.y = xytheta[1];
+    s.theta = xytheta[2];
+    s.cx = controller_.x_;
+    s.cy = controller_.y_;
+    s.ctheta = controller_.theta_;
+    s.target_k = controller_.target_k_;
+    s.target_v = controller_.target_v_;
+    s.target_ax = controller_.target_ax_;
+    s.target_ay = controller_.target_ay_;
+    s.u_throttle = u_throttle_;
+    s.u_steering = u_steering_;
+    s.us_control = t1 - t0;
+    s.us_decode = t2 - t1;
+    s.us_localize = t3 - t2;
+    s.us_obstacle = t4 - t3;
+    s.us_plan = t5 - t4;
+    result->us[0] += s.us_decode;
+    result->us[1] += s.us_localize;
+    result->us[2] += s.us_obstacle;
+    result->us[3] += s.us_plan;
+    result->us[4] += s.us_control;
+    result->frames++;
+    Output(s);
+  }
+  result->wall_us = MonotonicMicros() - t_start;
+  CloseOutput();
+  return true;
+}
+
+bool Replayer::OpenOutput(const char *path, const DriverConfig &config) {
+  std::string base(name_);
+  if (base.size() > 4 && base.compare(base.size() - 4, 4, ".rec") == 0) {
+    base.resize(base.size() - 4);
+  }
+  std::string outpath = std::string(out_dir) + "/" + base +
+      (binary_out ? ".replay.bin" : ".replay.csv");
+  out_ = fopen(outpath.c_str(), binary_out ? "wb" : "w");
+  if (out_ == NULL) {
+    perror(outpath.c_str());
+    return false;
+  }
+  if (binary_out) {
+    // the configuration it was replayed with, as recordings start
+    DriverConfig c = config;
+    std::vector<uint8_t> hdr(c.SerializedSize());
+    c.Serialize(&hdr[0], hdr.size());
+    fwrite(&hdr[0], 1, hdr.size(), out_);
+    samples_.clear();
+  } else {
+    fprintf(out_, "# frame,t,fix,x,y,theta,cx,cy,ctheta,target_k,target_v,"
+            "target_ax,target_ay,u_throttle,u_steering,us_decode,us_localize,"
+            "us_obstacle,us_plan,us_control\n");
+  }
+  return true;
+}
+
+void Replayer::Output(const ReplaySample &s) {
+  if (binary_out) {
+    samples_.push_back(s);
+    return;
+  }
+  fprintf(out_, "%d,%lld,%d,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,"
+          "%d,%d,%d,%d,%d\n", s.frame, (long long) s.t, s.fix, s.x, s.y,
+          s.theta, s.cx, s.cy, s.ctheta, s.target_k, s.target_v, s.target_ax,
+          s.target_ay, s.u_throttle, s.u_steering, s.us_decode, s.us_localize,
+          s.us_obstacle, s.us_plan, s.us_control);
+}
+
+void Replayer::CloseOutput() {
+  if (binary_out) {
+    // laid out as a telemetry ring's chunk (see io/telemetryring.h)
+    uint32_t len = 16 + samples_.size() * sizeof(ReplaySample);
+    uint16_t size = sizeof(ReplaySample), zero = 0;
+    uint32_t dropped = 0;
+    fwrite("RPL1", 1, 4, out_);
+    fwrite(&len, 4, 1, out_);
+    fwrite(&size, 2, 1, out_);
+    fwrite(&zero, 2, 1, out_);
+    fwrite(&dropped, 4, 1, out_);
+    if (!samples_.empty()) {
+      fwrite(&samples_[0], sizeof(ReplaySample), samples_.size(), out_);
+    }
+  }
+  fclose(out_);
+  out_ = NULL;
+}
+
+static void *worker(void *arg) {
+  Replayer *r = new Replayer();
+  if (!r->Init()) {
+    delete r;
+    return NULL;
+  }
+  // files are taken one at a time, as they vary a lot in length
+  for (;;) {
+    int i = next_file++;
+    if (i >= static_cast<int>(files.size())) {
+      break;
+    }
+    results[i].ok = r->Replay(files[i], &results[i]);
+  }
+  delete r;
+  return NULL;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [-j threads] [-c driverconf.txt] "
+          "[-i cycloid.ini] [-o outdir] [-b] file.rec...\n", argv0);
+}
+
+int main(int argc, char *argv[]) {
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *ini_path = "cycloid.ini";
+  int opt;
+  while ((opt = getopt(argc, argv, "j:c:i:o:b")) != -1) {
+    switch (opt) {
+      case 'j':
+        nthreads = atoi(optarg);
+        break;
+      case 'c':
+        conf_path = optarg;
+        break;
+      case 'i':
+        ini_path = optarg;
+        break;
+      case 'o':
+        out_dir = optarg;
+        break;
+      case 'b':
+        binary_out = true;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind >= argc || nthreads < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  ini = new INIReader(ini_path);
+  if (ini->ParseError() != 0) {
+    fprintf(stderr, "error loading %s\n", ini_path);
+    return 1;
+  }
+
+  for (int i = optind; i < argc; i++) {
+    files.push_back(argv[i]);
+  }
+  results.resize(files.size());
+  for (size_t i = 0; i < results.size(); i++) {
+    results[i].ok = false;
+    results[i].frames = results[i].fixes = results[i].ticks = 0;
+    memset(results[i].us, 0, sizeof(results[i].us));
+    results[i].wall_us = 0;
+  }
+  if (nthreads > static_cast<int>(files.size())) {
+    nthreads = files.size();
+  }
+
+  int64_t t0 = MonotonicMicros();
+  pthread_t *threads = new pthread_t[nthreads];
+  for (int i = 0; i < nthreads; i++) {
+    pthread_create(&threads[i], NULL, worker, NULL);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  delete[] threads;
+  int64_t t1 = MonotonicMicros();
+
+  std::string lappath = std::string(out_dir) + "/laps.csv";
+  FILE *laps = fopen(lappath.c_str(), "w");
+  if (laps == NULL) {
+    perror(lappath.c_str());
+  } else {
+    fprintf(laps, "# file,lap,seconds\n");
+  }
+  int failed = 0, frames = 0;
+  for (size_t i = 0; i < files.size(); i++) {
+    const ReplayResult &r = results[i];
+    if (!r.ok) {
+      fprintf(stderr, "%s: FAILED\n", files[i]);
+      failed++;
+      continue;
+    }
+    frames += r.frames;
+    fprintf(stderr, "%s: %d frames, %d fixes, %d control ticks, %.1fs",
+            files[i], r.frames, r.fixes, r.ticks, r.wall_us * 1e-6);
+    for (int j = 0; j < kStages; j++) {
+      fprintf(stderr, " %s %.0fus", kStageNames[j],
+              r.frames ? static_cast<double>(r.us[j]) / r.frames : 0.0);
+    }
+    float best = 0;
+    for (size_t j = 0; j < r.laps.size(); j++) {
+      if (laps) {
+        fprintf(laps, "%s,%zu,%0.3f\n", files[i], j + 1, r.laps[j]);
+      }
+      if (best == 0 || r.laps[j] < best) {
+        best = r.laps[j];
+      }
+    }
+    if (!r.laps.empty()) {
+      fprintf(stderr, ", %zu laps, best %0.3f", r.laps.size(), best);
+    }
+    fprintf(stderr, "\n");
+  }
+  if (laps) {
+    fclose(laps);
+  }
+  fprintf(stderr, "%zu recordings, %d frames in %.1fs on %d threads\n",
+          files.size(), frames, (t1 - t0) * 1e-6, nthreads);
+  delete ini;
+  return failed ? 1 : 0;
+}
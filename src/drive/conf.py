@@ -57,7 +57,8 @@ class DriverConfig {
   static const char *confignames[];
   static const int N_CONFIGITEMS;
 
-  bool Load();
+  // from driverconf.txt, or path
+  bool Load(const char *path = "driverconf.txt");
   bool Save();
   int SerializedSize() const;
   int Serialize(uint8_t *buf, int buflen);
@@ -97,10 +98,10 @@ bool DriverConfig::Save() {
   return true;
 }
 
-bool DriverConfig::Load() {
-  FILE *fp = fopen("driverconf.txt", "r");
+bool DriverConfig::Load(const char *path) {
+  FILE *fp = fopen(path, "r");
   if (!fp) {
-    perror("driverconf.txt");
+    perror(path);
     return false;
   }
   char varbuf[21];
@@ -112,7 +113,7 @@ bool DriverConfig::Load() {
         cc.write('    %sif (!strcmp(varbuf, "%-20s { %-20s = valuebuf; }\n' % (prefix, varname + '"))', varname))
         prefix = "else "
     cc.write('''\
-    else { printf("driverconf.txt: ignoring unknown variable %s\\n", varbuf); }
+    else { printf("%s: ignoring unknown variable %s\\n", path, varbuf); }
   }
   fclose(fp);
   return true;
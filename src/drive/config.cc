@@ -64,10 +64,10 @@ bool DriverConfig::Save() {
   return true;
 }
 
-bool DriverConfig::Load() {
-  FILE *fp = fopen("driverconf.txt", "r");
+bool DriverConfig::Load(const char *path) {
+  FILE *fp = fopen(path, "r");
   if (!fp) {
-    perror("driverconf.txt");
+    perror(path);
     return false;
   }
   char varbuf[21];
@@ -95,7 +95,7 @@ bool DriverConfig::Load() {
     else if (!strcmp(varbuf, "servo_kI"))          { servo_kI             = valuebuf; }
     else if (!strcmp(varbuf, "servo_min"))         { servo_min            = valuebuf; }
     else if (!strcmp(varbuf, "servo_max"))         { servo_max            = valuebuf; }
-    else { printf("driverconf.txt: ignoring unknown variable %s\n", varbuf); }
+    else { printf("%s: ignoring unknown variable %s\n", path, varbuf); }
   }
   fclose(fp);
   return true;
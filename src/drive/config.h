@@ -59,7 +59,8 @@ class DriverConfig {
   static const char *confignames[];
   static const int N_CONFIGITEMS;
 
-  bool Load();
+  // from driverconf.txt, or path
+  bool Load(const char *path = "driverconf.txt");
   bool Save();
   int SerializedSize() const;
   int Serialize(uint8_t *buf, int buflen);
@@ -8,13 +8,33 @@
 
 using Eigen::Vector3f;
 
+// max number of value function tiles resident at once, for large tracks
+static const int kMaxResidentVFTiles = 64;
+
+// 99% chi-square bound with 3 degrees of freedom; localizer poses whose
+// innovation is beyond this are ignored, unless they keep disagreeing with
+// us for kMaxRejectedPoses frames in a row, in which case we're the one
+// that's lost
+static const float kPoseGate = 11.34;
+static const int kMaxRejectedPoses = 10;
+
 DriveController::DriveController() {
+  pthread_mutex_init(&ekf_mutex_, NULL);
+  x_ = y_ = theta_ = 0;
+  n_rejected_poses_ = 0;
+  history_head_ = history_len_ = 0;
+  n_stale_poses_ = 0;
   ResetState();
-  if (!V_.Init()) {
+  tiled_vf_ = Vt_.Init("vft1.bin", kMaxResidentVFTiles);
+  if (!tiled_vf_ && !V_.Init()) {
     perror("*** WARNING: no vf.bin (value function) found, cannot autodrive!");
   }
 }
 
+DriveController::~DriveController() {
+  pthread_mutex_destroy(&ekf_mutex_);
+}
+
 void DriveController::ResetState() {
   vr_ = vf_ = 0;
   w_ = 0;
@@ -36,28 +56,132 @@ static inline float clip(float x, float min, float max) {
 
 void DriveController::UpdateState(const DriverConfig &config,
                                   const Vector3f &accel, const Vector3f &gyro,
-                                  float wheel_v, float dt) {
+                                  float wheel_v, float dt, int64_t t) {
   vr_ = vf_ = wheel_v;
-  w_ = gyro[2];
   ax_ = accel[0];
   ay_ = accel[1];
+
+  pthread_mutex_lock(&ekf_mutex_);
+  ekf_.Predict(dt, wheel_v, gyro[2]);
+  // yaw rate less the estimated gyro bias
+  w_ = gyro[2] - ekf_.GetState()[3];
+  CopyPose();
+
+  PoseSample &h = history_[history_head_];
+  h.t = t;
+  h.dt = dt;
+  h.v = wheel_v;
+  h.w = gyro[2];
+  h.x = ekf_.GetState();
+  h.P = ekf_.GetCovariance();
+  history_head_ = (history_head_ + 1) % kPoseHistory;
+  if (history_len_ < kPoseHistory) {
+    history_len_++;
+  }
+  pthread_mutex_unlock(&ekf_mutex_);
 }
 
 void DriveController::UpdateLocation(const DriverConfig &config,
-                                     const float *xytheta) {
-  x_ = xytheta[0];
-  y_ = xytheta[1];
-  theta_ = xytheta[2];
+                                     const Vector3f &xytheta,
+                                     const Eigen::Matrix3f &cov, int64_t t) {
+  pthread_mutex_lock(&ekf_mutex_);
+  // find the last control frame at or before the capture time
+  int back = 0;
+  while (back < history_len_ &&
+         history_[(history_head_ - 1 - back + kPoseHistory) % kPoseHistory]
+             .t > t) {
+    back++;
+  }
+  if (back == history_len_ && history_len_ > 0) {
+    // older than anything we remember; correcting the present with it would
+    // do more harm than good
+    if (++n_stale_poses_ % 100 == 1) {
+      fprintf(stderr, "DriveController: %d localizer poses older than the "
+              "pose history\n", n_stale_poses_);
+    }
+    pthread_mutex_unlock(&ekf_mutex_);
+    return;
+  }
+
+  // rewind, correct, and replay the control frames since
+  if (back > 0) {
+    const PoseSample &h =
+        history_[(history_head_ - 1 - back + kPoseHistory) % kPoseHistory];
+    ekf_.GetState() = h.x;
+    ekf_.GetCovariance() = h.P;
+  }
+  FusePose(xytheta, cov);
+  for (int i = back - 1; i >= 0; i--) {
+    PoseSample &h =
+        history_[(history_head_ - 1 - i + kPoseHistory) % kPoseHistory];
+    ekf_.Predict(h.dt, h.v, h.w);
+    h.x = ekf_.GetState();
+    h.P = ekf_.GetCovariance();
+  }
+  CopyPose();
+  float px = x_, py = y_, ptheta = theta_;
+  pthread_mutex_unlock(&ekf_mutex_);
+
+  if (tiled_vf_) {
+    Vt_.Prefetch(px, py, ptheta, vr_);
+  }
+}
+
+void DriveController::FusePose(const Vector3f &xytheta,
+                               const Eigen::Matrix3f &cov) {
+  const PoseEKF::State &x = ekf_.GetState();
+  // the localizer's heading may be any multiple of 2pi away from ours
+  Vector3f z(xytheta[0], xytheta[1],
+             x[2] + remainderf(xytheta[2] - x[2], 2 * M_PI));
+  Vector3f y = z - x.head<3>();
+  Eigen::Matrix3f S = ekf_.GetCovariance().topLeftCorner<3, 3>() + cov;
+  float d2 = y.dot(S.ldlt().solve(y));
+  if (d2 < kPoseGate) {
+    ekf_.UpdatePose(z[0], z[1], z[2], cov);
+    n_rejected_poses_ = 0;
+  } else if (++n_rejected_poses_ >= kMaxRejectedPoses) {
+    fprintf(stderr, "DriveController: pose estimate lost, resetting to "
+            "(%f, %f, %f)\n", xytheta[0], xytheta[1], xytheta[2]);
+    float bias = x[3];
+    ekf_.Reset();
+    ekf_.GetState().head<3>() = z;
+    ekf_.GetState()[3] = bias;
+    ekf_.GetCovariance().topLeftCorner<3, 3>() = cov;
+    n_rejected_poses_ = 0;
+  }
+}
+
+void DriveController::ResetLocation(const Vector3f &xytheta) {
+  pthread_mutex_lock(&ekf_mutex_);
+  ekf_.Reset();
+  ekf_.GetState().head<3>() = xytheta;
+  n_rejected_poses_ = 0;
+  // the history leads up to a pose we no longer believe
+  history_head_ = history_len_ = 0;
+  CopyPose();
+  pthread_mutex_unlock(&ekf_mutex_);
+}
+
+void DriveController::CopyPose() {
+  const PoseEKF::State &x = ekf_.GetState();
+  x_ = x[0];
+  y_ = x[1];
+  theta_ = x[2];
 }
 
 void DriveController::Plan(const DriverConfig &config, const int32_t *cardetect,
                            const int32_t *conedetect) {
+  // the control thread keeps moving the pose; plan from a consistent one
+  pthread_mutex_lock(&ekf_mutex_);
+  const float x = x_, y = y_, theta = theta_;
+  pthread_mutex_unlock(&ekf_mutex_);
+
   const float s = config.reaction_time * 0.01 * vr_;
-  const float t0 = theta_ + config.reaction_time * 0.01 * w_;
-  const float t0h = (theta_ + t0) / 2;
+  const float t0 = theta + config.reaction_time * 0.01 * w_;
+  const float t0h = (theta + t0) / 2;
   const float C = cos(t0h), S = sin(t0h);
-  const float x0 = x_ + s * C;
-  const float y0 = y_ + s * S;
+  const float x0 = x + s * C;
+  const float y0 = y + s * S;
   const float v0 = clip(vr_, 2, 14);
 
   // best action value, best accel, best curvature
@@ -77,7 +201,7 @@ void DriveController::Plan(const DriverConfig &config, const int32_t *cardetect,
     float dx = v1 * cos(theta1) * pdt;
     float dy = v1 * sin(theta1) * pdt;
 
-    float cost = V_.V(x0 + dx, y0 + dy, theta1, v1);
+    float cost = V(x0 + dx, y0 + dy, theta1, v1);
 
     // check whether we hit a cone or a car at this angle
     int iang = (relang * 256 / M_PI) + 128;
@@ -2,21 +2,44 @@
 #define DRIVE_CONTROLLER_H_
 
 #include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <Eigen/Dense>
 
 #include "drive/config.h"
 #include "drive/vflookup.h"
+#include "drive/vftiles.h"
+#include "localization/ekf/pose_ekf.h"
 
 static const int kTractionCircleAngles = 128;
 
+// control frames of pose history kept for rewinding to a camera frame's
+// capture time; 640ms at 100Hz
+static const int kPoseHistory = 64;
+
 class DriveController {
  public:
   DriveController();
+  ~DriveController();
 
+  // called every control frame, with the time t (CLOCK_MONOTONIC
+  // microseconds, see timing/clock.h) the sensors were read; dead-reckons the
+  // pose forward from the gyro and wheel speed
   void UpdateState(const DriverConfig &config, const Eigen::Vector3f &accel,
-                   const Eigen::Vector3f &gyro, float wheel_v, float dt);
+                   const Eigen::Vector3f &gyro, float wheel_v, float dt,
+                   int64_t t);
+
+  // called from the camera thread with a fused localizer pose and its
+  // covariance, which corrects the dead-reckoned pose and gyro bias. t is
+  // when the camera frame was captured, on the same clock as UpdateState's:
+  // the correction is applied to the pose as it was then, and the control
+  // frames since are replayed on top of it.
+  void UpdateLocation(const DriverConfig &config,
+                      const Eigen::Vector3f &xytheta,
+                      const Eigen::Matrix3f &cov, int64_t t);
 
-  void UpdateLocation(const DriverConfig &config, const float *xytheta);
+  // start over from a known pose
+  void ResetLocation(const Eigen::Vector3f &xytheta);
 
   void Plan(const DriverConfig &config, const int32_t *cardetect,
             const int32_t *conedetect);
@@ -31,7 +54,8 @@ class DriveController {
   int Serialize(uint8_t *buf, int buflen) const;
   void Dump() const;
 
-  // car state
+  // car state; x_, y_, theta_ are the pose estimate as of the last
+  // UpdateState/UpdateLocation
   float x_, y_, theta_;
   float vf_, vr_;        // front and rear wheel velocity
   float w_;              // gyro reading: yaw rate
@@ -50,8 +74,42 @@ class DriveController {
   float target_v_, target_w_;  // control targets
   float bw_w_, bw_v_;          // control bandwidth for yaw and speed
 
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
  private:
+  // copy the EKF's pose out to x_, y_, theta_; ekf_mutex_ must be held
+  void CopyPose();
+
+  // fuse a localizer pose into ekf_ as it stands; ekf_mutex_ must be held
+  void FusePose(const Eigen::Vector3f &xytheta, const Eigen::Matrix3f &cov);
+
+  // one control frame: its prediction inputs and the EKF right after
+  struct PoseSample {
+    int64_t t;
+    float dt, v, w;
+    PoseEKF::State x;
+    PoseEKF::Covariance P;
+  };
+
+  // use the tiled value function if there is one, otherwise the dense one
+  float V(float x, float y, float theta, float v) {
+    return tiled_vf_ ? Vt_.V(x, y, theta, v) : V_.V(x, y, theta, v);
+  }
+
   ValueFuncLookup V_;
+  TiledValueFuncLookup Vt_;
+  bool tiled_vf_;
+
+  // pose estimate, predicted from the control thread and corrected from the
+  // camera thread
+  PoseEKF ekf_;
+  int n_rejected_poses_;  // consecutive localizer poses outside the gate
+  // ring buffer of the last history_len_ control frames, newest at
+  // history_head_ - 1
+  PoseSample history_[kPoseHistory];
+  int history_head_, history_len_;
+  int n_stale_poses_;  // localizer poses older than the whole history
+  pthread_mutex_t ekf_mutex_;
 };
 
 #endif  // DRIVE_CONTROLLER_H_
@@ -37,7 +37,7 @@ int main() {
   for (int i = 0; i < 900; i++) {
     float throttle, steering;
 
-    control.UpdateState(config, accel, gyro, s, dt);
+    control.UpdateState(config, accel, gyro, s, dt, i * 1000000 / 30);
     #if 0
     // broken now by a dependency on coneslam. oops.
     control.UpdateLocation(config, x, y, theta);
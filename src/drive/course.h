@@ -0,0 +1,22 @@
+#ifndef DRIVE_COURSE_H_
+#define DRIVE_COURSE_H_
+
+// Where the course is, for the car and for replaying its recordings.
+// hardcoded garbage for the time being
+
+// ceiling light grid and the starting line pose, in track coordinates
+const float CEILHOME_X = -3.03, CEILHOME_Y = 0.73, CEILHOME_THETA = 0;
+const float CEIL_HEIGHT = 8.25*0.3048;
+const float CEIL_X_GRID = 0.3048*10/CEIL_HEIGHT;
+const float CEIL_Y_GRID = 0.3048*12/CEIL_HEIGHT;
+
+// finish line for built-in lap timer
+const float FINISHX = 9.5;
+const float FINISHY = 160/60.0;
+
+// whether going from prevxy to xy crossed the finish line
+inline bool CrossedFinish(const float *prevxy, const float *xy) {
+  return prevxy[0] < FINISHX && xy[0] >= FINISHX && xy[1] < FINISHY;
+}
+
+#endif  // DRIVE_COURSE_H_
@@ -1,6 +1,5 @@
 #include "drive/driver.h"
 
-#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
@@ -10,24 +9,16 @@
 
 #include "drive/config.h"
 #include "drive/controller.h"
+#include "drive/course.h"
 #include "hw/cam/cam.h"
 #include "hw/car/car.h"
 #include "hw/imu/imu.h"
 #include "hw/input/js.h"
 #include "io/flushthread.h"
-#include "localization/ceiltrack/ceiltrack.h"
+#include "io/recordindex.h"
+#include "timing/clock.h"
 #include "ui/display.h"
 
-// hardcoded garbage for the time being
-const float CEILHOME_X = -3.03, CEILHOME_Y = 0.73, CEILHOME_THETA = 0;
-const float CEIL_HEIGHT = 8.25*0.3048;
-const float CEIL_X_GRID = 0.3048*10/CEIL_HEIGHT;
-const float CEIL_Y_GRID = 0.3048*12/CEIL_HEIGHT;
-
-// finish line for built-in lap timer
-const float FINISHX = 9.5;
-const float FINISHY = 160/60.0;
-
 // const int PWMCHAN_STEERING = 14;
 // const int PWMCHAN_ESC = 15;
 
@@ -35,20 +26,12 @@ struct CarState {
   Eigen::Vector3f accel, gyro;
   int8_t throttle, steering;
   float wheel_dist, wheel_v;
-  float ceiltrack_pos[3];
 
   CarState() : accel(0, 0, 0), gyro(0, 0, 0) {
     throttle = 0;
     steering = 0;
     wheel_dist = 0;
     wheel_v = 0;
-    SetHome();
-  }
-
-  void SetHome() {
-    ceiltrack_pos[0] = CEILHOME_X;
-    ceiltrack_pos[1] = CEILHOME_Y;
-    ceiltrack_pos[2] = CEILHOME_THETA;
   }
 
   // 2 3-float vectors, 3 uint8s, 2 4-uint16 arrays
@@ -79,22 +62,40 @@ Driver::Driver(FlushThread *ft, IMU *imu, JoystickInput *js, UIDisplay *disp)
       imu_(imu),
       js_(js),
       display_(disp),
+      telemetry_("TLM1"),
+      blackbox_("TLM1"),
       gyro_last_(0, 0, 0),
       gyro_bias_(0, 0, 0),
       accel_last_(0, 0, 0),
-      accel_bias_(0, 0, 0) {
-  output_fd_ = -1;
+      accel_bias_(0, 0, 0),
+      exposure_to_arrival_("exposure to arrival"),
+      exposure_to_plan_("exposure to plan"),
+      exposure_to_actuation_("exposure to actuation"),
+      sample_to_actuation_("control sample to actuation") {
+  ceiltrack_ = NULL;
+  coneslam_ = NULL;
+  last_wheel_dist_ = 0;
+  reset_localizers_ = false;
+  output_ = NULL;
+  record_direct_ = true;
+  record_legacy_ = true;
   frame_ = 0;
   frameskip_ = 0;
+  record_drops_ = 0;
+  residual_spike_ = residual_avg_ = 0;
+  deadline_ = 0;
+  last_tick_ = 0;
   autodrive_ = false;
-  memset(&last_t_, 0, sizeof(last_t_));
-  memset(&last_lap_, 0, sizeof(last_lap_));
+  last_capture_ = last_lap_ = 0;
   js_throttle_ = 0;
   js_steering_ = 0;
 
   config_item_ = 0;
   x_down_ = y_down_ = false;
   done_ = false;
+  planned_capture_ = 0;
+  pthread_mutex_init(&latency_mutex_, NULL);
+  pthread_mutex_init(&record_mutex_, NULL);
 }
 
 bool Driver::Init(const INIReader &ini) {
@@ -110,11 +111,99 @@ bool Driver::Init(const INIReader &ini) {
   float camrot = ini.GetReal("camera", "rotation", 22) * M_PI / 180.0;
 
   frameskip_ = ini.GetInteger("datalog", "frameskip", 0);
+  // O_DIRECT writes through io_uring, where the kernel can do them
+  record_direct_ = ini.GetBoolean("datalog", "direct", true);
+  // what to record of each frame, and whether to compress it on its way
+  // to the flush thread
+  if (!record_format_.Parse(ini.GetString("datalog", "roi", "").c_str(),
+                            ini.GetString("datalog", "planes", "yuv").c_str(),
+                            ini.GetInteger("datalog", "compress", 0),
+                            640, 480)) {
+    return false;
+  }
+  record_legacy_ = record_format_.IsLegacy(640, 480);
+
+  if (ini.GetBoolean("localization", "ceiltrack", true)) {
+    // the tracker's home is in ceiling coordinates; ours is on the ground
+    ceiltrack_ = new CeilTrackLocalizer(
+        CEIL_HEIGHT, CEIL_X_GRID * CEIL_HEIGHT, CEIL_Y_GRID * CEIL_HEIGHT,
+        -CEILHOME_X * CEIL_HEIGHT, -CEILHOME_Y * CEIL_HEIGHT, -CEILHOME_THETA);
+    if (!ceiltrack_->Init(lens_, camrot)) {
+      fprintf(stderr, "ceiltrack init failure");
+      return false;
+    }
+    localizers_.Add(ceiltrack_);
+  }
+  if (ini.GetBoolean("localization", "coneslam", false)) {
+    coneslam_ = new ConeSLAMLocalizer(
+        ini.GetInteger("localization", "particles", 1000),
+        ini.GetInteger("localization", "threads", 2),
+        ini.GetReal("localization", "temperature", 0.01));
+    std::string lmfile = ini.GetString("localization", "landmarks", "lm.txt");
+    if (!coneslam_->Init(lens_, camrot, lmfile.c_str())) {
+      fprintf(stderr, "coneslam init failure");
+      return false;
+    }
+    // no fix unless the particles are within max_spread meters RMS
+    coneslam_->SetMaxSpread(
+        ini.GetReal("localization", "max_spread",
+                    ConeSLAMLocalizer::kDefaultMaxSpread));
+    // KLD-sampling, if min_particles is set: particles shrink to as few as
+    // that once the posterior is tight, growing back towards [particles] as
+    // it spreads. bins are kld_bin_xy meters and kld_bin_theta degrees
+    int min_particles = ini.GetInteger("localization", "min_particles", 0);
+    if (min_particles > 0) {
+      coneslam_->SetAdaptiveParticleCount(
+          min_particles, ini.GetReal("localization", "kld_epsilon", 0.05),
+          ini.GetReal("localization", "kld_bin_xy", 0.2),
+          ini.GetReal("localization", "kld_bin_theta", 10) * M_PI / 180.0);
+    }
+    // what each recorded frame keeps of the particle filter: off, summary
+    // (mean and covariance), topk (the log_topk likeliest particles) or full
+    std::string log = ini.GetString("localization", "log", "off");
+    if (log == "full") {
+      coneslam_->SetLogLevel(coneslam::Localizer::LOG_FULL, 0);
+    } else if (log == "topk") {
+      coneslam_->SetLogLevel(coneslam::Localizer::LOG_TOPK,
+                             ini.GetInteger("localization", "log_topk", 16));
+    } else if (log == "summary") {
+      coneslam_->SetLogLevel(coneslam::Localizer::LOG_SUMMARY, 0);
+    } else if (log != "off") {
+      fprintf(stderr, "unknown [localization].log %s; "
+              "expected off, summary, topk or full\n", log.c_str());
+      return false;
+    }
+    localizers_.Add(coneslam_);
+  }
+  if (localizers_.NumLocalizers() == 0) {
+    fprintf(stderr, "no localizers enabled in [localization] in .ini file!\n");
+    return false;
+  }
 
-  if (!ceiltrack_.Init(lens_, camrot)) {
-    fprintf(stderr, "ceiltrack init failure");
+  // recording buffers in flight to the sdcard, each a whole 640x480 frame
+  // behind room for the frame state, which the localizers' logs can make
+  // more than a page
+  int nbuffers = ini.GetInteger("datalog", "buffers", 8);
+  if (!record_pool_.Init(nbuffers, 640 * 480 * 3 / 2,
+                         8 + 8 + FrameStateSize() +
+                         FrameFormat::kChunkHeaderSize)) {
     return false;
   }
+  // room for a few seconds of control ticks between recorded frames
+  telemetry_.Init(ini.GetInteger("datalog", "telemetry", 1024));
+  if (record_format_.level > 0 &&
+      !compressor_.Init(record_format_, record_pool_.Capacity(), nbuffers,
+                        ini.GetInteger("datalog", "compress_cpu", -1),
+                        flush_thread_)) {
+    return false;
+  }
+  localizers_.Reset();
+  {
+    Eigen::Vector3f pose;
+    Eigen::Matrix3f posecov;
+    localizers_.GetPose(&pose, &posecov);
+    controller_.ResetLocation(pose);
+  }
 
   if (display_) {
     display_->InitCamera(lens_, camrot);
@@ -131,100 +220,299 @@ bool Driver::Init(const INIReader &ini) {
     return false;
   }
 
+  return InitBlackBox(ini);
+}
+
+// The flight recorder keeps [blackbox] seconds (0 turns it off) of every
+// frameskip+1'th frame, luma only by default, and every control tick. It's
+// dumped post_ms after
+//  - the ZR button
+//  - the ceiling tracker's fit residual jumping to residual_spike times its
+//    recent average
+//  - a control tick longer than deadline_ms, or a gap between frames
+//  - SIGUSR1, or right away on a fatal signal (see main.cc)
+bool Driver::InitBlackBox(const INIReader &ini) {
+  int seconds = ini.GetInteger("blackbox", "seconds", 5);
+  residual_spike_ = ini.GetReal("blackbox", "residual_spike", 5);
+  deadline_ = ini.GetReal("blackbox", "deadline_ms", 30) * 1e-3;
+  if (seconds <= 0) {
+    return true;
+  }
+  FrameFormat format;
+  int frameskip = ini.GetInteger("blackbox", "frameskip", 2);
+  if (!format.Parse(ini.GetString("blackbox", "roi", "").c_str(),
+                    ini.GetString("blackbox", "planes", "y").c_str(), 0,
+                    640, 480)) {
+    return false;
+  }
+  // nominally 30 frames and 100 control ticks a second
+  if (!blackbox_.InitFrames(format, 640, 480, seconds * 30 / (frameskip + 1),
+                            frameskip) ||
+      !blackbox_.InitTelemetry(sizeof(ControlSample), seconds * 100) ||
+      !blackbox_.Start(ini.GetString("blackbox", "prefix", "blackbox").c_str(),
+                       ini.GetInteger("blackbox", "post_ms", 1000))) {
+    return false;
+  }
+  UpdateBlackBoxHeader();
   return true;
 }
 
+// dumps start with the driver configuration, as recordings do
+void Driver::UpdateBlackBoxHeader() {
+  uint8_t hdr[BlackBox::kMaxHeader];
+  int siz = config_.SerializedSize();
+  if (siz <= static_cast<int>(sizeof(hdr))) {
+    config_.Serialize(hdr, siz);
+    blackbox_.SetHeader(hdr, siz);
+  }
+}
+
 bool Driver::StartRecording(const char *fname) {
   frame_ = 0;
+  StorageWriter *out;
   if (!strcmp(fname, "-")) {
-    output_fd_ = fileno(stdout);
+    out = StorageWriter::FromFd(fileno(stdout));
   } else {
-    output_fd_ = open(fname, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    out = StorageWriter::Open(fname, record_direct_);
   }
-  if (output_fd_ == -1) {
-    perror(fname);
+  if (out == NULL) {
     return false;
   }
-  printf("--- recording %s ---\n", fname);
-  // write header IFF chunk immediately: store the car config
+  // index the frames as they're written, with a footer when it's closed
+  out = new RecordIndexWriter(out);
+  printf("--- recording %s (%s) ---\n", fname, out->Backend());
+  // header IFF chunk goes first: store the car config
   int siz = config_.SerializedSize();
   uint8_t *hdrbuf = new uint8_t[siz];
   config_.Serialize(hdrbuf, siz);
-  write(output_fd_, hdrbuf, siz);
-  delete[] hdrbuf;
+  flush_thread_->AddEntry(out, hdrbuf, siz);
+  // only now can the camera thread see it, so no frame goes ahead of the
+  // header
+  pthread_mutex_lock(&record_mutex_);
+  output_ = out;
+  pthread_mutex_unlock(&record_mutex_);
   return true;
 }
 
-bool Driver::IsRecording() { return output_fd_ != -1; }
+bool Driver::IsRecording() { return output_ != NULL; }
 
 void Driver::StopRecording() {
-  if (output_fd_ == -1) {
+  pthread_mutex_lock(&record_mutex_);
+  StorageWriter *out = output_.exchange(NULL);
+  if (out == NULL) {
+    pthread_mutex_unlock(&record_mutex_);
     return;
   }
-  flush_thread_->AddEntry(output_fd_, NULL, -1);
-  output_fd_ = -1;
+  // the last telemetry and the close go behind the frames already queued,
+  // through the compressor if it's on so that frames still being compressed
+  // reach the file first; the file closes once they're written, without
+  // holding up this (control) thread or the camera thread, which won't find
+  // a writer once we let go
+  if (record_format_.level > 0) {
+    compressor_.AddSource(out, &telemetry_);
+    compressor_.AddClose(out);
+  } else {
+    flush_thread_->AddSource(out, &telemetry_);
+    flush_thread_->AddEntry(out, NULL, -1);
+  }
+  pthread_mutex_unlock(&record_mutex_);
+  if (telemetry_.Dropped() > 0) {
+    fprintf(stderr, "telemetry: %d control samples dropped\n",
+            telemetry_.Dropped());
+  }
+  ReportLatency();
 }
 
-Driver::~Driver() { StopRecording(); }
+void Driver::ReportLatency() {
+  pthread_mutex_lock(&latency_mutex_);
+  exposure_to_arrival_.Report(stderr);
+  exposure_to_plan_.Report(stderr);
+  exposure_to_arrival_.Clear();
+  exposure_to_plan_.Clear();
+  pthread_mutex_unlock(&latency_mutex_);
+  exposure_to_actuation_.Report(stderr);
+  sample_to_actuation_.Report(stderr);
+  exposure_to_actuation_.Clear();
+  sample_to_actuation_.Clear();
+}
+
+Driver::~Driver() {
+  if (IsRecording()) {
+    StopRecording();
+  } else {
+    ReportLatency();
+  }
+  // nothing else records through the flush thread; let it drain while our
+  // record buffers are still around
+  compressor_.Stop();
+  flush_thread_->Stop();
+  delete ceiltrack_;
+  delete coneslam_;
+  pthread_mutex_destroy(&latency_mutex_);
+  pthread_mutex_destroy(&record_mutex_);
+}
 
 // recording data is in IFF format, can be read with python chunk interface:
 // ck = chunk.Chunk(file, align=False, bigendian=False, inclheader=True)
-// each frame is stored in a CYCF chunk which includes an 8-byte timestamp,
-// and further set of chunks encoded by each piece below.
-void Driver::QueueRecordingData(const timeval &t, uint8_t *buf, size_t length) {
-  uint32_t chunklen = 8 + 8;           // iff header, timestamp
-  uint32_t yuvcklen = length + 8 + 2;  // iff header, width, camera frame
-  // each of the following entries is expected to be a valid
-  // IFF chunk on its own
-  chunklen += carstate_.SerializedSize();
-  chunklen += controller_.SerializedSize();
-  chunklen += yuvcklen;
-
-  // copy our frame, push it onto a stack to be flushed
-  // asynchronously to sdcard
-  uint8_t *chunkbuf = new uint8_t[chunklen];
+// each frame is stored in a CYCF chunk which includes an 8-byte wall-clock
+// timestamp, and further set of chunks encoded by each piece below.
+//
+// The chunks up to and including the frame's chunk header go in a pooled
+// buffer's header area and the camera frame in its data area, which the
+// FlushThread writes out contiguously with writev(); copying the frame out
+// of the camera's buffer is the only copy, and nothing is allocated.
+//
+// The frame is a Y420 chunk unless [datalog] asks for a region, luma only
+// or compression, in which case it's a YUVz chunk (see io/framecodec.h);
+// compressed frames detour through the FrameCompressor, which fills in
+// their lengths, and the control ticks queued ahead of them go the same way
+// so they stay in order.
+void Driver::QueueRecordingData(const timeval &t, int64_t t_capture,
+                                int64_t t_arrival, uint8_t *buf,
+                                size_t length) {
+  uint32_t hdrlen = 8 + 8;             // iff header, timestamp
+  size_t framelen = record_legacy_ ? length : record_format_.RawSize();
+  hdrlen += FrameStateSize();
+  // the frame's chunk header; the frame follows
+  uint32_t framehdrlen =
+      record_legacy_ ? 8 + 2 : FrameFormat::kChunkHeaderSize;
+  hdrlen += framehdrlen;
+
+  if (hdrlen > record_pool_.HeaderSize() ||
+      length > record_pool_.Capacity()) {
+    fprintf(stderr, "QueueRecordingData: %u+%zu byte frame doesn't fit in "
+            "a record buffer\n", hdrlen, length);
+    return;
+  }
+  RecordBuffer *rec = record_pool_.Get();
+  if (rec == NULL) {
+    // the sdcard has fallen behind; drop this frame rather than wait
+    if (++record_drops_ % 30 == 1) {
+      fprintf(stderr, "QueueRecordingData: out of record buffers, "
+              "%d frames dropped\n", record_drops_);
+    }
+    return;
+  }
+
   // write length + timestamp header
+  uint8_t *chunkbuf = rec->header;
+  int ptr = 16;
+  ptr += SerializeFrameState(chunkbuf + ptr, hdrlen - framehdrlen - ptr,
+                             t_capture, t_arrival);
+  // FrameStateSize() was only a bound; the localizer log varies
+  hdrlen = ptr + framehdrlen;
+  uint32_t chunklen = hdrlen + framelen;
   memcpy(chunkbuf, "CYCF", 4);
   memcpy(chunkbuf + 4, &chunklen, 4);
   memcpy(chunkbuf + 8, &t.tv_sec, 4);
   memcpy(chunkbuf + 12, &t.tv_usec, 4);
-  int ptr = 16;
-  ptr += carstate_.Serialize(chunkbuf + ptr, chunklen - ptr);
-  ptr += controller_.Serialize(chunkbuf + ptr, chunklen - ptr);
+  rec->header_len = hdrlen;
+  rec->data_len = framelen;
 
   // write the 640x480 yuv420 buffer last
-  memcpy(chunkbuf + ptr, "Y420", 4);
-  memcpy(chunkbuf + ptr + 4, &yuvcklen, 4);
-  uint16_t framewidth = 640;  // hardcoded, fixme
-  memcpy(chunkbuf + ptr + 8, &framewidth, 2);
-  memcpy(chunkbuf + ptr + 10, buf, length);
+  if (record_legacy_) {
+    uint32_t yuvcklen = length + 8 + 2;  // iff header, width, camera frame
+    memcpy(chunkbuf + ptr, "Y420", 4);
+    memcpy(chunkbuf + ptr + 4, &yuvcklen, 4);
+    uint16_t framewidth = 640;  // hardcoded, fixme
+    memcpy(chunkbuf + ptr + 8, &framewidth, 2);
+    memcpy(rec->data, buf, length);
+  } else {
+    record_format_.WriteChunkHeader(chunkbuf + ptr, FRAME_RAW, framelen);
+    record_format_.Extract(buf, 640, 480, rec->data);
+  }
 
-  flush_thread_->AddEntry(output_fd_, chunkbuf, chunklen);
+  // the recording may have been stopped while we filled the buffer; if not,
+  // it can't close until this frame is queued
+  pthread_mutex_lock(&record_mutex_);
+  StorageWriter *out = output_;
+  if (out == NULL) {
+    pthread_mutex_unlock(&record_mutex_);
+    record_pool_.Put(rec);
+    return;
+  }
+  // the control ticks since the last frame, up to now, go ahead of it
+  if (record_format_.level > 0) {
+    compressor_.AddSource(out, &telemetry_);
+    compressor_.AddRecord(out, rec);
+  } else {
+    flush_thread_->AddSource(out, &telemetry_);
+    flush_thread_->AddRecord(out, rec);
+  }
+  pthread_mutex_unlock(&record_mutex_);
+}
+
+int Driver::FrameStateSize() {
+  return 8 + 8 + 8 + carstate_.SerializedSize() + controller_.SerializedSize() +
+      (coneslam_ ? coneslam_->LogSize() : 0);
+}
+
+// each of these is expected to be a valid IFF chunk on its own
+int Driver::SerializeFrameState(uint8_t *buf, int buflen, int64_t t_capture,
+                                int64_t t_arrival) {
+  uint32_t timecklen = 8 + 8 + 8;  // iff header, capture, arrival time
+  int ptr = 0;
+  // the frame's exposure and arrival times, in CLOCK_MONOTONIC microseconds
+  memcpy(buf + ptr, "TMon", 4);
+  memcpy(buf + ptr + 4, &timecklen, 4);
+  memcpy(buf + ptr + 8, &t_capture, 8);
+  memcpy(buf + ptr + 16, &t_arrival, 8);
+  ptr += timecklen;
+  ptr += carstate_.Serialize(buf + ptr, buflen - ptr);
+  ptr += controller_.Serialize(buf + ptr, buflen - ptr);
+  // the particle filter as of its last update, before it resampled; left
+  // out where there isn't room for it, as in the black box
+  if (coneslam_ != NULL) {
+    int len;
+    const uint8_t *log = coneslam_->Log(&len);
+    if (len > 0 && len <= buflen - ptr) {
+      memcpy(buf + ptr, log, len);
+      ptr += len;
+    }
+  }
+  return ptr;
 }
 
   // Update controller from gyro and wheel encoder inputs
 
   // Update controller and UI from camera
-void Driver::UpdateFromCamera(uint8_t *buf, float dt) {
-  float prevxy[2];
-  prevxy[0] = -carstate_.ceiltrack_pos[0] * CEIL_HEIGHT;
-  prevxy[1] = -carstate_.ceiltrack_pos[1] * CEIL_HEIGHT;
-
-  ceiltrack_.Update(buf, 240, CEIL_X_GRID, CEIL_Y_GRID, carstate_.ceiltrack_pos,
-                    2, false);
-  float xytheta[3];
-  // convert ceiling homogeneous coordinates to actual meters on the ground
-  // also we need to convert from bottom-up to top-down coordinates so we negate
-  // through
-  xytheta[0] = -carstate_.ceiltrack_pos[0] * CEIL_HEIGHT;
-  xytheta[1] = -carstate_.ceiltrack_pos[1] * CEIL_HEIGHT;
-  xytheta[2] = -carstate_.ceiltrack_pos[2];
+void Driver::UpdateFromCamera(uint8_t *buf, float dt, int64_t t_capture) {
+  Eigen::Vector3f pose;
+  Eigen::Matrix3f posecov;
+  // take the request and clear it at once, so a press that lands while
+  // this frame is being processed waits for the next one
+  if (reset_localizers_.exchange(false)) {
+    localizers_.Reset();
+    localizers_.GetPose(&pose, &posecov);
+    controller_.ResetLocation(pose);
+  }
+  localizers_.GetPose(&pose, &posecov);
+  float prevxy[2] = {pose[0], pose[1]};
+
+  // every localizer runs on its own core and the results are fused
+  float ds = carstate_.wheel_dist - last_wheel_dist_;
+  last_wheel_dist_ = carstate_.wheel_dist;
+  localizers_.Predict(ds, carstate_.gyro[2], dt);
+  bool fix = localizers_.Update(buf);
+  localizers_.GetPose(&pose, &posecov);
+
+  // a sudden jump in the ceiling fit's residual means it's lost track or
+  // is about to; worth a look afterwards
+  float residual = ceiltrack_ ? ceiltrack_->Residual() : -1;
+  if (residual > 0) {
+    if (residual_spike_ > 0 && residual_avg_ > 0 &&
+        residual > residual_spike_ * residual_avg_) {
+      blackbox_.Trigger("residual");
+    }
+    residual_avg_ = residual_avg_ > 0 ?
+        0.95 * residual_avg_ + 0.05 * residual : residual;
+  }
+  float xytheta[3] = {pose[0], pose[1], pose[2]};
 
   // lap timer
-  if (prevxy[0] < FINISHX && xytheta[0] >= FINISHX && xytheta[1] < FINISHY) {
-    if (last_lap_.tv_sec != 0) {
-      float laptime = (last_t_.tv_sec - last_lap_.tv_sec) +
-                      (last_t_.tv_usec - last_lap_.tv_usec) * 1e-6;
+  if (CrossedFinish(prevxy, xytheta)) {
+    if (last_lap_ != 0) {
+      float laptime = (t_capture - last_lap_) * 1e-6;
       printf("### lap time %0.3f ", laptime);
       // dump configuration
       uint16_t *dc = reinterpret_cast<uint16_t*>(&config_);
@@ -235,7 +523,7 @@ void Driver::UpdateFromCamera(uint8_t *buf, float dt) {
     } else {
       fprintf(stderr, "Starting first lap...\n");
     }
-    last_lap_ = last_t_;
+    last_lap_ = t_capture;
   }
 
   obstacledetect_.Update(buf, config_.black_thresh,
@@ -243,8 +531,17 @@ void Driver::UpdateFromCamera(uint8_t *buf, float dt) {
   const int32_t *pcar = obstacledetect_.GetCarPenalties();
   const int32_t *pcone = obstacledetect_.GetConePenalties();
 
-  controller_.UpdateLocation(config_, xytheta);
+  // the controller keeps its own pose estimate at the control rate; correct
+  // it with the localizers' when they have one
+  if (fix) {
+    controller_.UpdateLocation(config_, pose, posecov, t_capture);
+  }
   controller_.Plan(config_, pcar, pcone);
+  int64_t t_planned = MonotonicMicros();
+  pthread_mutex_lock(&latency_mutex_);
+  exposure_to_plan_.Add(t_planned - t_capture);
+  planned_capture_ = t_capture;
+  pthread_mutex_unlock(&latency_mutex_);
 
   // display_.UpdateConeView(buf, 0, NULL);
   // display_->UpdateEncoders(carstate_.wheel_pos);
@@ -252,7 +549,9 @@ void Driver::UpdateFromCamera(uint8_t *buf, float dt) {
   if (display_) {
     static std::vector<std::pair<float, float>> gridpts;
     gridpts.clear();
-    ceiltrack_.GetMatchedGrid(lens_, carstate_.ceiltrack_pos, CEIL_X_GRID, CEIL_Y_GRID, &gridpts);
+    if (ceiltrack_) {
+      ceiltrack_->GetMatchedGrid(lens_, &gridpts);
+    }
     display_->UpdateCameraView(buf, gridpts);
     display_->UpdateCeiltrackView(xytheta, CEIL_X_GRID * CEIL_HEIGHT,
                                   CEIL_Y_GRID * CEIL_HEIGHT, 20, 10,
@@ -261,35 +560,56 @@ void Driver::UpdateFromCamera(uint8_t *buf, float dt) {
 }
 
   // Called each camera frame, 30Hz
-void Driver::OnCameraFrame(uint8_t *buf, size_t length) {
+void Driver::OnCameraFrame(uint8_t *buf, size_t length, int64_t t_capture) {
+  int64_t t_arrival = MonotonicMicros();
   struct timeval t;
   gettimeofday(&t, NULL);
   frame_++;
+  pthread_mutex_lock(&latency_mutex_);
+  exposure_to_arrival_.Add(t_arrival - t_capture);
+  pthread_mutex_unlock(&latency_mutex_);
 
-  float dt = t.tv_sec - last_t_.tv_sec + (t.tv_usec - last_t_.tv_usec) * 1e-6;
-  if (dt > 0.1 && last_t_.tv_sec != 0) {
+  float dt = (t_capture - last_capture_) * 1e-6;
+  if (dt > 0.1 && last_capture_ != 0) {
     fprintf(stderr,
             "CameraThread::OnFrame: WARNING: "
             "%fs gap between frames?!\n",
             dt);
+    blackbox_.Trigger("framegap");
   }
-  last_t_ = t;
+  last_capture_ = t_capture;
+
+  UpdateFromCamera(buf, dt, t_capture);
 
-  UpdateFromCamera(buf, dt);
+  uint8_t *bb = blackbox_.BeginFrame();
+  if (bb != NULL) {
+    int len = SerializeFrameState(bb, BlackBox::kFrameChunkRoom, t_capture,
+                                  t_arrival);
+    blackbox_.CommitFrame(t, t_capture, len, buf);
+  }
 
   if (IsRecording() && frame_ > frameskip_) {
     frame_ = 0;
-    QueueRecordingData(t, buf, length);
+    QueueRecordingData(t, t_capture, t_arrival, buf, length);
   }
 }
 
 // Called each control loop frame, 100Hz
 // N.B. this can be called concurrently with OnFrame in a separate thread
-bool Driver::OnControlFrame(CarHW *car, float dt) {
+bool Driver::OnControlFrame(CarHW *car, float dt, int64_t t) {
   if (js_) {
     js_->ReadInput(this);
   }
 
+  ControlSample sample;
+  memset(&sample, 0, sizeof(sample));
+  sample.t = t;
+  sample.dt = dt;
+  if (deadline_ > 0 && last_tick_ != 0 && dt > deadline_) {
+    blackbox_.Trigger("deadline");
+  }
+  last_tick_ = t;
+
   Eigen::Vector3f gyro, accel;
   imu_->ReadIMU(&accel, &gyro);
   gyro_last_ = 0.95 * gyro_last_ + 0.05 * gyro;
@@ -302,6 +622,9 @@ bool Driver::OnControlFrame(CarHW *car, float dt) {
   float ds, v;
   if (car->GetWheelMotion(&ds, &v)) {  // use wheel encoders if we have 'em
     carstate_.wheel_v = v;
+    carstate_.wheel_dist += ds;
+    sample.wheel_ds = ds;
+    sample.flags |= ControlSample::kSampleEncoders;
   } else {
     // otherwise try to use the acceleromters/gyros to guess
     // FIXME(a1k0n): do these axes need configuration in the .ini?
@@ -313,9 +636,11 @@ bool Driver::OnControlFrame(CarHW *car, float dt) {
     if (carstate_.wheel_v < 0) {
       carstate_.wheel_v = 0;
     }
+    carstate_.wheel_dist += carstate_.wheel_v * dt;
+    sample.wheel_ds = carstate_.wheel_v * dt;
   }
   controller_.UpdateState(config_, carstate_.accel, carstate_.gyro,
-                          carstate_.wheel_v, dt);
+                          carstate_.wheel_v, dt, t);
 
   float u_a = carstate_.throttle / 127.0;
   float u_s = carstate_.steering / 127.0;
@@ -325,10 +650,41 @@ bool Driver::OnControlFrame(CarHW *car, float dt) {
     uint8_t leds = (frame_ & 4);    // blink green LED
     leds |= IsRecording() ? 2 : 0;  // solid red when recording
     car->SetControls(leds, u_a, u_s);
+
+    int64_t t_actuated = MonotonicMicros();
+    sample_to_actuation_.Add(t_actuated - t);
+    sample.t_actuated = t_actuated;
+    sample.flags |= ControlSample::kSampleActuated;
+    // the first control output since the camera thread planned from a new
+    // frame is the one that frame first affects
+    pthread_mutex_lock(&latency_mutex_);
+    int64_t t_capture = planned_capture_;
+    planned_capture_ = 0;
+    pthread_mutex_unlock(&latency_mutex_);
+    if (t_capture != 0) {
+      exposure_to_actuation_.Add(t_actuated - t_capture);
+    }
   }
   carstate_.throttle = 127*u_a;
   carstate_.steering = 127*u_s;
 
+  for (int i = 0; i < 3; i++) {
+    sample.accel[i] = carstate_.accel[i];
+    sample.gyro[i] = carstate_.gyro[i];
+  }
+  sample.wheel_v = carstate_.wheel_v;
+  sample.u_throttle = u_a;
+  sample.u_steering = u_s;
+  sample.js_throttle = js_throttle_;
+  sample.js_steering = js_steering_;
+  if (autodrive_) {
+    sample.flags |= ControlSample::kSampleAutodrive;
+  }
+  blackbox_.AddSample(&sample);
+  if (IsRecording()) {
+    telemetry_.Push(sample);
+  }
+
   return !done_;
 }
 
@@ -365,6 +721,7 @@ void Driver::OnDPadPress(char direction) {
       break;
   }
   UpdateDisplay();
+  UpdateBlackBoxHeader();
 }
 
 void Driver::OnButtonPress(char button) {
@@ -395,7 +752,7 @@ void Driver::OnButtonPress(char button) {
       }
       break;
     case 'H':  // home button: init to start line
-      carstate_.SetHome();
+      reset_localizers_ = true;
       gyro_bias_ = gyro_last_;
       accel_bias_ = accel_last_;
       printf("gyro bias %0.3f %0.3f %0.3f\n", gyro_bias_[0], gyro_bias_[1],
@@ -419,6 +776,7 @@ void Driver::OnButtonPress(char button) {
       controller_.ResetState();
       if (config_.Load()) {
         fprintf(stderr, "config loaded\n");
+        UpdateBlackBoxHeader();
         int16_t *values = ((int16_t *)&config_);
         if (display_) {
           display_->UpdateConfig(DriverConfig::confignames,
@@ -441,6 +799,13 @@ void Driver::OnButtonPress(char button) {
     case 'Y':
       y_down_ = true;
       break;
+    case 'r':  // ZR: keep the last few seconds
+      if (blackbox_.Trigger("button")) {
+        fprintf(stderr, "%ld.%06ld black box triggered\n", tv.tv_sec,
+                tv.tv_usec);
+        if (display_) display_->UpdateStatus("black box", 0xffe0);
+      }
+      break;
   }
 }
 
@@ -2,14 +2,26 @@
 #ifndef DRIVE_DRIVER_H_
 #define DRIVE_DRIVER_H_
 
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+
 #include "drive/config.h"
 #include "drive/controller.h"
 #include "drive/obstacle.h"
 #include "hw/cam/cam.h"
 #include "hw/car/car.h"
 #include "hw/input/input.h"
+#include "io/blackbox.h"
+#include "io/framecodec.h"
+#include "io/recordpool.h"
+#include "io/storage.h"
+#include "io/telemetryring.h"
 #include "lens/fisheye.h"
-#include "localization/ceiltrack/ceiltrack.h"
+#include "localization/fusion/ceiltrack_localizer.h"
+#include "localization/fusion/coneslam_localizer.h"
+#include "localization/fusion/fusion.h"
+#include "timing/latency.h"
 
 class DriveController;
 class DriverConfig;
@@ -18,18 +30,35 @@ class IMU;
 class JoystickInput;
 class UIDisplay;
 
+// one control loop tick, recorded in "TLM1" chunks (see io/telemetryring.h)
+// between the frames
+struct ControlSample {
+  int64_t t;           // sensors sampled, CLOCK_MONOTONIC microseconds
+  int64_t t_actuated;  // controls sent, or 0 if they weren't this tick
+  float dt;
+  float accel[3], gyro[3];  // less their biases, as the controller sees them
+  float wheel_ds, wheel_v;  // distance this tick, and speed
+  float u_throttle, u_steering;  // the controls, -1..1
+  int16_t js_throttle, js_steering;
+  uint8_t flags;  // kSample* below
+  uint8_t pad[7];
+
+  static const uint8_t kSampleAutodrive = 1;
+  static const uint8_t kSampleEncoders = 2;  // wheel_ds/v are from encoders
+  static const uint8_t kSampleActuated = 4;
+};
+
 class Driver : public CameraReceiver,
                public ControlListener,
                public JoystickListener {
  public:
-  // FIXME(a1k0n): CeilingTracker -> Localizer
   Driver(FlushThread *ft, IMU *imu, JoystickInput *js, UIDisplay *disp);
   ~Driver();
 
   bool Init(const INIReader &ini);
 
-  virtual void OnCameraFrame(uint8_t *buf, size_t length);
-  virtual bool OnControlFrame(CarHW *car, float dt);
+  virtual void OnCameraFrame(uint8_t *buf, size_t length, int64_t t_capture);
+  virtual bool OnControlFrame(CarHW *car, float dt, int64_t t);
 
   virtual void OnDPadPress(char direction);
 
@@ -40,19 +69,47 @@ class Driver : public CameraReceiver,
 
   void Quit() { done_ = true; }
 
+  // the flight recorder, for main's signal handlers: dump what it holds
+  // shortly, or right away when we're about to die
+  bool TriggerBlackBox(const char *reason) {
+    return blackbox_.Trigger(reason);
+  }
+  void DumpBlackBox(const char *reason) { blackbox_.DumpNow(reason); }
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
  private:
   bool StartRecording(const char *fname);
   bool IsRecording();
   void StopRecording();
 
-  void UpdateFromCamera(uint8_t *buf, float dt);
+  // print the latency histograms to stderr and start them over
+  void ReportLatency();
+
+  void UpdateFromCamera(uint8_t *buf, float dt, int64_t t_capture);
 
   void UpdateDisplay();
 
-  void QueueRecordingData(const timeval &t, uint8_t *buf, size_t length);
+  void QueueRecordingData(const timeval &t, int64_t t_capture,
+                          int64_t t_arrival, uint8_t *buf, size_t length);
+
+  // the TMon, CSt1 and CTL2 chunks every recorded frame carries; returns
+  // their length
+  int SerializeFrameState(uint8_t *buf, int buflen, int64_t t_capture,
+                          int64_t t_arrival);
+  int FrameStateSize();
+
+  // start the flight recorder from the [blackbox] settings
+  bool InitBlackBox(const INIReader &ini);
+  void UpdateBlackBoxHeader();
 
   FisheyeLens lens_;
-  CeilingTracker ceiltrack_;
+  // localizers enabled in the [localization] section of the .ini
+  CeilTrackLocalizer *ceiltrack_;
+  ConeSLAMLocalizer *coneslam_;
+  LocalizerFusion localizers_;
+  float last_wheel_dist_;
+  std::atomic<bool> reset_localizers_;  // home button, from the control thread
   ObstacleDetector obstacledetect_;
   DriveController controller_;
   DriverConfig config_;
@@ -66,9 +123,29 @@ class Driver : public CameraReceiver,
   int frame_;
 
   const char *name;
-  int output_fd_;
+  // the recording being written, if any, owned by the FlushThread once
+  // closed. StartRecording and StopRecording come from the control thread
+  // and the camera thread queues each frame to it, so publishing, closing
+  // and queuing to it all happen under record_mutex_; IsRecording() alone
+  // reads it without the lock.
+  std::atomic<StorageWriter*> output_;
+  pthread_mutex_t record_mutex_;
+  bool record_direct_;
   int frameskip_;
-  struct timeval last_t_, last_lap_;
+  RecordBufferPool record_pool_;
+  // every control tick while recording, written out ahead of each frame
+  TelemetryRing<ControlSample> telemetry_;
+  FrameFormat record_format_;  // legacy Y420 unless cropped or compressed
+  bool record_legacy_;
+  FrameCompressor compressor_;  // only started if record_format_.level > 0
+  int record_drops_;  // frames not recorded for want of a free buffer
+  // the last few seconds, whether recording or not, dumped when
+  // something goes wrong: see InitBlackBox for the triggers
+  BlackBox blackbox_;
+  float residual_spike_, residual_avg_;  // ceiltrack fit residual
+  float deadline_;  // longest control tick, seconds
+  int64_t last_tick_;
+  int64_t last_capture_, last_lap_;  // CLOCK_MONOTONIC microseconds
   int16_t js_throttle_, js_steering_;
 
   Eigen::Vector3f gyro_last_, gyro_bias_;
@@ -76,6 +153,17 @@ class Driver : public CameraReceiver,
 
   int config_item_;
   bool x_down_, y_down_;
+
+  // latency histograms; the first two are written by the camera thread under
+  // latency_mutex_, so the control thread can report and clear them, the
+  // rest by the control thread alone
+  LatencyHistogram exposure_to_arrival_;
+  LatencyHistogram exposure_to_plan_;
+  LatencyHistogram exposure_to_actuation_;
+  LatencyHistogram sample_to_actuation_;
+  // capture time of the newest planned camera frame not yet acted on, or 0
+  int64_t planned_capture_;
+  pthread_mutex_t latency_mutex_;
 };
 
 #endif  // DRIVE_DRIVER_H_
@@ -0,0 +1,252 @@
+#include "drive/journal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "io/flushthread.h"
+#include "timing/clock.h"
+
+InputJournal::InputJournal(FlushThread *ft) : ticks_("JTCK") {
+  flush_thread_ = ft;
+  out_ = NULL;
+  seq_ = 0;
+  memset(&tick_, 0, sizeof(tick_));
+  in_tick_ = false;
+  wait_ = false;
+  frame_drops_ = 0;
+}
+
+InputJournal::~InputJournal() {
+  Close();
+}
+
+bool InputJournal::Open(const char *path, int nbuffers, bool wait) {
+  if (!pool_.Init(nbuffers, 640 * 480 * 3 / 2)) {
+    return false;
+  }
+  // ten seconds or so of ticks, flushed with every frame
+  ticks_.Init(1024);
+  StorageWriter *out = StorageWriter::Open(path, false);
+  if (out == NULL) {
+    return false;
+  }
+
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  int64_t times[2] = {
+    tv.tv_sec * (int64_t)1000000 + tv.tv_usec,
+    MonotonicMicros()
+  };
+  uint32_t len = 24;
+  uint8_t *buf = new uint8_t[len];
+  memcpy(buf, "JNL1", 4);
+  memcpy(buf + 4, &len, 4);
+  memcpy(buf + 8, times, 16);
+  flush_thread_->AddEntry(out, buf, len);
+  wait_ = wait;
+  out_ = out;
+  return true;
+}
+
+void InputJournal::Close() {
+  if (out_ == NULL) {
+    return;
+  }
+  flush_thread_->AddSource(out_, &ticks_);
+  flush_thread_->AddEntry(out_, NULL, -1);
+  out_ = NULL;
+  if (frame_drops_ > 0 || ticks_.Dropped() > 0) {
+    fprintf(stderr, "InputJournal: %d frames and %d ticks dropped; "
+            "the journal can't be replayed past the first\n", frame_drops_,
+            ticks_.Dropped());
+  }
+}
+
+void InputJournal::AddFrame(const uint8_t *buf, size_t length,
+                            int64_t t_capture) {
+  if (out_ == NULL) {
+    return;
+  }
+  int64_t seq = seq_++;
+  RecordBuffer *rec = NULL;
+  if (length <= pool_.Capacity()) {
+    while ((rec = pool_.Get()) == NULL && wait_) {
+      usleep(1000);
+    }
+  }
+  if (rec == NULL) {
+    frame_drops_++;
+    return;
+  }
+  uint32_t len = 8 + 16 + length;
+  memcpy(rec->header, "JCAM", 4);
+  memcpy(rec->header + 4, &len, 4);
+  memcpy(rec->header + 8, &seq, 8);
+  memcpy(rec->header + 16, &t_capture, 8);
+  rec->header_len = 24;
+  memcpy(rec->data, buf, length);
+  rec->data_len = length;
+  // the ticks so far go ahead of it
+  flush_thread_->AddSource(out_, &ticks_);
+  if (!flush_thread_->AddRecord(out_, rec)) {
+    frame_drops_++;
+  }
+}
+
+void InputJournal::BeginTick(float dt, int64_t t) {
+  if (out_ == NULL) {
+    return;
+  }
+  memset(&tick_, 0, sizeof(tick_));
+  tick_.t = t;
+  tick_.seq = seq_++;
+  tick_.dt = dt;
+  in_tick_ = true;
+}
+
+void InputJournal::EndTick(bool ok) {
+  if (!in_tick_) {
+    return;
+  }
+  if (!ok) {
+    tick_.flags |= JournalTick::kQuit;
+  }
+  ticks_.Push(tick_);
+  in_tick_ = false;
+}
+
+bool JournalCar::SetControls(unsigned LEDs, float throttle, float steering) {
+  bool ok = car_->SetControls(LEDs, throttle, steering);
+  JournalTick *tick = journal_->Tick();
+  if (tick != NULL) {
+    if (tick->flags & JournalTick::kActuated) {
+      tick->flags |= JournalTick::kOverflow;
+    }
+    tick->flags |= JournalTick::kActuated | (ok ? JournalTick::kActuatedOk : 0);
+    tick->leds = LEDs;
+    tick->u_throttle = throttle;
+    tick->u_steering = steering;
+  }
+  return ok;
+}
+
+bool JournalCar::GetWheelMotion(float *ds, float *v) {
+  bool ok = car_->GetWheelMotion(ds, v);
+  JournalTick *tick = journal_->Tick();
+  if (tick != NULL) {
+    if (tick->flags & JournalTick::kWheel) {
+      tick->flags |= JournalTick::kOverflow;
+    }
+    tick->flags |= JournalTick::kWheel | (ok ? JournalTick::kWheelOk : 0);
+    tick->ds = *ds;
+    tick->v = *v;
+  }
+  return ok;
+}
+
+int JournalCar::GetRadioInput(float *channelbuf, int maxch) {
+  int n = car_->GetRadioInput(channelbuf, maxch);
+  JournalTick *tick = journal_->Tick();
+  if (tick != NULL) {
+    if ((tick->flags & JournalTick::kRadio) || n > JournalTick::kMaxRadio) {
+      tick->flags |= JournalTick::kOverflow;
+    }
+    tick->flags |= JournalTick::kRadio;
+    tick->n_radio = n < 0 ? 0 : n > JournalTick::kMaxRadio ?
+        JournalTick::kMaxRadio : n;
+    memcpy(tick->radio, channelbuf, tick->n_radio * sizeof(float));
+  }
+  return n;
+}
+
+void JournalCar::RunMainLoop(ControlListener *cb) {
+  cb_ = cb;
+  car_->RunMainLoop(this);
+}
+
+bool JournalCar::OnControlFrame(CarHW *car, float dt, int64_t t) {
+  journal_->BeginTick(dt, t);
+  // the listener's hardware calls come back through us
+  bool ok = cb_->OnControlFrame(this, dt, t);
+  journal_->EndTick(ok);
+  return ok;
+}
+
+bool JournalIMU::ReadIMU(Eigen::Vector3f *accel, Eigen::Vector3f *gyro) {
+  bool ok = imu_->ReadIMU(accel, gyro);
+  JournalTick *tick = journal_->Tick();
+  if (tick != NULL) {
+    if (tick->flags & JournalTick::kImu) {
+      tick->flags |= JournalTick::kOverflow;
+    }
+    tick->flags |= JournalTick::kImu | (ok ? JournalTick::kImuOk : 0);
+    for (int i = 0; i < 3; i++) {
+      tick->accel[i] = (*accel)[i];
+      tick->gyro[i] = (*gyro)[i];
+    }
+  }
+  return ok;
+}
+
+bool JournalJoystick::ReadInput(JoystickListener *receiver) {
+  receiver_ = receiver;
+  bool ok = js_->ReadInput(this);
+  JournalTick *tick = journal_->Tick();
+  if (tick != NULL) {
+    if (tick->flags & JournalTick::kJoystick) {
+      tick->flags |= JournalTick::kOverflow;
+    }
+    tick->flags |= JournalTick::kJoystick |
+        (ok ? JournalTick::kJoystickOk : 0);
+  }
+  return ok;
+}
+
+void JournalJoystick::Event(char event, char arg, int16_t value) {
+  JournalTick *tick = journal_->Tick();
+  if (tick == NULL) {
+    return;
+  }
+  if (tick->n_js >= JournalTick::kMaxJoystick) {
+    tick->flags |= JournalTick::kOverflow;
+    return;
+  }
+  tick->js_event[tick->n_js] = event;
+  tick->js_arg[tick->n_js] = arg;
+  tick->js_value[tick->n_js] = value;
+  tick->n_js++;
+}
+
+void JournalJoystick::OnDPadPress(char direction) {
+  Event('D', direction, 0);
+  receiver_->OnDPadPress(direction);
+}
+
+void JournalJoystick::OnDPadRelease(char direction) {
+  Event('d', direction, 0);
+  receiver_->OnDPadRelease(direction);
+}
+
+void JournalJoystick::OnButtonPress(char button) {
+  Event('B', button, 0);
+  receiver_->OnButtonPress(button);
+}
+
+void JournalJoystick::OnButtonRelease(char button) {
+  Event('b', button, 0);
+  receiver_->OnButtonRelease(button);
+}
+
+void JournalJoystick::OnAxisMove(int axis, int16_t value) {
+  Event('A', axis, value);
+  receiver_->OnAxisMove(axis, value);
+}
+
+void JournalCamera::OnCameraFrame(uint8_t *buf, size_t length,
+                                  int64_t t_capture) {
+  // before the receiver gets to it, in case it scribbles on it
+  journal_->AddFrame(buf, length, t_capture);
+  receiver_->OnCameraFrame(buf, length, t_capture);
+}
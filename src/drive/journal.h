@@ -0,0 +1,171 @@
+#ifndef DRIVE_JOURNAL_H_
+#define DRIVE_JOURNAL_H_
+
+#include <stdint.h>
+#include <atomic>
+
+#include "hw/cam/cam.h"
+#include "hw/car/car.h"
+#include "hw/imu/imu.h"
+#include "hw/input/input.h"
+#include "hw/input/js.h"
+#include "io/recordpool.h"
+#include "io/storage.h"
+#include "io/telemetryring.h"
+
+class FlushThread;
+
+// Input journal: everything the hardware tells the Driver, at the CarHW,
+// IMU, JoystickInput and Camera boundaries, so a run can be played back
+// into a Driver exactly (see drive/journalreplay.h). The Journal* classes
+// below stand in for the real hardware and pass every call through,
+// noting what came back.
+//
+// Each camera frame and each control tick is a unit of the journal,
+// numbered in the order they started across both threads. A frame goes in
+// a chunk of its own
+//
+//   "JCAM", uint32 length, int64 seq, int64 t_capture, frame bytes
+//
+// and a tick, with every hardware call made during it, in a JournalTick
+// written out through a TelemetryRing ("JTCK") ahead of each frame. The
+// file starts with
+//
+//   "JNL1", uint32 24, int64 wall clock us, int64 CLOCK_MONOTONIC us
+
+// what one control tick read from and sent to the hardware
+struct JournalTick {
+  static const int kMaxJoystick = 8;  // events per tick
+  static const int kMaxRadio = 8;     // channels
+
+  // which calls were made, and what they returned
+  static const uint16_t kImu = 1;
+  static const uint16_t kImuOk = 2;
+  static const uint16_t kWheel = 4;
+  static const uint16_t kWheelOk = 8;
+  static const uint16_t kJoystick = 16;
+  static const uint16_t kJoystickOk = 32;
+  static const uint16_t kActuated = 64;
+  static const uint16_t kActuatedOk = 128;
+  static const uint16_t kRadio = 256;
+  static const uint16_t kQuit = 512;      // OnControlFrame returned false
+  static const uint16_t kOverflow = 1024;  // didn't all fit; not replayable
+
+  int64_t t;  // sensors sampled, CLOCK_MONOTONIC microseconds
+  int64_t seq;
+  float dt;
+  float accel[3], gyro[3];       // ReadIMU
+  float ds, v;                   // GetWheelMotion
+  float u_throttle, u_steering;  // SetControls
+  uint32_t leds;
+  float radio[kMaxRadio];        // GetRadioInput
+  // JoystickListener calls made from ReadInput, in order: 'D'/'d' dpad
+  // press/release, 'B'/'b' button press/release, 'A' axis move
+  int16_t js_value[kMaxJoystick];
+  char js_event[kMaxJoystick];
+  char js_arg[kMaxJoystick];
+  uint16_t flags;
+  uint8_t n_js, n_radio;
+  uint8_t pad[4];
+};
+
+class InputJournal {
+ public:
+  explicit InputJournal(FlushThread *ft);
+  ~InputJournal();
+
+  // nbuffers frames may be waiting for the sdcard at once; more are dropped
+  // (and the journal can't be replayed past them) unless wait is set, as
+  // when journaling a replay, which has no camera to keep up with
+  bool Open(const char *path, int nbuffers = 16, bool wait = false);
+  // once the camera and control loop have stopped
+  void Close();
+  bool IsOpen() const { return out_ != NULL; }
+
+  // camera thread
+  void AddFrame(const uint8_t *buf, size_t length, int64_t t_capture);
+
+  // control thread: the tick the hardware calls are noted in, between
+  // BeginTick and EndTick
+  void BeginTick(float dt, int64_t t);
+  JournalTick *Tick() { return in_tick_ ? &tick_ : NULL; }
+  void EndTick(bool ok);
+
+ private:
+  FlushThread *flush_thread_;
+  StorageWriter *out_;
+  RecordBufferPool pool_;
+  TelemetryRing<JournalTick> ticks_;
+  std::atomic<int64_t> seq_;
+  JournalTick tick_;
+  bool in_tick_;
+  bool wait_;
+  int frame_drops_;
+};
+
+class JournalCar : public CarHW, public ControlListener {
+ public:
+  JournalCar(InputJournal *journal, CarHW *car)
+      : journal_(journal), car_(car), cb_(NULL) {}
+
+  virtual bool Init() { return car_->Init(); }
+  virtual bool SetControls(unsigned LEDs, float throttle, float steering);
+  virtual bool GetWheelMotion(float *ds, float *v);
+  virtual int GetRadioInput(float *channelbuf, int maxch);
+  // runs car's loop with each tick journaled on its way to cb
+  virtual void RunMainLoop(ControlListener *cb);
+
+  virtual bool OnControlFrame(CarHW *car, float dt, int64_t t);
+
+ private:
+  InputJournal *journal_;
+  CarHW *car_;
+  ControlListener *cb_;
+};
+
+class JournalIMU : public IMU {
+ public:
+  JournalIMU(InputJournal *journal, IMU *imu) : journal_(journal), imu_(imu) {}
+
+  virtual bool Init() { return imu_->Init(); }
+  virtual bool ReadIMU(Eigen::Vector3f *accel, Eigen::Vector3f *gyro);
+
+ private:
+  InputJournal *journal_;
+  IMU *imu_;
+};
+
+class JournalJoystick : public JoystickInput, public JoystickListener {
+ public:
+  JournalJoystick(InputJournal *journal, JoystickInput *js)
+      : journal_(journal), js_(js), receiver_(NULL) {}
+
+  virtual bool ReadInput(JoystickListener *receiver);
+
+  virtual void OnDPadPress(char direction);
+  virtual void OnDPadRelease(char direction);
+  virtual void OnButtonPress(char button);
+  virtual void OnButtonRelease(char button);
+  virtual void OnAxisMove(int axis, int16_t value);
+
+ private:
+  void Event(char event, char arg, int16_t value);
+
+  InputJournal *journal_;
+  JoystickInput *js_;
+  JoystickListener *receiver_;
+};
+
+class JournalCamera : public CameraReceiver {
+ public:
+  JournalCamera(InputJournal *journal, CameraReceiver *receiver)
+      : journal_(journal), receiver_(receiver) {}
+
+  virtual void OnCameraFrame(uint8_t *buf, size_t length, int64_t t_capture);
+
+ private:
+  InputJournal *journal_;
+  CameraReceiver *receiver_;
+};
+
+#endif  // DRIVE_JOURNAL_H_
@@ -0,0 +1,206 @@
+// journal a run of a toy driver fed from a camera and a control loop thread
+// racing each other, replay it into a fresh one while journaling that, then
+// replay the second journal: it has to come out bit for bit the same
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "drive/journal.h"
+#include "drive/journalreplay.h"
+#include "io/flushthread.h"
+
+static const int kFrameLen = 640 * 480 * 3 / 2;
+static const int kFrames = 60, kTicks = 200;
+
+// stands in for Driver: its controls depend on every input, and on the
+// order the frames and ticks arrive in
+class ToyDriver : public CameraReceiver,
+                  public ControlListener,
+                  public JoystickListener {
+ public:
+  ToyDriver(IMU *imu, JoystickInput *js) : imu_(imu), js_(js) {
+    state_ = 1;
+    buttons_ = 0;
+    pthread_mutex_init(&mutex_, NULL);
+  }
+  ~ToyDriver() { pthread_mutex_destroy(&mutex_); }
+
+  virtual void OnCameraFrame(uint8_t *buf, size_t length, int64_t t_capture) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < length; i += 97) {
+      sum += buf[i];
+    }
+    pthread_mutex_lock(&mutex_);
+    state_ = state_ * 0.9f + sum * 1e-6f + t_capture * 1e-9f;
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  virtual bool OnControlFrame(CarHW *car, float dt, int64_t t) {
+    js_->ReadInput(this);
+    Eigen::Vector3f accel, gyro;
+    imu_->ReadIMU(&accel, &gyro);
+    float ds, v;
+    car->GetWheelMotion(&ds, &v);
+    pthread_mutex_lock(&mutex_);
+    state_ += dt * (accel[0] + gyro[2] + ds * v);
+    float u = state_;
+    pthread_mutex_unlock(&mutex_);
+    if (static_cast<int>(t / 10000) % 3 != 0) {
+      car->SetControls(buttons_, u, -u);
+    }
+    return true;
+  }
+
+  virtual void OnButtonPress(char button) { buttons_ += button; }
+  virtual void OnAxisMove(int axis, int16_t value) {
+    pthread_mutex_lock(&mutex_);
+    state_ += value * 1e-5f;
+    pthread_mutex_unlock(&mutex_);
+  }
+
+ private:
+  IMU *imu_;
+  JoystickInput *js_;
+  float state_;
+  unsigned buttons_;
+  pthread_mutex_t mutex_;
+};
+
+class FakeCar : public CarHW {
+ public:
+  virtual bool Init() { return true; }
+  virtual bool SetControls(unsigned LEDs, float throttle, float steering) {
+    return true;
+  }
+  virtual bool GetWheelMotion(float *ds, float *v) {
+    *ds = n_ * 0.01f;
+    *v = n_ * 0.1f;
+    return true;
+  }
+  virtual int GetRadioInput(float *channelbuf, int maxch) { return 0; }
+  virtual void RunMainLoop(ControlListener *cb) {
+    for (n_ = 0; n_ < kTicks; n_++) {
+      cb->OnControlFrame(this, 0.01, 1000000 + n_ * 10000LL);
+      usleep(500);
+    }
+  }
+
+ private:
+  int n_;
+};
+
+class FakeIMU : public IMU {
+ public:
+  FakeIMU() : n_(0) {}
+  virtual bool Init() { return true; }
+  virtual bool ReadIMU(Eigen::Vector3f *accel, Eigen::Vector3f *gyro) {
+    n_++;
+    *accel = Eigen::Vector3f(n_ * 0.25f, 0, 9.8f);
+    *gyro = Eigen::Vector3f(0, 0, -n_ * 0.125f);
+    return true;
+  }
+
+ private:
+  int n_;
+};
+
+class FakeJoystick : public JoystickInput {
+ public:
+  FakeJoystick() : n_(0) {}
+  virtual bool ReadInput(JoystickListener *receiver) {
+    if (++n_ % 7 == 0) {
+      receiver->OnButtonPress('A' + n_ % 5);
+      receiver->OnAxisMove(1, n_ * 100);
+    }
+    return true;
+  }
+
+ private:
+  int n_;
+};
+
+static JournalCamera *camera;
+
+static void *camera_thread(void *) {
+  uint8_t *frame = new uint8_t[kFrameLen];
+  for (int n = 0; n < kFrames; n++) {
+    for (int i = 0; i < kFrameLen; i++) {
+      frame[i] = i * 7 + n;
+    }
+    camera->OnCameraFrame(frame, kFrameLen, 1000000 + n * 33333LL);
+    usleep(1500);
+  }
+  delete[] frame;
+  return NULL;
+}
+
+// replay in into a ToyDriver, journaling it to out if it's not NULL
+static bool Replay(const char *in, const char *out, int *mismatches) {
+  FlushThread flush;
+  if (!flush.Init(16)) {
+    return false;
+  }
+  JournalReplay replay;
+  if (!replay.Open(in)) {
+    return false;
+  }
+  InputJournal journal(&flush);
+  JournalCar car(&journal, replay.Car());
+  JournalIMU imu(&journal, replay.Imu());
+  JournalJoystick js(&journal, replay.Joystick());
+  if (out != NULL && !journal.Open(out, 4, true)) {
+    return false;
+  }
+  ToyDriver driver(&imu, &js);
+  JournalCamera cam(&journal, &driver);
+  replay.StartCamera(&cam);
+  car.RunMainLoop(&driver);
+  journal.Close();
+  flush.Stop();
+  replay.Report(stdout);
+  *mismatches = replay.Mismatches();
+  // nothing dropped, in the live run or journaling the replay
+  return replay.Frames() == kFrames && replay.Ticks() == kTicks;
+}
+
+int main() {
+  const char *live = "journal_test_live.tmp", *base = "journal_test_base.tmp";
+  FlushThread flush;
+  if (!flush.Init(16)) {
+    return 1;
+  }
+  InputJournal journal(&flush);
+  FakeCar fakecar;
+  FakeIMU fakeimu;
+  FakeJoystick fakejs;
+  JournalCar car(&journal, &fakecar);
+  JournalIMU imu(&journal, &fakeimu);
+  JournalJoystick js(&journal, &fakejs);
+  if (!journal.Open(live, 16)) {
+    return 1;
+  }
+  ToyDriver driver(&imu, &js);
+  JournalCamera cam(&journal, &driver);
+  camera = &cam;
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, camera_thread, NULL);
+  car.RunMainLoop(&driver);
+  pthread_join(thread, NULL);
+  journal.Close();
+  flush.Stop();
+
+  // the live run raced, so its replay needn't match it; replays of the
+  // replay have to
+  int live_mismatches, mismatches = -1;
+  bool ok = Replay(live, base, &live_mismatches) &&
+      Replay(base, NULL, &mismatches) && mismatches == 0;
+  unlink(live);
+  unlink(base);
+
+  printf(ok ? "OK\n" : "FAIL\n");
+  return ok ? 0 : 1;
+}
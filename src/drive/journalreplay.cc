@@ -0,0 +1,277 @@
+#include "drive/journalreplay.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "timing/clock.h"
+
+// what the driver did that we check: the calls which feed its state, and
+// the controls it sent
+static const uint16_t kCheckedCalls =
+    JournalTick::kImu | JournalTick::kWheel | JournalTick::kActuated;
+
+JournalReplay::JournalReplay()
+    : car_(this), imu_(this), js_(this) {
+  map_ = NULL;
+  size_ = 0;
+  receiver_ = NULL;
+  framebuf_ = NULL;
+  framebuf_len_ = 0;
+  tick_ = NULL;
+  memset(&actual_, 0, sizeof(actual_));
+  frames_ = nticks_ = mismatches_ = 0;
+  camera_us_ = control_us_ = wall_us_ = 0;
+}
+
+JournalReplay::~JournalReplay() {
+  Close();
+  delete[] framebuf_;
+}
+
+bool JournalReplay::Open(const char *path) {
+  Close();
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    perror(path);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    perror(path);
+    close(fd);
+    return false;
+  }
+  size_ = st.st_size;
+  if (size_ < 24) {
+    fprintf(stderr, "%s: not a journal\n", path);
+    close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("JournalReplay: mmap");
+    size_ = 0;
+    return false;
+  }
+  map_ = reinterpret_cast<const uint8_t*>(map);
+  if (memcmp(map_, "JNL1", 4)) {
+    fprintf(stderr, "%s: not a journal\n", path);
+    Close();
+    return false;
+  }
+
+  // the frames stay in the mapping; the ticks are copied out
+  size_t offset = 0;
+  while (offset + 8 <= size_) {
+    uint32_t len;
+    memcpy(&len, map_ + offset + 4, 4);
+    if (len < 8 || len > size_ - offset) {
+      fprintf(stderr, "%s: torn at offset %zu\n", path, offset);
+      break;
+    }
+    const uint8_t *ck = map_ + offset;
+    if (!memcmp(ck, "JCAM", 4) && len >= 24) {
+      Unit u;
+      memcpy(&u.seq, ck + 8, 8);
+      memcpy(&u.t_capture, ck + 16, 8);
+      u.tick = -1;
+      u.frame = ck + 24;
+      u.length = len - 24;
+      units_.push_back(u);
+      framebuf_len_ = std::max(framebuf_len_, u.length);
+    } else if (!memcmp(ck, "JTCK", 4) && len >= 16) {
+      uint16_t size;
+      memcpy(&size, ck + 8, 2);
+      if (size != sizeof(JournalTick)) {
+        fprintf(stderr, "%s: %d byte ticks, expected %zu\n", path, size,
+                sizeof(JournalTick));
+        Close();
+        return false;
+      }
+      for (size_t i = 16; i + size <= len; i += size) {
+        JournalTick t;
+        memcpy(&t, ck + i, size);
+        Unit u;
+        u.seq = t.seq;
+        u.tick = ticks_.size();
+        u.frame = NULL;
+        u.length = 0;
+        u.t_capture = 0;
+        ticks_.push_back(t);
+        units_.push_back(u);
+      }
+    }
+    offset += len;
+  }
+
+  // in the order they started; stop short of anything dropped or that
+  // didn't fit in the journal
+  std::sort(units_.begin(), units_.end());
+  for (size_t i = 0; i < units_.size(); i++) {
+    const Unit &u = units_[i];
+    if (u.seq != static_cast<int64_t>(i) ||
+        (u.tick >= 0 && ticks_[u.tick].flags & JournalTick::kOverflow)) {
+      fprintf(stderr, "%s: unit %zu %s; replaying the %zu before it\n",
+              path, i, u.seq != static_cast<int64_t>(i) ? "missing" :
+              "incomplete", i);
+      units_.resize(i);
+      break;
+    }
+  }
+  delete[] framebuf_;
+  framebuf_ = new uint8_t[framebuf_len_ > 0 ? framebuf_len_ : 1];
+  return true;
+}
+
+void JournalReplay::Close() {
+  if (map_ != NULL) {
+    munmap(const_cast<uint8_t*>(map_), size_);
+  }
+  map_ = NULL;
+  size_ = 0;
+  ticks_.clear();
+  units_.clear();
+}
+
+void JournalReplay::Run(ControlListener *cb) {
+  int64_t t0 = MonotonicMicros();
+  for (size_t i = 0; i < units_.size(); i++) {
+    const Unit &u = units_[i];
+    if (u.tick < 0) {
+      if (receiver_ == NULL) {
+        continue;
+      }
+      // a writable copy, as the camera's buffers are
+      memcpy(framebuf_, u.frame, u.length);
+      int64_t t = MonotonicMicros();
+      receiver_->OnCameraFrame(framebuf_, u.length, u.t_capture);
+      camera_us_ += MonotonicMicros() - t;
+      frames_++;
+      continue;
+    }
+
+    tick_ = &ticks_[u.tick];
+    memset(&actual_, 0, sizeof(actual_));
+    int64_t t = MonotonicMicros();
+    bool ok = cb->OnControlFrame(&car_, tick_->dt, tick_->t);
+    control_us_ += MonotonicMicros() - t;
+    nticks_++;
+    Check(u.tick, ok);
+    tick_ = NULL;
+    if (!ok) {
+      break;
+    }
+  }
+  wall_us_ = MonotonicMicros() - t0;
+}
+
+void JournalReplay::Check(int i, bool ok) {
+  const JournalTick &want = ticks_[i];
+  bool same = ok == !(want.flags & JournalTick::kQuit) &&
+      (actual_.flags & kCheckedCalls) == (want.flags & kCheckedCalls);
+  if (same && (want.flags & JournalTick::kActuated)) {
+    // bit for bit
+    same = actual_.leds == want.leds &&
+        !memcmp(&actual_.u_throttle, &want.u_throttle, sizeof(float)) &&
+        !memcmp(&actual_.u_steering, &want.u_steering, sizeof(float));
+  }
+  if (same) {
+    return;
+  }
+  if (++mismatches_ <= 10) {
+    fprintf(stderr, "JournalReplay: tick %lld (t=%lld) differs: calls %03x "
+            "controls %f %f leds %u, journal has calls %03x controls %f %f "
+            "leds %u\n", (long long) want.seq, (long long) want.t,
+            actual_.flags & kCheckedCalls, actual_.u_throttle,
+            actual_.u_steering, actual_.leds, want.flags & kCheckedCalls,
+            want.u_throttle, want.u_steering, want.leds);
+  }
+}
+
+void JournalReplay::Report(FILE *fp) const {
+  fprintf(fp, "replayed %d frames and %d ticks in %.3fs: camera %.1f us/frame,"
+          " control %.1f us/tick; %d ticks differ from the journal\n",
+          frames_, nticks_, wall_us_ * 1e-6,
+          frames_ ? static_cast<double>(camera_us_) / frames_ : 0.0,
+          nticks_ ? static_cast<double>(control_us_) / nticks_ : 0.0,
+          mismatches_);
+}
+
+bool ReplayCar::SetControls(unsigned LEDs, float throttle, float steering) {
+  JournalTick *a = &replay_->actual_;
+  a->flags |= JournalTick::kActuated;
+  a->leds = LEDs;
+  a->u_throttle = throttle;
+  a->u_steering = steering;
+  const JournalTick *t = replay_->tick_;
+  return t != NULL && (t->flags & JournalTick::kActuatedOk);
+}
+
+bool ReplayCar::GetWheelMotion(float *ds, float *v) {
+  replay_->actual_.flags |= JournalTick::kWheel;
+  const JournalTick *t = replay_->tick_;
+  if (t == NULL || !(t->flags & JournalTick::kWheel)) {
+    return false;
+  }
+  *ds = t->ds;
+  *v = t->v;
+  return t->flags & JournalTick::kWheelOk;
+}
+
+int ReplayCar::GetRadioInput(float *channelbuf, int maxch) {
+  const JournalTick *t = replay_->tick_;
+  if (t == NULL || !(t->flags & JournalTick::kRadio)) {
+    return 0;
+  }
+  int n = std::min<int>(t->n_radio, maxch);
+  memcpy(channelbuf, t->radio, n * sizeof(float));
+  return n;
+}
+
+void ReplayCar::RunMainLoop(ControlListener *cb) {
+  replay_->Run(cb);
+}
+
+bool ReplayIMU::ReadIMU(Eigen::Vector3f *accel, Eigen::Vector3f *gyro) {
+  replay_->actual_.flags |= JournalTick::kImu;
+  const JournalTick *t = replay_->tick_;
+  if (t == NULL || !(t->flags & JournalTick::kImu)) {
+    return false;
+  }
+  *accel = Eigen::Vector3f(t->accel[0], t->accel[1], t->accel[2]);
+  *gyro = Eigen::Vector3f(t->gyro[0], t->gyro[1], t->gyro[2]);
+  return t->flags & JournalTick::kImuOk;
+}
+
+bool ReplayJoystick::ReadInput(JoystickListener *receiver) {
+  const JournalTick *t = replay_->tick_;
+  if (t == NULL || !(t->flags & JournalTick::kJoystick)) {
+    return false;
+  }
+  for (int i = 0; i < t->n_js; i++) {
+    switch (t->js_event[i]) {
+      case 'D':
+        receiver->OnDPadPress(t->js_arg[i]);
+        break;
+      case 'd':
+        receiver->OnDPadRelease(t->js_arg[i]);
+        break;
+      case 'B':
+        receiver->OnButtonPress(t->js_arg[i]);
+        break;
+      case 'b':
+        receiver->OnButtonRelease(t->js_arg[i]);
+        break;
+      case 'A':
+        receiver->OnAxisMove(t->js_arg[i], t->js_value[i]);
+        break;
+    }
+  }
+  return t->flags & JournalTick::kJoystickOk;
+}
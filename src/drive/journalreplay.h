@@ -0,0 +1,128 @@
+#ifndef DRIVE_JOURNALREPLAY_H_
+#define DRIVE_JOURNALREPLAY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include "drive/journal.h"
+#include "hw/cam/cam.h"
+#include "hw/car/car.h"
+#include "hw/imu/imu.h"
+#include "hw/input/js.h"
+
+class JournalReplay;
+
+// the hardware as the journal remembers it
+class ReplayCar : public CarHW {
+ public:
+  explicit ReplayCar(JournalReplay *r) : replay_(r) {}
+
+  virtual bool Init() { return true; }
+  virtual bool SetControls(unsigned LEDs, float throttle, float steering);
+  virtual bool GetWheelMotion(float *ds, float *v);
+  virtual int GetRadioInput(float *channelbuf, int maxch);
+  // plays the whole journal back; see JournalReplay::Run
+  virtual void RunMainLoop(ControlListener *cb);
+
+ private:
+  JournalReplay *replay_;
+};
+
+class ReplayIMU : public IMU {
+ public:
+  explicit ReplayIMU(JournalReplay *r) : replay_(r) {}
+
+  virtual bool Init() { return true; }
+  virtual bool ReadIMU(Eigen::Vector3f *accel, Eigen::Vector3f *gyro);
+
+ private:
+  JournalReplay *replay_;
+};
+
+class ReplayJoystick : public JoystickInput {
+ public:
+  explicit ReplayJoystick(JournalReplay *r) : replay_(r) {}
+
+  virtual bool ReadInput(JoystickListener *receiver);
+
+ private:
+  JournalReplay *replay_;
+};
+
+// Plays an input journal (see drive/journal.h) back on one thread: each
+// camera frame and control tick in the order they started, every one run
+// to completion before the next, with the replay hardware answering each
+// call as the real hardware did. The run is then a function of the journal
+// alone, save for whatever else the driver reads (cycloid.ini,
+// driverconf.txt, the value function...), so two builds can be compared
+// on the same input for speed and output.
+//
+// The controls each tick sends are checked against the journal's. Those
+// of a journal recorded on the car will differ, as its camera and control
+// threads raced; journal a replay (drive -r car.jnl -j base.jnl) and
+// replays of that should match it bit for bit.
+class JournalReplay {
+ public:
+  JournalReplay();
+  ~JournalReplay();
+
+  // map and index the journal, up to the first unit that's missing
+  bool Open(const char *path);
+  void Close();
+
+  CarHW *Car() { return &car_; }
+  IMU *Imu() { return &imu_; }
+  JoystickInput *Joystick() { return &js_; }
+
+  // where frames go, as with Camera::StartRecord
+  void StartCamera(CameraReceiver *receiver) { receiver_ = receiver; }
+
+  // replay everything, frames to the camera receiver and ticks to cb,
+  // until the journal runs out or cb returns false
+  void Run(ControlListener *cb);
+
+  // timings and mismatches
+  void Report(FILE *fp) const;
+  int Frames() const { return frames_; }
+  int Ticks() const { return nticks_; }
+  int Mismatches() const { return mismatches_; }
+
+ private:
+  friend class ReplayCar;
+  friend class ReplayIMU;
+  friend class ReplayJoystick;
+
+  struct Unit {
+    int64_t seq;
+    int tick;  // index into ticks_, or -1 for a frame
+    const uint8_t *frame;
+    size_t length;
+    int64_t t_capture;
+
+    bool operator<(const Unit &u) const { return seq < u.seq; }
+  };
+
+  // compare what the driver did in tick i with what the journal says
+  void Check(int i, bool ok);
+
+  const uint8_t *map_;
+  size_t size_;
+  std::vector<JournalTick> ticks_;
+  std::vector<Unit> units_;
+
+  ReplayCar car_;
+  ReplayIMU imu_;
+  ReplayJoystick js_;
+  CameraReceiver *receiver_;
+  uint8_t *framebuf_;
+  size_t framebuf_len_;
+
+  const JournalTick *tick_;  // being replayed
+  JournalTick actual_;       // and what the driver did during it
+
+  int frames_, nticks_, mismatches_;
+  int64_t camera_us_, control_us_, wall_us_;
+};
+
+#endif  // DRIVE_JOURNALREPLAY_H_
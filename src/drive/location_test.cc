@@ -0,0 +1,71 @@
+// check that DriveController's pose estimate absorbs late camera poses at
+// their capture time, rather than as if they were current
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <Eigen/Dense>
+
+#include "drive/config.h"
+#include "drive/controller.h"
+
+const float kDt = 0.01;
+const int64_t kDtMicros = 10000;
+const float kSpeed = 4.0, kRadius = 3.0;
+const int kLatencyFrames = 6;  // camera latency, in control frames
+const int kCameraEvery = 3;
+
+int main() {
+  DriverConfig config;
+  DriveController control;
+
+  Eigen::Vector3f accel(0, 0, 0), gyro(0, 0, 0);
+  Eigen::Matrix3f cov = Eigen::Matrix3f::Identity() * 1e-4;
+
+  // true poses for the last kLatencyFrames control frames
+  float xs[kLatencyFrames], ys[kLatencyFrames], thetas[kLatencyFrames];
+  float x = 0, y = -kRadius, theta = 0;
+  control.ResetLocation(Eigen::Vector3f(x, y, theta));
+
+  float maxerr = 0;
+  for (int i = 0; i < 1000; i++) {
+    // wheel odometry reads 10% high, so we rely on the camera to keep up
+    float w = kSpeed / kRadius;
+    gyro[2] = w;
+    float theta1 = theta + w * kDt / 2;
+    x += kSpeed * kDt * cos(theta1);
+    y += kSpeed * kDt * sin(theta1);
+    theta += w * kDt;
+    xs[i % kLatencyFrames] = x;
+    ys[i % kLatencyFrames] = y;
+    thetas[i % kLatencyFrames] = theta;
+    control.UpdateState(config, accel, gyro, kSpeed * 1.1, kDt,
+                        i * kDtMicros);
+
+    if (i >= kLatencyFrames && i % kCameraEvery == 0) {
+      int j = (i + 1) % kLatencyFrames;  // kLatencyFrames - 1 frames ago
+      control.UpdateLocation(config, Eigen::Vector3f(xs[j], ys[j], thetas[j]),
+                             cov, (i - kLatencyFrames + 1) * kDtMicros);
+    }
+    if (i >= 100) {
+      maxerr = fmaxf(maxerr, hypotf(control.x_ - x, control.y_ - y));
+    }
+  }
+  printf("max position error with %0.0fms camera latency: %f m\n",
+         (kLatencyFrames - 1) * kDt * 1000, maxerr);
+  // uncompensated, we'd be a whole latency's worth of travel behind
+  if (!(maxerr < 0.25 * kSpeed * (kLatencyFrames - 1) * kDt)) {
+    fprintf(stderr, "pose lags the car\n");
+    return 1;
+  }
+
+  // a pose from before anything in the history is dropped
+  float x0 = control.x_;
+  control.UpdateLocation(config, Eigen::Vector3f(x0 + 1, 0, 0), cov, -100);
+  if (control.x_ != x0) {
+    fprintf(stderr, "stale pose was applied\n");
+    return 1;
+  }
+  return 0;
+}
@@ -6,6 +6,8 @@
 #include <sys/time.h>
 
 #include "drive/driver.h"
+#include "drive/journal.h"
+#include "drive/journalreplay.h"
 #include "hw/cam/cam.h"
 #include "hw/car/car.h"
 #include "hw/gpio/i2c.h"
@@ -21,6 +23,58 @@ void handle_sigint(int signo) {
   if (driver_) driver_->Quit();
 }
 
+// SIGUSR1 dumps the black box, as the ZR button does
+void handle_sigusr1(int signo) {
+  if (driver_) driver_->TriggerBlackBox("signal");
+}
+
+// on the way down, write out what led up to it
+void handle_fatal(int signo) {
+  if (driver_) driver_->DumpBlackBox("crash");
+  signal(signo, SIG_DFL);
+  raise(signo);
+}
+
+// the car's camera, joystick, IMU and motors
+static bool InitHardware(const INIReader &ini, int fps, I2C *i2c,
+                         JoystickInput *js, bool *has_joystick, IMU **imu,
+                         CarHW **carhw) {
+  if (!Camera::Init(640, 480, fps)) return false;
+
+  if (!i2c->Open()) {
+    fprintf(stderr, "need to enable i2c in raspi-config, probably\n");
+    return false;
+  }
+
+  *has_joystick = false;
+  if (js->Open(ini)) {
+    *has_joystick = true;
+  } else {
+    fprintf(stderr, "joystick not detected, but continuing anyway!\n");
+  }
+
+  *imu = IMU::GetI2CIMU(*i2c, ini);
+  if (!*imu || !(*imu)->Init()) {
+    fprintf(stderr, "unable to connect to IMU; aborting\n");
+    return false;
+  }
+
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  fprintf(stderr, "%ld.%06ld camera on @%d fps\n", tv.tv_sec, tv.tv_usec, fps);
+
+  gettimeofday(&tv, NULL);
+  fprintf(stderr, "%ld.%06ld started camera\n", tv.tv_sec, tv.tv_usec);
+
+  *carhw = CarHW::GetCar(i2c, ini);
+  if (!*carhw || !(*carhw)->Init()) {
+    fprintf(stderr, "failed to init car hardware\n");
+    return false;
+  }
+
+  return true;
+}
+
 int main(int argc, char *argv[]) {
   I2C i2c;
   CarHW *carhw;
@@ -31,9 +85,32 @@ int main(int argc, char *argv[]) {
   ObstacleDetector obstacledetector;
 
   signal(SIGINT, handle_sigint);
+  signal(SIGUSR1, handle_sigusr1);
+  signal(SIGSEGV, handle_fatal);
+  signal(SIGBUS, handle_fatal);
+  signal(SIGFPE, handle_fatal);
+  signal(SIGABRT, handle_fatal);
 
   feenableexcept(FE_INVALID | FE_DIVBYZERO | FE_OVERFLOW | FE_UNDERFLOW);
 
+  // -j journals every input from the hardware; -r replays a journal in
+  // place of the hardware (see drive/journalreplay.h)
+  const char *journal_path = NULL, *replay_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:r:")) != -1) {
+    switch (opt) {
+      case 'j':
+        journal_path = optarg;
+        break;
+      case 'r':
+        replay_path = optarg;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-j journal] [-r journal]\n", argv[0]);
+        return 1;
+    }
+  }
+
   INIReader ini("cycloid.ini");
   {
     int inierr = ini.ParseError();
@@ -49,48 +126,61 @@ int main(int argc, char *argv[]) {
 
   int fps = ini.GetInteger("camera", "fps", 30);
 
-  if (!flush_thread.Init()) {
+  // recording queue: entries waiting for the sdcard, and what to do when
+  // it's full
+  FlushOverflowPolicy overflow;
+  if (!FlushThread::ParseOverflowPolicy(
+          ini.GetString("datalog", "overflow", "dropvideo").c_str(),
+          &overflow)) {
     return 1;
   }
-
-  if (!Camera::Init(640, 480, fps)) return 1;
-
-  JoystickInput js;
-
-  if (!i2c.Open()) {
-    fprintf(stderr, "need to enable i2c in raspi-config, probably\n");
+  if (replay_path != NULL) {
+    // no camera to keep up with, so nothing need be dropped
+    overflow = FLUSH_BLOCK;
+  }
+  if (!flush_thread.Init(ini.GetInteger("datalog", "queue", 64), overflow)) {
     return 1;
   }
 
+  JoystickInput js;
   bool has_joystick = false;
-  if (js.Open(ini)) {
-    has_joystick = true;
-  } else {
-    fprintf(stderr, "joystick not detected, but continuing anyway!\n");
-  }
-
-  imu = IMU::GetI2CIMU(i2c, ini);
-  if (!imu || !imu->Init()) {
-    fprintf(stderr, "unable to connect to IMU; aborting\n");
+  JournalReplay replay;
+  if (replay_path != NULL) {
+    // the journal plays the hardware's part, on this thread
+    if (!replay.Open(replay_path)) {
+      return 1;
+    }
+    carhw = replay.Car();
+    imu = replay.Imu();
+  } else if (!InitHardware(ini, fps, &i2c, &js, &has_joystick, &imu,
+                           &carhw)) {
     return 1;
   }
+  JoystickInput *jsp = has_joystick ? &js : NULL;
+  if (replay_path != NULL) {
+    jsp = replay.Joystick();
+  }
 
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  fprintf(stderr, "%ld.%06ld camera on @%d fps\n", tv.tv_sec, tv.tv_usec, fps);
-
-  gettimeofday(&tv, NULL);
-  fprintf(stderr, "%ld.%06ld started camera\n", tv.tv_sec, tv.tv_usec);
-
-  carhw = CarHW::GetCar(&i2c, ini);
-  if (!carhw || !carhw->Init()) {
-    fprintf(stderr, "failed to init car hardware\n");
-    return 1;
+  // note everything the hardware says on its way to the driver
+  InputJournal journal(&flush_thread);
+  JournalCar jcar(&journal, carhw);
+  JournalIMU jimu(&journal, imu);
+  JournalJoystick jjs(&journal, jsp);
+  if (journal_path != NULL) {
+    if (!journal.Open(journal_path, ini.GetInteger("journal", "buffers", 16),
+                      replay_path != NULL)) {
+      return 1;
+    }
+    carhw = &jcar;
+    imu = &jimu;
+    if (jsp != NULL) {
+      jsp = &jjs;
+    }
   }
 
   // FIXME(a1k0n): INI
-  bool has_display = true;
-  if (!display.Init()) {
+  bool has_display = replay_path == NULL;
+  if (has_display && !display.Init()) {
     fprintf(stderr,
             "run this:\n"
             "sudo modprobe fbtft_device name=adafruit22a rotate=90\n"
@@ -98,18 +188,39 @@ int main(int argc, char *argv[]) {
     has_display = false;
   }
 
-  driver_ = new Driver(&flush_thread, imu, has_joystick ? &js : NULL,
+  driver_ = new Driver(&flush_thread, imu, jsp,
                        has_display ? &display : NULL);
 
   if (!driver_->Init(ini)) {
     return 1;
   }
 
-  if (!Camera::StartRecord(driver_)) {
+  JournalCamera jcam(&journal, driver_);
+  CameraReceiver *receiver = driver_;
+  if (journal_path != NULL) {
+    receiver = &jcam;
+  }
+  if (replay_path != NULL) {
+    replay.StartCamera(receiver);
+  } else if (!Camera::StartRecord(receiver)) {
     return 1;
   }
 
   carhw->RunMainLoop(driver_);
 
-  Camera::StopRecord();
+  if (replay_path == NULL) {
+    Camera::StopRecord();
+  }
+  journal.Close();
+
+  // finishes the recording, if any, and writes out everything queued
+  Driver *driver = driver_;
+  driver_ = NULL;
+  delete driver;
+  if (replay_path != NULL) {
+    replay.Report(stderr);
+    // for scripts comparing a build against a journal
+    return replay.Mismatches() > 0 ? 2 : 0;
+  }
+  return 0;
 }
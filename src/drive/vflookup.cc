@@ -3,8 +3,8 @@
 
 #include "drive/vflookup.h"
 
-bool ValueFuncLookup::Init() {
-  FILE *fp = fopen("vf4.bin", "rb");
+bool ValueFuncLookup::Init(const char *fname) {
+  FILE *fp = fopen(fname, "rb");
   if (!fp) {
     return false;
   }
@@ -35,8 +35,8 @@ bool ValueFuncLookup::Init() {
     float d1 = h2f(data_[0]), d2 = h2f(data_[1]), d3 = h2f(data_[2]),
           d4 = h2f(data_[3]);
     fprintf(stderr,
-            "loaded vf.bin %dx%dx%dx%d @ %f scale; first values are %f %f %f %f\n",
-            v_, a_, h_, w_, scale_, d1, d2, d3, d4);
+            "loaded %s %dx%dx%dx%d @ %f scale; first values are %f %f %f %f\n",
+            fname, v_, a_, h_, w_, scale_, d1, d2, d3, d4);
   }
   return true;
 bad:
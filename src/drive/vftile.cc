@@ -0,0 +1,24 @@
+// convert a dense vf4.bin value function into a tiled vft1.bin for large
+// tracks; see drive/vftiles.h
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "drive/vftiles.h"
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr,
+            "usage: %s <vf4.bin> <vft1.bin> [tilesize=32] [emptythresh=1000]\n"
+            "tiles whose values are all >= emptythresh are left out\n",
+            argv[0]);
+    return 1;
+  }
+  int tilesize = argc > 3 ? atoi(argv[3]) : 32;
+  float empty_thresh = argc > 4 ? atof(argv[4]) : 1000;
+  if (!TiledValueFuncLookup::Convert(argv[1], argv[2], tilesize,
+                                     empty_thresh)) {
+    return 1;
+  }
+  return 0;
+}
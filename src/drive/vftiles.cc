@@ -0,0 +1,486 @@
+// large file support for multi-GB value functions on 32-bit ARM
+#define _FILE_OFFSET_BITS 64
+
+#include "drive/vftiles.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <vector>
+
+// VFT1 file layout (little-endian):
+//   "VFT1", uint32 header length (not including these 8 bytes)
+//   uint16 num velocities, num angles, height, width, tile width, tile height
+//   float pixel scale (pixels/meter), vmin, vscale
+//   uint32 bytes per tile (page-aligned)
+//   uint64 file offset of each tile, row-major by tile; 0 = empty tile
+// followed by page-aligned tiles of v x a x (th+1) x (tw+1) float16 values.
+static const int kVFT1FixedHeader = 8 + 6 * 2 + 3 * 4 + 4;
+static const size_t kTileAlign = 4096;
+
+// how far ahead (seconds) and to each side (meters) of the car to prefetch
+static const float kPrefetchHorizon = 2.0;
+static const float kPrefetchMargin = 2.0;
+
+TiledValueFuncLookup::TiledValueFuncLookup() {
+  h_ = w_ = a_ = v_ = 0;
+  scale_ = 1.;
+  vmin_ = 0;
+  tw_ = th_ = 1;
+  ntx_ = nty_ = 0;
+  tilebytes_ = 0;
+  fd_ = -1;
+  tileoffs_ = NULL;
+  tiles_ = NULL;
+  max_tiles_ = 0;
+  resident_ = NULL;
+  n_resident_ = 0;
+  retired_ = NULL;
+  n_retired_ = 0;
+  n_misses_ = 0;
+  last_used_ = NULL;
+  n_lookups_ = 0;
+  faulting_ = NULL;
+  n_faulting_ = 0;
+  running_ = false;
+  pending_ = false;
+  req_x_ = req_y_ = req_theta_ = req_v_ = 0;
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&cond_, NULL);
+  pthread_cond_init(&faulted_, NULL);
+}
+
+TiledValueFuncLookup::~TiledValueFuncLookup() {
+  if (running_) {
+    pthread_mutex_lock(&mutex_);
+    running_ = false;
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&mutex_);
+    pthread_join(thread_, NULL);
+  }
+  ReleaseRetired();
+  for (int i = 0; i < n_resident_; i++) {
+    const uint16_t *data = tiles_[resident_[i]].load();
+    munmap(const_cast<uint16_t*>(data), tilebytes_);
+  }
+  if (fd_ != -1) {
+    close(fd_);
+  }
+  delete[] tileoffs_;
+  delete[] tiles_;
+  delete[] resident_;
+  delete[] retired_;
+  delete[] last_used_;
+  delete[] faulting_;
+  pthread_cond_destroy(&faulted_);
+  pthread_cond_destroy(&cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+bool TiledValueFuncLookup::Init(const char *fname, int max_tiles) {
+  if (max_tiles < 1) {
+    fprintf(stderr, "%s: need at least one resident tile\n", fname);
+    return false;
+  }
+  fd_ = open(fname, O_RDONLY);
+  if (fd_ == -1) {
+    return false;
+  }
+  uint8_t hdr[kVFT1FixedHeader];
+  struct stat st;
+  if (fstat(fd_, &st) != 0 ||
+      pread(fd_, hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      memcmp(hdr, "VFT1", 4) != 0) {
+    fprintf(stderr, "%s: not a VFT1 tiled value function\n", fname);
+    CloseFile();
+    return false;
+  }
+  uint16_t dims[6];
+  float vscale;  // expected to be 1 at this point
+  uint32_t tilebytes;
+  memcpy(dims, hdr + 8, sizeof(dims));
+  memcpy(&scale_, hdr + 20, 4);
+  memcpy(&vmin_, hdr + 24, 4);
+  memcpy(&vscale, hdr + 28, 4);
+  memcpy(&tilebytes, hdr + 32, 4);
+  v_ = dims[0];
+  a_ = dims[1];
+  h_ = dims[2];
+  w_ = dims[3];
+  tw_ = dims[4];
+  th_ = dims[5];
+  tilebytes_ = tilebytes;
+  // V() reads straight out of the mappings, so a header or tile table that
+  // doesn't match what Convert() writes mustn't get that far
+  if (v_ == 0 || a_ == 0 || h_ < 2 || w_ < 2 || tw_ == 0 || th_ == 0) {
+    fprintf(stderr, "%s: bad dimensions %dx%dx%dx%d, %dx%d tiles\n", fname,
+            v_, a_, h_, w_, tw_, th_);
+    CloseFile();
+    return false;
+  }
+  size_t tilevals = (size_t) v_ * a_ * (th_ + 1) * (tw_ + 1);
+  if (tilebytes_ != ((tilevals * 2 + kTileAlign - 1) & ~(kTileAlign - 1))) {
+    fprintf(stderr, "%s: %zu bytes per tile, expected room for %zu values\n",
+            fname, tilebytes_, tilevals);
+    CloseFile();
+    return false;
+  }
+  ntx_ = (w_ + tw_ - 1) / tw_;
+  nty_ = (h_ + th_ - 1) / th_;
+  int ntiles = ntx_ * nty_;
+
+  tileoffs_ = new uint64_t[ntiles];
+  ssize_t tablelen = ntiles * sizeof(uint64_t);
+  if (pread(fd_, tileoffs_, tablelen, kVFT1FixedHeader) != tablelen) {
+    fprintf(stderr, "%s: short read on tile table\n", fname);
+    CloseFile();
+    return false;
+  }
+  for (int i = 0; i < ntiles; i++) {
+    uint64_t off = tileoffs_[i];
+    if (off != 0 && (off % kTileAlign != 0 ||
+                     off < kVFT1FixedHeader + (uint64_t) tablelen ||
+                     off + tilebytes_ > (uint64_t) st.st_size)) {
+      fprintf(stderr, "%s: tile %d at offset %llu is outside the file\n",
+              fname, i, (unsigned long long) off);
+      CloseFile();
+      return false;
+    }
+  }
+  tiles_ = new std::atomic<const uint16_t*>[ntiles];
+  last_used_ = new std::atomic<uint32_t>[ntiles];
+  int nonempty = 0;
+  for (int i = 0; i < ntiles; i++) {
+    tiles_[i].store(NULL);
+    last_used_[i].store(0);
+    if (tileoffs_[i] != 0) nonempty++;
+  }
+
+  max_tiles_ = max_tiles;
+  resident_ = new int[ntiles];
+  retired_ = new const uint16_t*[ntiles];
+  faulting_ = new int[max_tiles];
+
+  fprintf(stderr,
+          "loaded %s %dx%dx%dx%d @ %f scale; %dx%d tiles of %dx%d, "
+          "%d non-empty, %d resident max (%zu KB)\n",
+          fname, v_, a_, h_, w_, scale_, ntx_, nty_, tw_, th_, nonempty,
+          max_tiles_, max_tiles_ * tilebytes_ / 1024);
+
+  running_ = true;
+  if (pthread_create(&thread_, NULL, thread_entry, this) != 0) {
+    perror("TiledValueFuncLookup: pthread_create");
+    running_ = false;
+    CloseFile();
+    return false;
+  }
+  return true;
+}
+
+void TiledValueFuncLookup::CloseFile() {
+  if (fd_ != -1) {
+    close(fd_);
+    fd_ = -1;
+  }
+  delete[] tileoffs_;
+  tileoffs_ = NULL;
+}
+
+const uint16_t *TiledValueFuncLookup::MapTile(int tile) {
+  const uint16_t *data = tiles_[tile].load();
+  if (data != NULL) {
+    return data;
+  }
+  void *p = mmap(NULL, tilebytes_, PROT_READ, MAP_PRIVATE, fd_,
+                 tileoffs_[tile]);
+  if (p == MAP_FAILED) {
+    perror("TiledValueFuncLookup: mmap");
+    return NULL;
+  }
+  data = reinterpret_cast<const uint16_t*>(p);
+  // a newly mapped tile counts as just used, so it isn't the first evicted
+  last_used_[tile].store(n_lookups_.load(std::memory_order_relaxed),
+                         std::memory_order_relaxed);
+  resident_[n_resident_++] = tile;
+  tiles_[tile].store(data, std::memory_order_release);
+  return data;
+}
+
+const uint16_t *TiledValueFuncLookup::MapTileSync(int tile) {
+  // the prefetcher fell behind (or we just started); map it here, making
+  // room first so we stay within max_tiles_, and let the prefetcher evict it
+  // later if it's no longer wanted. if every resident tile is being faulted
+  // in, wait for the prefetcher to finish, which may map this one too.
+  pthread_mutex_lock(&mutex_);
+  n_misses_++;
+  const uint16_t *data = tiles_[tile].load();
+  while (data == NULL && n_resident_ >= max_tiles_ && !EvictLRU()) {
+    pthread_cond_wait(&faulted_, &mutex_);
+    data = tiles_[tile].load();
+  }
+  if (data == NULL) {
+    data = MapTile(tile);
+  }
+  pthread_mutex_unlock(&mutex_);
+  return data;
+}
+
+bool TiledValueFuncLookup::EvictLRU() {
+  int victim = -1;
+  uint32_t oldest = 0;
+  uint32_t now = n_lookups_.load(std::memory_order_relaxed);
+  for (int i = 0; i < n_resident_; i++) {
+    int tile = resident_[i];
+    bool faulting = false;
+    for (int j = 0; j < n_faulting_ && !faulting; j++) {
+      faulting = faulting_[j] == tile;
+    }
+    // compare ages, so the lookup count wrapping around doesn't matter
+    uint32_t age = now - last_used_[tile].load(std::memory_order_relaxed);
+    if (!faulting && (victim == -1 || age > oldest)) {
+      victim = i;
+      oldest = age;
+    }
+  }
+  if (victim == -1) {
+    return false;
+  }
+  // no lookup is in flight on this (the planner) thread, and the prefetcher
+  // only touches tiles outside the lock while they're in faulting_, so the
+  // tile can go right away
+  int tile = resident_[victim];
+  const uint16_t *data = tiles_[tile].load();
+  tiles_[tile].store(NULL, std::memory_order_release);
+  munmap(const_cast<uint16_t*>(data), tilebytes_);
+  resident_[victim] = resident_[--n_resident_];
+  return true;
+}
+
+void TiledValueFuncLookup::ReleaseRetired() {
+  pthread_mutex_lock(&mutex_);
+  for (int i = 0; i < n_retired_; i++) {
+    munmap(const_cast<uint16_t*>(retired_[i]), tilebytes_);
+  }
+  n_retired_ = 0;
+  pthread_mutex_unlock(&mutex_);
+}
+
+void TiledValueFuncLookup::Prefetch(float x, float y, float theta, float v) {
+  if (!running_) {
+    return;
+  }
+  // no lookups can be in flight on this thread right now, so it's safe to
+  // unmap whatever the prefetcher evicted since last time
+  ReleaseRetired();
+  pthread_mutex_lock(&mutex_);
+  req_x_ = x;
+  req_y_ = y;
+  req_theta_ = theta;
+  req_v_ = v;
+  pending_ = true;
+  pthread_cond_signal(&cond_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+int TiledValueFuncLookup::PlanTiles(float x, float y, float theta, float v,
+                                    int *want) const {
+  int n = 0;
+  float C = cos(theta), S = sin(theta);
+  int margin = ceilf(kPrefetchMargin * scale_);
+  // sample the path every half tile so we can't skip over one
+  float step = 0.5f * std::min(tw_, th_) / scale_;
+  float dist = std::max(v, 1.0f) * kPrefetchHorizon;
+  for (float s = 0; s <= dist && n < max_tiles_; s += step) {
+    int ix = (x + s * C) * scale_;
+    int iy = -(y + s * S) * scale_;
+    int tx0 = std::max(0, (ix - margin) / tw_);
+    int tx1 = std::min(ntx_ - 1, (ix + margin) / tw_);
+    int ty0 = std::max(0, (iy - margin) / th_);
+    int ty1 = std::min(nty_ - 1, (iy + margin) / th_);
+    for (int ty = ty0; ty <= ty1; ty++) {
+      for (int tx = tx0; tx <= tx1; tx++) {
+        int tile = tx + ty * ntx_;
+        if (tileoffs_[tile] == 0 || n >= max_tiles_) continue;
+        bool dup = false;
+        for (int i = 0; i < n && !dup; i++) dup = want[i] == tile;
+        if (!dup) want[n++] = tile;
+      }
+    }
+  }
+  return n;
+}
+
+void *TiledValueFuncLookup::thread_entry(void *arg) {
+  TiledValueFuncLookup *self = reinterpret_cast<TiledValueFuncLookup*>(arg);
+  self->PrefetchLoop();
+  return NULL;
+}
+
+void TiledValueFuncLookup::PrefetchLoop() {
+  std::vector<int> want(max_tiles_);
+  std::vector<const uint16_t*> loaded;
+  pthread_mutex_lock(&mutex_);
+  for (;;) {
+    while (running_ && !pending_) {
+      pthread_cond_wait(&cond_, &mutex_);
+    }
+    if (!running_) {
+      break;
+    }
+    pending_ = false;
+    int nwant = PlanTiles(req_x_, req_y_, req_theta_, req_v_, &want[0]);
+
+    // evict resident tiles we no longer want
+    for (int i = 0; i < n_resident_;) {
+      int tile = resident_[i];
+      bool keep = false;
+      for (int j = 0; j < nwant && !keep; j++) keep = want[j] == tile;
+      if (keep) {
+        i++;
+        continue;
+      }
+      retired_[n_retired_++] = tiles_[tile].load();
+      tiles_[tile].store(NULL, std::memory_order_release);
+      resident_[i] = resident_[--n_resident_];
+    }
+
+    // map the new ones, nearest first
+    loaded.clear();
+    n_faulting_ = 0;
+    for (int j = 0; j < nwant; j++) {
+      if (tiles_[want[j]].load() == NULL) {
+        const uint16_t *data = MapTile(want[j]);
+        if (data) {
+          loaded.push_back(data);
+          faulting_[n_faulting_++] = want[j];
+        }
+      }
+    }
+
+    // fault the new tiles in without holding the lock, so the planner never
+    // waits on the sdcard; only this thread retires tiles, so they stay
+    // mapped while we touch them
+    pthread_mutex_unlock(&mutex_);
+    for (size_t j = 0; j < loaded.size(); j++) {
+      void *p = const_cast<uint16_t*>(loaded[j]);
+      madvise(p, tilebytes_, MADV_WILLNEED);
+      const volatile uint8_t *b = reinterpret_cast<const volatile uint8_t*>(p);
+      for (size_t k = 0; k < tilebytes_; k += kTileAlign) {
+        (void) b[k];
+      }
+    }
+    pthread_mutex_lock(&mutex_);
+    n_faulting_ = 0;
+    pthread_cond_broadcast(&faulted_);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+bool TiledValueFuncLookup::Convert(const char *dense_fname,
+                                   const char *tiled_fname, int tilesize,
+                                   float empty_thresh) {
+  int infd = open(dense_fname, O_RDONLY);
+  if (infd == -1) {
+    perror(dense_fname);
+    return false;
+  }
+  struct stat st;
+  fstat(infd, &st);
+  void *inmap = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, infd, 0);
+  close(infd);
+  if (inmap == MAP_FAILED) {
+    perror(dense_fname);
+    return false;
+  }
+  const uint8_t *in = reinterpret_cast<const uint8_t*>(inmap);
+  if (st.st_size < 28 || memcmp(in, "VFN4", 4) != 0 || in[4] != 0x14) {
+    fprintf(stderr, "%s: not a VFN4 value function\n", dense_fname);
+    munmap(inmap, st.st_size);
+    return false;
+  }
+  uint16_t dims[4];
+  memcpy(dims, in + 8, sizeof(dims));
+  int v = dims[0], a = dims[1], h = dims[2], w = dims[3];
+  const uint16_t *data = reinterpret_cast<const uint16_t*>(in + 28);
+  if (st.st_size < 28 + 2 * (off_t) v * a * h * w) {
+    fprintf(stderr, "%s: truncated\n", dense_fname);
+    munmap(inmap, st.st_size);
+    return false;
+  }
+
+  FILE *fp = fopen(tiled_fname, "wb");
+  if (!fp) {
+    perror(tiled_fname);
+    munmap(inmap, st.st_size);
+    return false;
+  }
+  int tw = tilesize, th = tilesize;
+  int ntx = (w + tw - 1) / tw, nty = (h + th - 1) / th;
+  int sw = tw + 1, sh = th + 1;
+  size_t tilevals = (size_t) v * a * sh * sw;
+  uint32_t tilebytes =
+      (tilevals * 2 + kTileAlign - 1) & ~(kTileAlign - 1);
+  size_t hdrlen = kVFT1FixedHeader + ntx * nty * sizeof(uint64_t);
+  uint64_t offset = (hdrlen + kTileAlign - 1) & ~(kTileAlign - 1);
+
+  std::vector<uint64_t> tileoffs(ntx * nty);
+  std::vector<uint16_t> tile(tilebytes / 2);
+  int nonempty = 0;
+  for (int ty = 0; ty < nty; ty++) {
+    for (int tx = 0; tx < ntx; tx++) {
+      bool empty = true;
+      size_t k = 0;
+      for (int iv = 0; iv < v; iv++) {
+        for (int ia = 0; ia < a; ia++) {
+          for (int j = 0; j < sh; j++) {
+            // clamp the overlap cells at the edge of the map; they're never
+            // interpolated into anyway
+            int y = std::min(ty * th + j, h - 1);
+            for (int i = 0; i < sw; i++) {
+              int x = std::min(tx * tw + i, w - 1);
+              uint16_t val = data[(((size_t) iv * a + ia) * h + y) * w + x];
+              if (ValueFuncLookup::h2f(val) < empty_thresh) {
+                empty = false;
+              }
+              tile[k++] = val;
+            }
+          }
+        }
+      }
+      if (empty) {
+        tileoffs[tx + ty * ntx] = 0;
+        continue;
+      }
+      tileoffs[tx + ty * ntx] = offset;
+      fseeko(fp, offset, SEEK_SET);
+      fwrite(&tile[0], 1, tilebytes, fp);
+      offset += tilebytes;
+      nonempty++;
+    }
+  }
+
+  uint8_t hdr[kVFT1FixedHeader];
+  uint32_t len = hdrlen - 8;
+  uint16_t tdims[6] = {
+    (uint16_t) v, (uint16_t) a, (uint16_t) h, (uint16_t) w,
+    (uint16_t) tw, (uint16_t) th};
+  memcpy(hdr, "VFT1", 4);
+  memcpy(hdr + 4, &len, 4);
+  memcpy(hdr + 8, tdims, sizeof(tdims));
+  memcpy(hdr + 20, in + 16, 12);  // scale, vmin, vscale
+  memcpy(hdr + 32, &tilebytes, 4);
+  fseeko(fp, 0, SEEK_SET);
+  fwrite(hdr, 1, sizeof(hdr), fp);
+  fwrite(&tileoffs[0], sizeof(uint64_t), tileoffs.size(), fp);
+  bool ok = !ferror(fp);
+  fclose(fp);
+  munmap(inmap, st.st_size);
+
+  fprintf(stderr, "%s: %dx%d tiles of %dx%d, %d non-empty, %zu KB/tile\n",
+          tiled_fname, ntx, nty, tw, th, nonempty, (size_t) tilebytes / 1024);
+  return ok;
+}
@@ -0,0 +1,183 @@
+#ifndef DRIVE_VFTILES_H_
+#define DRIVE_VFTILES_H_
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <cmath>
+#include <algorithm>
+
+#include "drive/vflookup.h"
+
+// Tiled value function lookup for tracks too large to hold the whole dense
+// v x a x h x w grid in memory (e.g. GPS racetracks at 5cm resolution).
+//
+// The VFT1 file splits the x-y plane into tiles of tw x th cells; each tile
+// holds every velocity and angle layer for its cells plus a one-cell overlap
+// on the right and bottom edges, so interpolation never straddles two tiles.
+// Tiles are page-aligned and mmap'd individually by a background thread
+// which keeps only the tiles along the car's projected path mapped, so both
+// memory and address space stay bounded by max_tiles regardless of track
+// size.
+//
+// Tiles which are entirely off-track can be left out of the file; lookups in
+// them return the same 1000 penalty as lookups off the edge of the map.
+//
+// V() and Prefetch() must be called from the same thread (the planner);
+// unmapping tiles the prefetcher evicts is deferred to Prefetch() so a
+// lookup never races with an munmap. A lookup that misses when max_tiles
+// are already mapped unmaps the least recently used one itself.
+class TiledValueFuncLookup {
+ public:
+  TiledValueFuncLookup();
+  ~TiledValueFuncLookup();
+
+  // open tiled value function file and start the prefetch thread; at most
+  // max_tiles tiles are kept mapped at a time
+  bool Init(const char *fname, int max_tiles);
+
+  // convert a dense VFN4 value function (as written by vicuda.py) into a
+  // VFT1 tiled file. tiles whose values are all >= empty_thresh are dropped.
+  static bool Convert(const char *dense_fname, const char *tiled_fname,
+                      int tilesize, float empty_thresh);
+
+  // hint the prefetcher with the car's current position, heading and speed;
+  // tiles along the next couple of seconds of travel are paged in
+  // asynchronously. never blocks on I/O.
+  void Prefetch(float x, float y, float theta, float v);
+
+  int NumResidentTiles() const { return n_resident_; }
+  // number of lookups which had to map a tile synchronously
+  int NumMisses() const { return n_misses_; }
+
+  float V(float x, float y, float theta, float v) {
+    float ftheta = fmodf(theta * a_ * 1.0/(2*M_PI), a_);
+    if (ftheta < 0)
+      ftheta += a_;
+    int itheta = std::floor(ftheta);
+    ftheta -= itheta;
+    // due to fp precision issues, we might still be rounded to a_ here
+    if (itheta >= a_)
+      itheta -= a_;
+    float fv = std::min(std::max(v - vmin_, 0.0f), v_ - 1.0f);
+    int iv = std::floor(fv);
+    fv -= iv;
+    float fx = x * scale_;
+    int ix = std::floor(fx);
+    fx -= ix;
+    float fy = -y * scale_;
+    int iy = std::floor(fy);
+    fy -= iy;
+    if (ix < 0 || ix >= w_ - 1 || iy < 0 || iy >= h_ - 1)
+      return 1000.0f;
+
+    int tx = ix / tw_, ty = iy / th_;
+    int tile = tx + ty * ntx_;
+    const uint16_t *data = tiles_[tile].load(std::memory_order_acquire);
+    if (data == NULL) {
+      if (tileoffs_[tile] == 0)
+        return 1000.0f;  // empty tile
+      data = MapTileSync(tile);
+      if (data == NULL)
+        return 1000.0f;
+    }
+    // only this thread counts lookups
+    uint32_t now = n_lookups_.load(std::memory_order_relaxed) + 1;
+    n_lookups_.store(now, std::memory_order_relaxed);
+    last_used_[tile].store(now, std::memory_order_relaxed);
+
+    // tiles are stored with a one-cell overlap, so x+1 and y+1 are always
+    // within this tile
+    const int sw = tw_ + 1, sh = th_ + 1;
+    int di = (ix - tx * tw_) + (iy - ty * th_) * sw +
+             itheta * sw * sh + iv * sw * sh * a_;
+
+    int nexttheta =
+        itheta < a_ - 1 ? sw * sh : -sw * sh * (a_ - 1);
+    int nextv = iv < v_ - 1 ? sw * sh * a_ : 0;
+
+    //     vtyx
+    float V0000 = ValueFuncLookup::h2f(data[di]);
+    float V0001 = ValueFuncLookup::h2f(data[di + 1]);
+    float V0010 = ValueFuncLookup::h2f(data[di + sw]);
+    float V0011 = ValueFuncLookup::h2f(data[di + sw + 1]);
+    float V0100 = ValueFuncLookup::h2f(data[di + nexttheta]);
+    float V0101 = ValueFuncLookup::h2f(data[di + nexttheta + 1]);
+    float V0110 = ValueFuncLookup::h2f(data[di + nexttheta + sw]);
+    float V0111 = ValueFuncLookup::h2f(data[di + nexttheta + sw + 1]);
+    di += nextv;
+    float V1000 = ValueFuncLookup::h2f(data[di]);
+    float V1001 = ValueFuncLookup::h2f(data[di + 1]);
+    float V1010 = ValueFuncLookup::h2f(data[di + sw]);
+    float V1011 = ValueFuncLookup::h2f(data[di + sw + 1]);
+    float V1100 = ValueFuncLookup::h2f(data[di + nexttheta]);
+    float V1101 = ValueFuncLookup::h2f(data[di + nexttheta + 1]);
+    float V1110 = ValueFuncLookup::h2f(data[di + nexttheta + sw]);
+    float V1111 = ValueFuncLookup::h2f(data[di + nexttheta + sw + 1]);
+    // lerp
+    return (1 - fv) *
+               ((1 - ftheta) * ((1 - fy) * ((1 - fx) * V0000 + fx * V0001) +
+                                fy * ((1 - fx) * V0010 + fx * V0011)) +
+                ftheta * ((1 - fy) * ((1 - fx) * V0100 + fx * V0101) +
+                          fy * ((1 - fx) * V0110 + fx * V0111))) +
+           fv * ((1 - ftheta) * ((1 - fy) * ((1 - fx) * V1000 + fx * V1001) +
+                                 fy * ((1 - fx) * V1010 + fx * V1011)) +
+                 ftheta * ((1 - fy) * ((1 - fx) * V1100 + fx * V1101) +
+                           fy * ((1 - fx) * V1110 + fx * V1111)));
+  }
+
+ private:
+  static void *thread_entry(void *arg);
+  void PrefetchLoop();
+
+  // fill want with tiles along the projected path, nearest first
+  int PlanTiles(float x, float y, float theta, float v, int *want) const;
+
+  // give up on the file Init() was reading
+  void CloseFile();
+
+  // mmap tile and publish it in the directory; called with mutex_ held
+  const uint16_t *MapTile(int tile);
+  const uint16_t *MapTileSync(int tile);
+  // unmap the least recently used tile the prefetcher isn't faulting in;
+  // false if there's none. called with mutex_ held, from the planner thread
+  bool EvictLRU();
+  void ReleaseRetired();
+
+  // height, width, number of angles, number of velocities
+  int h_, w_, a_, v_;
+  float scale_;  // pixels / meter
+  float vmin_;
+  int tw_, th_;    // tile size in cells
+  int ntx_, nty_;  // number of tiles in x and y
+  size_t tilebytes_;  // page-aligned size of each tile
+
+  int fd_;
+  uint64_t *tileoffs_;  // file offset of each tile; 0 for empty tiles
+  std::atomic<const uint16_t*> *tiles_;  // currently mapped tiles
+
+  int max_tiles_;
+  int *resident_;  // tile indices currently mapped
+  int n_resident_;
+  const uint16_t **retired_;  // unpublished mappings awaiting munmap
+  int n_retired_;
+  int n_misses_;
+  // V()'s lookup count when each tile was last looked up or mapped
+  std::atomic<uint32_t> *last_used_;
+  std::atomic<uint32_t> n_lookups_;
+  // tiles the prefetcher is touching outside the lock, which mustn't be
+  // evicted until it's done
+  int *faulting_;
+  int n_faulting_;
+
+  pthread_t thread_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t cond_;
+  pthread_cond_t faulted_;  // the prefetcher has finished faulting tiles in
+  bool running_;
+  bool pending_;
+  float req_x_, req_y_, req_theta_, req_v_;
+};
+
+#endif  // DRIVE_VFTILES_H_
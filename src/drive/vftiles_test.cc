@@ -0,0 +1,169 @@
+// check that the tiled value function matches the dense one everywhere, and
+// that residency stays bounded both by lookups alone and as the prefetcher
+// follows us across the map
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "drive/vflookup.h"
+#include "drive/vftiles.h"
+
+static const char *kDenseFile = "/tmp/vftiles_test_vf4.bin";
+static const char *kTiledFile = "/tmp/vftiles_test_vft1.bin";
+
+static const int V = 3, A = 8, H = 70, W = 90;
+
+// float -> half for the small integers we use here
+static uint16_t f2h(float f) {
+  uint32_t u;
+  memcpy(&u, &f, 4);
+  uint32_t sign = (u >> 16) & 0x8000;
+  int exp = ((u >> 23) & 0xff) - 127 + 15;
+  if (f == 0) return sign;
+  return sign | (exp << 10) | ((u >> 13) & 0x3ff);
+}
+
+static bool WriteDense() {
+  FILE *fp = fopen(kDenseFile, "wb");
+  if (!fp) {
+    perror(kDenseFile);
+    return false;
+  }
+  uint32_t hlen = 0x14;
+  uint16_t dims[4] = {V, A, H, W};
+  float scale = 10, vmin = 2, vscale = 1;
+  fwrite("VFN4", 1, 4, fp);
+  fwrite(&hlen, 4, 1, fp);
+  fwrite(dims, 2, 4, fp);
+  fwrite(&scale, 4, 1, fp);
+  fwrite(&vmin, 4, 1, fp);
+  fwrite(&vscale, 4, 1, fp);
+  for (int v = 0; v < V; v++) {
+    for (int a = 0; a < A; a++) {
+      for (int y = 0; y < H; y++) {
+        for (int x = 0; x < W; x++) {
+          // an "off-track" region in the bottom right corner
+          float val = (x >= 64 && y >= 32) ? 1500 :
+              (x + 2 * y + 3 * a + 5 * v) % 997;
+          uint16_t h = f2h(val);
+          fwrite(&h, 2, 1, fp);
+        }
+      }
+    }
+  }
+  fclose(fp);
+  return true;
+}
+
+// copy the tiled file with len bytes of it, patched at offset, and check
+// Init() turns it down
+static bool RejectsCorrupt(const char *what, off_t offset, const void *patch,
+                           size_t patchlen, off_t len) {
+  static const char *kCorruptFile = "/tmp/vftiles_test_corrupt.bin";
+  FILE *in = fopen(kTiledFile, "rb");
+  FILE *out = fopen(kCorruptFile, "wb");
+  if (!in || !out) {
+    perror(kCorruptFile);
+    return false;
+  }
+  for (off_t i = 0; i < len; i++) {
+    int c = fgetc(in);
+    if (c == EOF) break;
+    if (i >= offset && i < offset + (off_t) patchlen) {
+      c = reinterpret_cast<const uint8_t*>(patch)[i - offset];
+    }
+    fputc(c, out);
+  }
+  fclose(in);
+  fclose(out);
+  TiledValueFuncLookup tiled;
+  bool ok = !tiled.Init(kCorruptFile, 12);
+  unlink(kCorruptFile);
+  if (!ok) {
+    fprintf(stderr, "Init() accepted a file with %s\n", what);
+  }
+  return ok;
+}
+
+int main() {
+  if (!WriteDense()) {
+    return 1;
+  }
+  if (!TiledValueFuncLookup::Convert(kDenseFile, kTiledFile, 16, 1200)) {
+    return 1;
+  }
+
+  ValueFuncLookup dense;
+  TiledValueFuncLookup tiled;
+  if (!dense.Init(kDenseFile) || !tiled.Init(kTiledFile, 12)) {
+    return 1;
+  }
+
+  srand48(1);
+  int nchecked = 0;
+  for (int i = 0; i < 100000; i++) {
+    float x = drand48() * 9.5 - 0.2;
+    float y = -drand48() * 7.5 + 0.2;
+    float theta = drand48() * 20 - 10;
+    float v = drand48() * 6;
+    float d = dense.V(x, y, theta, v);
+    float t = tiled.V(x, y, theta, v);
+    // nothing's been prefetched; every new tile is a synchronous miss, which
+    // has to evict one to make room
+    if (tiled.NumResidentTiles() > 12) {
+      fprintf(stderr, "%d tiles resident after lookup %d\n",
+              tiled.NumResidentTiles(), i);
+      return 1;
+    }
+    // tiles entirely >= 1200 are dropped and read back as 1000
+    bool offtrack = x * 10 >= 64 && -y * 10 >= 32;
+    if (offtrack) {
+      continue;
+    }
+    if (fabsf(d - t) > 1e-3) {
+      fprintf(stderr, "mismatch at %f %f %f %f: dense %f tiled %f\n", x, y,
+              theta, v, d, t);
+      return 1;
+    }
+    nchecked++;
+  }
+  if (tiled.V(8.5, -6.5, 0, 3) != 1000.0f) {
+    fprintf(stderr, "empty tile lookup should return 1000\n");
+    return 1;
+  }
+  printf("%d lookups match; %d synchronous tile maps\n", nchecked,
+         tiled.NumMisses());
+
+  // drive across the map and check we never keep more than max_tiles mapped
+  for (float x = 0; x < 9; x += 0.1) {
+    tiled.Prefetch(x, -1, 0, 1);
+    usleep(1000);
+    tiled.V(x, -1, 0, 3);
+    if (tiled.NumResidentTiles() > 12) {
+      fprintf(stderr, "%d tiles resident at x=%f\n", tiled.NumResidentTiles(),
+              x);
+      return 1;
+    }
+  }
+  printf("%d tiles resident after drive\n", tiled.NumResidentTiles());
+
+  // V() reads straight out of the tiles, so Init() has to check them
+  struct stat st;
+  stat(kTiledFile, &st);
+  uint16_t zero = 0;
+  uint32_t tilebytes = 4096;
+  if (!RejectsCorrupt("zero tile width", 16, &zero, 2, st.st_size) ||
+      !RejectsCorrupt("short tiles", 32, &tilebytes, 4, st.st_size) ||
+      !RejectsCorrupt("the last tile cut off", 0, NULL, 0,
+                      st.st_size - 1)) {
+    return 1;
+  }
+
+  unlink(kDenseFile);
+  unlink(kTiledFile);
+  return 0;
+}
@@ -14,6 +14,8 @@
 #include "hw/input/js.h"
 #include "inih/cpp/INIReader.h"
 #include "inih/ini.h"
+#include "io/flushthread.h"
+#include "timing/clock.h"
 #include "ui/display.h"
 
 float clamp(float x, float min, float max) {
@@ -31,9 +33,14 @@ GPSDrive::GPSDrive(FlushThread *ft, IMU *imu, Magnetometer *mag,
       display_(disp),
       gyro_last_(0, 0, 0),
       gyro_bias_(0, 0, 0),
-      gps_v_(0, 0, 0) {
+      gps_v_(0, 0, 0),
+      log_(ft),
+      control_log_("GCTL"),
+      nav_log_("GNAV"),
+      epoch_to_arrival_("gps epoch to arrival"),
+      fix_to_actuation_("gps epoch to actuation"),
+      sample_to_actuation_("control sample to actuation") {
   done_ = false;
-  record_fp_ = NULL;
   js_throttle_ = 0;
   js_steering_ = 0;
   config_item_ = 0;
@@ -55,7 +62,14 @@ GPSDrive::GPSDrive(FlushThread *ft, IMU *imu, Magnetometer *mag,
 
   autodrive_ = false;
   x_down_ = y_down_ = false;
-  pthread_mutex_init(&record_mut_, NULL);
+  // a few seconds' worth at 100Hz and 10Hz, flushed every 0.1s
+  control_log_.Init(256);
+  nav_log_.Init(32);
+  log_.AddSource(&control_log_);
+  log_.AddSource(&nav_log_);
+  log_ticks_ = 0;
+  pending_fix_ = 0;
+  pthread_mutex_init(&latency_mut_, NULL);
 }
 
 void* GPSDrive::gpsThread(void* arg) {
@@ -111,7 +125,10 @@ bool GPSDrive::Init(const INIReader &ini) {
   return true;
 }
 
-GPSDrive::~GPSDrive() {}
+GPSDrive::~GPSDrive() {
+  ReportLatency();
+  pthread_mutex_destroy(&latency_mut_);
+}
 
 void GPSDrive::UpdateControls(float in_throttle, float in_steering,
                               bool radio_safe, const StateObservation &obs,
@@ -198,7 +215,7 @@ void GPSDrive::UpdateControls(float in_throttle, float in_steering,
   }
 }
 
-bool GPSDrive::OnControlFrame(CarHW *car, float dt) {
+bool GPSDrive::OnControlFrame(CarHW *car, float dt, int64_t t) {
   if (js_) {
     js_->ReadInput(this);
   }
@@ -268,17 +285,41 @@ bool GPSDrive::OnControlFrame(CarHW *car, float dt) {
   UpdateControls(in_throttle, in_steering, radio_safe, obs, dt, &out);
   car->SetControls(out.leds, out.u_esc, out.u_servo);
 
-  if (record_fp_ != NULL) {
-    timeval tv;
-    gettimeofday(&tv, NULL);
-    pthread_mutex_lock(&record_mut_);
-    fprintf(record_fp_,
-            "%ld.%06ld control %f %f wheel %f %f imu %f %f %f %f %f %f mag %f "
-            "%f %f windup_vk %f %f input %f %f\n",
-            tv.tv_sec, tv.tv_usec, out.u_esc, out.u_servo, ds, v, accel[0],
-            accel[1], accel[2], gyro[0], gyro[1], gyro[2], mag[0], mag[1],
-            mag[2], ierr_v_, ierr_k_, in_throttle, in_steering);
-    pthread_mutex_unlock(&record_mut_);
+  int64_t t_actuated = MonotonicMicros();
+  sample_to_actuation_.Add(t_actuated - t);
+  // the first control output since a new fix is the one it first affects
+  pthread_mutex_lock(&latency_mut_);
+  int64_t t_fix = pending_fix_;
+  pending_fix_ = 0;
+  pthread_mutex_unlock(&latency_mut_);
+  if (t_fix != 0) {
+    fix_to_actuation_.Add(t_actuated - t_fix);
+  }
+
+  // log timestamps are the CLOCK_MONOTONIC times the samples were taken; the
+  // CLK1 chunk at the top of the log relates them to the wall clock
+  if (log_.IsOpen()) {
+    GPSControlSample s;
+    s.t = t;
+    s.u_esc = out.u_esc;
+    s.u_servo = out.u_servo;
+    s.wheel_ds = ds;
+    s.wheel_v = v;
+    for (int i = 0; i < 3; i++) {
+      s.accel[i] = accel[i];
+      s.gyro[i] = gyro[i];
+      s.mag[i] = mag[i];
+    }
+    s.ierr_v = ierr_v_;
+    s.ierr_k = ierr_k_;
+    s.in_throttle = in_throttle;
+    s.in_steering = in_steering;
+    s.pad = 0;
+    control_log_.Push(s);
+    if (++log_ticks_ >= 10) {
+      log_.Flush();
+      log_ticks_ = 0;
+    }
   }
 
   if (display_) {
@@ -291,7 +332,8 @@ bool GPSDrive::OnControlFrame(CarHW *car, float dt) {
   return !done_;
 }
 
-void GPSDrive::OnNav(const nav_pvt &msg) {
+void GPSDrive::OnNav(const nav_pvt &msg, int64_t t) {
+  int64_t t_arrival = MonotonicMicros();
   lat_ = msg.lat;
   lon_ = msg.lon;
   numSV_ = msg.numSV;
@@ -344,26 +386,21 @@ void GPSDrive::OnNav(const nav_pvt &msg) {
          cy / mscale_lat_ + ref_lat_, mscale_lon_, mscale_lat_);
 #endif
 
-  if (record_fp_ != NULL) {
-    timeval tv;
-    gettimeofday(&tv, NULL);
-    pthread_mutex_lock(&record_mut_);
-    fprintf(record_fp_, "%ld.%06ld gps ", tv.tv_sec, tv.tv_usec);
-    fprintf(record_fp_, "%04d-%02d-%02dT%02d:%02d:%02d.%09d ", msg.year,
-            msg.month, msg.day, msg.hour, msg.min, msg.sec, msg.nano);
-    fprintf(record_fp_,
-        "fix:%d numSV:%d %d.%07d +-%dmm %d.%07d +-%dmm height %dmm "
-        "vel %d %d %d +-%d mm/s "
-        "heading motion %d.%05d vehicle %d +- %d.%05d\n",
-        msg.fixType, msg.numSV, msg.lon / 10000000,
-        std::abs(msg.lon) % 10000000, msg.hAcc, msg.lat / 10000000,
-        std::abs(msg.lat) % 10000000, msg.vAcc, msg.height, msg.velN, msg.velE,
-        msg.velD, msg.sAcc, msg.headMot / 100000,
-        std::abs(msg.headMot) % 100000, msg.headVeh, msg.headAcc / 100000,
-        msg.headAcc % 100000);
-    fprintf(record_fp_, "%ld.%06ld nav %0.4f %0.4f %f kv %0.5f %0.4f\n",
-            tv.tv_sec, tv.tv_usec, ye_, psie_, k_, autodrive_k_, autodrive_v_);
-    pthread_mutex_unlock(&record_mut_);
+  pthread_mutex_lock(&latency_mut_);
+  epoch_to_arrival_.Add(t_arrival - t);
+  pending_fix_ = t;
+  pthread_mutex_unlock(&latency_mut_);
+
+  if (log_.IsOpen()) {
+    GPSNavSample s;
+    s.t = t;
+    s.nav = msg;
+    s.ye = ye_;
+    s.psie = psie_;
+    s.k = k_;
+    s.autodrive_k = autodrive_k_;
+    s.autodrive_v = autodrive_v_;
+    nav_log_.Push(s);
   }
 }
 
@@ -481,7 +518,7 @@ void GPSDrive::StartRecording() {
   timeval tv;
   gettimeofday(&tv, NULL);
 
-  if (record_fp_ != NULL) {
+  if (log_.IsOpen()) {
     return;
   }
 
@@ -489,32 +526,45 @@ void GPSDrive::StartRecording() {
   time_t start_time = time(NULL);
   struct tm start_time_tm;
   localtime_r(&start_time, &start_time_tm);
-  strftime(fnamebuf, sizeof(fnamebuf), "gpsdrive-%Y%m%d-%H%M%S.log",
+  strftime(fnamebuf, sizeof(fnamebuf), "gpsdrive-%Y%m%d-%H%M%S.bin",
            &start_time_tm);
-  record_fp_ = fopen(fnamebuf, "w");
-  if (!record_fp_) {
+  if (!log_.Open(fnamebuf)) {
     perror(fnamebuf);
   }
+  log_ticks_ = 0;
 
   printf("%ld.%06ld start recording %s\n", tv.tv_sec, tv.tv_usec, fnamebuf);
   display_->UpdateStatus(fnamebuf);
 }
 
 void GPSDrive::StopRecording() {
-  if (record_fp_ == NULL) {
+  if (!log_.IsOpen()) {
     return;
   }
 
   timeval tv;
   gettimeofday(&tv, NULL);
 
-  pthread_mutex_lock(&record_mut_);
-  fclose(record_fp_);
-  record_fp_ = NULL;
-  pthread_mutex_unlock(&record_mut_);
+  log_.Close();
+  if (control_log_.Dropped() > 0 || nav_log_.Dropped() > 0) {
+    fprintf(stderr, "log samples dropped so far: %d control, %d nav\n",
+            control_log_.Dropped(), nav_log_.Dropped());
+  }
 
   printf("%ld.%06ld stop recording\n", tv.tv_sec, tv.tv_usec);
   display_->UpdateStatus("stop recording");
+  ReportLatency();
+}
+
+void GPSDrive::ReportLatency() {
+  pthread_mutex_lock(&latency_mut_);
+  epoch_to_arrival_.Report(stderr);
+  epoch_to_arrival_.Clear();
+  pthread_mutex_unlock(&latency_mut_);
+  fix_to_actuation_.Report(stderr);
+  sample_to_actuation_.Report(stderr);
+  fix_to_actuation_.Clear();
+  sample_to_actuation_.Clear();
 }
 
 void GPSDrive::UpdateDisplay() {
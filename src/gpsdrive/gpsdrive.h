@@ -12,8 +12,10 @@
 #include "hw/car/car.h"
 #include "hw/gps/ubx.h"
 #include "hw/input/input.h"
+#include "io/binlog.h"
+#include "io/telemetryring.h"
+#include "timing/latency.h"
 
-class FlushThread;
 class Magnetometer;
 class IMU;
 class INIReader;
@@ -37,6 +39,25 @@ struct ControlOutput {
   }
 };
 
+// one control loop tick, as logged in a GCTL chunk
+struct GPSControlSample {
+  int64_t t;  // CLOCK_MONOTONIC us the inputs were sampled
+  float u_esc, u_servo;
+  float wheel_ds, wheel_v;
+  float accel[3], gyro[3], mag[3];
+  float ierr_v, ierr_k;
+  float in_throttle, in_steering;
+  uint32_t pad;
+};
+
+// one GPS fix and the tracking errors computed from it, in a GNAV chunk
+struct GPSNavSample {
+  int64_t t;  // navigation epoch
+  nav_pvt nav;
+  float ye, psie, k;
+  float autodrive_k, autodrive_v;
+};
+
 struct StateObservation {
   float vx;  // forward velocity
   float w;  // yaw rate
@@ -56,10 +77,10 @@ class GPSDrive : public ControlListener,
   void Quit();
 
   // ControlListener
-  virtual bool OnControlFrame(CarHW *car, float dt);
+  virtual bool OnControlFrame(CarHW *car, float dt, int64_t t);
 
   // NavListener
-  virtual void OnNav(const nav_pvt &nav);
+  virtual void OnNav(const nav_pvt &nav, int64_t t);
 
   // JoystickListener
   virtual void OnDPadPress(char direction);
@@ -76,6 +97,9 @@ class GPSDrive : public ControlListener,
   void StopRecording();
   void UpdateDisplay();
 
+  // print the latency histograms to stderr and start them over
+  void ReportLatency();
+
   DriverConfig config_;
   TrajectoryTracker raceline_;
   FlushThread *flush_thread_;
@@ -125,8 +149,25 @@ class GPSDrive : public ControlListener,
   static void *gpsThread(void *);
   pthread_t gps_thread_;
 
-  FILE *record_fp_;
-  pthread_mutex_t record_mut_;
+  // control_log_ is pushed to by the control thread, nav_log_ by the GPS
+  // thread; the control thread owns log_ and flushes them both
+  BinaryLog log_;
+  TelemetryRing<GPSControlSample> control_log_;
+  TelemetryRing<GPSNavSample> nav_log_;
+  int log_ticks_;
+
+  // latency histograms; epoch_to_arrival_ is written by the GPS thread under
+  // latency_mut_, so the control thread can report and clear it, the others
+  // by the control thread alone. the GPS's epochs are mapped onto our clock
+  // from when its messages arrive, so epoch_to_arrival_ is the time on the
+  // wire plus jitter: the receiver's own solution delay can't be told apart
+  // from clock offset, and is left out of it and fix_to_actuation_
+  LatencyHistogram epoch_to_arrival_;
+  LatencyHistogram fix_to_actuation_;
+  LatencyHistogram sample_to_actuation_;
+  // navigation epoch of the newest fix not yet acted on, or 0
+  int64_t pending_fix_;
+  pthread_mutex_t latency_mut_;
 };
 
 #endif  // GPSDRIVE_GPSDRIVE_H_
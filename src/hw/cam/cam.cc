@@ -9,6 +9,7 @@
 #include "interface/mmal/util/mmal_default_components.h"
 #include "interface/mmal/util/mmal_util.h"
 #include "interface/mmal/util/mmal_util_params.h"
+#include "timing/clock.h"
 
 MMAL_POOL_T *Camera::camera_pool_ = NULL;
 MMAL_COMPONENT_T *Camera::camera_ = NULL;
@@ -23,12 +24,33 @@ void Camera::ControlCallback(
   mmal_buffer_header_release(buffer);
 }
 
+// The camera stamps each buffer with the GPU's system time clock (STC), in
+// microseconds, at the start of the frame; the STC is reset when capture
+// starts (use_stc_timestamp below), so it's only meaningful relative to the
+// STC now. Reading that back costs a round trip to the GPU, which is small
+// next to the age of the frame.
+int64_t Camera::CaptureTime(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+  int64_t now = MonotonicMicros();
+  uint64_t stc;
+  if (buffer->pts == MMAL_TIME_UNKNOWN ||
+      mmal_port_parameter_get_uint64(port, MMAL_PARAMETER_SYSTEM_TIME, &stc)
+      != MMAL_SUCCESS) {
+    return now;
+  }
+  int64_t age = (int64_t)stc - buffer->pts;
+  if (age < 0) {
+    return now;
+  }
+  return now - age;
+}
+
 void Camera::BufferCallback(MMAL_PORT_T *port,
                             MMAL_BUFFER_HEADER_T *buffer) {
   if (buffer->length) {
     if (receiver_ != NULL) {
+      int64_t t_capture = CaptureTime(port, buffer);
       mmal_buffer_header_mem_lock(buffer);
-      receiver_->OnCameraFrame(buffer->data, buffer->length);
+      receiver_->OnCameraFrame(buffer->data, buffer->length, t_capture);
       mmal_buffer_header_mem_unlock(buffer);
     }
   }
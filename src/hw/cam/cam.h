@@ -7,7 +7,9 @@
 class CameraReceiver {
  public:
   virtual ~CameraReceiver();
-  virtual void OnCameraFrame(uint8_t *buf, size_t len) = 0;
+  // t_capture is when the frame was exposed, in CLOCK_MONOTONIC microseconds
+  // (see timing/clock.h)
+  virtual void OnCameraFrame(uint8_t *buf, size_t len, int64_t t_capture) = 0;
 };
 
 struct MMAL_BUFFER_HEADER_T;
@@ -29,6 +31,9 @@ class Camera {
 
   static void ControlCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
   static void BufferCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
+
+  // map a buffer's presentation timestamp onto CLOCK_MONOTONIC
+  static int64_t CaptureTime(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
 };
 
 #endif  // HW_CAM_CAM_H_
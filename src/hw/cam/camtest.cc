@@ -5,6 +5,7 @@
 #include <unistd.h>
 
 #include "hw/cam/cam.h"
+#include "timing/clock.h"
 
 volatile bool done = false;
 
@@ -32,9 +33,18 @@ class Recorder: public CameraReceiver {
     if (output_file_) fclose(output_file_);
   }
 
-  void OnCameraFrame(uint8_t *buf, size_t length) {
+  void OnCameraFrame(uint8_t *buf, size_t length, int64_t t_capture) {
+    // the file format has wall-clock timestamps; back-date now by the frame's
+    // age so they're exposure times rather than arrival times
     struct timeval t;
     gettimeofday(&t, NULL);
+    int64_t age = MonotonicMicros() - t_capture;
+    t.tv_sec -= age / 1000000;
+    t.tv_usec -= age % 1000000;
+    if (t.tv_usec < 0) {
+      t.tv_usec += 1000000;
+      t.tv_sec--;
+    }
     fwrite(&t.tv_sec, sizeof(t.tv_sec), 1, output_file_);
     fwrite(&t.tv_usec, sizeof(t.tv_usec), 1, output_file_);
     fwrite(buf, 1, length, output_file_);
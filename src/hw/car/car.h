@@ -1,14 +1,18 @@
 #ifndef HW_CAR_CAR_H_
 #define HW_CAR_CAR_H_
 
+#include <stdint.h>
+
 class CarHW;
 class INIReader;
 class I2C;
 
 class ControlListener {
  public:
-  // Callback returns false to exit main loop
-  virtual bool OnControlFrame(CarHW *car, float dt) = 0;
+  // Callback returns false to exit main loop. t is when the car's sensors
+  // were sampled this frame, in CLOCK_MONOTONIC microseconds (see
+  // timing/clock.h), and dt the time since the previous frame's t.
+  virtual bool OnControlFrame(CarHW *car, float dt, int64_t t) = 0;
 };
 
 class CarHW {
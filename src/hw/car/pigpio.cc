@@ -1,10 +1,10 @@
-#include <sys/time.h>
 #include <unistd.h>
 
 #include "hw/car/car.h"
 #include "hw/car/pigpio.h"
 #include "inih/cpp/INIReader.h"
 #include "pigpio/pigpio.h"
+#include "timing/clock.h"
 
 PiGPIOCar::PiGPIOCar(const INIReader &ini) {
   escpin_ = ini.GetInteger("car", "escpin", 12);
@@ -53,21 +53,19 @@ bool PiGPIOCar::GetWheelMotion(float *, float *) {
 }
 
 void PiGPIOCar::RunMainLoop(ControlListener *cb) {
-  timeval t0;
-  gettimeofday(&t0, NULL);
+  int64_t t0 = MonotonicMicros();
   unsigned pwmusec = 1000000 / pwmfreq_;
   for (;;) {
-    timeval t;
-    gettimeofday(&t, NULL);
     // sleep until we are at t0+dt
-    uint64_t sleepus =
-        (t0.tv_usec - t.tv_usec) + 1000000 * (t0.tv_sec - t.tv_sec) + pwmusec;
-    usleep(sleepus);
-    gettimeofday(&t, NULL);
-    float dt = (t.tv_usec - t0.tv_usec)*1e-6 + t.tv_sec - t0.tv_sec;
+    int64_t sleepus = t0 + pwmusec - MonotonicMicros();
+    if (sleepus > 0) {
+      usleep(sleepus);
+    }
+    int64_t t = MonotonicMicros();
+    float dt = (t - t0) * 1e-6;
     t0 = t;
 
-    if (!cb->OnControlFrame(this, dt)) {
+    if (!cb->OnControlFrame(this, dt, t)) {
       break;
     }
   }
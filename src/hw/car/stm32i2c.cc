@@ -1,9 +1,9 @@
-#include <sys/time.h>
 #include <unistd.h>
 
 #include "hw/car/stm32i2c.h"
 #include "hw/car/car.h"
 #include "inih/cpp/INIReader.h"
+#include "timing/clock.h"
 
 static const int STM32HAT_ADDRESS = 0x75;
 
@@ -68,21 +68,19 @@ void STM32Hat::RunMainLoop(ControlListener *cb) {
   const int N = NUM_ADDRS - ADDR_ENCODER_COUNT;
   uint8_t buf[N];
   uint16_t last_wpos;
-  timeval last_t;
 
-  gettimeofday(&last_t, NULL);
+  int64_t last_t = MonotonicMicros();
   for (;;) {
     // sync to next 100Hz frame
-    timeval t;
-    gettimeofday(&t, NULL);
-    useconds_t udt =
-        (t.tv_sec - last_t.tv_sec) * 1000000 + (t.tv_usec - last_t.tv_usec);
+    int64_t udt = MonotonicMicros() - last_t;
     if (udt < 10000) usleep(10000 - udt);
 
     if (!i2c_->Read(STM32HAT_ADDRESS, ADDR_ENCODER_COUNT, N, buf)) {
       return;
     }
-    gettimeofday(&t, NULL);
+    // the hat latches its registers as they're read, so the end of the read
+    // is when they were sampled
+    int64_t t = MonotonicMicros();
 
     uint16_t wpos = buf[0] + (buf[1] << 8);
     uint16_t wheeldt = buf[2] + (buf[3] << 8);
@@ -100,8 +98,8 @@ void STM32Hat::RunMainLoop(ControlListener *cb) {
     } else if (wheeldt == 0) {
       v_ = 0;
     }
-    float dt = t.tv_sec - last_t.tv_sec + (t.tv_usec - last_t.tv_usec) * 1e-6;
-    if (!cb->OnControlFrame(this, dt)) {
+    float dt = (t - last_t) * 1e-6;
+    if (!cb->OnControlFrame(this, dt, t)) {
       break;
     }
     last_t = t;
@@ -3,13 +3,13 @@
 #include <stdio.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
-#include <sys/time.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <unistd.h>
 
 #include "hw/car/stm32rs232.h"
 #include "inih/cpp/INIReader.h"
+#include "timing/clock.h"
 
 STM32HatSerial::STM32HatSerial(const INIReader &ini) {
   fd_ = -1;
@@ -111,17 +111,18 @@ static int read_fully(int fd, uint8_t *buf, int ntoread) {
 
 void STM32HatSerial::RunMainLoop(ControlListener *cb) {
   uint16_t last_wpos, wheeldt;
-  timeval last_t;
 
+  // the hat's packets carry no timestamp of their own; it sends them as soon
+  // as it samples the encoder, so the time the packet finishes arriving is
+  // within a 6-byte serial transfer (~0.5ms) of the measurement
   AwaitSync(&last_wpos, &wheeldt);
-  gettimeofday(&last_t, NULL);
+  int64_t last_t = MonotonicMicros();
   for (;;) {
     uint16_t wpos;
     if (!AwaitSync(&wpos, &wheeldt)) {
       continue;
     }
-    timeval t;
-    gettimeofday(&t, NULL);
+    int64_t t = MonotonicMicros();
 
     uint16_t wheel_delta = wpos - last_wpos;
     last_wpos = wpos;
@@ -133,9 +134,9 @@ void STM32HatSerial::RunMainLoop(ControlListener *cb) {
     } else if (wheeldt == 0) {
       v_ = 0;
     }
-    float dt = t.tv_sec - last_t.tv_sec + (t.tv_usec - last_t.tv_usec) * 1e-6;
+    float dt = (t - last_t) * 1e-6;
 
-    if (!cb->OnControlFrame(this, dt)) {
+    if (!cb->OnControlFrame(this, dt, t)) {
       break;
     }
     last_t = t;
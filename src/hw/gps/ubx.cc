@@ -10,6 +10,7 @@
 #include <unistd.h>
 
 #include "hw/gps/ubx.h"
+#include "timing/clock.h"
 
 const char ubx_port[] = "/dev/serial0";
 #define startup_ioctl_baud B9600
@@ -78,8 +79,11 @@ void ubx_enable_periodic(int fd, uint8_t msgclass, uint8_t msgid, uint8_t enable
   ubx_sendmsg(fd, 6, 1, cfg_msg, 8);
 }
 
+// iTOW is GPS time of week in milliseconds, wrapping every week
+ClockMapper itow_clock(1000, 7 * 24 * 3600 * 1000);
+
 void process_msg(int fd, int msg_class, int msg_id, uint8_t *msgbuf,
-                 int msg_length, NavListener *listener) {
+                 int msg_length, int64_t arrival, NavListener *listener) {
   int i;
   switch ((msg_class << 8) + msg_id) {
     case 0x0101:  // NAV-POSECEF
@@ -92,7 +96,12 @@ void process_msg(int fd, int msg_class, int msg_id, uint8_t *msgbuf,
     case 0x0107:  // NAV-PVT
     {
       const struct nav_pvt *navmsg = (struct nav_pvt *)msgbuf;
-      listener->OnNav(*navmsg);
+      // it can't have arrived any sooner than it takes to send: sync, class,
+      // id, length, payload and checksum at 10 bits a byte
+      int64_t wire_us =
+          (6 + msg_length + 2) * 10 * 1000000LL / runtime_baudrate;
+      listener->OnNav(*navmsg,
+                      itow_clock.Map(navmsg->iTOW, arrival, wire_us));
       break;
     }
     case 0x0501:  // ACK
@@ -179,6 +188,11 @@ void ubx_read_loop(int fd, NavListener *listener) {
       perror("read");
       return;
     }
+    // the receiver finishes sending a message well after the epoch it
+    // describes: its time on the wire, which process_msg accounts for, plus
+    // a solution delay that's close to constant; itow_clock takes out the
+    // part that isn't, and can't tell the rest from clock offset
+    int64_t arrival = MonotonicMicros();
     for (i = 0; i < len; i++) {
       // printf("%02x ", buf[i]);
       if (read_state > 1 && read_state < 7) {
@@ -249,7 +263,8 @@ void ubx_read_loop(int fd, NavListener *listener) {
                     "cka mismatch (got %02x calc'd %02x)\n",
                     msg_cls, msg_id, buf[i], msg_cka);
           } else {
-            process_msg(fd, msg_cls, msg_id, msgbuf, msg_length, listener);
+            process_msg(fd, msg_cls, msg_id, msgbuf, msg_length, arrival,
+                        listener);
           }
           read_state = 0;
           break;
@@ -55,7 +55,9 @@ struct nav_pvt {
 
 class NavListener {
  public:
-  virtual void OnNav(const nav_pvt &nav)=0;
+  // t is the navigation epoch (nav.iTOW) mapped onto CLOCK_MONOTONIC
+  // microseconds (see timing/clock.h)
+  virtual void OnNav(const nav_pvt &nav, int64_t t)=0;
 };
 
 int ubx_open();
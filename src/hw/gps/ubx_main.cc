@@ -5,7 +5,9 @@
 
 class NavLogger: public NavListener {
  public:
-  void OnNav(const nav_pvt& msg) {
+  void OnNav(const nav_pvt& msg, int64_t t) {
+    printf("%lld.%06lld ", (long long) (t / 1000000),
+           (long long) (t % 1000000));
     printf("%04d-%02d-%02dT%02d:%02d:%02d.%09d ", msg.year, msg.month, msg.day,
            msg.hour, msg.min, msg.sec, msg.nano);
     printf(
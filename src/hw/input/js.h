@@ -13,12 +13,12 @@ class INIReader;
 class JoystickInput {
  public:
   JoystickInput();
-  ~JoystickInput();
+  virtual ~JoystickInput();
 
   bool Open(const INIReader &ini);
 
   // Read latest car input from joystick
-  bool ReadInput(JoystickListener *receiver);
+  virtual bool ReadInput(JoystickListener *receiver);
 
   int GetFileDescriptor() { return fd_; }
 
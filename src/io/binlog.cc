@@ -0,0 +1,76 @@
+#include "io/binlog.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "timing/clock.h"
+
+BinaryLog::BinaryLog(FlushThread *flush) {
+  flush_ = flush;
+  out_ = NULL;
+  open_ = false;
+  nsources_ = 0;
+}
+
+BinaryLog::~BinaryLog() {
+  Close();
+}
+
+void BinaryLog::AddSource(FlushSource *src) {
+  if (nsources_ >= kMaxSources) {
+    fprintf(stderr, "BinaryLog: too many sources\n");
+    return;
+  }
+  sources_[nsources_++] = src;
+}
+
+bool BinaryLog::Open(const char *path) {
+  if (out_ != NULL) {
+    Close();
+  }
+  StorageWriter *out = StorageWriter::Open(path, false);
+  if (out == NULL) {
+    return false;
+  }
+  // leftovers from the last log, pushed after its final flush
+  for (int i = 0; i < nsources_; i++) {
+    flush_->AddSource(NULL, sources_[i]);
+  }
+
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  int64_t times[2] = {
+    tv.tv_sec * (int64_t)1000000 + tv.tv_usec,
+    MonotonicMicros()
+  };
+  uint32_t len = 24;
+  uint8_t *buf = new uint8_t[len];
+  memcpy(buf, "CLK1", 4);
+  memcpy(buf + 4, &len, 4);
+  memcpy(buf + 8, times, 16);
+  flush_->AddEntry(out, buf, len);
+
+  out_ = out;
+  open_ = true;
+  return true;
+}
+
+void BinaryLog::Flush() {
+  if (out_ == NULL) {
+    return;
+  }
+  for (int i = 0; i < nsources_; i++) {
+    flush_->AddSource(out_, sources_[i]);
+  }
+}
+
+void BinaryLog::Close() {
+  if (out_ == NULL) {
+    return;
+  }
+  open_ = false;
+  Flush();
+  flush_->AddEntry(out_, NULL, -1);
+  out_ = NULL;
+}
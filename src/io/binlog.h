@@ -0,0 +1,49 @@
+#ifndef IO_BINLOG_H_
+#define IO_BINLOG_H_
+
+#include "io/flushthread.h"
+#include "io/storage.h"
+
+// A log file of binary chunks in place of fprintf'd text, for the tools
+// which log from their control loop (gpsdrive, cf). Each logging thread
+// pushes fixed-size samples into a TelemetryRing of its own, so nothing on
+// the hot path formats, locks or waits; the thread owning the log calls
+// Flush() now and then to have the FlushThread write out whatever the rings
+// hold. The file starts with
+//
+//   "CLK1", uint32 24, int64 wall clock us, int64 CLOCK_MONOTONIC us
+//
+// relating the monotonic sample stamps to the wall clock, followed by the
+// rings' chunks (see telemetryring.h). tools/logconv/log2txt.py turns it
+// back into the old text format.
+class BinaryLog {
+ public:
+  static const int kMaxSources = 4;
+
+  explicit BinaryLog(FlushThread *flush);
+  ~BinaryLog();
+
+  // add a ring to be written out on each Flush(); before the first Open()
+  void AddSource(FlushSource *src);
+
+  // Open, Flush and Close belong to one thread
+  bool Open(const char *path);
+  void Flush();
+  // writes out what's left in the rings and closes the file
+  void Close();
+
+  // may be called from any thread, e.g. to see whether to push a sample.
+  // A sample pushed after seeing the log open can miss Close()'s final
+  // flush; the next Open() throws away whatever the rings hold, so it never
+  // lands in the next file ahead of that file's clock.
+  bool IsOpen() const { return open_; }
+
+ private:
+  FlushThread *flush_;
+  StorageWriter *out_;
+  volatile bool open_;
+  FlushSource *sources_[kMaxSources];
+  int nsources_;
+};
+
+#endif  // IO_BINLOG_H_
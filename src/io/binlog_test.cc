@@ -0,0 +1,180 @@
+// log from two threads through a ring each, as gpsdrive does from its
+// control and GPS threads, flushing from the first; check the file starts
+// with the clock chunk and holds every sample of both, in order
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "io/binlog.h"
+#include "io/flushthread.h"
+#include "io/telemetryring.h"
+#include "timing/clock.h"
+
+struct Fast {
+  int64_t seq;
+  float v[17];
+  uint32_t pad;
+};
+
+struct Slow {
+  int64_t seq;
+  uint8_t blob[92];
+  float v[5];
+};
+
+static const int kFast = 5000, kSlow = 500;
+
+static FlushThread flush;
+static BinaryLog binlog(&flush);
+static TelemetryRing<Fast> fast("TFST");
+static TelemetryRing<Slow> slow("TSLO");
+
+static void *produce_slow(void *) {
+  for (int i = 0; i < kSlow; i++) {
+    Slow s;
+    s.seq = i;
+    memset(s.blob, i, sizeof(s.blob));
+    s.v[4] = i;
+    slow.Push(s);
+    usleep(200);
+  }
+  return NULL;
+}
+
+// check one ring chunk's samples follow on from the last; returns how many
+template <typename T>
+static int CheckChunk(const std::vector<uint8_t> &body, int64_t *next,
+                      uint32_t *dropped) {
+  uint16_t size;
+  uint32_t dr;
+  memcpy(&size, &body[0], 2);
+  memcpy(&dr, &body[4], 4);
+  size_t n = (body.size() - 8) / sizeof(T);
+  if (size != sizeof(T) || (body.size() - 8) % sizeof(T) || dr < *dropped) {
+    fprintf(stderr, "bad chunk header\n");
+    return -1;
+  }
+  *dropped = dr;
+  for (size_t i = 0; i < n; i++) {
+    T s;
+    memcpy(&s, &body[8 + i * sizeof(T)], sizeof(T));
+    if (s.seq < *next) {
+      fprintf(stderr, "sample %lld out of order\n", (long long) s.seq);
+      return -1;
+    }
+    *next = s.seq + 1;
+  }
+  return n;
+}
+
+int main() {
+  const char *path = "binlog_test.tmp";
+  fast.Init(256);
+  slow.Init(32);
+  binlog.AddSource(&fast);
+  binlog.AddSource(&slow);
+  if (!flush.Init(16)) {
+    return 1;
+  }
+  int64_t t0 = MonotonicMicros();
+  if (!binlog.Open(path)) {
+    perror(path);
+    return 1;
+  }
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, produce_slow, NULL);
+  for (int i = 0; i < kFast; i++) {
+    Fast s;
+    memset(&s, 0, sizeof(s));
+    s.seq = i;
+    fast.Push(s);
+    if (i % 10 == 9) {
+      binlog.Flush();
+    }
+    usleep(20);
+  }
+  pthread_join(thread, NULL);
+  binlog.Close();
+  flush.Stop();
+
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    perror(path);
+    return 1;
+  }
+  bool ok = true;
+  int nchunks = 0, nfast = 0, nslow = 0;
+  int64_t next_fast = 0, next_slow = 0;
+  uint32_t dropped_fast = 0, dropped_slow = 0;
+  uint8_t hdr[8];
+  while (ok && fread(hdr, 1, 8, fp) == 8) {
+    uint32_t len;
+    memcpy(&len, hdr + 4, 4);
+    std::vector<uint8_t> body(len - 8);
+    if (len < 16 || fread(&body[0], 1, body.size(), fp) != body.size()) {
+      fprintf(stderr, "short chunk\n");
+      ok = false;
+      break;
+    }
+    int n = 0;
+    if (nchunks == 0) {
+      int64_t times[2];
+      memcpy(times, &body[0], 16);
+      if (memcmp(hdr, "CLK1", 4) || len != 24 || times[1] < t0 ||
+          times[1] > MonotonicMicros() || times[0] < 1500000000LL * 1000000) {
+        fprintf(stderr, "bad clock chunk\n");
+        ok = false;
+      }
+    } else if (!memcmp(hdr, "TFST", 4)) {
+      nfast += n = CheckChunk<Fast>(body, &next_fast, &dropped_fast);
+    } else if (!memcmp(hdr, "TSLO", 4)) {
+      nslow += n = CheckChunk<Slow>(body, &next_slow, &dropped_slow);
+    } else {
+      fprintf(stderr, "unexpected chunk\n");
+      ok = false;
+    }
+    if (n < 0) {
+      ok = false;
+    }
+    nchunks++;
+  }
+  fclose(fp);
+  unlink(path);
+
+  if (nfast + static_cast<int>(dropped_fast) != kFast ||
+      nslow + static_cast<int>(dropped_slow) != kSlow) {
+    fprintf(stderr, "samples missing\n");
+    ok = false;
+  }
+  printf("%d chunks: %d + %u dropped fast samples, %d + %u slow\n", nchunks,
+         nfast, dropped_fast, nslow, dropped_slow);
+
+  // a sample pushed too late for the last log mustn't turn up in the next
+  Slow stray;
+  memset(&stray, 0, sizeof(stray));
+  slow.Push(stray);
+  if (!binlog.Open(path)) {
+    perror(path);
+    return 1;
+  }
+  binlog.Close();
+  fp = fopen(path, "rb");
+  if (!fp) {
+    perror(path);
+    return 1;
+  }
+  if (fread(hdr, 1, 8, fp) != 8 || memcmp(hdr, "CLK1", 4) ||
+      fseek(fp, 16, SEEK_CUR) != 0 || fgetc(fp) != EOF) {
+    fprintf(stderr, "stray sample written to the next log\n");
+    ok = false;
+  }
+  fclose(fp);
+  unlink(path);
+  printf(ok ? "OK\n" : "FAIL\n");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,389 @@
+#include "io/blackbox.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "io/telemetryring.h"
+
+namespace {
+
+// the dump path has to be safe in a signal handler, so no stdio: these
+// just make system calls
+
+bool WriteAll(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    while (iovcnt > 0 && static_cast<size_t>(n) >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = reinterpret_cast<uint8_t*>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+  return true;
+}
+
+bool WriteAll(int fd, const void *buf, size_t len) {
+  struct iovec iov = {const_cast<void*>(buf), len};
+  return WriteAll(fd, &iov, 1);
+}
+
+// append s to the NUL-terminated string in buf, which has room for size
+void Append(char *buf, size_t size, const char *s) {
+  size_t n = strlen(buf);
+  while (*s && n + 1 < size) {
+    buf[n++] = *s++;
+  }
+  buf[n] = 0;
+}
+
+void AppendInt(char *buf, size_t size, int64_t v) {
+  char digits[24];
+  int n = sizeof(digits);
+  digits[--n] = 0;
+  do {
+    digits[--n] = '0' + v % 10;
+    v /= 10;
+  } while (v > 0 && n > 0);
+  Append(buf, size, digits + n);
+}
+
+void Say(const char *what, const char *path) {
+  char msg[512] = "BlackBox: ";
+  Append(msg, sizeof(msg), what);
+  Append(msg, sizeof(msg), path);
+  Append(msg, sizeof(msg), "\n");
+  ssize_t ignored = write(2, msg, strlen(msg));
+  (void) ignored;
+}
+
+}  // namespace
+
+BlackBox::BlackBox(const char *telemetry_tag) {
+  memcpy(tag_, telemetry_tag, 4);
+  framewidth_ = frameheight_ = 0;
+  frames_ = NULL;
+  slotsize_ = 0;
+  framelen_ = NULL;
+  frametime_ = NULL;
+  nframes_ = frameskip_ = skipped_ = 0;
+  frame_head_ = 0;
+  pending_ = NULL;
+  samples_ = NULL;
+  samplesize_ = 0;
+  nsamples_ = 0;
+  sample_head_ = 0;
+  header_len_ = 0;
+  frame_busy_ = sample_busy_ = header_busy_ = 0;
+  state_ = IDLE;
+  reason_ = "";
+  prefix_[0] = 0;
+  path_[0] = 0;
+  post_ms_ = 0;
+  dumps_ = 0;
+  running_ = false;
+  stop_ = false;
+  sem_init(&sem_, 0, 0);
+}
+
+BlackBox::~BlackBox() {
+  Stop();
+  delete[] frames_;
+  delete[] framelen_;
+  delete[] frametime_;
+  delete[] samples_;
+  sem_destroy(&sem_);
+}
+
+bool BlackBox::InitFrames(const FrameFormat &fmt, int framewidth,
+                          int frameheight, int nframes, int frameskip) {
+  if (nframes < 1) {
+    fprintf(stderr, "BlackBox: need at least one frame\n");
+    return false;
+  }
+  format_ = fmt;
+  format_.level = 0;
+  framewidth_ = framewidth;
+  frameheight_ = frameheight;
+  slotsize_ = 16 + kFrameChunkRoom + FrameFormat::kChunkHeaderSize +
+      format_.RawSize();
+  frames_ = new uint8_t[nframes * slotsize_];
+  framelen_ = new size_t[nframes];
+  frametime_ = new int64_t[nframes];
+  // touch it all now rather than on the camera thread's first lap
+  memset(frames_, 0, nframes * slotsize_);
+  nframes_ = nframes;
+  frameskip_ = frameskip;
+  skipped_ = frameskip;  // keep the first one
+  return true;
+}
+
+bool BlackBox::InitTelemetry(size_t samplesize, int nsamples) {
+  if (samplesize < sizeof(int64_t) || nsamples < 1) {
+    fprintf(stderr, "BlackBox: bad telemetry sample size or count\n");
+    return false;
+  }
+  samples_ = new uint8_t[nsamples * samplesize];
+  memset(samples_, 0, nsamples * samplesize);
+  samplesize_ = samplesize;
+  nsamples_ = nsamples;
+  return true;
+}
+
+bool BlackBox::Start(const char *prefix, int post_ms) {
+  prefix_[0] = 0;
+  Append(prefix_, sizeof(prefix_), prefix);
+  post_ms_ = post_ms;
+  if (pthread_create(&thread_, NULL, thread_entry, this) != 0) {
+    perror("BlackBox: pthread_create");
+    return false;
+  }
+  running_ = true;
+  return true;
+}
+
+void BlackBox::Stop() {
+  if (!running_) {
+    return;
+  }
+  stop_ = true;
+  sem_post(&sem_);
+  pthread_join(thread_, NULL);
+  running_ = false;
+}
+
+bool BlackBox::SetHeader(const uint8_t *hdr, size_t len) {
+  if (len > kMaxHeader) {
+    fprintf(stderr, "BlackBox: %zu byte header too long\n", len);
+    return false;
+  }
+  header_busy_ = 1;
+  bool ok = state_ != DUMPING;
+  if (ok) {
+    memcpy(header_, hdr, len);
+    header_len_ = len;
+  }
+  header_busy_ = 0;
+  return ok;
+}
+
+uint8_t *BlackBox::BeginFrame() {
+  if (!running_ || frames_ == NULL) {
+    return NULL;
+  }
+  if (skipped_ < frameskip_) {
+    skipped_++;
+    return NULL;
+  }
+  frame_busy_ = 1;
+  if (state_ == DUMPING) {
+    frame_busy_ = 0;
+    return NULL;
+  }
+  skipped_ = 0;
+  uint32_t head = frame_head_.load(std::memory_order_relaxed);
+  pending_ = frames_ + (head % nframes_) * slotsize_;
+  return pending_ + 16;
+}
+
+void BlackBox::CommitFrame(const timeval &t, int64_t t_capture,
+                           size_t chunklen, const uint8_t *yuv) {
+  uint8_t *slot = pending_;
+  uint32_t rawlen = format_.RawSize();
+  uint8_t *p = slot + 16 + chunklen;
+  format_.WriteChunkHeader(p, FRAME_RAW, rawlen);
+  format_.Extract(yuv, framewidth_, frameheight_,
+                  p + FrameFormat::kChunkHeaderSize);
+  uint32_t len = 16 + chunklen + FrameFormat::kChunkHeaderSize + rawlen;
+  uint32_t tv[2] = {static_cast<uint32_t>(t.tv_sec),
+                    static_cast<uint32_t>(t.tv_usec)};
+  memcpy(slot, "CYCF", 4);
+  memcpy(slot + 4, &len, 4);
+  memcpy(slot + 8, tv, 8);
+
+  uint32_t head = frame_head_.load(std::memory_order_relaxed);
+  framelen_[head % nframes_] = len;
+  frametime_[head % nframes_] = t_capture;
+  frame_head_.store(head + 1, std::memory_order_release);
+  pending_ = NULL;
+  frame_busy_ = 0;
+}
+
+void BlackBox::AddSample(const void *sample) {
+  if (!running_ || samples_ == NULL) {
+    return;
+  }
+  sample_busy_ = 1;
+  if (state_ != DUMPING) {
+    uint32_t head = sample_head_.load(std::memory_order_relaxed);
+    memcpy(samples_ + (head % nsamples_) * samplesize_, sample, samplesize_);
+    sample_head_.store(head + 1, std::memory_order_release);
+  }
+  sample_busy_ = 0;
+}
+
+bool BlackBox::Trigger(const char *reason) {
+  if (!running_) {
+    return false;
+  }
+  int expected = IDLE;
+  if (!state_.compare_exchange_strong(expected, TRIGGERED)) {
+    return false;
+  }
+  reason_ = reason;
+  sem_post(&sem_);
+  return true;
+}
+
+bool BlackBox::DumpNow(const char *reason) {
+  if (!running_) {
+    return false;
+  }
+  int expected = IDLE;
+  if (!state_.compare_exchange_strong(expected, DUMPING)) {
+    // take over a triggered dump still waiting out its post_ms
+    if (expected != TRIGGERED ||
+        !state_.compare_exchange_strong(expected, DUMPING)) {
+      return false;
+    }
+  }
+  Freeze();
+  bool ok = Dump(reason);
+  state_ = IDLE;
+  return ok;
+}
+
+void BlackBox::Freeze() {
+  // the producers won't start another write now that they can see
+  // DUMPING; wait out any they're in the middle of. if this is a signal
+  // handler interrupting one of them it never will finish, so give up
+  // after a while and live with a torn frame or sample.
+  for (int i = 0; i < 1000 && (frame_busy_ || sample_busy_ || header_busy_);
+       i++) {
+    sched_yield();
+  }
+}
+
+bool BlackBox::WriteSamples(int fd, uint32_t *next, uint32_t end,
+                            int64_t until) {
+  uint32_t first = *next, n = 0;
+  while (first + n != end) {
+    int64_t t;
+    memcpy(&t, samples_ + ((first + n) % nsamples_) * samplesize_, 8);
+    if (t > until) {
+      break;
+    }
+    n++;
+  }
+  if (n == 0) {
+    return true;
+  }
+  // the same chunk TelemetryRing writes
+  uint8_t hdr[TelemetryRing<int64_t>::kHeaderSize];
+  uint32_t len = sizeof(hdr) + n * samplesize_;
+  uint16_t size = samplesize_, zero = 0;
+  uint32_t dropped = 0;
+  memcpy(hdr, tag_, 4);
+  memcpy(hdr + 4, &len, 4);
+  memcpy(hdr + 8, &size, 2);
+  memcpy(hdr + 10, &zero, 2);
+  memcpy(hdr + 12, &dropped, 4);
+  // as in TelemetryRing::FlushTo, they wrap around at most once
+  uint32_t slot = first % nsamples_;
+  uint32_t n1 = n < nsamples_ - slot ? n : nsamples_ - slot;
+  struct iovec iov[3] = {
+    {hdr, sizeof(hdr)},
+    {samples_ + slot * samplesize_, n1 * samplesize_},
+    {samples_, (n - n1) * samplesize_},
+  };
+  *next = first + n;
+  return WriteAll(fd, iov, n1 < n ? 3 : 2);
+}
+
+bool BlackBox::Dump(const char *reason) {
+  path_[0] = 0;
+  Append(path_, sizeof(path_), prefix_);
+  Append(path_, sizeof(path_), "-");
+  AppendInt(path_, sizeof(path_), time(NULL));
+  Append(path_, sizeof(path_), "-");
+  Append(path_, sizeof(path_), reason);
+  Append(path_, sizeof(path_), ".rec");
+
+  int fd = open(path_, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    Say("can't create ", path_);
+    return false;
+  }
+
+  bool ok;
+  if (header_len_ > 0) {
+    ok = WriteAll(fd, header_, header_len_);
+  } else {
+    // readers want a recording to start with one
+    ok = WriteAll(fd, "cfg1\x08\0\0\0", 8);
+  }
+
+  uint32_t fhead = frame_head_.load(std::memory_order_acquire);
+  uint32_t f = fhead > static_cast<uint32_t>(nframes_) ? fhead - nframes_ : 0;
+  uint32_t shead = sample_head_.load(std::memory_order_acquire);
+  uint32_t s = shead > nsamples_ ? shead - nsamples_ : 0;
+  for (; ok && frames_ != NULL && f != fhead; f++) {
+    int i = f % nframes_;
+    if (samples_ != NULL) {
+      ok = WriteSamples(fd, &s, shead, frametime_[i]);
+    }
+    ok = ok && WriteAll(fd, frames_ + i * slotsize_, framelen_[i]);
+  }
+  if (ok && samples_ != NULL) {
+    ok = WriteSamples(fd, &s, shead, INT64_MAX);
+  }
+  ok = fsync(fd) == 0 && ok;
+  ok = close(fd) == 0 && ok;
+  if (!ok) {
+    Say("write failed: ", path_);
+    return false;
+  }
+  dumps_++;
+  Say("dumped ", path_);
+  return true;
+}
+
+void *BlackBox::thread_entry(void *arg) {
+  BlackBox *self = reinterpret_cast<BlackBox*>(arg);
+  for (;;) {
+    if (sem_wait(&self->sem_) != 0) {
+      continue;  // EINTR
+    }
+    if (self->stop_) {
+      break;
+    }
+    // let the rings record what happens next, too
+    struct timespec ts = {self->post_ms_ / 1000,
+                          (self->post_ms_ % 1000) * 1000000L};
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+    int expected = TRIGGERED;
+    if (!self->state_.compare_exchange_strong(expected, DUMPING)) {
+      continue;  // DumpNow got there first
+    }
+    self->Freeze();
+    self->Dump(self->reason_);
+    self->state_ = IDLE;
+  }
+  return NULL;
+}
@@ -0,0 +1,124 @@
+#ifndef IO_BLACKBOX_H_
+#define IO_BLACKBOX_H_
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <atomic>
+
+#include "io/framecodec.h"
+
+// Always-on flight recorder: the last few seconds of (cropped, luma-only,
+// frame-skipped) camera frames and every control tick, held in memory
+// allocated once at Init and written to disk only when something
+// interesting happens.
+//
+// The camera thread fills frame slots with BeginFrame/CommitFrame and the
+// control thread adds telemetry samples, each overwriting the oldest; no
+// locks, no allocation. Trigger() (from any thread, or a signal handler)
+// wakes the dump thread, which waits post_ms for the aftermath to be
+// recorded too, then freezes the rings, writes them out and lets them run
+// again. Frames and samples arriving during a dump are lost.
+//
+// A dump is an ordinary recording, readable by anything that reads .rec
+// files: the header set with SetHeader, then each frame as a CYCF chunk
+// preceded by a telemetry chunk (see io/telemetryring.h) of the samples up
+// to it. Telemetry samples must start with their int64 CLOCK_MONOTONIC
+// microsecond timestamp, which is how they're put in order with the frames.
+class BlackBox {
+ public:
+  // room for the chunks a frame carries ahead of its pixels
+  static const size_t kFrameChunkRoom = 4096;
+  static const size_t kMaxHeader = 512;
+
+  explicit BlackBox(const char *telemetry_tag);
+  ~BlackBox();
+
+  // keep the newest nframes frames out of every frameskip+1 offered, in
+  // fmt, from framewidth x frameheight camera frames
+  bool InitFrames(const FrameFormat &fmt, int framewidth, int frameheight,
+                  int nframes, int frameskip);
+  // keep the newest nsamples samplesize-byte samples
+  bool InitTelemetry(size_t samplesize, int nsamples);
+  // start the dump thread; dumps are named <prefix>-<unix time>-<reason>.rec
+  bool Start(const char *prefix, int post_ms);
+  void Stop();
+
+  bool IsRunning() const { return running_; }
+
+  // the chunk (e.g. cfg1) each dump starts with; from any one thread at a
+  // time. false if a dump is in progress.
+  bool SetHeader(const uint8_t *hdr, size_t len);
+
+  // camera thread: where to put this frame's chunks, at most
+  // kFrameChunkRoom bytes of them, or NULL to skip the frame. a non-NULL
+  // return must be followed by CommitFrame with the frame itself.
+  uint8_t *BeginFrame();
+  void CommitFrame(const timeval &t, int64_t t_capture, size_t chunklen,
+                   const uint8_t *yuv);
+
+  // control thread
+  void AddSample(const void *sample);
+
+  // ask for a dump; reason should be a string literal. async-signal-safe.
+  // false if a dump is already on its way.
+  bool Trigger(const char *reason);
+
+  // dump right now on this thread, for a fatal signal handler: it only
+  // makes system calls. false if a dump is already in progress.
+  bool DumpNow(const char *reason);
+
+  int Dumps() const { return dumps_; }
+  // the last dump's file name
+  const char *LastPath() const { return path_; }
+
+ private:
+  enum {
+    IDLE,
+    TRIGGERED,
+    DUMPING,
+  };
+
+  void Freeze();
+  bool Dump(const char *reason);
+  bool WriteSamples(int fd, uint32_t *next, uint32_t end, int64_t until);
+
+  static void *thread_entry(void *arg);
+
+  char tag_[4];
+  FrameFormat format_;
+  int framewidth_, frameheight_;
+
+  uint8_t *frames_;  // nframes_ slots of slotsize_ bytes
+  size_t slotsize_;
+  size_t *framelen_;
+  int64_t *frametime_;
+  int nframes_, frameskip_, skipped_;
+  std::atomic<uint32_t> frame_head_;
+  uint8_t *pending_;  // slot between BeginFrame and CommitFrame
+
+  uint8_t *samples_;
+  size_t samplesize_;
+  uint32_t nsamples_;
+  std::atomic<uint32_t> sample_head_;
+
+  uint8_t header_[kMaxHeader];
+  size_t header_len_;
+
+  // producers raise these while writing; a dump waits for them to drop
+  std::atomic<int> frame_busy_, sample_busy_, header_busy_;
+  std::atomic<int> state_;
+  const char *volatile reason_;
+
+  char prefix_[128];
+  char path_[256];
+  int post_ms_;
+  std::atomic<int> dumps_;
+  bool running_;
+  volatile bool stop_;
+  pthread_t thread_;
+  sem_t sem_;  // posted on Trigger, and to stop
+};
+
+#endif  // IO_BLACKBOX_H_
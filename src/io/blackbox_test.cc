@@ -0,0 +1,189 @@
+// run a BlackBox with a camera and a control thread feeding it, trigger a
+// dump partway and then dump it again once they've stopped; check both
+// read back with RecordFile as consecutive kept frames, cropped and luma
+// only, with the telemetry ahead of each frame in order
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "io/blackbox.h"
+#include "io/framecodec.h"
+#include "io/recordfile.h"
+
+static const int kWidth = 64, kHeight = 48;
+static const int kFrames = 300, kKeep = 12, kSkip = 2;
+static const int kTicksPerFrame = 3, kSamples = 40;
+
+struct Sample {
+  int64_t t;
+  int32_t seq;
+  float v;
+};
+
+static BlackBox box("TTST");
+static FrameFormat format;
+
+static int64_t FrameTime(int n) { return 1000000 + n * 33333LL; }
+
+static void MakeFrame(int n, uint8_t *yuv) {
+  for (int i = 0; i < kWidth * kHeight * 3 / 2; i++) {
+    yuv[i] = i + n * 7;
+  }
+}
+
+static void *control(void *) {
+  for (int i = 0; i < kFrames * kTicksPerFrame; i++) {
+    Sample s;
+    s.t = FrameTime(0) + i * 11111LL;
+    s.seq = i;
+    s.v = i * 0.5f;
+    box.AddSample(&s);
+    usleep(300);
+  }
+  return NULL;
+}
+
+static void *camera(void *) {
+  std::vector<uint8_t> yuv(kWidth * kHeight * 3 / 2);
+  for (int n = 0; n < kFrames; n++) {
+    MakeFrame(n, &yuv[0]);
+    uint8_t *p = box.BeginFrame();
+    if (p != NULL) {
+      // a per-frame chunk of our own ahead of the pixels
+      uint32_t len = 12;
+      memcpy(p, "FNUM", 4);
+      memcpy(p + 4, &len, 4);
+      memcpy(p + 8, &n, 4);
+      timeval tv = {1500000000, n};
+      box.CommitFrame(tv, FrameTime(n), len, &yuv[0]);
+    }
+    if (n == kFrames / 2) {
+      box.Trigger("test");
+    }
+    usleep(900);
+  }
+  return NULL;
+}
+
+// returns the number of frames in the dump, or -1 if it's wrong
+static int Check(const char *path) {
+  RecordFile f;
+  if (!f.Open(path)) {
+    return -1;
+  }
+  int last = -1;
+  for (int i = 0; i < f.NumFrames(); i++) {
+    RecordFrame fr;
+    const RecordChunk *num;
+    if (!f.Frame(i, &fr) || (num = fr.Find("FNUM")) == NULL) {
+      fprintf(stderr, "%s: frame %d unreadable\n", path, i);
+      return -1;
+    }
+    int n;
+    memcpy(&n, num->data, 4);
+    if (fr.tv_usec != static_cast<uint32_t>(n) ||
+        (last >= 0 && n != last + kSkip + 1)) {
+      fprintf(stderr, "%s: frame %d is %d after %d\n", path, i, n, last);
+      return -1;
+    }
+    last = n;
+    // luma of our region, and nothing else
+    const RecordChunk *img = fr.Find("YUVz");
+    std::vector<uint8_t> want(kWidth * kHeight * 3 / 2), got(format.RawSize());
+    MakeFrame(n, &want[0]);
+    FrameFormat dec;
+    if (img == NULL ||
+        !dec.Decode(img->data - 8, img->len + 8, &got[0], got.size()) ||
+        dec.planes != 1 || dec.width != format.width) {
+      fprintf(stderr, "%s: frame %d image undecodable\n", path, i);
+      return -1;
+    }
+    for (int y = 0; y < format.height; y++) {
+      if (memcmp(&got[y * format.width],
+                 &want[(y + format.y0) * kWidth + format.x0], format.width)) {
+        fprintf(stderr, "%s: frame %d image wrong\n", path, i);
+        return -1;
+      }
+    }
+  }
+
+  // telemetry: read the chunks between frames straight from the file
+  FILE *fp = fopen(path, "rb");
+  uint8_t hdr[8];
+  int64_t frame_t = -1, last_t = -1;
+  int nsamples = 0;
+  while (fread(hdr, 1, 8, fp) == 8) {
+    uint32_t len;
+    memcpy(&len, hdr + 4, 4);
+    std::vector<uint8_t> body(len - 8);
+    if (fread(&body[0], 1, body.size(), fp) != body.size()) {
+      break;
+    }
+    if (!memcmp(hdr, "CYCF", 4)) {
+      int n;
+      memcpy(&n, &body[8 + 8], 4);  // after the timestamp, FNUM's body
+      frame_t = FrameTime(n);
+    } else if (!memcmp(hdr, "TTST", 4)) {
+      for (size_t i = 8; i + sizeof(Sample) <= body.size();
+           i += sizeof(Sample)) {
+        Sample s;
+        memcpy(&s, &body[i], sizeof(s));
+        // in order, and each chunk comes after the frame before its samples
+        if (s.t <= last_t || s.t < frame_t || s.v != s.seq * 0.5f) {
+          fprintf(stderr, "%s: sample %d out of order\n", path, s.seq);
+          fclose(fp);
+          return -1;
+        }
+        last_t = s.t;
+        nsamples++;
+      }
+    }
+  }
+  fclose(fp);
+  if (nsamples == 0 || nsamples > kSamples) {
+    fprintf(stderr, "%s: %d samples\n", path, nsamples);
+    return -1;
+  }
+  return f.NumFrames();
+}
+
+int main() {
+  if (!format.Parse("8 4 32 40", "y", 0, kWidth, kHeight) ||
+      !box.InitFrames(format, kWidth, kHeight, kKeep, kSkip) ||
+      !box.InitTelemetry(sizeof(Sample), kSamples) ||
+      !box.Start("blackbox_test", 5)) {
+    return 1;
+  }
+  uint8_t cfg[12];
+  memcpy(cfg, "cfg1\x0c\0\0\0abcd", 12);
+  box.SetHeader(cfg, 12);
+
+  pthread_t cam, ctl;
+  pthread_create(&cam, NULL, camera, NULL);
+  pthread_create(&ctl, NULL, control, NULL);
+  pthread_join(cam, NULL);
+  pthread_join(ctl, NULL);
+  while (box.Dumps() < 1) {
+    usleep(1000);
+  }
+  std::vector<char> triggered(box.LastPath(), box.LastPath() + 256);
+  int n1 = Check(&triggered[0]);
+  printf("triggered dump %s: %d frames\n", &triggered[0], n1);
+  unlink(&triggered[0]);
+
+  // now everything's stopped: exactly the newest frames and samples
+  bool ok = n1 > 0 && box.DumpNow("final");
+  int n2 = ok ? Check(box.LastPath()) : -1;
+  printf("final dump %s: %d frames\n", box.LastPath(), n2);
+  unlink(box.LastPath());
+  box.Stop();
+
+  ok = ok && n2 == kKeep && box.Dumps() == 2;
+  printf(ok ? "OK\n" : "FAIL\n");
+  return ok ? 0 : 1;
+}
@@ -2,109 +2,351 @@
 #define DRIVE_FLUSHTHREAD_H_
 
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
-#include <deque>
+#include <atomic>
+
+#include "io/recordpool.h"
+#include "io/storage.h"
+
+// Something that produces its data on the FlushThread, when an entry for
+// it comes up in the queue, e.g. a ring of samples from a thread that
+// mustn't allocate or wait.
+class FlushSource {
+ public:
+  virtual ~FlushSource() {}
+
+  // how far the source has got, noted when an entry for it is queued so
+  // that it writes only what came before the entry
+  virtual uint32_t Mark() const = 0;
+  // write out whatever was pending at mark, or with out NULL throw it away;
+  // called only from the FlushThread
+  virtual bool FlushTo(StorageWriter *out, uint32_t mark) = 0;
+};
 
 // asynchronous flush to sdcard
 struct FlushEntry {
-  int fd_;
+  StorageWriter *out_;
   uint8_t *buf_;
   ssize_t len_;
-  ssize_t unsynced_;
+  RecordBuffer *rec_;  // written with writev and returned to its pool
+  FlushSource *src_;
+  uint32_t mark_;  // src_->Mark() when it was queued
 
-  FlushEntry() { buf_ = NULL; }
-  FlushEntry(int fd, uint8_t *buf, size_t len):
-    fd_(fd), buf_(buf), len_(len) { unsynced_ = 0; }
+  FlushEntry() {
+    out_ = NULL; buf_ = NULL; rec_ = NULL; src_ = NULL; mark_ = 0;
+  }
+  FlushEntry(StorageWriter *out, uint8_t *buf, size_t len):
+    out_(out), buf_(buf), len_(len) { rec_ = NULL; src_ = NULL; mark_ = 0; }
+  FlushEntry(StorageWriter *out, RecordBuffer *rec):
+    out_(out), buf_(NULL), rec_(rec) {
+    len_ = rec->header_len + rec->data_len;
+    src_ = NULL;
+    mark_ = 0;
+  }
+  FlushEntry(StorageWriter *out, FlushSource *src, uint32_t mark):
+    out_(out), buf_(NULL), len_(0), rec_(NULL), src_(src), mark_(mark) {}
 
   void flush() {
     if (len_ == -1) {
-      fprintf(stderr, "FlushThread: closing fd %d\n", fd_);
-      close(fd_);
+      fprintf(stderr, "FlushThread: closing %lld byte file\n",
+              (long long) out_->Offset());
+      out_->Close();
+      delete out_;
+      return;
     }
-    if (buf_ != NULL) {
-      if (write(fd_, buf_, len_) != len_) {
-        perror("FlushThread write");
-      }
+    bool ok;
+    if (rec_ != NULL) {
+      // chunk headers and camera frame together, no staging copy
+      iovec iov[2] = {
+        {rec_->header, rec_->header_len},
+        {rec_->data, rec_->data_len},
+      };
+      ok = out_->Write(iov, 2);
+      rec_->pool->Put(rec_);
+      rec_ = NULL;
+    } else if (buf_ != NULL) {
+      ok = out_->Write(buf_, len_);
       delete[] buf_;
       buf_ = NULL;
-      unsynced_ += len_;
-      // sync every 1MB
-      // way too expensive! wtf!
-      if (unsynced_ > 1048576) {
-        unsynced_ = 0;
-        fsync(fd_);
-      }
+    } else if (src_ != NULL) {
+      ok = src_->FlushTo(out_, mark_);
+      src_ = NULL;
+    } else {
+      return;
+    }
+    if (!ok) {
+      fprintf(stderr, "FlushThread: write failed\n");
+    }
+  }
+
+  // throw the entry away unwritten, releasing its buffer
+  void discard() {
+    if (rec_ != NULL) {
+      rec_->pool->Put(rec_);
+      rec_ = NULL;
     }
+    delete[] buf_;
+    buf_ = NULL;
   }
+
+  bool is_video() const { return rec_ != NULL; }
+};
+
+// What AddEntry/AddRecord do when the queue is full.
+enum FlushOverflowPolicy {
+  FLUSH_BLOCK,       // wait for the sdcard to catch up
+  FLUSH_DROP_NEWEST,  // drop the entry being added
+  FLUSH_DROP_VIDEO,  // drop camera frames once the queue is 3/4 full, keeping
+                     // the rest for telemetry, which waits if it must
 };
 
+// Single writer thread fed by a bounded lock-free multi-producer queue
+// (Vyukov's, with a sequence number per slot). Closing a file always waits
+// for room, whatever the policy, so every file gets closed.
 class FlushThread {
  public:
   FlushThread() {
-    pthread_mutex_init(&mutex_, NULL);
+    slots_ = NULL;
+    mask_ = 0;
+    policy_ = FLUSH_BLOCK;
+    running_ = false;
+    stop_ = false;
+    enqueue_pos_ = 0;
+    dequeue_pos_ = 0;
+    depth_ = 0;
+    bytes_in_flight_ = 0;
+    dropped_ = 0;
+    space_waiters_ = 0;
     sem_init(&sem_, 0, 0);
+    sem_init(&space_, 0, 0);
   }
 
   ~FlushThread() {
-    // terminate the thread?
+    Stop();
+    delete[] slots_;
+    sem_destroy(&sem_);
+    sem_destroy(&space_);
   }
 
-  bool Init() {
+  // capacity is rounded up to a power of two
+  bool Init(int capacity = 64, FlushOverflowPolicy policy = FLUSH_BLOCK) {
+    int n = 2;
+    while (n < capacity) {
+      n *= 2;
+    }
+    slots_ = new Slot[n];
+    mask_ = n - 1;
+    for (int i = 0; i < n; i++) {
+      slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+    policy_ = policy;
     if (pthread_create(&thread_, NULL, thread_entry, this) != 0) {
       perror("FlushThread: pthread_create");
       return false;
     }
+    running_ = true;
+    return true;
+  }
+
+  // "block", "drop" (newest) or "dropvideo"
+  static bool ParseOverflowPolicy(const char *name,
+                                  FlushOverflowPolicy *policy) {
+    if (!strcmp(name, "block")) {
+      *policy = FLUSH_BLOCK;
+    } else if (!strcmp(name, "drop")) {
+      *policy = FLUSH_DROP_NEWEST;
+    } else if (!strcmp(name, "dropvideo")) {
+      *policy = FLUSH_DROP_VIDEO;
+    } else {
+      fprintf(stderr, "FlushThread: unknown overflow policy \"%s\"\n", name);
+      return false;
+    }
     return true;
   }
 
-  void AddEntry(int fd, uint8_t *buf, size_t len) {
-    static int count = 0;
-    pthread_mutex_lock(&mutex_);
-    flush_queue_.push_back(FlushEntry(fd, buf, len));
-    size_t siz = flush_queue_.size();
-    pthread_mutex_unlock(&mutex_);
+  // write out the queue, then stop the thread; entries added afterwards are
+  // written synchronously. Call it once the producers are done adding.
+  void Stop() {
+    if (!running_) {
+      return;
+    }
+    stop_ = true;
     sem_post(&sem_);
-    count++;
-    if (count >= 15) {
-      if (siz > 2) {
-        fprintf(stderr, "[FlushThread %d]\r", siz);
-        fflush(stderr);
-      }
-      count = 0;
+    pthread_join(thread_, NULL);
+    running_ = false;
+    if (dropped_ > 0) {
+      fprintf(stderr, "FlushThread: %d entries dropped on overflow\n",
+              dropped_.load());
     }
-#if 0
-    int semval;
-    sem_getvalue(&sem_, &semval);
-    fprintf(stderr, "Flusher: qsize %d sem %d\n", flush_queue_.size(), semval);
-#endif
   }
 
+  // write buf and delete[] it, or if len is -1 close out and delete it.
+  // returns false if the entry was dropped.
+  bool AddEntry(StorageWriter *out, uint8_t *buf, size_t len) {
+    return Push(FlushEntry(out, buf, len));
+  }
+
+  // write out a pooled record buffer, then return it to its pool
+  bool AddRecord(StorageWriter *out, RecordBuffer *rec) {
+    return Push(FlushEntry(out, rec));
+  }
+
+  // have src write out what it's got now once everything before it's
+  // written; if this is dropped, src's data waits for the next one
+  bool AddSource(StorageWriter *out, FlushSource *src) {
+    return AddSource(out, src, src->Mark());
+  }
+
+  // the same, as of mark, an earlier src->Mark(): for an entry held up on
+  // its way here, as by the FrameCompressor
+  bool AddSource(StorageWriter *out, FlushSource *src, uint32_t mark) {
+    return Push(FlushEntry(out, src, mark));
+  }
+
+  int QueueDepth() const { return depth_; }
+  int64_t BytesInFlight() const { return bytes_in_flight_; }
+  int Dropped() const { return dropped_; }
+
  private:
+  struct Slot {
+    std::atomic<uint32_t> seq;
+    FlushEntry e;
+  };
+
+  // claim a slot and fill it; false if the queue is full (or, for video
+  // under FLUSH_DROP_VIDEO, past its share of it)
+  bool TryPush(const FlushEntry &e) {
+    uint32_t limit = mask_ + 1;
+    if (policy_ == FLUSH_DROP_VIDEO && e.is_video()) {
+      limit -= limit / 4;
+    }
+    uint32_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      if (pos - dequeue_pos_.load(std::memory_order_acquire) >= limit) {
+        return false;
+      }
+      Slot *slot = &slots_[pos & mask_];
+      int32_t dif = slot->seq.load(std::memory_order_acquire) - pos;
+      if (dif == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          slot->e = e;
+          slot->seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (dif < 0) {
+        return false;  // full
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool Push(FlushEntry e) {
+    if (!running_ || stop_) {
+      e.flush();
+      return true;
+    }
+    ssize_t len = e.len_ > 0 ? e.len_ : 0;
+    // count the bytes first so the writer never sees them go negative
+    bytes_in_flight_ += len;
+    bool wait = policy_ == FLUSH_BLOCK || e.len_ == -1 ||
+        (policy_ == FLUSH_DROP_VIDEO && !e.is_video());
+    bool pushed = TryPush(e);
+    if (!pushed && wait) {
+      // the writer posts space_ after each entry while anyone is waiting;
+      // registering first means we can't miss the post
+      space_waiters_++;
+      while (!(pushed = TryPush(e))) {
+        sem_wait(&space_);
+      }
+      space_waiters_--;
+    }
+    if (!pushed) {
+      bytes_in_flight_ -= len;
+      e.discard();
+      if (++dropped_ % 30 == 1) {
+        fprintf(stderr, "FlushThread: queue full, %d entries dropped\n",
+                dropped_.load());
+      }
+      return false;
+    }
+    depth_++;
+    sem_post(&sem_);
+    return true;
+  }
+
+  // single consumer: take the next entry, if it's been filled in
+  bool Pop(FlushEntry *e) {
+    uint32_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    Slot *slot = &slots_[pos & mask_];
+    if (slot->seq.load(std::memory_order_acquire) != pos + 1) {
+      return false;
+    }
+    *e = slot->e;
+    slot->seq.store(pos + mask_ + 1, std::memory_order_release);
+    dequeue_pos_.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
   static void* thread_entry(void* arg) {
     FlushThread *self = reinterpret_cast<FlushThread*>(arg);
 
     fprintf(stderr, "FlushThread: started\n");
 
+    int count = 0;
     for (;;) {
       sem_wait(&self->sem_);
-      pthread_mutex_lock(&self->mutex_);
-      if (!self->flush_queue_.empty()) {
-        FlushEntry e = self->flush_queue_.front();
-        self->flush_queue_.pop_front();
-        pthread_mutex_unlock(&self->mutex_);
-        e.flush();
-      } else {
-        pthread_mutex_unlock(&self->mutex_);
+      FlushEntry e;
+      if (!self->Pop(&e)) {
+        // either the stop request, once everything's written, or a producer
+        // has claimed the next slot but not filled it yet; put the wakeup
+        // back and let it finish
+        if (self->stop_ && self->depth_ <= 0) {
+          break;
+        }
+        sem_post(&self->sem_);
+        sched_yield();
+        continue;
+      }
+      if (self->space_waiters_ > 0) {
+        sem_post(&self->space_);
+      }
+      ssize_t len = e.len_ > 0 ? e.len_ : 0;
+      e.flush();
+      int depth = --self->depth_;
+      self->bytes_in_flight_ -= len;
+      if (++count >= 15) {
+        if (depth > 2) {
+          fprintf(stderr, "[FlushThread %d entries %lldk]\r", depth,
+                  (long long) self->bytes_in_flight_ >> 10);
+          fflush(stderr);
+        }
+        count = 0;
       }
     }
+    return NULL;
   }
 
-  std::deque<FlushEntry> flush_queue_;
-  pthread_mutex_t mutex_;
+  Slot *slots_;
+  uint32_t mask_;
+  FlushOverflowPolicy policy_;
+  bool running_;
+  volatile bool stop_;
+  std::atomic<uint32_t> enqueue_pos_, dequeue_pos_;
+  std::atomic<int> depth_;
+  std::atomic<int64_t> bytes_in_flight_;
+  std::atomic<int> dropped_;
+  std::atomic<int> space_waiters_;
   pthread_t thread_;
-  sem_t sem_;
+  sem_t sem_;    // posted once per entry queued, and to stop
+  sem_t space_;  // posted as entries are written, while producers wait
 };
 
 #endif  // DRIVE_FLUSHTHREAD_H_
@@ -0,0 +1,347 @@
+#include "io/framecodec.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace {
+
+// each pixel less the one to its left; rows of a plane in, rows out
+void DeltaRows(const uint8_t *in, uint8_t *out, int width, int height) {
+  for (int y = 0; y < height; y++) {
+    out[0] = in[0];
+    for (int x = 1; x < width; x++) {
+      out[x] = in[x] - in[x - 1];
+    }
+    in += width;
+    out += width;
+  }
+}
+
+void UndeltaRows(uint8_t *p, int width, int height) {
+  for (int y = 0; y < height; y++) {
+    for (int x = 1; x < width; x++) {
+      p[x] += p[x - 1];
+    }
+    p += width;
+  }
+}
+
+// the region of one plane, with the given row stride in the frame
+void CopyRegion(const uint8_t *plane, int stride, int x0, int y0,
+                int width, int height, uint8_t *out) {
+  plane += y0 * stride + x0;
+  for (int y = 0; y < height; y++) {
+    memcpy(out, plane, width);
+    plane += stride;
+    out += width;
+  }
+}
+
+}  // namespace
+
+bool FrameFormat::Parse(const char *roi, const char *planestr, int lvl,
+                        int framewidth, int frameheight) {
+  int x = 0, y = 0, w = framewidth, h = frameheight;
+  if (roi[0] != '\0' && sscanf(roi, "%d %d %d %d", &x, &y, &w, &h) != 4) {
+    fprintf(stderr, "FrameFormat: roi should be \"x y width height\", "
+            "not \"%s\"\n", roi);
+    return false;
+  }
+  if (x < 0 || y < 0 || w <= 0 || h <= 0 ||
+      x + w > framewidth || y + h > frameheight ||
+      ((x | y | w | h) & 1)) {
+    fprintf(stderr, "FrameFormat: roi %d %d %d %d isn't an even-aligned "
+            "part of the %dx%d frame\n", x, y, w, h, framewidth, frameheight);
+    return false;
+  }
+  if (!strcmp(planestr, "yuv")) {
+    planes = 3;
+  } else if (!strcmp(planestr, "y")) {
+    planes = 1;
+  } else {
+    fprintf(stderr, "FrameFormat: planes should be yuv or y, not \"%s\"\n",
+            planestr);
+    return false;
+  }
+  if (lvl < 0 || lvl > 9) {
+    fprintf(stderr, "FrameFormat: compression level %d not in 0..9\n", lvl);
+    return false;
+  }
+  x0 = x;
+  y0 = y;
+  width = w;
+  height = h;
+  level = lvl;
+  return true;
+}
+
+void FrameFormat::Extract(const uint8_t *yuv, int framewidth,
+                          int frameheight, uint8_t *out) const {
+  CopyRegion(yuv, framewidth, x0, y0, width, height, out);
+  if (planes == 3) {
+    int cw = framewidth / 2, ch = frameheight / 2;
+    const uint8_t *u = yuv + framewidth * frameheight;
+    const uint8_t *v = u + cw * ch;
+    out += width * height;
+    CopyRegion(u, cw, x0 / 2, y0 / 2, width / 2, height / 2, out);
+    out += (width / 2) * (height / 2);
+    CopyRegion(v, cw, x0 / 2, y0 / 2, width / 2, height / 2, out);
+  }
+}
+
+void FrameFormat::WriteChunkHeader(uint8_t *dst, FrameCodec codec,
+                                   uint32_t datalen) const {
+  uint32_t cklen = kChunkHeaderSize + datalen;
+  uint32_t rawlen = RawSize();
+  uint8_t c = codec;
+  memcpy(dst, "YUVz", 4);
+  memcpy(dst + 4, &cklen, 4);
+  memcpy(dst + 8, &width, 2);
+  memcpy(dst + 10, &height, 2);
+  memcpy(dst + 12, &x0, 2);
+  memcpy(dst + 14, &y0, 2);
+  dst[16] = planes;
+  dst[17] = c;
+  memcpy(dst + 18, &rawlen, 4);
+}
+
+bool FrameFormat::Decode(const uint8_t *chunk, size_t chunklen,
+                         uint8_t *out, size_t outlen) {
+  uint32_t cklen, rawlen;
+  if (chunklen < kChunkHeaderSize || memcmp(chunk, "YUVz", 4)) {
+    return false;
+  }
+  memcpy(&cklen, chunk + 4, 4);
+  if (cklen < kChunkHeaderSize || cklen > chunklen) {
+    return false;
+  }
+  memcpy(&width, chunk + 8, 2);
+  memcpy(&height, chunk + 10, 2);
+  memcpy(&x0, chunk + 12, 2);
+  memcpy(&y0, chunk + 14, 2);
+  planes = chunk[16];
+  uint8_t codec = chunk[17];
+  memcpy(&rawlen, chunk + 18, 4);
+  if ((planes != 1 && planes != 3) || rawlen != RawSize() ||
+      rawlen > outlen) {
+    return false;
+  }
+  const uint8_t *data = chunk + kChunkHeaderSize;
+  uLong datalen = cklen - kChunkHeaderSize;
+  if (codec == FRAME_RAW) {
+    if (datalen != rawlen) {
+      return false;
+    }
+    memcpy(out, data, rawlen);
+    return true;
+  }
+  if (codec != FRAME_DELTA_ZLIB) {
+    return false;
+  }
+  uLongf n = rawlen;
+  if (uncompress(out, &n, data, datalen) != Z_OK || n != rawlen) {
+    return false;
+  }
+  UndeltaRows(out, width, height);
+  if (planes == 3) {
+    // U and V together are height rows of width/2
+    UndeltaRows(out + width * height, width / 2, height);
+  }
+  return true;
+}
+
+FrameCompressor::FrameCompressor() {
+  flush_ = NULL;
+  memset(&zs_, 0, sizeof(zs_));
+  delta_ = deflated_ = NULL;
+  capacity_ = deflated_size_ = 0;
+  queue_ = NULL;
+  queuelen_ = head_ = count_ = 0;
+  busy_ = running_ = stop_ = false;
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&added_, NULL);
+  pthread_cond_init(&done_, NULL);
+}
+
+FrameCompressor::~FrameCompressor() {
+  Stop();
+  if (delta_ != NULL) {
+    deflateEnd(&zs_);
+  }
+  delete[] delta_;
+  delete[] deflated_;
+  delete[] queue_;
+  pthread_mutex_destroy(&mutex_);
+  pthread_cond_destroy(&added_);
+  pthread_cond_destroy(&done_);
+}
+
+bool FrameCompressor::Init(const FrameFormat &format, size_t capacity,
+                           int queuelen, int cpu, FlushThread *flush) {
+  format_ = format;
+  flush_ = flush;
+  // level 1 is run-length and Huffman coding only, which is about as small
+  // as a full LZ77 search on delta-coded rows at a fraction of the time;
+  // above that it's zlib's own levels with its strategy for filtered images
+  int strategy = format.level == 1 ? Z_RLE : Z_FILTERED;
+  if (deflateInit2(&zs_, format.level, Z_DEFLATED, 15, 8, strategy)
+      != Z_OK) {
+    fprintf(stderr, "FrameCompressor: deflateInit2 failed\n");
+    return false;
+  }
+  capacity_ = capacity;
+  deflated_size_ = deflateBound(&zs_, capacity);
+  delta_ = new uint8_t[capacity];
+  deflated_ = new uint8_t[deflated_size_];
+  // room for a source ahead of each frame, and a recording's last source
+  // and close
+  queuelen_ = 2 * queuelen + 2;
+  queue_ = new Entry[queuelen_];
+
+  if (pthread_create(&thread_, NULL, thread_entry, this) != 0) {
+    perror("FrameCompressor: pthread_create");
+    return false;
+  }
+  running_ = true;
+  if (cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (pthread_setaffinity_np(thread_, sizeof(cpus), &cpus) != 0) {
+      fprintf(stderr, "FrameCompressor: can't pin to cpu %d\n", cpu);
+    }
+  }
+  return true;
+}
+
+void FrameCompressor::AddRecord(StorageWriter *out, RecordBuffer *rec) {
+  Entry e = {out, rec, NULL, 0};
+  Enqueue(e);
+}
+
+void FrameCompressor::AddSource(StorageWriter *out, FlushSource *src) {
+  Entry e = {out, NULL, src, src->Mark()};
+  Enqueue(e);
+}
+
+void FrameCompressor::AddClose(StorageWriter *out) {
+  Entry e = {out, NULL, NULL, 0};
+  Enqueue(e);
+}
+
+// hand an entry on to the FlushThread
+void FrameCompressor::Pass(const Entry &e) {
+  if (e.rec != NULL) {
+    flush_->AddRecord(e.out, e.rec);
+  } else if (e.src != NULL) {
+    flush_->AddSource(e.out, e.src, e.mark);
+  } else {
+    flush_->AddEntry(e.out, NULL, -1);
+  }
+}
+
+void FrameCompressor::Enqueue(const Entry &e) {
+  pthread_mutex_lock(&mutex_);
+  if (!running_) {
+    pthread_mutex_unlock(&mutex_);
+    if (e.rec != NULL) {
+      Compress(e.rec);
+    }
+    Pass(e);
+    return;
+  }
+  // only if it was handed more buffers than it was told about
+  while (count_ == queuelen_) {
+    pthread_cond_wait(&done_, &mutex_);
+  }
+  queue_[(head_ + count_) % queuelen_] = e;
+  count_++;
+  pthread_cond_signal(&added_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+void FrameCompressor::Drain() {
+  pthread_mutex_lock(&mutex_);
+  while (count_ > 0 || busy_) {
+    pthread_cond_wait(&done_, &mutex_);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+void FrameCompressor::Stop() {
+  if (!running_) {
+    return;
+  }
+  Drain();
+  pthread_mutex_lock(&mutex_);
+  stop_ = true;
+  pthread_cond_signal(&added_);
+  pthread_mutex_unlock(&mutex_);
+  pthread_join(thread_, NULL);
+  running_ = false;
+}
+
+void FrameCompressor::Compress(RecordBuffer *rec) {
+  const FrameFormat &f = format_;
+  size_t rawlen = rec->data_len;
+  DeltaRows(rec->data, delta_, f.width, f.height);
+  if (f.planes == 3) {
+    size_t ysize = f.width * f.height;
+    DeltaRows(rec->data + ysize, delta_ + ysize, f.width / 2, f.height);
+  }
+
+  // the zlib stream is built in scratch space and copied back over the raw
+  // pixels, unless it comes out no smaller (pure noise, say)
+  FrameCodec codec = FRAME_RAW;
+  deflateReset(&zs_);
+  zs_.next_in = delta_;
+  zs_.avail_in = rawlen;
+  zs_.next_out = deflated_;
+  zs_.avail_out = deflated_size_;
+  if (deflate(&zs_, Z_FINISH) == Z_STREAM_END && zs_.total_out < rawlen) {
+    memcpy(rec->data, deflated_, zs_.total_out);
+    rec->data_len = zs_.total_out;
+    codec = FRAME_DELTA_ZLIB;
+  }
+
+  f.WriteChunkHeader(
+      rec->header + rec->header_len - FrameFormat::kChunkHeaderSize,
+      codec, rec->data_len);
+  uint32_t cyclen = rec->header_len + rec->data_len;
+  memcpy(rec->header + 4, &cyclen, 4);
+}
+
+void* FrameCompressor::thread_entry(void* arg) {
+  FrameCompressor *self = reinterpret_cast<FrameCompressor*>(arg);
+
+  fprintf(stderr, "FrameCompressor: started, level %d\n",
+          self->format_.level);
+
+  pthread_mutex_lock(&self->mutex_);
+  for (;;) {
+    while (self->count_ == 0 && !self->stop_) {
+      pthread_cond_wait(&self->added_, &self->mutex_);
+    }
+    if (self->count_ == 0) {
+      break;
+    }
+    Entry e = self->queue_[self->head_];
+    self->head_ = (self->head_ + 1) % self->queuelen_;
+    self->count_--;
+    self->busy_ = true;
+    pthread_mutex_unlock(&self->mutex_);
+
+    if (e.rec != NULL) {
+      self->Compress(e.rec);
+    }
+    self->Pass(e);
+
+    pthread_mutex_lock(&self->mutex_);
+    self->busy_ = false;
+    pthread_cond_broadcast(&self->done_);
+  }
+  pthread_mutex_unlock(&self->mutex_);
+  return NULL;
+}
@@ -0,0 +1,152 @@
+#ifndef IO_FRAMECODEC_H_
+#define IO_FRAMECODEC_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "io/flushthread.h"
+#include "io/recordpool.h"
+#include "io/storage.h"
+
+// What's recorded of each camera frame: a region of it, luma only or with
+// chroma, and how hard to compress it.
+//
+// Frames not recorded as the legacy full Y420 chunk go in a "YUVz" chunk:
+//   char[4] "YUVz", uint32 chunk length (including this header)
+//   uint16 width, height    size of the stored region (luma pixels)
+//   uint16 x0, y0           its top left in the camera frame
+//   uint8 planes            1: Y only, 3: Y then U and V at half resolution
+//   uint8 codec             FRAME_RAW or FRAME_DELTA_ZLIB
+//   uint32 rawlen           bytes of pixels once decoded
+//   ... pixels
+// FRAME_DELTA_ZLIB stores every row of every plane as differences from the
+// pixel to its left (the first as itself), mod 256, deflated as one zlib
+// stream.
+enum FrameCodec {
+  FRAME_RAW = 0,
+  FRAME_DELTA_ZLIB = 1,
+};
+
+struct FrameFormat {
+  static const size_t kChunkHeaderSize = 8 + 14;
+
+  uint16_t x0, y0, width, height;
+  uint8_t planes;
+  // 0 records the pixels uncompressed, 1 is the fast run-length-only
+  // deflate and 2-9 zlib's usual levels
+  int level;
+
+  FrameFormat() {
+    x0 = y0 = 0;
+    width = 640;
+    height = 480;
+    planes = 3;
+    level = 0;
+  }
+
+  // set up from the [datalog] settings: roi "x y w h" (empty for the whole
+  // frame), planes "yuv" or "y", and compression level; returns false
+  // (having said why) if they don't describe an even-aligned region of a
+  // framewidth x frameheight frame
+  bool Parse(const char *roi, const char *planes, int level,
+             int framewidth, int frameheight);
+
+  // the whole frame, uncompressed: record it as a plain Y420 chunk
+  bool IsLegacy(int framewidth, int frameheight) const {
+    return level == 0 && planes == 3 && x0 == 0 && y0 == 0 &&
+        width == framewidth && height == frameheight;
+  }
+
+  size_t RawSize() const {
+    size_t n = width * height;
+    if (planes == 3) {
+      n += 2 * (width / 2) * (height / 2);
+    }
+    return n;
+  }
+
+  // copy our region of a yuv420 frame into out, which has room for
+  // RawSize() bytes
+  void Extract(const uint8_t *yuv, int framewidth, int frameheight,
+               uint8_t *out) const;
+
+  // fill in a YUVz chunk header at dst for datalen bytes of pixel data
+  void WriteChunkHeader(uint8_t *dst, FrameCodec codec,
+                        uint32_t datalen) const;
+
+  // decode the YUVz chunk at chunk (header included) into out, which has
+  // room for outlen bytes, and set *this to its format (level is left
+  // alone); false if it's corrupt or doesn't fit
+  bool Decode(const uint8_t *chunk, size_t chunklen, uint8_t *out,
+              size_t outlen);
+};
+
+// Background thread compressing recorded frames on their way to the
+// FlushThread, so deflate's time comes out of a spare core instead of the
+// camera thread. It works on pooled RecordBuffers whose header area ends
+// with a YUVz chunk header (written for FRAME_RAW) and starts with the
+// enclosing CYCF chunk; both lengths get patched once the frame's size is
+// known. Frames come out in the order they go in.
+//
+// There's no queue limit of its own: every entry is a RecordBuffer from a
+// fixed pool, so if compression falls behind the pool runs dry and the
+// camera thread drops frames.
+class FrameCompressor {
+ public:
+  FrameCompressor();
+  ~FrameCompressor();
+
+  // start the thread, pinned to cpu unless it's -1, compressing frames of
+  // up to capacity bytes into flush
+  bool Init(const FrameFormat &format, size_t capacity, int queuelen,
+            int cpu, FlushThread *flush);
+
+  // compress rec and queue it for out
+  void AddRecord(StorageWriter *out, RecordBuffer *rec);
+
+  // queue src for out behind the frames already added, as of now (see
+  // FlushThread::AddSource), so its chunk lands in the file where it would
+  // have without compression
+  void AddSource(StorageWriter *out, FlushSource *src);
+
+  // close out behind everything added for it so far, without waiting
+  void AddClose(StorageWriter *out);
+
+  // wait until everything added so far has been handed to the FlushThread
+  void Drain();
+
+  // drain, then stop the thread
+  void Stop();
+
+ private:
+  // a frame to compress, or a FlushSource and its mark to pass along, or
+  // with neither, out's close
+  struct Entry {
+    StorageWriter *out;
+    RecordBuffer *rec;
+    FlushSource *src;
+    uint32_t mark;
+  };
+
+  void Enqueue(const Entry &e);
+  void Pass(const Entry &e);
+  void Compress(RecordBuffer *rec);
+
+  static void* thread_entry(void* arg);
+
+  FrameFormat format_;
+  FlushThread *flush_;
+  z_stream zs_;
+  uint8_t *delta_, *deflated_;
+  size_t capacity_, deflated_size_;
+
+  Entry *queue_;
+  int queuelen_, head_, count_;
+  bool busy_, running_, stop_;
+  pthread_t thread_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t added_, done_;
+};
+
+#endif  // IO_FRAMECODEC_H_
@@ -0,0 +1,181 @@
+// record synthetic camera frames through FrameCompressor and FlushThread
+// in a few formats, each behind a TelemetryRing chunk as the Driver does,
+// read the file back and check every frame decodes to the region that went
+// in, after exactly the ticks up to its own; prints the compression ratio
+// and speed
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "io/flushthread.h"
+#include "io/framecodec.h"
+#include "io/recordpool.h"
+#include "io/storage.h"
+#include "io/telemetryring.h"
+#include "timing/clock.h"
+
+static const int kWidth = 640, kHeight = 480;
+static const size_t kFrameLen = kWidth * kHeight * 3 / 2;
+static const int kFrames = 60;
+
+// a shaded floor with a few hard edges and a little sensor noise, moving a
+// bit each frame
+static void MakeFrame(int n, uint8_t *yuv) {
+  uint32_t seed = n * 2654435761u + 1;
+  for (int y = 0; y < kHeight; y++) {
+    for (int x = 0; x < kWidth; x++) {
+      seed = seed * 1103515245 + 12345;
+      int v = 40 + (x + n) / 8 + y / 4 + ((seed >> 16) & 3);
+      if (((x + 3 * n) / 80 + y / 60) % 5 == 0) {
+        v += 90;
+      }
+      yuv[y * kWidth + x] = v;
+    }
+  }
+  uint8_t *uv = yuv + kWidth * kHeight;
+  for (int i = 0; i < kWidth * kHeight / 2; i++) {
+    uv[i] = 128 + ((i / 320 + n) % 16);
+  }
+}
+
+static bool RunFormat(const char *roi, const char *planes, int level) {
+  FrameFormat fmt;
+  if (!fmt.Parse(roi, planes, level, kWidth, kHeight)) {
+    return false;
+  }
+  const char *path = "framecodec_test.tmp";
+  StorageWriter *out = StorageWriter::Open(path, false);
+  if (out == NULL) {
+    return false;
+  }
+
+  static uint8_t frames[kFrames][kFrameLen];
+  for (int n = 0; n < kFrames; n++) {
+    MakeFrame(n, frames[n]);
+  }
+
+  // same shape as Driver::QueueRecordingData: the ticks so far, then the
+  // CYCF header and frame chunk; tick 2n comes just before frame n and
+  // 2n+1 just after it's queued, so it has to wait for frame n+1
+  FlushThread flush;
+  RecordBufferPool pool;
+  FrameCompressor compressor;
+  TelemetryRing<int64_t> ticks("TTCK");
+  ticks.Init(256);
+  if (!flush.Init(16) || !pool.Init(4, kFrameLen) ||
+      !compressor.Init(fmt, kFrameLen, 4, -1, &flush)) {
+    return false;
+  }
+  int64_t t0 = MonotonicMicros();
+  for (int n = 0; n < kFrames; n++) {
+    RecordBuffer *rec;
+    while ((rec = pool.Get()) == NULL) {
+      usleep(1000);
+    }
+    uint32_t hdrlen = 8 + FrameFormat::kChunkHeaderSize;
+    uint32_t cyclen = hdrlen + fmt.RawSize();
+    memcpy(rec->header, "CYCF", 4);
+    memcpy(rec->header + 4, &cyclen, 4);
+    fmt.WriteChunkHeader(rec->header + 8, FRAME_RAW, fmt.RawSize());
+    rec->header_len = hdrlen;
+    fmt.Extract(frames[n], kWidth, kHeight, rec->data);
+    rec->data_len = fmt.RawSize();
+    ticks.Push(2 * n);
+    compressor.AddSource(out, &ticks);
+    compressor.AddRecord(out, rec);
+    ticks.Push(2 * n + 1);
+  }
+  // as Driver::StopRecording does, the close goes behind the frames still
+  // being compressed
+  compressor.AddClose(out);
+  compressor.Stop();
+  flush.Stop();
+  int64_t dt = MonotonicMicros() - t0;
+
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    perror(path);
+    return false;
+  }
+  static uint8_t chunk[8 + kFrameLen * 2], want[kFrameLen], got[kFrameLen];
+  bool ok = true;
+  long total = 0;
+  int64_t tick = -1;
+  for (int n = 0; n < kFrames && ok; n++) {
+    uint32_t cyclen;
+    bool eof;
+    while (!(eof = fread(chunk, 1, 8, fp) != 8) &&
+           !memcmp(chunk, "TTCK", 4)) {
+      uint32_t len;
+      memcpy(&len, chunk + 4, 4);
+      if (len < 16 || (len - 16) % 8 || len > sizeof(chunk) ||
+          fread(chunk + 8, 1, len - 8, fp) != len - 8) {
+        fprintf(stderr, "frame %d: bad TTCK chunk\n", n);
+        ok = false;
+        break;
+      }
+      for (uint32_t i = 16; i < len && ok; i += 8) {
+        int64_t t;
+        memcpy(&t, chunk + i, 8);
+        if (t != tick + 1 || t > 2 * n) {
+          fprintf(stderr, "frame %d: tick %lld out of order\n", n,
+                  (long long) t);
+          ok = false;
+        }
+        tick = t;
+      }
+    }
+    if (!ok) {
+      break;
+    }
+    if (eof || memcmp(chunk, "CYCF", 4) || tick != 2 * n) {
+      fprintf(stderr, "frame %d: no CYCF chunk after tick %d\n", n, 2 * n);
+      ok = false;
+      break;
+    }
+    memcpy(&cyclen, chunk + 4, 4);
+    if (cyclen < 8 || cyclen > sizeof(chunk) ||
+        fread(chunk, 1, cyclen - 8, fp) != cyclen - 8) {
+      fprintf(stderr, "frame %d: bad CYCF length %u\n", n, cyclen);
+      ok = false;
+      break;
+    }
+    total += cyclen;
+    FrameFormat dec;
+    fmt.Extract(frames[n], kWidth, kHeight, want);
+    if (!dec.Decode(chunk, cyclen - 8, got, sizeof(got)) ||
+        dec.width != fmt.width || dec.height != fmt.height ||
+        dec.x0 != fmt.x0 || dec.y0 != fmt.y0 || dec.planes != fmt.planes ||
+        memcmp(got, want, fmt.RawSize())) {
+      fprintf(stderr, "frame %d: doesn't decode to what went in\n", n);
+      ok = false;
+    }
+  }
+  if (ok && fgetc(fp) != EOF) {
+    fprintf(stderr, "trailing garbage\n");
+    ok = false;
+  }
+  fclose(fp);
+  unlink(path);
+
+  printf("roi \"%s\" planes %s level %d: %ld bytes/frame (%.1f%% of Y420), "
+         "%.1f frames/s\n", roi, planes, level, total / kFrames,
+         100.0 * total / kFrames / kFrameLen, kFrames * 1e6 / dt);
+  return ok;
+}
+
+int main() {
+  if (!RunFormat("", "yuv", 1) ||
+      !RunFormat("", "yuv", 6) ||
+      !RunFormat("", "y", 1) ||
+      !RunFormat("0 240 640 240", "y", 1) ||
+      !RunFormat("64 32 320 200", "yuv", 0)) {
+    printf("FAIL\n");
+    return 1;
+  }
+  printf("OK\n");
+  return 0;
+}
@@ -0,0 +1,408 @@
+#include "io/recordfile.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+
+#include "io/framecodec.h"
+
+bool RecordFrame::Parse(const uint8_t *buf, size_t size, int64_t off) {
+  uint32_t cklen;
+  if (size < 16 || memcmp(buf, "CYCF", 4)) {
+    return false;
+  }
+  memcpy(&cklen, buf + 4, 4);
+  if (cklen < 16 || cklen > size) {
+    return false;
+  }
+  data = buf;
+  len = cklen;
+  offset = off;
+  memcpy(&tv_sec, data + 8, 4);
+  memcpy(&tv_usec, data + 12, 4);
+  nchunks_ = 0;
+  size_t ptr = 16;
+  while (ptr + 8 <= cklen && nchunks_ < kMaxChunks) {
+    uint32_t n;
+    memcpy(&n, data + ptr + 4, 4);
+    if (n < 8 || n > cklen - ptr) {
+      break;  // torn; keep what's whole
+    }
+    RecordChunk *c = &chunks_[nchunks_++];
+    memcpy(c->tag, data + ptr, 4);
+    c->data = data + ptr + 8;
+    c->len = n - 8;
+    ptr += n;
+  }
+  return true;
+}
+
+const RecordChunk *RecordFrame::Find(const char *tag) const {
+  for (int i = 0; i < nchunks_; i++) {
+    if (chunks_[i].Is(tag)) {
+      return &chunks_[i];
+    }
+  }
+  return NULL;
+}
+
+const RecCarState *RecordFrame::CarState() const {
+  const RecordChunk *c = Find("CSt1");
+  if (c == NULL || c->len < sizeof(RecCarState)) {
+    return NULL;
+  }
+  return reinterpret_cast<const RecCarState*>(c->data);
+}
+
+const RecTimes *RecordFrame::Times() const {
+  const RecordChunk *c = Find("TMon");
+  if (c == NULL || c->len < sizeof(RecTimes)) {
+    return NULL;
+  }
+  return reinterpret_cast<const RecTimes*>(c->data);
+}
+
+const RecParticleSummary *RecordFrame::ParticleSummary() const {
+  const RecordChunk *c = Find("MCLs");
+  if (c == NULL || c->len < sizeof(RecParticleSummary)) {
+    return NULL;
+  }
+  return reinterpret_cast<const RecParticleSummary*>(c->data);
+}
+
+RecArray<float> RecordFrame::Controller() const {
+  const RecordChunk *c = Find("CTL2");
+  return c ? RecArray<float>(c->data, c->len) : RecArray<float>();
+}
+
+RecArray<RecParticle> RecordFrame::Particles() const {
+  const RecordChunk *c = Find("MCL4");
+  return c ? RecArray<RecParticle>(c->data, c->len) : RecArray<RecParticle>();
+}
+
+RecArray<int32_t> RecordFrame::Activations() const {
+  const RecordChunk *c = Find("aCDF");
+  return c ? RecArray<int32_t>(c->data, c->len) : RecArray<int32_t>();
+}
+
+bool RecordFrame::Y420(const uint8_t **yuv, size_t *len, int *width) const {
+  const RecordChunk *c = Find("Y420");
+  if (c == NULL || c->len < 2) {
+    return false;
+  }
+  uint16_t w;
+  memcpy(&w, c->data, 2);
+  *width = w;
+  *yuv = c->data + 2;
+  *len = c->len - 2;
+  return true;
+}
+
+bool RecordFrame::DecodeImage(uint8_t *out, int framewidth,
+                              int frameheight) const {
+  size_t ysize = framewidth * frameheight;
+  size_t csize = (framewidth / 2) * (frameheight / 2);
+  const uint8_t *yuv;
+  size_t len;
+  int width;
+  if (Y420(&yuv, &len, &width)) {
+    if (width != framewidth || len < ysize + 2 * csize) {
+      return false;
+    }
+    memcpy(out, yuv, ysize + 2 * csize);
+    return true;
+  }
+
+  const RecordChunk *c = Find("YUVz");
+  if (c == NULL) {
+    return false;
+  }
+  const uint8_t *chunk = c->data - 8;
+  size_t chunklen = c->len + 8;
+  FrameFormat fmt;
+  if (c->len < FrameFormat::kChunkHeaderSize - 8) {
+    return false;
+  }
+  // the whole frame decodes in place; anything less goes via a buffer
+  uint16_t dims[4];  // width, height, x0, y0
+  memcpy(dims, c->data, sizeof(dims));
+  if (dims[0] == framewidth && dims[1] == frameheight && c->data[8] == 3) {
+    return fmt.Decode(chunk, chunklen, out, ysize + 2 * csize);
+  }
+  std::vector<uint8_t> region(ysize + 2 * csize);
+  if (!fmt.Decode(chunk, chunklen, &region[0], region.size()) ||
+      fmt.x0 + fmt.width > framewidth || fmt.y0 + fmt.height > frameheight) {
+    return false;
+  }
+  memset(out, 0, ysize);
+  memset(out + ysize, 128, 2 * csize);
+  const uint8_t *src = &region[0];
+  for (int y = 0; y < fmt.height; y++) {
+    memcpy(out + (fmt.y0 + y) * framewidth + fmt.x0, src, fmt.width);
+    src += fmt.width;
+  }
+  if (fmt.planes == 3) {
+    int cw = framewidth / 2;
+    for (int p = 0; p < 2; p++) {
+      uint8_t *plane = out + ysize + p * csize;
+      for (int y = 0; y < fmt.height / 2; y++) {
+        memcpy(plane + (fmt.y0 / 2 + y) * cw + fmt.x0 / 2, src,
+               fmt.width / 2);
+        src += fmt.width / 2;
+      }
+    }
+  }
+  return true;
+}
+
+RecordFile::RecordFile() {
+  map_ = NULL;
+  size_ = 0;
+  start_ = 0;
+  indexed_ = false;
+}
+
+RecordFile::~RecordFile() {
+  Close();
+}
+
+bool RecordFile::Open(const char *path) {
+  Close();
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    perror(path);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    perror(path);
+    close(fd);
+    return false;
+  }
+  size_ = st.st_size;
+  if (size_ == 0) {
+    fprintf(stderr, "%s: empty\n", path);
+    close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("RecordFile: mmap");
+    size_ = 0;
+    return false;
+  }
+  map_ = reinterpret_cast<const uint8_t*>(map);
+
+  start_ = 0;
+  if (size_ >= 8 && !memcmp(map_, "cfg1", 4)) {
+    uint32_t len;
+    memcpy(&len, map_ + 4, 4);
+    start_ = std::min<size_t>(len, size_);
+  } else if (size_ < 4 || memcmp(map_, "CYCF", 4)) {
+    fprintf(stderr, "%s: not a cycloid recording\n", path);
+    Close();
+    return false;
+  }
+
+  indexed_ = ReadFooter();
+  if (!indexed_) {
+    Scan(start_);
+  }
+  return true;
+}
+
+void RecordFile::Close() {
+  if (map_ != NULL) {
+    munmap(const_cast<uint8_t*>(map_), size_);
+  }
+  map_ = NULL;
+  size_ = 0;
+  index_.clear();
+}
+
+bool RecordFile::ReadFooter() {
+  if (size_ < 16 || memcmp(map_ + size_ - 16, "CEND", 4)) {
+    return false;
+  }
+  int64_t offset;
+  memcpy(&offset, map_ + size_ - 8, 8);
+  if (offset < 0 || offset + 20 > static_cast<int64_t>(size_) - 16 ||
+      memcmp(map_ + offset, "CIDX", 4)) {
+    return false;
+  }
+  uint32_t len, first;
+  memcpy(&len, map_ + offset + 4, 4);
+  memcpy(&first, map_ + offset + 16, 4);
+  if (first != 0 || len < 20 || (len - 20) % sizeof(Entry) ||
+      offset + len > static_cast<int64_t>(size_)) {
+    return false;
+  }
+  index_.resize((len - 20) / sizeof(Entry));
+  if (!index_.empty()) {
+    memcpy(&index_[0], map_ + offset + 20, len - 20);
+  }
+  for (size_t i = 0; i < index_.size(); i++) {
+    if (index_[i].offset < 0 || index_[i].offset >= offset ||
+        memcmp(map_ + index_[i].offset, "CYCF", 4)) {
+      index_.clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+void RecordFile::Scan(size_t offset) {
+  index_.clear();
+  while (offset + 16 <= size_) {
+    uint32_t len;
+    memcpy(&len, map_ + offset + 4, 4);
+    if (len < 8 || len > size_ - offset) {
+      break;
+    }
+    if (!memcmp(map_ + offset, "CYCF", 4)) {
+      Entry e;
+      e.offset = offset;
+      memcpy(&e.tv_sec, map_ + offset + 8, 4);
+      memcpy(&e.tv_usec, map_ + offset + 12, 4);
+      index_.push_back(e);
+    }
+    offset += len;
+  }
+}
+
+const uint8_t *RecordFile::Header(size_t *len) const {
+  if (start_ < 8) {
+    return NULL;
+  }
+  *len = start_ - 8;
+  return map_ + 8;
+}
+
+bool RecordFile::Frame(int i, RecordFrame *frame) const {
+  if (i < 0 || i >= NumFrames()) {
+    return false;
+  }
+  int64_t offset = index_[i].offset;
+  return frame->Parse(map_ + offset, size_ - offset, offset);
+}
+
+void RecordFile::ChunksBefore(int i, const char *tag,
+                              std::vector<RecordChunk> *out) const {
+  out->clear();
+  if (i < 0 || i > NumFrames()) {
+    return;
+  }
+  size_t offset = start_, end = size_;
+  if (i > 0) {
+    uint32_t len;
+    offset = index_[i - 1].offset;
+    memcpy(&len, map_ + offset + 4, 4);
+    offset += len;
+  }
+  if (i < NumFrames()) {
+    end = index_[i].offset;
+  }
+  while (offset + 8 <= end) {
+    uint32_t len;
+    memcpy(&len, map_ + offset + 4, 4);
+    if (len < 8 || len > end - offset) {
+      break;
+    }
+    if (!memcmp(map_ + offset, tag, 4)) {
+      RecordChunk ck;
+      memcpy(ck.tag, tag, 4);
+      ck.data = map_ + offset + 8;
+      ck.len = len - 8;
+      out->push_back(ck);
+    }
+    offset += len;
+  }
+}
+
+int RecordFile::FindTime(double t) const {
+  int lo = 0, hi = NumFrames();
+  // first frame after t
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    const Entry &e = index_[mid];
+    if (e.tv_sec + e.tv_usec * 1e-6 <= t) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo > 0 ? lo - 1 : 0;
+}
+
+namespace {
+
+struct DecodeJob {
+  const RecordFile *file;
+  int begin, end;
+  uint8_t *out;
+  size_t framelen;
+  int framewidth, frameheight;
+  std::atomic<int> next;
+  std::atomic<bool> ok;
+};
+
+}  // namespace
+
+void* RecordFile::decode_thread(void *arg) {
+  DecodeJob *job = reinterpret_cast<DecodeJob*>(arg);
+  // frames are taken one at a time, as they vary a lot in cost
+  for (;;) {
+    int i = job->next++;
+    if (i >= job->end) {
+      break;
+    }
+    RecordFrame frame;
+    if (!job->file->Frame(i, &frame) ||
+        !frame.DecodeImage(job->out + (i - job->begin) * job->framelen,
+                           job->framewidth, job->frameheight)) {
+      job->ok = false;
+    }
+  }
+  return NULL;
+}
+
+bool RecordFile::DecodeFrames(int begin, int end, int nthreads,
+                              uint8_t *out, size_t framelen,
+                              int framewidth, int frameheight) const {
+  if (begin < 0 || end > NumFrames() || begin > end ||
+      framelen < static_cast<size_t>(framewidth * frameheight * 3 / 2)) {
+    return false;
+  }
+  DecodeJob job;
+  job.file = this;
+  job.begin = begin;
+  job.end = end;
+  job.out = out;
+  job.framelen = framelen;
+  job.framewidth = framewidth;
+  job.frameheight = frameheight;
+  job.next = begin;
+  job.ok = true;
+
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  std::vector<pthread_t> threads(nthreads - 1);
+  int started = 0;
+  for (; started < nthreads - 1; started++) {
+    if (pthread_create(&threads[started], NULL, decode_thread, &job) != 0) {
+      break;
+    }
+  }
+  decode_thread(&job);
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  return job.ok;
+}
@@ -0,0 +1,171 @@
+#ifndef IO_RECORDFILE_H_
+#define IO_RECORDFILE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <vector>
+
+// Reads .rec recordings by memory-mapping them. Frames and the chunks in
+// them are views straight into the mapping, and the chunk layouts below are
+// packed structs, so looking at a field reads it from the file's pages with
+// no parsing or copying in between; nothing is valid after the RecordFile
+// is closed.
+//
+// The frame index comes from the footer the recorder writes at
+// StopRecording (see io/recordindex.h); files without one, torn or from
+// before it existed, are indexed by walking their chunk headers, up to the
+// first chunk that runs past the end of the file.
+
+// "CSt1": car state
+struct RecCarState {
+  int8_t throttle, steering;
+  float accel[3], gyro[3];
+  float wheel_dist, wheel_v;
+} __attribute__((packed));
+
+// "TMon": exposure and arrival, CLOCK_MONOTONIC microseconds
+struct RecTimes {
+  int64_t capture, arrival;
+} __attribute__((packed));
+
+// "MCL4": coneslam particles
+struct RecParticle {
+  float x, y, theta, heading;
+} __attribute__((packed));
+
+// "MCLs": particle cloud summary
+struct RecParticleSummary {
+  uint32_t count;
+  float mean[4];
+  float cov[9];
+} __attribute__((packed));
+
+// n elements of type T at any alignment, e.g. the floats of a CTL2 chunk
+template <typename T>
+class RecArray {
+ public:
+  RecArray() : data_(NULL), n_(0) {}
+  RecArray(const uint8_t *data, size_t len)
+      : data_(data), n_(len / sizeof(T)) {}
+
+  size_t size() const { return n_; }
+  T operator[](size_t i) const {
+    T v;
+    memcpy(&v, data_ + i * sizeof(T), sizeof(T));
+    return v;
+  }
+
+ private:
+  const uint8_t *data_;
+  size_t n_;
+};
+
+struct RecordChunk {
+  char tag[4];
+  const uint8_t *data;  // body, after the 8-byte header
+  uint32_t len;
+
+  bool Is(const char *t) const { return !memcmp(tag, t, 4); }
+};
+
+// one CYCF chunk
+class RecordFrame {
+ public:
+  static const int kMaxChunks = 16;
+
+  RecordFrame()
+      : data(NULL), len(0), offset(0), tv_sec(0), tv_usec(0), nchunks_(0) {}
+
+  // parse the chunk list of the CYCF chunk at buf, which has size bytes
+  // left in the file; false if it's not one
+  bool Parse(const uint8_t *buf, size_t size, int64_t offset);
+
+  const uint8_t *data;  // the whole CYCF chunk
+  size_t len;
+  int64_t offset;
+  uint32_t tv_sec, tv_usec;
+
+  double Timestamp() const { return tv_sec + tv_usec * 1e-6; }
+
+  int NumChunks() const { return nchunks_; }
+  const RecordChunk &Chunk(int i) const { return chunks_[i]; }
+  // the first chunk tagged tag, or NULL
+  const RecordChunk *Find(const char *tag) const;
+
+  // typed views of the usual chunks; NULL or empty if the frame hasn't
+  // got one (or it's too short)
+  const RecCarState *CarState() const;
+  const RecTimes *Times() const;
+  const RecParticleSummary *ParticleSummary() const;
+  RecArray<float> Controller() const;        // CTL2
+  RecArray<RecParticle> Particles() const;   // MCL4
+  RecArray<int32_t> Activations() const;     // aCDF
+
+  // the raw Y420 frame, without copying it; false if it isn't one
+  bool Y420(const uint8_t **yuv, size_t *len, int *width) const;
+
+  // the camera frame as a framewidth x frameheight I420 image, from a
+  // Y420 or YUVz chunk; where a YUVz chunk only has part of the frame the
+  // rest of luma is 0 and chroma 128. false if there isn't one or it's
+  // corrupt.
+  bool DecodeImage(uint8_t *out, int framewidth = 640,
+                   int frameheight = 480) const;
+
+ private:
+  RecordChunk chunks_[kMaxChunks];
+  int nchunks_;
+};
+
+class RecordFile {
+ public:
+  RecordFile();
+  ~RecordFile();
+
+  bool Open(const char *path);
+  void Close();
+
+  int NumFrames() const { return index_.size(); }
+
+  // the cfg1 header chunk's body, or NULL if there isn't one
+  const uint8_t *Header(size_t *len) const;
+
+  bool Frame(int i, RecordFrame *frame) const;
+
+  // the top-level chunks tagged tag between frame i-1 (or the header) and
+  // frame i, e.g. the TLM1 control ticks leading up to frame i; i =
+  // NumFrames() for those after the last frame
+  void ChunksBefore(int i, const char *tag,
+                    std::vector<RecordChunk> *out) const;
+
+  // the last frame stamped at or before t (seconds since the epoch), or 0
+  int FindTime(double t) const;
+
+  // decode frames [begin, end) with DecodeImage into out, framelen bytes
+  // apiece, across nthreads threads
+  bool DecodeFrames(int begin, int end, int nthreads, uint8_t *out,
+                    size_t framelen, int framewidth = 640,
+                    int frameheight = 480) const;
+
+  // whether the index came from the footer
+  bool Indexed() const { return indexed_; }
+
+ private:
+  struct Entry {
+    int64_t offset;
+    uint32_t tv_sec, tv_usec;
+  };
+
+  bool ReadFooter();
+  void Scan(size_t start);
+
+  static void* decode_thread(void *arg);
+
+  const uint8_t *map_;
+  size_t size_;
+  size_t start_;  // end of the header chunk
+  bool indexed_;
+  std::vector<Entry> index_;
+};
+
+#endif  // IO_RECORDFILE_H_
@@ -0,0 +1,76 @@
+// C interface to RecordFile, built as librecfile.so for
+// tools/replay/recfile.py to load with ctypes. Pointers returned point
+// into the mapped file and are good until rec_close.
+
+#include <stdint.h>
+
+#include "io/recordfile.h"
+
+extern "C" {
+
+void *rec_open(const char *path) {
+  RecordFile *f = new RecordFile();
+  if (!f->Open(path)) {
+    delete f;
+    return NULL;
+  }
+  return f;
+}
+
+void rec_close(void *f) {
+  delete reinterpret_cast<RecordFile*>(f);
+}
+
+int rec_num_frames(void *f) {
+  return reinterpret_cast<RecordFile*>(f)->NumFrames();
+}
+
+int rec_indexed(void *f) {
+  return reinterpret_cast<RecordFile*>(f)->Indexed();
+}
+
+int rec_find_time(void *f, double t) {
+  return reinterpret_cast<RecordFile*>(f)->FindTime(t);
+}
+
+// the cfg1 header's body; its length, or -1 if there's no header
+int64_t rec_header(void *f, const uint8_t **data) {
+  size_t len;
+  *data = reinterpret_cast<RecordFile*>(f)->Header(&len);
+  return *data ? static_cast<int64_t>(len) : -1;
+}
+
+// frame i's whole CYCF chunk and timestamp; its length, or -1
+int64_t rec_frame(void *f, int i, const uint8_t **data, double *tstamp) {
+  RecordFrame frame;
+  if (!reinterpret_cast<RecordFile*>(f)->Frame(i, &frame)) {
+    return -1;
+  }
+  *data = frame.data;
+  *tstamp = frame.Timestamp();
+  return frame.len;
+}
+
+// the body of frame i's first chunk tagged tag; its length, or -1
+int64_t rec_chunk(void *f, int i, const char *tag, const uint8_t **data) {
+  RecordFrame frame;
+  if (!reinterpret_cast<RecordFile*>(f)->Frame(i, &frame)) {
+    return -1;
+  }
+  const RecordChunk *c = frame.Find(tag);
+  if (c == NULL) {
+    return -1;
+  }
+  *data = c->data;
+  return c->len;
+}
+
+// decode frames [begin, end) into out, 640x480 I420 apiece, on nthreads
+// threads; 0 if they all decoded
+int rec_decode_frames(void *f, int begin, int end, int nthreads,
+                      uint8_t *out) {
+  return reinterpret_cast<RecordFile*>(f)->DecodeFrames(
+      begin, end, nthreads, out, 640 * 480 * 3 / 2) ? 0 : -1;
+}
+
+}  // extern "C"
@@ -0,0 +1,241 @@
+// write a recording the way Driver does, in each frame format, then read it
+// back with RecordFile: the index, typed chunk views, serial and parallel
+// decoding, the chunks between frames, and a torn copy indexed by scanning
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "io/flushthread.h"
+#include "io/framecodec.h"
+#include "io/recordfile.h"
+#include "io/recordindex.h"
+#include "io/recordpool.h"
+#include "io/storage.h"
+#include "timing/clock.h"
+
+static const int kWidth = 640, kHeight = 480;
+static const size_t kFrameLen = kWidth * kHeight * 3 / 2;
+static const int kFrames = 90;
+static const int kControllerFloats = 14 + 128 * 3;
+
+static void MakeFrame(int n, uint8_t *yuv) {
+  for (size_t i = 0; i < kFrameLen; i++) {
+    yuv[i] = (i % kWidth) / 4 + (i / kWidth) / 3 + n;
+  }
+}
+
+// what DecodeImage should give for frame n recorded in format fmt
+static void Expected(int n, const FrameFormat &fmt, uint8_t *out) {
+  std::vector<uint8_t> frame(kFrameLen);
+  MakeFrame(n, &frame[0]);
+  if (fmt.IsLegacy(kWidth, kHeight) || fmt.level > 0) {
+    // compressed frames here are all whole
+    memcpy(out, &frame[0], kFrameLen);
+    return;
+  }
+  memset(out, 0, kWidth * kHeight);
+  memset(out + kWidth * kHeight, 128, kFrameLen - kWidth * kHeight);
+  for (int y = fmt.y0; y < fmt.y0 + fmt.height; y++) {
+    memcpy(out + y * kWidth + fmt.x0, &frame[y * kWidth + fmt.x0],
+           fmt.width);
+  }
+  for (int p = 0; p < 2; p++) {
+    size_t base = kWidth * kHeight + p * (kWidth / 2) * (kHeight / 2);
+    for (int y = fmt.y0 / 2; y < (fmt.y0 + fmt.height) / 2; y++) {
+      memcpy(out + base + y * kWidth / 2 + fmt.x0 / 2,
+             &frame[base + y * kWidth / 2 + fmt.x0 / 2], fmt.width / 2);
+    }
+  }
+}
+
+static FrameFormat formats[3];
+
+static bool Write(const char *path) {
+  formats[1].Parse("", "yuv", 1, kWidth, kHeight);
+  formats[2].Parse("100 50 200 300", "yuv", 0, kWidth, kHeight);
+
+  StorageWriter *out = StorageWriter::Open(path, false);
+  if (out == NULL) {
+    return false;
+  }
+  out = new RecordIndexWriter(out);
+  // not started, so everything is written as it's added, in order
+  FlushThread flush;
+  RecordBufferPool pool;
+  FrameCompressor compressor;
+  if (!pool.Init(2, kFrameLen) ||
+      !compressor.Init(formats[1], kFrameLen, 2, -1, &flush)) {
+    return false;
+  }
+  uint8_t *cfg = new uint8_t[12];
+  memcpy(cfg, "cfg1\x0c\0\0\0abcd", 12);
+  flush.AddEntry(out, cfg, 12);
+
+  std::vector<uint8_t> frame(kFrameLen);
+  for (int n = 0; n < kFrames; n++) {
+    const FrameFormat &fmt = formats[n % 3];
+    bool legacy = fmt.IsLegacy(kWidth, kHeight);
+    MakeFrame(n, &frame[0]);
+    if (n % 2 == 0) {
+      // a chunk of our own ahead of every other frame, as TLM1 goes
+      uint8_t *ck = new uint8_t[12];
+      memcpy(ck, "TNUM\x0c\0\0\0", 8);
+      memcpy(ck + 8, &n, 4);
+      flush.AddEntry(out, ck, 12);
+    }
+    RecordBuffer *rec = pool.Get();
+    uint8_t *h = rec->header;
+    size_t framelen = legacy ? kFrameLen : fmt.RawSize();
+    uint32_t len = 16 + 24 + 42 + 8 + kControllerFloats * 4 +
+        (legacy ? 10 : FrameFormat::kChunkHeaderSize);
+    uint32_t cyclen = len + framelen;
+    uint32_t tv[2] = {1500000000u + n / 30, (n % 30) * 33333u};
+    memcpy(h, "CYCF", 4);
+    memcpy(h + 4, &cyclen, 4);
+    memcpy(h + 8, tv, 8);
+    h += 16;
+    int64_t times[2] = {n * 33333LL, n * 33333LL + 5000};
+    uint32_t cklen = 24;
+    memcpy(h, "TMon", 4);
+    memcpy(h + 4, &cklen, 4);
+    memcpy(h + 8, times, 16);
+    h += 24;
+    // CSt1 as CarState writes it: 34 bytes of fields, 42 long
+    cklen = 42;
+    memcpy(h, "CSt1", 4);
+    memcpy(h + 4, &cklen, 4);
+    h[8] = n;
+    h[9] = -n;
+    for (int i = 0; i < 8; i++) {
+      float v = n + i * 0.5f;
+      memcpy(h + 10 + 4 * i, &v, 4);
+    }
+    h += 42;
+    cklen = 8 + kControllerFloats * 4;
+    memcpy(h, "CTL2", 4);
+    memcpy(h + 4, &cklen, 4);
+    for (int i = 0; i < kControllerFloats; i++) {
+      float v = n * 1000 + i;
+      memcpy(h + 8 + 4 * i, &v, 4);
+    }
+    h += cklen;
+    if (legacy) {
+      cklen = 10 + kFrameLen;
+      uint16_t w = kWidth;
+      memcpy(h, "Y420", 4);
+      memcpy(h + 4, &cklen, 4);
+      memcpy(h + 8, &w, 2);
+      memcpy(rec->data, &frame[0], kFrameLen);
+    } else {
+      fmt.WriteChunkHeader(h, FRAME_RAW, framelen);
+      fmt.Extract(&frame[0], kWidth, kHeight, rec->data);
+    }
+    rec->header_len = len;
+    rec->data_len = framelen;
+    if (fmt.level > 0) {
+      compressor.AddRecord(out, rec);
+      compressor.Drain();
+    } else {
+      flush.AddRecord(out, rec);
+    }
+  }
+  flush.AddEntry(out, NULL, -1);
+  return true;
+}
+
+static bool Check(const RecordFile &f, int nframes) {
+  if (f.NumFrames() != nframes) {
+    fprintf(stderr, "%d frames, expected %d\n", f.NumFrames(), nframes);
+    return false;
+  }
+  size_t hlen;
+  const uint8_t *hdr = f.Header(&hlen);
+  if (hdr == NULL || hlen != 4 || memcmp(hdr, "abcd", 4)) {
+    fprintf(stderr, "header wrong\n");
+    return false;
+  }
+  std::vector<uint8_t> want(kFrameLen), got(kFrameLen);
+  for (int n = 0; n < nframes; n++) {
+    RecordFrame fr;
+    if (!f.Frame(n, &fr)) {
+      fprintf(stderr, "frame %d missing\n", n);
+      return false;
+    }
+    const RecTimes *t = fr.Times();
+    const RecCarState *cs = fr.CarState();
+    RecArray<float> ctl = fr.Controller();
+    if (fr.tv_sec != 1500000000u + n / 30 || t == NULL ||
+        t->capture != n * 33333LL || t->arrival != n * 33333LL + 5000 ||
+        cs == NULL || cs->throttle != n || cs->steering != -n ||
+        cs->accel[1] != n + 0.5f || cs->wheel_v != n + 3.5f ||
+        ctl.size() != kControllerFloats ||
+        ctl[kControllerFloats - 1] != n * 1000 + kControllerFloats - 1) {
+      fprintf(stderr, "frame %d chunks wrong\n", n);
+      return false;
+    }
+    Expected(n, formats[n % 3], &want[0]);
+    if (!fr.DecodeImage(&got[0]) || want != got) {
+      fprintf(stderr, "frame %d image wrong\n", n);
+      return false;
+    }
+    std::vector<RecordChunk> between;
+    f.ChunksBefore(n, "TNUM", &between);
+    int num = -1;
+    if (between.size() == 1 && between[0].len == 4) {
+      memcpy(&num, between[0].data, 4);
+    }
+    if (between.size() != (n % 2 == 0 ? 1u : 0u) ||
+        (n % 2 == 0 && num != n)) {
+      fprintf(stderr, "frame %d chunks before it wrong\n", n);
+      return false;
+    }
+    if (f.FindTime(fr.Timestamp() + 1e-5) != n) {
+      fprintf(stderr, "frame %d not found by time\n", n);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main() {
+  const char *path = "recordfile_test.tmp";
+  if (!Write(path)) {
+    return 1;
+  }
+  RecordFile f;
+  bool ok = f.Open(path) && f.Indexed() && Check(f, kFrames);
+  printf("indexed: %s\n", ok ? "ok" : "FAILED");
+
+  // serial and parallel decoding agree
+  std::vector<uint8_t> serial(kFrames * kFrameLen);
+  std::vector<uint8_t> parallel(kFrames * kFrameLen);
+  int64_t t0 = MonotonicMicros();
+  ok = f.DecodeFrames(0, kFrames, 1, &serial[0], kFrameLen) && ok;
+  int64_t t1 = MonotonicMicros();
+  ok = f.DecodeFrames(0, kFrames, 4, &parallel[0], kFrameLen) && ok;
+  int64_t t2 = MonotonicMicros();
+  ok = ok && serial == parallel;
+  printf("decode %d frames: %.1f ms on 1 thread, %.1f ms on 4: %s\n",
+         kFrames, (t1 - t0) * 1e-3, (t2 - t1) * 1e-3, ok ? "ok" : "FAILED");
+  f.Close();
+
+  // cut off mid-frame, losing the footer: the first 60 frames survive
+  RecordFile whole;
+  whole.Open(path);
+  RecordFrame last;
+  whole.Frame(60, &last);
+  int64_t cut = last.offset + 1000;
+  whole.Close();
+  bool torn = truncate(path, cut) == 0 && f.Open(path) && !f.Indexed() &&
+      Check(f, 60);
+  printf("torn: %s\n", torn ? "ok" : "FAILED");
+  f.Close();
+  unlink(path);
+
+  ok = ok && torn;
+  printf(ok ? "OK\n" : "FAIL\n");
+  return ok ? 0 : 1;
+}
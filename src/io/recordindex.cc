@@ -0,0 +1,90 @@
+#include "io/recordindex.h"
+
+#include <stdio.h>
+#include <string.h>
+
+RecordIndexWriter::RecordIndexWriter(StorageWriter *out) {
+  out_ = out;
+  offset_ = out->Offset();
+  indexed_ = 0;
+  last_index_ = -1;
+  closed_ = false;
+  // an hour at 30fps before it has to grow
+  entries_.reserve(30 * 3600);
+}
+
+RecordIndexWriter::~RecordIndexWriter() {
+  if (!closed_) {
+    Close();
+  }
+  delete out_;
+}
+
+bool RecordIndexWriter::Write(const struct iovec *iov, int iovcnt) {
+  // every Write is one or more whole chunks; note it if it's a frame
+  uint8_t head[16];
+  size_t n = 0;
+  for (int i = 0; i < iovcnt && n < sizeof(head); i++) {
+    size_t len = iov[i].iov_len;
+    if (len > sizeof(head) - n) {
+      len = sizeof(head) - n;
+    }
+    memcpy(head + n, iov[i].iov_base, len);
+    n += len;
+  }
+  if (n == sizeof(head) && !memcmp(head, "CYCF", 4)) {
+    Entry e;
+    e.offset = out_->Offset();
+    memcpy(&e.tv_sec, head + 8, 4);
+    memcpy(&e.tv_usec, head + 12, 4);
+    entries_.push_back(e);
+  }
+
+  bool ok = out_->Write(iov, iovcnt);
+  offset_ = out_->Offset();
+  if (ok && entries_.size() - indexed_ >= kInterval) {
+    int64_t where = offset_;
+    ok = WriteIndex(indexed_, last_index_);
+    last_index_ = where;
+    indexed_ = entries_.size();
+  }
+  return ok;
+}
+
+bool RecordIndexWriter::WriteIndex(size_t first, int64_t prev) {
+  uint32_t n = entries_.size() - first;
+  uint32_t len = 8 + 8 + 4 + n * sizeof(Entry);
+  uint32_t firstframe = first;
+  uint8_t *buf = new uint8_t[len];
+  memcpy(buf, "CIDX", 4);
+  memcpy(buf + 4, &len, 4);
+  memcpy(buf + 8, &prev, 8);
+  memcpy(buf + 16, &firstframe, 4);
+  if (n > 0) {
+    memcpy(buf + 20, &entries_[first], n * sizeof(Entry));
+  }
+  bool ok = out_->Write(buf, len);
+  offset_ = out_->Offset();
+  delete[] buf;
+  return ok;
+}
+
+bool RecordIndexWriter::Close() {
+  if (closed_) {
+    return true;
+  }
+  closed_ = true;
+  int64_t where = offset_;
+  bool ok = WriteIndex(0, -1);
+  uint8_t end[16];
+  uint32_t len = sizeof(end);
+  memcpy(end, "CEND", 4);
+  memcpy(end + 4, &len, 4);
+  memcpy(end + 8, &where, 8);
+  ok = ok && out_->Write(end, sizeof(end));
+  offset_ = out_->Offset();
+  if (!ok) {
+    fprintf(stderr, "RecordIndexWriter: couldn't write the index\n");
+  }
+  return out_->Close() && ok;
+}
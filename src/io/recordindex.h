@@ -0,0 +1,56 @@
+#ifndef IO_RECORDINDEX_H_
+#define IO_RECORDINDEX_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "io/storage.h"
+
+// Wraps the StorageWriter a recording goes to and indexes the recording as
+// the FlushThread writes it: notes where each CYCF chunk starts and its
+// timestamp, and every kInterval frames appends a CIDX chunk listing them.
+// Close() appends a CIDX chunk listing every frame, then a CEND chunk
+// pointing at it, so a reader can seek straight to any frame or time.
+//
+//   "CIDX" uint32 length, int64 prev, uint32 first, then for each frame:
+//          int64 offset, uint32 tv_sec, uint32 tv_usec
+//   "CEND" uint32 16, int64 offset of the final CIDX
+//
+// prev is the offset of the CIDX chunk written before this one (-1 for the
+// first, and for the final one), and first the number of the first frame
+// listed. A file torn before its footer can still be indexed by finding
+// the last periodic CIDX near its end, following prev back to the start,
+// and walking the few frames written after it.
+class RecordIndexWriter : public StorageWriter {
+ public:
+  static const int kInterval = 64;
+
+  // takes ownership of out
+  explicit RecordIndexWriter(StorageWriter *out);
+  ~RecordIndexWriter();
+
+  using StorageWriter::Write;
+  bool Write(const struct iovec *iov, int iovcnt);
+
+  // write the footer, then close the file
+  bool Close();
+
+  const char *Backend() const { return out_->Backend(); }
+
+ private:
+  struct Entry {
+    int64_t offset;
+    uint32_t tv_sec, tv_usec;
+  };
+
+  // append a CIDX chunk for entries_[first:]
+  bool WriteIndex(size_t first, int64_t prev);
+
+  StorageWriter *out_;
+  std::vector<Entry> entries_;
+  size_t indexed_;      // frames covered by periodic CIDX chunks so far
+  int64_t last_index_;  // offset of the last periodic CIDX chunk, or -1
+  bool closed_;
+};
+
+#endif  // IO_RECORDINDEX_H_
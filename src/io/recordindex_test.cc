@@ -0,0 +1,157 @@
+// write a recording through RecordIndexWriter, then check its footer lists
+// every frame and the chain of periodic CIDX chunks agrees with it
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "io/recordindex.h"
+#include "io/storage.h"
+
+static const int kFrames = 200;
+
+struct Frame {
+  int64_t offset;
+  uint32_t sec, usec;
+};
+
+static bool ReadFile(const char *path, std::vector<uint8_t> *data) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    perror(path);
+    return false;
+  }
+  uint8_t buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    data->insert(data->end(), buf, buf + n);
+  }
+  fclose(fp);
+  return true;
+}
+
+// check the CIDX chunk at offset lists frames[first...]; returns its prev
+static bool CheckIndex(const std::vector<uint8_t> &file, int64_t offset,
+                       const std::vector<Frame> &frames, int64_t *prev,
+                       uint32_t *first, uint32_t *count) {
+  if (offset < 0 || offset + 20 > (int64_t) file.size() ||
+      memcmp(&file[offset], "CIDX", 4)) {
+    fprintf(stderr, "no CIDX chunk at %lld\n", (long long) offset);
+    return false;
+  }
+  uint32_t len;
+  memcpy(&len, &file[offset + 4], 4);
+  memcpy(prev, &file[offset + 8], 8);
+  memcpy(first, &file[offset + 16], 4);
+  *count = (len - 20) / 16;
+  if (*first + *count > frames.size()) {
+    fprintf(stderr, "CIDX at %lld lists frames past the end\n",
+            (long long) offset);
+    return false;
+  }
+  for (uint32_t i = 0; i < *count; i++) {
+    Frame f;
+    memcpy(&f, &file[offset + 20 + 16 * i], 16);
+    const Frame &want = frames[*first + i];
+    if (f.offset != want.offset || f.sec != want.sec ||
+        f.usec != want.usec || memcmp(&file[f.offset], "CYCF", 4)) {
+      fprintf(stderr, "CIDX at %lld: frame %u wrong\n", (long long) offset,
+              *first + i);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main() {
+  const char *path = "recordindex_test.tmp";
+  StorageWriter *out = StorageWriter::Open(path, false);
+  if (out == NULL) {
+    return 1;
+  }
+  RecordIndexWriter *w = new RecordIndexWriter(out);
+
+  // a header chunk that isn't a frame, then frames of varying size
+  std::vector<Frame> frames;
+  uint8_t cfg[12] = {'c', 'f', 'g', '1', 12, 0, 0, 0};
+  w->Write(cfg, sizeof(cfg));
+  std::vector<int64_t> periodic;
+  for (int i = 0; i < kFrames; i++) {
+    uint8_t buf[16 + 300];
+    uint32_t len = 16 + (i * 37) % 300;
+    Frame f = {w->Offset(), 1500000000u + i / 30, (i % 30) * 33333u};
+    memcpy(buf, "CYCF", 4);
+    memcpy(buf + 4, &len, 4);
+    memcpy(buf + 8, &f.sec, 4);
+    memcpy(buf + 12, &f.usec, 4);
+    memset(buf + 16, i, len - 16);
+    // split the chunk header across iovecs, as it could be
+    iovec iov[2] = {{buf, 6}, {buf + 6, len - 6}};
+    frames.push_back(f);
+    int64_t before = w->Offset() + len;
+    if (!w->Write(iov, 2)) {
+      return 1;
+    }
+    if (w->Offset() != before) {
+      periodic.push_back(before);
+    }
+  }
+  if (!w->Close()) {
+    return 1;
+  }
+  delete w;
+
+  std::vector<uint8_t> file;
+  if (!ReadFile(path, &file)) {
+    return 1;
+  }
+  unlink(path);
+
+  bool ok = true;
+  size_t size = file.size();
+  int64_t footer;
+  if (size < 16 || memcmp(&file[size - 16], "CEND", 4)) {
+    fprintf(stderr, "no CEND chunk at the end\n");
+    return 1;
+  }
+  memcpy(&footer, &file[size - 8], 8);
+  int64_t prev;
+  uint32_t first, count;
+  if (!CheckIndex(file, footer, frames, &prev, &first, &count) ||
+      first != 0 || count != kFrames || prev != -1) {
+    fprintf(stderr, "footer index doesn't list all %d frames\n", kFrames);
+    ok = false;
+  }
+  printf("footer at %lld lists %u frames\n", (long long) footer, count);
+
+  // follow the periodic chunks back from the last
+  if (periodic.size() != kFrames / RecordIndexWriter::kInterval) {
+    fprintf(stderr, "%zu periodic index chunks, expected %d\n",
+            periodic.size(), kFrames / RecordIndexWriter::kInterval);
+    ok = false;
+  }
+  int64_t offset = periodic.empty() ? -1 : periodic.back();
+  uint32_t next = kFrames - kFrames % RecordIndexWriter::kInterval;
+  int chunks = 0;
+  while (ok && offset != -1) {
+    if (!CheckIndex(file, offset, frames, &prev, &first, &count) ||
+        first + count != next) {
+      fprintf(stderr, "periodic index chain broken at %lld\n",
+              (long long) offset);
+      ok = false;
+    }
+    next = first;
+    offset = prev;
+    chunks++;
+  }
+  if (ok && next != 0) {
+    fprintf(stderr, "periodic chain stops at frame %u\n", next);
+    ok = false;
+  }
+  printf("%d periodic index chunks chained back to frame 0\n", chunks);
+
+  printf(ok ? "OK\n" : "FAIL\n");
+  return ok ? 0 : 1;
+}
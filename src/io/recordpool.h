@@ -0,0 +1,102 @@
+#ifndef IO_RECORDPOOL_H_
+#define IO_RECORDPOOL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+class RecordBufferPool;
+
+// one recorded frame, written with a single writev(): a small header area
+// for the IFF chunk headers and per-frame state, followed by a page-aligned
+// area holding the camera frame
+struct RecordBuffer {
+  uint8_t *header;
+  size_t header_len;
+  uint8_t *data;
+  size_t data_len;
+  RecordBufferPool *pool;
+};
+
+// Fixed set of recording buffers, allocated once up front so the camera
+// thread never touches the heap while recording. The camera thread takes a
+// buffer, fills it and hands it to the FlushThread, which puts it back once
+// it's on disk; if the card falls behind far enough that every buffer is
+// in flight, Get() fails and the caller drops the frame.
+class RecordBufferPool {
+ public:
+  static const size_t kHeaderSize = 4096;
+
+  RecordBufferPool() {
+    buffers_ = NULL;
+    free_ = NULL;
+    count_ = nfree_ = 0;
+    capacity_ = header_size_ = 0;
+    pthread_mutex_init(&mutex_, NULL);
+  }
+
+  ~RecordBufferPool() {
+    for (int i = 0; i < count_; i++) {
+      free(buffers_[i].header);
+    }
+    delete[] buffers_;
+    delete[] free_;
+    pthread_mutex_destroy(&mutex_);
+  }
+
+  // allocate count buffers, each with room for capacity bytes of frame data
+  // and header_size bytes of header, rounded up to keep the data page aligned
+  bool Init(int count, size_t capacity, size_t header_size = kHeaderSize) {
+    buffers_ = new RecordBuffer[count];
+    free_ = new RecordBuffer*[count];
+    capacity_ = capacity;
+    header_size_ = (header_size + kHeaderSize - 1) / kHeaderSize * kHeaderSize;
+    for (count_ = 0; count_ < count; count_++) {
+      void *mem;
+      if (posix_memalign(&mem, kHeaderSize, header_size_ + capacity) != 0) {
+        fprintf(stderr, "RecordBufferPool: can't allocate %d x %zu bytes\n",
+                count, header_size_ + capacity);
+        return false;
+      }
+      RecordBuffer *b = &buffers_[count_];
+      b->header = reinterpret_cast<uint8_t*>(mem);
+      b->data = b->header + header_size_;
+      b->header_len = b->data_len = 0;
+      b->pool = this;
+      free_[count_] = b;
+    }
+    nfree_ = count_;
+    return true;
+  }
+
+  size_t Capacity() const { return capacity_; }
+  size_t HeaderSize() const { return header_size_; }
+
+  // a free buffer, or NULL if they're all waiting to be written
+  RecordBuffer *Get() {
+    RecordBuffer *b = NULL;
+    pthread_mutex_lock(&mutex_);
+    if (nfree_ > 0) {
+      b = free_[--nfree_];
+    }
+    pthread_mutex_unlock(&mutex_);
+    return b;
+  }
+
+  void Put(RecordBuffer *b) {
+    pthread_mutex_lock(&mutex_);
+    free_[nfree_++] = b;
+    pthread_mutex_unlock(&mutex_);
+  }
+
+ private:
+  RecordBuffer *buffers_;
+  RecordBuffer **free_;  // stack of nfree_ buffers not in flight
+  int count_, nfree_;
+  size_t capacity_, header_size_;
+  pthread_mutex_t mutex_;
+};
+
+#endif  // IO_RECORDPOOL_H_
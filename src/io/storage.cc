@@ -0,0 +1,502 @@
+#include "io/storage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+// buffered writes: start writeback of each MB as it's written and wait on
+// the MB before it
+const int64_t kWritebackChunk = 1 << 20;
+
+class BufferedWriter : public StorageWriter {
+ public:
+  explicit BufferedWriter(int fd) {
+    fd_ = fd;
+    started_ = waited_ = 0;
+    can_sync_ = true;
+  }
+
+  ~BufferedWriter() {
+    if (fd_ != -1) {
+      Close();
+    }
+  }
+
+  bool Write(const struct iovec *iov, int iovcnt) {
+    // writev can stop short; carry on from wherever it did
+    struct iovec v[8];
+    if (iovcnt > 8) {
+      fprintf(stderr, "StorageWriter: too many iovecs (%d)\n", iovcnt);
+      return false;
+    }
+    memcpy(v, iov, iovcnt * sizeof(*iov));
+    struct iovec *p = v;
+    while (iovcnt > 0) {
+      ssize_t n = writev(fd_, p, iovcnt);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        perror("StorageWriter: writev");
+        return false;
+      }
+      offset_ += n;
+      while (iovcnt > 0 && static_cast<size_t>(n) >= p->iov_len) {
+        n -= p->iov_len;
+        p++;
+        iovcnt--;
+      }
+      if (iovcnt > 0) {
+        p->iov_base = reinterpret_cast<uint8_t*>(p->iov_base) + n;
+        p->iov_len -= n;
+      }
+    }
+
+    if (can_sync_ && offset_ - started_ >= kWritebackChunk) {
+      if (sync_file_range(fd_, started_, offset_ - started_,
+                          SYNC_FILE_RANGE_WRITE) != 0) {
+        // a pipe, or a filesystem without it; just write
+        can_sync_ = false;
+      } else {
+        if (started_ > waited_) {
+          sync_file_range(fd_, waited_, started_ - waited_,
+                          SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                          SYNC_FILE_RANGE_WAIT_AFTER);
+        }
+        waited_ = started_;
+        started_ = offset_;
+      }
+    }
+    return true;
+  }
+
+  bool Close() {
+    bool ok = true;
+    if (can_sync_ && fdatasync(fd_) != 0 && errno != EINVAL) {
+      perror("StorageWriter: fdatasync");
+      ok = false;
+    }
+    if (close(fd_) != 0) {
+      perror("StorageWriter: close");
+      ok = false;
+    }
+    fd_ = -1;
+    return ok;
+  }
+
+  const char *Backend() const { return "write"; }
+
+ private:
+  int fd_;
+  int64_t started_;  // writeback has been started up to here
+  int64_t waited_;   // and has finished up to here
+  bool can_sync_;
+};
+
+int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 NULL, 0);
+}
+
+// O_DIRECT writes through io_uring. There's no liburing on the car, so this
+// drives the rings by hand; only this thread touches them, so the only
+// ordering that matters is with the kernel, via the acquire/release loads
+// and stores on the ring indices.
+class UringWriter : public StorageWriter {
+ public:
+  static const size_t kAlign = 4096;  // O_DIRECT offset/length alignment
+  static const size_t kSegment = 1 << 20;
+  static const int kSegments = 4;  // so up to 3 in flight while we fill one
+  static const int64_t kPrealloc = 64 << 20;
+  static const int64_t kSyncEvery = 8 << 20;
+  static const uint64_t kSyncTag = ~0ULL;
+
+  explicit UringWriter(int fd) {
+    fd_ = fd;
+    ring_fd_ = -1;
+    sq_tail_local_ = 0;
+    sq_ring_ = cq_ring_ = MAP_FAILED;
+    sqes_ = reinterpret_cast<struct io_uring_sqe*>(MAP_FAILED);
+    memset(segs_, 0, sizeof(segs_));
+    cur_ = NULL;
+    next_offset_ = 0;
+    allocated_ = 0;
+    synced_ = 0;
+    inflight_ = 0;
+    can_fallocate_ = true;
+    failed_ = false;
+  }
+
+  ~UringWriter() {
+    if (fd_ != -1) {
+      Close();
+    }
+    if (sq_ring_ != MAP_FAILED) munmap(sq_ring_, sq_ring_size_);
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+      munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sqes_ != MAP_FAILED) munmap(sqes_, sqes_size_);
+    if (ring_fd_ != -1) close(ring_fd_);
+    for (int i = 0; i < kSegments; i++) {
+      free(segs_[i].buf);
+    }
+  }
+
+  // set up the rings and buffers, and check that a direct write works
+  bool Init() {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd_ = io_uring_setup(kSegments * 2, &p);
+    if (ring_fd_ < 0) {
+      ring_fd_ = -1;
+      perror("StorageWriter: io_uring_setup");
+      return false;
+    }
+    sq_entries_ = p.sq_entries;
+    sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+#else
+    bool single_mmap = false;
+#endif
+    if (single_mmap && cq_ring_size_ > sq_ring_size_) {
+      sq_ring_size_ = cq_ring_size_;
+    }
+    sq_ring_ = mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+      perror("StorageWriter: mmap sq ring");
+      return false;
+    }
+    if (single_mmap) {
+      cq_ring_ = sq_ring_;
+    } else {
+      cq_ring_ = mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+      if (cq_ring_ == MAP_FAILED) {
+        perror("StorageWriter: mmap cq ring");
+        return false;
+      }
+    }
+    sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = reinterpret_cast<struct io_uring_sqe*>(
+        mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+    if (sqes_ == MAP_FAILED) {
+      perror("StorageWriter: mmap sqes");
+      return false;
+    }
+    uint8_t *sq = reinterpret_cast<uint8_t*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    sq_tail_local_ = *sq_tail_;
+    uint8_t *cq = reinterpret_cast<uint8_t*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+
+    for (int i = 0; i < kSegments; i++) {
+      void *mem;
+      if (posix_memalign(&mem, kAlign, kSegment) != 0) {
+        fprintf(stderr, "StorageWriter: out of memory\n");
+        return false;
+      }
+      segs_[i].buf = reinterpret_cast<uint8_t*>(mem);
+    }
+
+    // not every filesystem takes O_DIRECT writes even if it lets us open
+    // with it, so try one; the first segment overwrites it
+    cur_ = &segs_[0];
+    memset(cur_->buf, 0, kAlign);
+    cur_->len = kAlign;
+    cur_->offset = 0;
+    if (!Submit(cur_)) {
+      return false;
+    }
+    while (inflight_ > 0) {
+      if (!Reap(true)) {
+        return false;
+      }
+    }
+    if (failed_) {
+      return false;
+    }
+    cur_ = &segs_[0];
+    cur_->len = 0;
+    cur_->offset = 0;
+    next_offset_ = kSegment;
+    return true;
+  }
+
+  bool Write(const struct iovec *iov, int iovcnt) {
+    if (failed_) {
+      return false;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+      const uint8_t *src = reinterpret_cast<const uint8_t*>(iov[i].iov_base);
+      size_t len = iov[i].iov_len;
+      while (len > 0) {
+        size_t n = kSegment - cur_->len;
+        if (n > len) {
+          n = len;
+        }
+        memcpy(cur_->buf + cur_->len, src, n);
+        cur_->len += n;
+        offset_ += n;
+        src += n;
+        len -= n;
+        if (cur_->len == kSegment) {
+          if (!Submit(cur_) || !NextSegment()) {
+            return false;
+          }
+        }
+      }
+      // pick up completions as we go so errors surface promptly
+      if (!Reap(false)) {
+        return false;
+      }
+    }
+    return !failed_;
+  }
+
+  bool Close() {
+    bool ok = !failed_;
+    // the partial last segment goes out padded to the alignment; the padding
+    // is truncated off below
+    if (ok && cur_ != NULL && cur_->len > 0) {
+      ok = Submit(cur_);
+    }
+    while (inflight_ > 0) {
+      if (!Reap(true)) {
+        ok = false;
+        break;
+      }
+    }
+    ok = ok && !failed_;
+    // this also gives back the preallocated space past the end
+    if (ftruncate(fd_, offset_) != 0) {
+      perror("StorageWriter: ftruncate");
+      ok = false;
+    }
+    if (fdatasync(fd_) != 0) {
+      perror("StorageWriter: fdatasync");
+      ok = false;
+    }
+    if (close(fd_) != 0) {
+      perror("StorageWriter: close");
+      ok = false;
+    }
+    fd_ = -1;
+    return ok;
+  }
+
+  const char *Backend() const { return "io_uring"; }
+
+ private:
+  struct Segment {
+    uint8_t *buf;
+    size_t len;      // bytes of data; written padded to kAlign
+    int64_t offset;  // file offset of buf[0]
+    bool busy;       // write in flight
+    struct iovec iov;
+  };
+
+  // the next free submission slot; Enter() hands it to the kernel
+  struct io_uring_sqe *GetSQE() {
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (sq_tail_local_ - head >= sq_entries_) {
+      return NULL;  // can't happen: we never have more in flight than this
+    }
+    unsigned idx = sq_tail_local_++ & sq_mask_;
+    struct io_uring_sqe *sqe = &sqes_[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array_[idx] = idx;
+    return sqe;
+  }
+
+  bool Enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    if (to_submit > 0) {
+      __atomic_store_n(sq_tail_, sq_tail_local_, __ATOMIC_RELEASE);
+    }
+    for (;;) {
+      int ret = io_uring_enter(ring_fd_, to_submit, min_complete, flags);
+      if (ret >= 0) {
+        return true;
+      }
+      if (errno != EINTR) {
+        perror("StorageWriter: io_uring_enter");
+        failed_ = true;
+        return false;
+      }
+    }
+  }
+
+  bool Submit(Segment *seg) {
+    size_t padded = (seg->len + kAlign - 1) & ~(kAlign - 1);
+    memset(seg->buf + seg->len, 0, padded - seg->len);
+    seg->iov.iov_base = seg->buf;
+    seg->iov.iov_len = padded;
+
+    // keep the file's blocks allocated well ahead of us, so writes don't
+    // wait on the block allocator and the file stays contiguous
+    int64_t end = seg->offset + padded;
+    if (can_fallocate_ && end > allocated_) {
+      if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, allocated_, kPrealloc) != 0) {
+        can_fallocate_ = false;
+      } else {
+        allocated_ += kPrealloc;
+      }
+    }
+
+    struct io_uring_sqe *sqe = GetSQE();
+    if (sqe == NULL) {
+      fprintf(stderr, "StorageWriter: submission queue full\n");
+      failed_ = true;
+      return false;
+    }
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd_;
+    sqe->addr = reinterpret_cast<uint64_t>(&seg->iov);
+    sqe->len = 1;
+    sqe->off = seg->offset;
+    sqe->user_data = seg - segs_;
+    seg->busy = true;
+    inflight_++;
+    unsigned n = 1;
+
+    // every so often, a datasync ordered after everything before it, so
+    // a crash loses at most the last few MB
+    if (end - synced_ >= kSyncEvery) {
+      sqe = GetSQE();
+      if (sqe != NULL) {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->flags = IOSQE_IO_DRAIN;
+        sqe->fd = fd_;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = kSyncTag;
+        inflight_++;
+        n++;
+        synced_ = end;
+      }
+    }
+    return Enter(n, 0, 0);
+  }
+
+  // take completions off the ring, waiting for at least one if wait
+  bool Reap(bool wait) {
+    unsigned head = *cq_head_;
+    if (wait && head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+      if (!Enter(0, 1, IORING_ENTER_GETEVENTS)) {
+        return false;
+      }
+    }
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      const struct io_uring_cqe *cqe = &cqes_[head & cq_mask_];
+      inflight_--;
+      if (cqe->user_data == kSyncTag) {
+        if (cqe->res < 0) {
+          fprintf(stderr, "StorageWriter: datasync: %s\n", strerror(-cqe->res));
+        }
+        continue;
+      }
+      Segment *seg = &segs_[cqe->user_data];
+      seg->busy = false;
+      if (cqe->res != static_cast<int>(seg->iov.iov_len)) {
+        fprintf(stderr, "StorageWriter: write at %lld: %s\n",
+                (long long) seg->offset,
+                cqe->res < 0 ? strerror(-cqe->res) : "short write");
+        failed_ = true;
+      }
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // move on to the next free segment, waiting for one if need be
+  bool NextSegment() {
+    for (;;) {
+      for (int i = 0; i < kSegments; i++) {
+        if (!segs_[i].busy) {
+          cur_ = &segs_[i];
+          cur_->len = 0;
+          cur_->offset = next_offset_;
+          next_offset_ += kSegment;
+          return true;
+        }
+      }
+      if (!Reap(true)) {
+        return false;
+      }
+    }
+  }
+
+  int fd_;
+  int ring_fd_;
+  void *sq_ring_, *cq_ring_;
+  size_t sq_ring_size_, cq_ring_size_, sqes_size_;
+  unsigned sq_entries_, sq_mask_, cq_mask_;
+  unsigned sq_tail_local_;  // slots claimed by GetSQE, up to *sq_tail_ once
+                            // submitted
+  unsigned *sq_head_, *sq_tail_, *sq_array_;
+  unsigned *cq_head_, *cq_tail_;
+  struct io_uring_sqe *sqes_;
+  struct io_uring_cqe *cqes_;
+
+  Segment segs_[kSegments];
+  Segment *cur_;         // being filled
+  int64_t next_offset_;  // file offset of the segment after cur_
+  int64_t allocated_;    // fallocated up to here
+  int64_t synced_;       // last datasync queued after writes up to here
+  int inflight_;         // submitted and not yet completed
+  bool can_fallocate_;
+  bool failed_;
+};
+
+}  // empty namespace
+
+StorageWriter *StorageWriter::Open(const char *path, bool direct) {
+  if (direct) {
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_DIRECT, 0666);
+    if (fd == -1 && errno != EINVAL) {
+      perror(path);
+      return NULL;
+    }
+    if (fd != -1) {
+      UringWriter *w = new UringWriter(fd);
+      if (w->Init()) {
+        return w;
+      }
+      delete w;
+    }
+    fprintf(stderr, "%s: no O_DIRECT io_uring writes here; using write()\n",
+            path);
+  }
+  int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if (fd == -1) {
+    perror(path);
+    return NULL;
+  }
+  return new BufferedWriter(fd);
+}
+
+StorageWriter *StorageWriter::FromFd(int fd) {
+  return new BufferedWriter(fd);
+}
@@ -0,0 +1,52 @@
+#ifndef IO_STORAGE_H_
+#define IO_STORAGE_H_
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Append-only output file for recordings, written from a single thread (the
+// FlushThread). Open() picks the fastest backend the kernel and filesystem
+// support:
+//
+//  - "io_uring": the file is preallocated with fallocate() and written with
+//    O_DIRECT through io_uring, a few 1MB segments in flight at once, so the
+//    writer only blocks when the card is that far behind. Data is staged
+//    into page-aligned segments and the tail is padded, then truncated away
+//    at Close(). A datasync is queued behind the writes every few MB.
+//  - "write": plain buffered writev(), with sync_file_range() starting
+//    writeback every 1MB and waiting on the MB before it, which keeps the
+//    dirty page cache (and so the stall at the next fsync) bounded.
+class StorageWriter {
+ public:
+  virtual ~StorageWriter() {}
+
+  // Create or truncate path. direct=false goes straight to the buffered
+  // backend. Returns NULL (having printed why) if the file can't be opened.
+  static StorageWriter *Open(const char *path, bool direct);
+
+  // buffered writer for an already-open fd, e.g. stdout; Close() closes it
+  static StorageWriter *FromFd(int fd);
+
+  // append; returns false on a write error (the file is probably toast)
+  virtual bool Write(const struct iovec *iov, int iovcnt) = 0;
+
+  bool Write(const void *buf, size_t len) {
+    struct iovec iov = {const_cast<void*>(buf), len};
+    return Write(&iov, 1);
+  }
+
+  // write out everything, sync and close the file
+  virtual bool Close() = 0;
+
+  virtual const char *Backend() const = 0;
+
+  // bytes appended so far, i.e. the file offset of the next Write
+  int64_t Offset() const { return offset_; }
+
+ protected:
+  StorageWriter() { offset_ = 0; }
+
+  int64_t offset_;
+};
+
+#endif  // IO_STORAGE_H_
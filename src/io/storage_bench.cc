@@ -0,0 +1,138 @@
+// write a recording's worth of frame-sized records through each storage
+// backend, and the plain write() the FlushThread used to do, reporting
+// sustained throughput and the worst time any one write held up the writer;
+// then read the file back to check it.
+//
+// usage: storage_bench [directory] [megabytes]
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "io/storage.h"
+#include "timing/clock.h"
+
+static const size_t kHeaderLen = 1700;  // about a frame's CYCF/CTL2/... chunks
+static const size_t kFrameLen = 640 * 480 * 3 / 2;
+
+static uint8_t header[kHeaderLen], frame[kFrameLen];
+
+static void Fill(int i) {
+  memset(header, i & 0xff, kHeaderLen);
+  memcpy(header, &i, sizeof(i));
+  memset(frame, (i * 7) & 0xff, kFrameLen);
+}
+
+static bool Verify(const char *path, int nrecords) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    perror(path);
+    return false;
+  }
+  static uint8_t buf[kHeaderLen + kFrameLen];
+  bool ok = true;
+  for (int i = 0; i < nrecords && ok; i++) {
+    if (fread(buf, 1, sizeof(buf), fp) != sizeof(buf)) {
+      fprintf(stderr, "%s: short read at record %d\n", path, i);
+      ok = false;
+      break;
+    }
+    Fill(i);
+    if (memcmp(buf, header, kHeaderLen) ||
+        memcmp(buf + kHeaderLen, frame, kFrameLen)) {
+      fprintf(stderr, "%s: record %d corrupt\n", path, i);
+      ok = false;
+    }
+  }
+  if (ok && fgetc(fp) != EOF) {
+    fprintf(stderr, "%s: trailing garbage\n", path);
+    ok = false;
+  }
+  fclose(fp);
+  return ok;
+}
+
+// backend NULL is the old way: one write() per record, no syncing until the
+// end
+static bool Bench(const char *dir, const char *backend, int nrecords) {
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/storage_bench.%s.tmp", dir,
+           backend ? backend : "legacy");
+
+  StorageWriter *w = NULL;
+  int fd = -1;
+  if (backend == NULL) {
+    fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    if (fd == -1) {
+      perror(path);
+      return false;
+    }
+  } else {
+    w = StorageWriter::Open(path, !strcmp(backend, "io_uring"));
+    if (w == NULL) {
+      return false;
+    }
+  }
+
+  int64_t worst = 0;
+  bool ok = true;
+  int64_t t0 = MonotonicMicros();
+  for (int i = 0; i < nrecords && ok; i++) {
+    Fill(i);
+    int64_t t1 = MonotonicMicros();
+    if (w) {
+      iovec iov[2] = {{header, kHeaderLen}, {frame, kFrameLen}};
+      ok = w->Write(iov, 2);
+    } else {
+      uint8_t *buf = new uint8_t[kHeaderLen + kFrameLen];
+      memcpy(buf, header, kHeaderLen);
+      memcpy(buf + kHeaderLen, frame, kFrameLen);
+      ok = write(fd, buf, kHeaderLen + kFrameLen) ==
+          static_cast<ssize_t>(kHeaderLen + kFrameLen);
+      delete[] buf;
+    }
+    int64_t dt = MonotonicMicros() - t1;
+    if (dt > worst) {
+      worst = dt;
+    }
+  }
+  const char *name = backend ? w->Backend() : "legacy write()";
+  if (w) {
+    ok = w->Close() && ok;
+    delete w;
+  } else {
+    ok = fdatasync(fd) == 0 && ok;
+    close(fd);
+  }
+  int64_t total = MonotonicMicros() - t0;
+  if (!ok) {
+    fprintf(stderr, "%s: write failed\n", name);
+    unlink(path);
+    return false;
+  }
+
+  double mb = nrecords * (kHeaderLen + kFrameLen) / 1048576.0;
+  printf("%-16s %6.1f MB in %6.3fs, synced: %7.1f MB/s, "
+         "worst write %6.2f ms\n", name, mb, total * 1e-6, mb * 1e6 / total,
+         worst * 1e-3);
+  ok = Verify(path, nrecords);
+  unlink(path);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  const char *dir = argc > 1 ? argv[1] : ".";
+  int mb = argc > 2 ? atoi(argv[2]) : 64;
+  int nrecords = mb * 1048576.0 / (kHeaderLen + kFrameLen);
+
+  if (!Bench(dir, NULL, nrecords) ||
+      !Bench(dir, "write", nrecords) ||
+      !Bench(dir, "io_uring", nrecords)) {
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,111 @@
+#ifndef IO_TELEMETRYRING_H_
+#define IO_TELEMETRYRING_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <atomic>
+
+#include "io/flushthread.h"
+#include "io/storage.h"
+
+// Single-producer ring of fixed-size samples from a thread that can't wait
+// on the sdcard (the 100Hz control loop), written out by the FlushThread
+// in batches: queue an AddSource(out, &ring) now and then, e.g. once per
+// recorded frame, and each one writes everything pushed up to when it was
+// queued, since the last, as one chunk straight out of the ring (samples
+// pushed while it waits in the queue go with the next one):
+//
+//   char[4] tag, uint32 length (including this header)
+//   uint16 sizeof(T), uint16 0, uint32 samples dropped so far
+//   T samples[]
+//
+// Push() never blocks or allocates; if the writer falls so far behind that
+// the ring is full, the sample is dropped and counted.
+template <typename T>
+class TelemetryRing : public FlushSource {
+ public:
+  static const size_t kHeaderSize = 16;
+
+  explicit TelemetryRing(const char *tag) {
+    memcpy(tag_, tag, 4);
+    buf_ = NULL;
+    mask_ = 0;
+    head_ = tail_ = 0;
+    dropped_ = 0;
+  }
+
+  ~TelemetryRing() { delete[] buf_; }
+
+  // capacity is rounded up to a power of two
+  void Init(int capacity) {
+    int n = 2;
+    while (n < capacity) {
+      n *= 2;
+    }
+    buf_ = new T[n];
+    mask_ = n - 1;
+  }
+
+  // producer side
+  bool Push(const T &sample) {
+    uint32_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) > mask_) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    buf_[head & mask_] = sample;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  int Dropped() const { return dropped_; }
+
+  // producer count so far, taken as an entry for the ring is queued
+  uint32_t Mark() const { return head_.load(std::memory_order_acquire); }
+
+  // FlushThread side: the samples before mark
+  bool FlushTo(StorageWriter *out, uint32_t mark) {
+    uint32_t tail = tail_.load(std::memory_order_relaxed);
+    uint32_t n = mark - tail;
+    if (n == 0 || n > mask_ + 1) {
+      // nothing new, or a mark older than what's already been written
+      return true;
+    }
+    if (out == NULL) {
+      tail_.store(tail + n, std::memory_order_release);
+      return true;
+    }
+    uint8_t hdr[kHeaderSize];
+    uint32_t len = kHeaderSize + n * sizeof(T);
+    uint16_t size = sizeof(T), zero = 0;
+    uint32_t dropped = dropped_;
+    memcpy(hdr, tag_, 4);
+    memcpy(hdr + 4, &len, 4);
+    memcpy(hdr + 8, &size, 2);
+    memcpy(hdr + 10, &zero, 2);
+    memcpy(hdr + 12, &dropped, 4);
+    // the samples wrap around the end of the ring at most once
+    uint32_t first = tail & mask_;
+    uint32_t n1 = n < mask_ + 1 - first ? n : mask_ + 1 - first;
+    struct iovec iov[3] = {
+      {hdr, kHeaderSize},
+      {&buf_[first], n1 * sizeof(T)},
+      {&buf_[0], (n - n1) * sizeof(T)},
+    };
+    bool ok = out->Write(iov, n1 < n ? 3 : 2);
+    // only now can the producer have the slots back
+    tail_.store(tail + n, std::memory_order_release);
+    return ok;
+  }
+
+ private:
+  char tag_[4];
+  T *buf_;
+  uint32_t mask_;
+  std::atomic<uint32_t> head_, tail_;
+  std::atomic<uint32_t> dropped_;
+};
+
+#endif  // IO_TELEMETRYRING_H_
@@ -0,0 +1,178 @@
+// one thread pushes numbered samples into a TelemetryRing as fast as it
+// can while another has the FlushThread write them out; check the file
+// holds them all in order, apart from any the ring counted as dropped;
+// first, that flushing as of a mark leaves what was pushed after it
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "io/flushthread.h"
+#include "io/storage.h"
+#include "io/telemetryring.h"
+
+struct Sample {
+  int64_t seq;
+  float v[6];
+};
+
+static const int kSamples = 200000;
+
+static TelemetryRing<Sample> ring("TTST");
+static volatile bool producing = true;
+
+static void *produce(void *) {
+  for (int i = 0; i < kSamples; i++) {
+    Sample s;
+    s.seq = i;
+    for (int j = 0; j < 6; j++) {
+      s.v[j] = i + j;
+    }
+    ring.Push(s);
+    if ((i & 255) == 0) {
+      usleep(100);
+    }
+  }
+  producing = false;
+  return NULL;
+}
+
+// push 10, mark, push 5: a flush as of the mark writes the 10, the next
+// the 5, and one as of the old mark again nothing
+static bool CheckMark() {
+  const char *path = "telemetryring_test.tmp";
+  StorageWriter *out = StorageWriter::Open(path, false);
+  if (out == NULL) {
+    return false;
+  }
+  TelemetryRing<int64_t> r("TMRK");
+  r.Init(16);
+  uint32_t mark = 0;
+  for (int64_t i = 0; i < 15; i++) {
+    if (i == 10) {
+      mark = r.Mark();
+    }
+    r.Push(i);
+  }
+  r.FlushTo(out, mark);
+  r.FlushTo(out, r.Mark());
+  r.FlushTo(out, mark);
+  out->Close();
+  delete out;
+
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    perror(path);
+    return false;
+  }
+  uint8_t buf[16 + 16 * 8];
+  uint32_t len, want[2] = {10, 5};
+  bool ok = true;
+  int64_t next = 0;
+  for (int c = 0; c < 2 && ok; c++) {
+    ok = fread(buf, 1, 16, fp) == 16 && !memcmp(buf, "TMRK", 4);
+    memcpy(&len, buf + 4, 4);
+    ok = ok && len == 16 + want[c] * 8 &&
+        fread(buf + 16, 8, want[c], fp) == want[c];
+    for (uint32_t i = 0; i < want[c] && ok; i++) {
+      int64_t v;
+      memcpy(&v, buf + 16 + i * 8, 8);
+      ok = v == next++;
+    }
+  }
+  ok = ok && fgetc(fp) == EOF;
+  fclose(fp);
+  unlink(path);
+  if (!ok) {
+    fprintf(stderr, "flushing as of a mark wrote the wrong samples\n");
+  }
+  return ok;
+}
+
+int main() {
+  if (!CheckMark()) {
+    printf("FAIL\n");
+    return 1;
+  }
+  const char *path = "telemetryring_test.tmp";
+  StorageWriter *out = StorageWriter::Open(path, false);
+  if (out == NULL) {
+    return 1;
+  }
+  FlushThread flush;
+  ring.Init(1024);
+  if (!flush.Init(16)) {
+    return 1;
+  }
+  pthread_t thread;
+  pthread_create(&thread, NULL, produce, NULL);
+  while (producing) {
+    flush.AddSource(out, &ring);
+    usleep(500);
+  }
+  pthread_join(thread, NULL);
+  flush.AddSource(out, &ring);
+  flush.AddEntry(out, NULL, -1);
+  flush.Stop();
+
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    perror(path);
+    return 1;
+  }
+  bool ok = true;
+  int64_t next = 0;
+  int nchunks = 0, received = 0, gaps = 0;
+  uint32_t dropped = 0;
+  uint8_t hdr[16];
+  while (ok && fread(hdr, 1, 16, fp) == 16) {
+    uint32_t len, dr;
+    uint16_t size;
+    memcpy(&len, hdr + 4, 4);
+    memcpy(&size, hdr + 8, 2);
+    memcpy(&dr, hdr + 12, 4);
+    if (memcmp(hdr, "TTST", 4) || size != sizeof(Sample) ||
+        (len - 16) % sizeof(Sample) || dr < dropped) {
+      fprintf(stderr, "bad chunk header\n");
+      ok = false;
+      break;
+    }
+    dropped = dr;
+    std::vector<Sample> s((len - 16) / sizeof(Sample));
+    if (fread(&s[0], sizeof(Sample), s.size(), fp) != s.size()) {
+      fprintf(stderr, "short chunk\n");
+      ok = false;
+      break;
+    }
+    for (size_t i = 0; i < s.size(); i++) {
+      if (s[i].seq < next || s[i].v[5] != s[i].seq + 5) {
+        fprintf(stderr, "sample %lld out of order or corrupt\n",
+                (long long) s[i].seq);
+        ok = false;
+        break;
+      }
+      if (s[i].seq > next) {
+        gaps++;
+      }
+      next = s[i].seq + 1;
+    }
+    received += s.size();
+    nchunks++;
+  }
+  fclose(fp);
+  unlink(path);
+
+  if (received + static_cast<int>(dropped) != kSamples ||
+      static_cast<int>(dropped) != ring.Dropped()) {
+    fprintf(stderr, "%d samples written + %u dropped != %d\n", received,
+            dropped, kSamples);
+    ok = false;
+  }
+  printf("%d samples in %d chunks, %u dropped in %d gaps\n", received,
+         nchunks, dropped, gaps);
+  printf(ok ? "OK\n" : "FAIL\n");
+  return ok ? 0 : 1;
+}
@@ -20,6 +20,8 @@ class FisheyeLens {
 
   void DistortPoint(float x, float y, float z, float *u, float *v) const;
 
+  float FocalLengthX() const { return fx; }
+
  private:
   float fx, fy;  // angular focal length (x, y)
   float cx, cy;  // optical center
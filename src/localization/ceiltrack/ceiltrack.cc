@@ -52,9 +52,18 @@ class RLEMask {
   std::vector<uint16_t> out_;
 };
 
+CeilingTracker::~CeilingTracker() {
+  delete[] mask_rle_;
+  delete[] uvmap_;
+  delete[] xybuf_;
+}
+
 bool CeilingTracker::Init(const FisheyeLens &lens, float camtilt) {
   // Use the provided fisheye model to build an RLE-compressed lookup table
   camtilt_ = camtilt;
+  delete[] mask_rle_;
+  delete[] uvmap_;
+  delete[] xybuf_;
   float *pts = lens.GenUndistortedPts(640, 480);
   float S = sin(camtilt), C = cos(camtilt);
   float centerlimit = 8 * 8;  // radius of pixels in the image to consider
@@ -89,6 +98,9 @@ bool CeilingTracker::Init(const FisheyeLens &lens, float camtilt) {
   uvmaplen_ = uvpts.size();
   uvmap_ = new float[uvmaplen_];
   memcpy(uvmap_, &uvpts[0], uvmaplen_ * sizeof(uint32_t));
+  // needs to have 16-byte alignment, which it should, being a relatively
+  // large allocation
+  xybuf_ = new float[uvmaplen_];
   mask_rlelen_ = mask.Size();
   mask_rle_ = new uint16_t[mask_rlelen_];
   memcpy(mask_rle_, mask.Data(), mask_rlelen_ * sizeof(uint16_t));
@@ -117,13 +129,8 @@ float CeilingTracker::Update(const uint8_t *img, uint8_t thresh, float xgrid,
   float ooxg = 1.0 / xgrid, ooyg = 1.0 / ygrid;
 
   // first step: lookup all the camera ray vectors of white pixels looking up
-  static float *xybuf = NULL;
+  float *xybuf = xybuf_;
   int bufptr = 0;
-  if (xybuf == NULL) {
-    // needs to have 16-byte alignment, which it should, being a relatively
-    // large allocation
-    xybuf = new float[uvmaplen_];
-  }
   while (rleptr < mask_rlelen_) {
     // read zero-len
     img += mask_rle_[rleptr++];
@@ -261,6 +268,7 @@ float CeilingTracker::Update(const uint8_t *img, uint8_t thresh, float xgrid,
       xytheta[1] -= x7 * (-S3 * x2 + S3 * x8 - Sdy * (x3 + x5));
       xytheta[2] -= x6 * (-x0 + x2 - x8);
     }
+    SaveInformation(N, S2, S3, R);
 
     if (verbose) {
       printf("CeilTrack::Update iter %d: cost %f xyt %f %f %f (%d pixels)\n",
@@ -290,13 +298,8 @@ float CeilingTracker::Update(const uint8_t *img, uint8_t thresh, float xgrid,
   float ooxg = 1.0 / xgrid, ooyg = 1.0 / ygrid;
 
   // first step: lookup all the camera ray vectors of white pixels looking up
-  static float *xybuf = NULL;
+  float *xybuf = xybuf_;
   int bufptr = 0;
-  if (xybuf == NULL) {
-    // needs to have 16-byte alignment, which it should, being a relatively
-    // large allocation
-    xybuf = new float[uvmaplen_];
-  }
   while (rleptr < mask_rlelen_) {
     // read zero-len
     img += mask_rle_[rleptr++];
@@ -427,6 +430,7 @@ float CeilingTracker::Update(const uint8_t *img, uint8_t thresh, float xgrid,
       xytheta[1] -= x7 * (-S3 * x2 + S3 * x8 - Sdy * (x3 + x5));
       xytheta[2] -= x6 * (-x0 + x2 - x8);
     }
+    SaveInformation(N, S2, S3, R);
 
     if (verbose) {
       printf("CeilTrack::Update iter %d: cost %f xyt %f %f %f (%d pixels)\n",
@@ -468,13 +472,8 @@ float CeilingTracker::Update(const uint8_t *img, uint8_t thresh, float xgrid,
   float ooxg = 1.0 / xgrid, ooyg = 1.0 / ygrid;
 
   // first step: lookup all the camera ray vectors of white pixels looking up
-  static float *xybuf = NULL;
+  float *xybuf = xybuf_;
   int bufptr = 0;
-  if (xybuf == NULL) {
-    // needs to have 16-byte alignment, which it should, being a relatively
-    // large allocation
-    xybuf = new float[uvmaplen_];
-  }
   while (rleptr < mask_rlelen_) {
     // read zero-len
     img += mask_rle_[rleptr++];
@@ -545,6 +544,7 @@ float CeilingTracker::Update(const uint8_t *img, uint8_t thresh, float xgrid,
       xytheta[1] -= x7 * (-S3 * x2 + S3 * x8 - Sdy * (x3 + x5));
       xytheta[2] -= x6 * (-x0 + x2 - x8);
     }
+    SaveInformation(N, S2, S3, R);
 
     if (verbose) {
       printf("CeilTrack::Update iter %d: cost %f xyt %f %f %f (%d pixels)\n",
@@ -557,6 +557,14 @@ float CeilingTracker::Update(const uint8_t *img, uint8_t thresh, float xgrid,
 
 #endif
 
+int CeilingTracker::GetInformation(float *JTJ) const {
+  float N = npixels_, S2 = jtj_[0], S3 = jtj_[1], R = jtj_[2];
+  JTJ[0] = N;  JTJ[1] = 0;   JTJ[2] = S2;
+  JTJ[3] = 0;  JTJ[4] = N;   JTJ[5] = S3;
+  JTJ[6] = S2; JTJ[7] = S3;  JTJ[8] = R;
+  return npixels_;
+}
+
 void CeilingTracker::GetMatchedGrid(
     const FisheyeLens &lens, const float *xytheta, float xgrid, float ygrid,
     std::vector<std::pair<float, float>> *out) const {
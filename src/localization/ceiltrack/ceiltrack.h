@@ -1,6 +1,7 @@
 #ifndef LOCALIZATION_CEILTRACK_CEILTRACK_H_
 #define LOCALIZATION_CEILTRACK_CEILTRACK_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <vector>
@@ -9,10 +10,13 @@
 
 class CeilingTracker {
  public:
-  CeilingTracker() {}
-  CeilingTracker(const FisheyeLens &lens, float camtilt) {
+  CeilingTracker()
+      : mask_rle_(NULL), uvmap_(NULL), xybuf_(NULL), npixels_(0) {}
+  CeilingTracker(const FisheyeLens &lens, float camtilt)
+      : mask_rle_(NULL), uvmap_(NULL), xybuf_(NULL), npixels_(0) {
     Init(lens, camtilt);
   }
+  ~CeilingTracker();
 
   bool Init(const FisheyeLens &lens, float camtilt);
 
@@ -21,17 +25,36 @@ class CeilingTracker {
   float Update(const uint8_t *img, uint8_t thresh, float xgrid, float ygrid,
                float *xytheta, int niter, bool verbose);
 
+  // Gauss-Newton information matrix J^T J (row-major 3x3, in ceiling grid
+  // units and radians, without damping) from the last Update()'s final
+  // iteration; returns the number of light pixels it was built from. scaled
+  // by the residual variance, its inverse is the estimate's covariance
+  int GetInformation(float *JTJ) const;
+
   void GetMatchedGrid(const FisheyeLens &lens, const float *xytheta,
                       float xgrid, float ygrid,
                       std::vector<std::pair<float, float>> *out) const;
 
  private:
+  void SaveInformation(float N, float S2, float S3, float R) {
+    npixels_ = N;
+    jtj_[0] = S2;
+    jtj_[1] = S3;
+    jtj_[2] = R;
+  }
+
   uint16_t *mask_rle_;
   int mask_rlelen_;
   float *uvmap_;
   int uvmaplen_;
+  // Update()'s scratch: the rays of the light pixels, one buffer per
+  // tracker so trackers on different threads don't share it
+  float *xybuf_;
 
   float camtilt_;
+
+  int npixels_;
+  float jtj_[3];  // the non-trivial entries of J^T J: S2, S3, R
 };
 
 #endif  // LOCALIZATION_CEILTRACK_CEILTRACK_H_
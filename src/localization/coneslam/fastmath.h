@@ -0,0 +1,293 @@
+#ifndef CONESLAM_FASTMATH_H_
+#define CONESLAM_FASTMATH_H_
+
+// 4-wide float vectors with polynomial atan2 / asin / sincos for evaluating
+// landmark bearings over many particles at once. NEON on the Pi, SSE2 on
+// x86, and a plain float version everywhere else; all three share the same
+// polynomials so they give the same answers to within rounding.
+//
+// Accuracy (vs. libm): atan2 ~1e-5 rad, asin ~1e-5 rad, sin/cos ~2e-6 for
+// |theta| < 1000, log ~1e-7 relative. One fisheye LUT column is ~6.6e-3 rad
+// so this is plenty.
+
+#include <math.h>
+#include <stdint.h>
+
+#if (defined __ARM_NEON) || (defined __ARM_NEON__)
+#include <arm_neon.h>
+#define CONESLAM_FASTMATH_NEON
+#elif defined __SSE2__
+#include <emmintrin.h>
+#define CONESLAM_FASTMATH_SSE2
+#endif
+
+namespace coneslam {
+namespace fastmath {
+
+#if defined CONESLAM_FASTMATH_NEON
+
+typedef float32x4_t v4f;
+typedef uint32x4_t v4m;
+
+static inline v4f set1(float x) { return vdupq_n_f32(x); }
+static inline v4f load(const float *p) { return vld1q_f32(p); }
+static inline void store(float *p, v4f x) { vst1q_f32(p, x); }
+static inline v4f add(v4f a, v4f b) { return vaddq_f32(a, b); }
+static inline v4f sub(v4f a, v4f b) { return vsubq_f32(a, b); }
+static inline v4f mul(v4f a, v4f b) { return vmulq_f32(a, b); }
+static inline v4f min(v4f a, v4f b) { return vminq_f32(a, b); }
+static inline v4f max(v4f a, v4f b) { return vmaxq_f32(a, b); }
+static inline v4f abs(v4f a) { return vabsq_f32(a); }
+static inline v4m lt(v4f a, v4f b) { return vcltq_f32(a, b); }
+static inline v4m gt(v4f a, v4f b) { return vcgtq_f32(a, b); }
+static inline v4f select(v4m m, v4f a, v4f b) { return vbslq_f32(m, a, b); }
+// copy the sign bit of s onto x
+static inline v4f xorsign(v4f x, v4f s) {
+  uint32x4_t sign = vandq_u32(vreinterpretq_u32_f32(s),
+                              vdupq_n_u32(0x80000000));
+  return vreinterpretq_f32_u32(veorq_u32(vreinterpretq_u32_f32(x), sign));
+}
+static inline v4f div(v4f a, v4f b) {
+  v4f r = vrecpeq_f32(b);
+  r = vmulq_f32(vrecpsq_f32(b, r), r);
+  r = vmulq_f32(vrecpsq_f32(b, r), r);
+  return vmulq_f32(a, r);
+}
+static inline v4f rsqrt(v4f x) {
+  v4f r = vrsqrteq_f32(x);
+  r = vmulq_f32(vrsqrtsq_f32(vmulq_f32(x, r), r), r);
+  r = vmulq_f32(vrsqrtsq_f32(vmulq_f32(x, r), r), r);
+  return r;
+}
+// round to nearest integer; NEON only truncates, so add +-0.5 first (see
+// also CeilingTracker::Update)
+static inline v4f round(v4f x) {
+  v4f h = xorsign(vdupq_n_f32(0.5f), x);
+  return vcvtq_f32_s32(vcvtq_s32_f32(vaddq_f32(x, h)));
+}
+static inline void store_int(int32_t *p, v4f x) {
+  vst1q_s32(p, vcvtq_s32_f32(x));
+}
+static inline v4f load_int(const int32_t *p) {
+  return vcvtq_f32_s32(vld1q_s32(p));
+}
+// split x > 0 into exponent and mantissa in [1, 2)
+static inline v4f frexp(v4f x, v4f *e) {
+  int32x4_t i = vreinterpretq_s32_f32(x);
+  *e = vcvtq_f32_s32(vsubq_s32(vshrq_n_s32(i, 23), vdupq_n_s32(127)));
+  i = vorrq_s32(vandq_s32(i, vdupq_n_s32(0x007fffff)),
+                vdupq_n_s32(0x3f800000));
+  return vreinterpretq_f32_s32(i);
+}
+
+#elif defined CONESLAM_FASTMATH_SSE2
+
+typedef __m128 v4f;
+typedef __m128 v4m;
+
+static inline v4f set1(float x) { return _mm_set1_ps(x); }
+static inline v4f load(const float *p) { return _mm_loadu_ps(p); }
+static inline void store(float *p, v4f x) { _mm_storeu_ps(p, x); }
+static inline v4f add(v4f a, v4f b) { return _mm_add_ps(a, b); }
+static inline v4f sub(v4f a, v4f b) { return _mm_sub_ps(a, b); }
+static inline v4f mul(v4f a, v4f b) { return _mm_mul_ps(a, b); }
+static inline v4f min(v4f a, v4f b) { return _mm_min_ps(a, b); }
+static inline v4f max(v4f a, v4f b) { return _mm_max_ps(a, b); }
+static inline v4f abs(v4f a) {
+  return _mm_andnot_ps(_mm_set1_ps(-0.0f), a);
+}
+static inline v4m lt(v4f a, v4f b) { return _mm_cmplt_ps(a, b); }
+static inline v4m gt(v4f a, v4f b) { return _mm_cmpgt_ps(a, b); }
+static inline v4f select(v4m m, v4f a, v4f b) {
+  return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+}
+static inline v4f xorsign(v4f x, v4f s) {
+  return _mm_xor_ps(x, _mm_and_ps(s, _mm_set1_ps(-0.0f)));
+}
+static inline v4f div(v4f a, v4f b) { return _mm_div_ps(a, b); }
+static inline v4f rsqrt(v4f x) {
+  // one Newton step on top of the 12-bit estimate
+  v4f r = _mm_rsqrt_ps(x);
+  v4f hx = _mm_mul_ps(x, _mm_set1_ps(0.5f));
+  return _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(1.5f),
+                                  _mm_mul_ps(hx, _mm_mul_ps(r, r))));
+}
+static inline v4f round(v4f x) {
+  // relies on the default round-to-nearest MXCSR mode
+  return _mm_cvtepi32_ps(_mm_cvtps_epi32(x));
+}
+static inline void store_int(int32_t *p, v4f x) {
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm_cvttps_epi32(x));
+}
+static inline v4f load_int(const int32_t *p) {
+  return _mm_cvtepi32_ps(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+}
+static inline v4f frexp(v4f x, v4f *e) {
+  __m128i i = _mm_castps_si128(x);
+  *e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(i, 23),
+                                     _mm_set1_epi32(127)));
+  i = _mm_or_si128(_mm_and_si128(i, _mm_set1_epi32(0x007fffff)),
+                   _mm_set1_epi32(0x3f800000));
+  return _mm_castsi128_ps(i);
+}
+
+#else  // plain ol' unvectorized float version
+
+struct v4f { float v[4]; };
+struct v4m { bool v[4]; };
+
+#define CONESLAM_V4_OP(name, expr) \
+  static inline v4f name(v4f a, v4f b) { \
+    v4f r; \
+    for (int i = 0; i < 4; i++) { \
+      float x = a.v[i], y = b.v[i]; \
+      r.v[i] = expr; \
+    } \
+    return r; \
+  }
+CONESLAM_V4_OP(add, x + y)
+CONESLAM_V4_OP(sub, x - y)
+CONESLAM_V4_OP(mul, x * y)
+CONESLAM_V4_OP(div, x / y)
+CONESLAM_V4_OP(min, x < y ? x : y)
+CONESLAM_V4_OP(max, x > y ? x : y)
+CONESLAM_V4_OP(xorsign, signbit(y) ? -x : x)
+#undef CONESLAM_V4_OP
+
+static inline v4f set1(float x) { v4f r = {{x, x, x, x}}; return r; }
+static inline v4f load(const float *p) {
+  v4f r = {{p[0], p[1], p[2], p[3]}};
+  return r;
+}
+static inline void store(float *p, v4f x) {
+  for (int i = 0; i < 4; i++) p[i] = x.v[i];
+}
+static inline v4f abs(v4f a) {
+  for (int i = 0; i < 4; i++) a.v[i] = fabsf(a.v[i]);
+  return a;
+}
+static inline v4m lt(v4f a, v4f b) {
+  v4m m;
+  for (int i = 0; i < 4; i++) m.v[i] = a.v[i] < b.v[i];
+  return m;
+}
+static inline v4m gt(v4f a, v4f b) { return lt(b, a); }
+static inline v4f select(v4m m, v4f a, v4f b) {
+  for (int i = 0; i < 4; i++) if (m.v[i]) b.v[i] = a.v[i];
+  return b;
+}
+static inline v4f rsqrt(v4f x) {
+  for (int i = 0; i < 4; i++) x.v[i] = 1.0f / sqrtf(x.v[i]);
+  return x;
+}
+static inline v4f round(v4f x) {
+  for (int i = 0; i < 4; i++) x.v[i] = roundf(x.v[i]);
+  return x;
+}
+static inline void store_int(int32_t *p, v4f x) {
+  for (int i = 0; i < 4; i++) p[i] = x.v[i];
+}
+static inline v4f load_int(const int32_t *p) {
+  v4f r = {{(float) p[0], (float) p[1], (float) p[2], (float) p[3]}};
+  return r;
+}
+static inline v4f frexp(v4f x, v4f *e) {
+  for (int i = 0; i < 4; i++) {
+    int ei;
+    x.v[i] = 2 * ::frexpf(x.v[i], &ei);
+    e->v[i] = ei - 1;
+  }
+  return x;
+}
+
+#endif
+
+// atan(x) for |x| <= 1, odd minimax polynomial
+static inline v4f atan_unit(v4f x) {
+  v4f x2 = mul(x, x);
+  v4f p = set1(-0.0117212f);
+  p = add(mul(p, x2), set1(0.05265332f));
+  p = add(mul(p, x2), set1(-0.11643287f));
+  p = add(mul(p, x2), set1(0.19354346f));
+  p = add(mul(p, x2), set1(-0.33262347f));
+  p = add(mul(p, x2), set1(0.99997726f));
+  return mul(p, x);
+}
+
+static inline v4f atan2(v4f y, v4f x) {
+  v4f ax = abs(x), ay = abs(y);
+  v4f mx = max(max(ax, ay), set1(1e-30f));
+  v4f mn = min(ax, ay);
+  v4f r = atan_unit(div(mn, mx));
+  r = select(gt(ay, ax), sub(set1(M_PI_2), r), r);
+  r = select(lt(x, set1(0)), sub(set1(M_PI), r), r);
+  return xorsign(r, y);
+}
+
+// asin(x) for 0 <= x <= 1
+static inline v4f asin_pos(v4f x) {
+  v4f c2 = max(sub(set1(1), mul(x, x)), set1(1e-30f));
+  return atan2(x, mul(c2, rsqrt(c2)));
+}
+
+// natural log for x > 0 (no denormals, infinities or NaNs); cephes logf
+static inline v4f log(v4f x) {
+  v4f e;
+  v4f m = frexp(x, &e);
+  // recenter the mantissa around 1 so the polynomial sees [sqrt(.5), sqrt(2))
+  v4m big = gt(m, set1(M_SQRT2));
+  m = select(big, mul(m, set1(0.5f)), m);
+  e = select(big, add(e, set1(1)), e);
+  v4f f = sub(m, set1(1));
+  v4f z = mul(f, f);
+  v4f p = set1(7.0376836292e-2f);
+  p = add(mul(p, f), set1(-1.1514610310e-1f));
+  p = add(mul(p, f), set1(1.1676998740e-1f));
+  p = add(mul(p, f), set1(-1.2420140846e-1f));
+  p = add(mul(p, f), set1(1.4249322787e-1f));
+  p = add(mul(p, f), set1(-1.6668057665e-1f));
+  p = add(mul(p, f), set1(2.0000714765e-1f));
+  p = add(mul(p, f), set1(-2.4999993993e-1f));
+  p = add(mul(p, f), set1(3.3333331174e-1f));
+  v4f y = mul(mul(p, f), z);
+  y = add(y, mul(e, set1(-2.12194440e-4f)));
+  y = sub(y, mul(z, set1(0.5f)));
+  return add(add(f, y), mul(e, set1(0.693359375f)));
+}
+
+static inline void sincos(v4f theta, v4f *s, v4f *c) {
+  // reduce to [-pi/4, pi/4] with a two-part pi/2 and remember the quadrant
+  v4f k = round(mul(theta, set1(M_2_PI)));
+  v4f r = sub(theta, mul(k, set1(1.5703125f)));
+  r = sub(r, mul(k, set1(4.83826794897e-4f)));
+  v4f r2 = mul(r, r);
+  v4f sp = set1(-1.9515295891e-4f);
+  sp = add(mul(sp, r2), set1(8.3321608736e-3f));
+  sp = add(mul(sp, r2), set1(-1.6666654611e-1f));
+  sp = add(mul(mul(sp, r2), r), r);
+  v4f cp = set1(2.443315711809948e-5f);
+  cp = add(mul(cp, r2), set1(-1.388731625493765e-3f));
+  cp = add(mul(cp, r2), set1(4.166664568298827e-2f));
+  cp = add(mul(mul(cp, r2), r2), sub(set1(1), mul(r2, set1(0.5f))));
+
+  // quadrant q = k mod 4: swap sin/cos for odd q, negate for q = 1, 2 (sin)
+  // and q = 2, 3 (cos)
+  int32_t q[4];
+  float swap[4], sneg[4], cneg[4];
+  store_int(q, k);
+  for (int i = 0; i < 4; i++) {
+    int qi = q[i] & 3;
+    swap[i] = (qi & 1) ? -1.0f : 1.0f;
+    sneg[i] = (qi == 2 || qi == 3) ? -1.0f : 1.0f;
+    cneg[i] = (qi == 1 || qi == 2) ? -1.0f : 1.0f;
+  }
+  v4m sw = lt(load(swap), set1(0));
+  *s = xorsign(select(sw, cp, sp), load(sneg));
+  *c = xorsign(select(sw, sp, cp), load(cneg));
+}
+
+}  // namespace fastmath
+}  // namespace coneslam
+
+#endif  // CONESLAM_FASTMATH_H_
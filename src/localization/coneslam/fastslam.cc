@@ -0,0 +1,375 @@
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+
+#include "localization/coneslam/fastslam.h"
+
+namespace coneslam {
+
+// motion noise: gyro noise in rad/sec, and longitudinal / lateral slip per
+// meter travelled
+const float FS_NOISE_GYRO = 0.1;
+const float FS_NOISE_LONG = 0.1;
+const float FS_NOISE_LAT = 0.05;
+
+// a bearing-only observation says nothing about range, so new landmarks
+// start out this far along the ray with a long skinny covariance
+const float NEW_LM_RANGE = 2.0;        // meters
+const float NEW_LM_RANGE_SIGMA = 2.0;  // meters
+
+// squared normalized innovation beyond which an observation can't be an
+// existing landmark (3 sigma)
+const float ASSOCIATION_GATE = 9;
+
+FastSLAM::FastSLAM(int n_particles, int max_landmarks) {
+  n_particles_ = n_particles;
+  particles_ = new SLAMParticle[n_particles];
+  back_ = new SLAMParticle[n_particles];
+  LL_ = new float[n_particles];
+  noise_ = new float[3 * ((n_particles + 3) & ~3)];
+  max_range_ = INFINITY;
+  frame_ = 0;
+  n_searched_ = 0;
+  depth_ = 0;
+  while ((1 << depth_) < max_landmarks) {
+    depth_++;
+  }
+  max_landmarks_ = 1 << depth_;
+  scratch_ = new LandmarkEKF[max_landmarks_];
+  for (int i = 0; i < n_particles_; i++) {
+    particles_[i].root = -1;
+  }
+  Seed(0);
+  Reset();
+}
+
+FastSLAM::~FastSLAM() {
+  delete[] particles_;
+  delete[] back_;
+  delete[] LL_;
+  delete[] noise_;
+  delete[] scratch_;
+}
+
+void FastSLAM::Seed(long seed) {
+  rng_.Seed(seed);
+}
+
+void FastSLAM::Reset(float x, float y, float theta) {
+  for (int i = 0; i < n_particles_; i++) {
+    SLAMParticle &p = particles_[i];
+    Release(p.root, 0);
+    p.x = x;
+    p.y = y;
+    p.theta = theta;
+    p.root = -1;
+    p.n_landmarks = 0;
+    LL_[i] = 0;
+  }
+  best_ = 0;
+  n_searched_ = 0;
+}
+
+int FastSLAM::NewNode() {
+  int n;
+  if (!free_.empty()) {
+    n = free_.back();
+    free_.pop_back();
+  } else {
+    n = nodes_.size();
+    nodes_.push_back(Node());
+  }
+  nodes_[n].refs = 1;
+  return n;
+}
+
+void FastSLAM::Release(int32_t node, int level) {
+  if (node < 0 || --nodes_[node].refs > 0) {
+    return;
+  }
+  if (level < depth_) {
+    Release(nodes_[node].child[0], level + 1);
+    Release(nodes_[node].child[1], level + 1);
+  }
+  free_.push_back(node);
+}
+
+void FastSLAM::SetLandmark(int32_t *root, int k, const LandmarkEKF &lm) {
+  // nodes_ may be reallocated as we go, so track the parent by index
+  int parent = -1, side = 0;
+  for (int level = 0;; level++) {
+    int32_t n = parent < 0 ? *root : nodes_[parent].child[side];
+    if (n < 0) {
+      n = NewNode();
+      if (level < depth_) {
+        nodes_[n].child[0] = nodes_[n].child[1] = -1;
+        nodes_[n].lo[0] = nodes_[n].hi[0] = lm.x;
+        nodes_[n].lo[1] = nodes_[n].hi[1] = lm.y;
+      }
+    } else if (nodes_[n].refs > 1) {
+      // someone else still sees this node; give ourselves a private copy
+      int32_t c = NewNode();
+      nodes_[c] = nodes_[n];
+      nodes_[c].refs = 1;
+      nodes_[n].refs--;
+      if (level < depth_) {
+        Retain(nodes_[c].child[0]);
+        Retain(nodes_[c].child[1]);
+      }
+      n = c;
+    }
+    if (parent < 0) {
+      *root = n;
+    } else {
+      nodes_[parent].child[side] = n;
+    }
+    Node &node = nodes_[n];
+    if (level == depth_) {
+      node.lm = lm;
+      return;
+    }
+    // the boxes only ever grow, so they can be loose once a landmark has
+    // moved, but never miss one
+    node.lo[0] = std::min(node.lo[0], lm.x);
+    node.lo[1] = std::min(node.lo[1], lm.y);
+    node.hi[0] = std::max(node.hi[0], lm.x);
+    node.hi[1] = std::max(node.hi[1], lm.y);
+    parent = n;
+    side = (k >> (depth_ - 1 - level)) & 1;
+  }
+}
+
+void FastSLAM::Associate(int32_t node, int level, int base, Association *a) {
+  if (node < 0) {
+    return;
+  }
+  const Node &n = nodes_[node];
+  if (level == depth_) {
+    Consider(n.lm, base, a);
+    return;
+  }
+  // nothing under here can be in range if the nearest point of the box
+  // isn't
+  float dx = std::max(0.0f, std::max(n.lo[0] - a->x, a->x - n.hi[0]));
+  float dy = std::max(0.0f, std::max(n.lo[1] - a->y, a->y - n.hi[1]));
+  if (dx * dx + dy * dy > a->maxr2) {
+    return;
+  }
+  int half = 1 << (depth_ - 1 - level);
+  if (level + 1 == depth_) {
+    // the leaves are right here; save a call each
+    for (int c = 0; c < 2; c++) {
+      if (n.child[c] >= 0) {
+        Consider(nodes_[n.child[c]].lm, base + c * half, a);
+      }
+    }
+    return;
+  }
+  Associate(n.child[0], level + 1, base, a);
+  Associate(n.child[1], level + 1, base + half, a);
+}
+
+void FastSLAM::Consider(const LandmarkEKF &l, int k, Association *a) {
+  n_searched_++;
+  if (l.last_frame == frame_) {
+    return;
+  }
+  float dx = l.x - a->x, dy = l.y - a->y;
+  if (dx * dx + dy * dy > a->maxr2) {
+    return;
+  }
+  float S = a->S, C = a->C;
+  float u = dx * S - dy * C, v = dx * C + dy * S;
+  float q = u * u + v * v;
+  // jacobian of the bearing atan2(u, v) w.r.t. the landmark position
+  float H1 = (v * S - u * C) / q, H2 = (-v * C - u * S) / q;
+  float Sk = H1 * (H1 * l.p11 + H2 * l.p12) +
+             H2 * (H1 * l.p12 + H2 * l.p22) + a->R;
+  float y = a->bearing - atan2f(u, v);
+  if (y > M_PI) y -= 2 * M_PI;
+  if (y < -M_PI) y += 2 * M_PI;
+  float d2 = y * y / Sk;
+  if (d2 > ASSOCIATION_GATE) {
+    return;
+  }
+  float LL = -0.5 * logf(2 * M_PI * Sk) - 0.5 * d2;
+  if (a->best == -1 || LL > a->LL) {
+    a->best = k;
+    a->lm = &l;
+    a->LL = LL;
+    a->y_innov = y;
+    a->Sk = Sk;
+    a->H1 = H1;
+    a->H2 = H2;
+  }
+}
+
+void FastSLAM::GatherLandmarks(int32_t node, int level, int base,
+                               LandmarkEKF *out) const {
+  if (node < 0) {
+    return;
+  }
+  if (level == depth_) {
+    out[base] = nodes_[node].lm;
+    return;
+  }
+  GatherLandmarks(nodes_[node].child[0], level + 1, base, out);
+  GatherLandmarks(nodes_[node].child[1], level + 1,
+                  base + (1 << (depth_ - 1 - level)), out);
+}
+
+void FastSLAM::GetLandmarks(int particle, LandmarkEKF *out) const {
+  GatherLandmarks(particles_[particle].root, 0, 0, out);
+}
+
+void FastSLAM::GetParticle(int i, Particle *p) const {
+  p->x = particles_[i].x;
+  p->y = particles_[i].y;
+  p->theta = particles_[i].theta;
+  p->heading = particles_[i].theta;
+}
+
+void FastSLAM::Predict(float ds, float w, float dt) {
+  int padded = (n_particles_ + 3) & ~3;
+  float *nangular = noise_, *nlong = noise_ + padded,
+        *nlat = noise_ + 2 * padded;
+  rng_.FillNormal(nangular, n_particles_, FS_NOISE_GYRO * dt);
+  rng_.FillNormal(nlong, n_particles_, FS_NOISE_LONG * fabsf(ds));
+  rng_.FillNormal(nlat, n_particles_, FS_NOISE_LAT * fabsf(ds));
+  for (int i = 0; i < n_particles_; i++) {
+    SLAMParticle &p = particles_[i];
+    p.theta += w * dt + nangular[i];
+    float S = sinf(p.theta), C = cosf(p.theta);
+    float dx = ds + nlong[i], dy = nlat[i];
+    p.x += dx * C - dy * S;
+    p.y += dx * S + dy * C;
+  }
+}
+
+void FastSLAM::UpdateLM(float lm_bearing, float sigma) {
+  const float R = sigma * sigma;
+  const float maxr2 = max_range_ * max_range_;
+  // the likelihood of seeing a brand new landmark: as if it were right at
+  // the edge of the gate of one we knew exactly
+  const float newLL = -0.5 * logf(2 * M_PI * R) - 0.5 * ASSOCIATION_GATE;
+
+  for (int i = 0; i < n_particles_; i++) {
+    SLAMParticle &p = particles_[i];
+
+    // find the likeliest landmark within the gate
+    Association a;
+    a.x = p.x;
+    a.y = p.y;
+    a.S = sinf(p.theta);
+    a.C = cosf(p.theta);
+    a.bearing = lm_bearing;
+    a.R = R;
+    a.maxr2 = maxr2;
+    a.best = -1;
+    a.LL = newLL;
+    Associate(p.root, 0, 0, &a);
+
+    if (a.best != -1) {
+      // copied out before SetLandmark() can move the nodes
+      LandmarkEKF l = *a.lm;
+      float K1 = (l.p11 * a.H1 + l.p12 * a.H2) / a.Sk,
+            K2 = (l.p12 * a.H1 + l.p22 * a.H2) / a.Sk;
+      l.x += K1 * a.y_innov;
+      l.y += K2 * a.y_innov;
+      l.p11 -= K1 * K1 * a.Sk;
+      l.p12 -= K1 * K2 * a.Sk;
+      l.p22 -= K2 * K2 * a.Sk;
+      l.n_seen++;
+      l.last_frame = frame_;
+      SetLandmark(&p.root, a.best, l);
+      LL_[i] += a.LL;
+    } else {
+      if (p.n_landmarks < max_landmarks_) {
+        // world-frame direction of the ray; see the bearing convention above
+        float phi = p.theta - lm_bearing;
+        float c = cosf(phi), s = sinf(phi);
+        float var_r = NEW_LM_RANGE_SIGMA * NEW_LM_RANGE_SIGMA;
+        float var_c = NEW_LM_RANGE * NEW_LM_RANGE * R;
+        LandmarkEKF l;
+        l.x = p.x + NEW_LM_RANGE * c;
+        l.y = p.y + NEW_LM_RANGE * s;
+        l.p11 = var_r * c * c + var_c * s * s;
+        l.p12 = (var_r - var_c) * c * s;
+        l.p22 = var_r * s * s + var_c * c * c;
+        l.n_seen = 1;
+        l.last_frame = frame_;
+        SetLandmark(&p.root, p.n_landmarks++, l);
+      }
+      LL_[i] += newLL;
+    }
+  }
+}
+
+void FastSLAM::Resample() {
+  float LLmax = LL_[0];
+  int argmax = 0;
+  for (int i = 1; i < n_particles_; i++) {
+    if (LL_[i] > LLmax) {
+      LLmax = LL_[i];
+      argmax = i;
+    }
+  }
+  // build the CDF in place
+  float sum = 0;
+  for (int i = 0; i < n_particles_; i++) {
+    sum += expf(LL_[i] - LLmax);
+    LL_[i] = sum;
+  }
+
+  // systematic resampling; new particles just take another reference to
+  // their parent's map
+  float step = sum / n_particles_;
+  float r = rng_.UniformScalar() * step;
+  best_ = -1;
+  for (int i = 0, j = 0; i < n_particles_; i++) {
+    float target = r + i * step;
+    while (j < n_particles_ - 1 && LL_[j] < target) {
+      j++;
+    }
+    back_[i] = particles_[j];
+    Retain(back_[i].root);
+    if (j == argmax && best_ == -1) {
+      best_ = i;
+    }
+  }
+  if (best_ == -1) {
+    best_ = 0;
+  }
+  for (int i = 0; i < n_particles_; i++) {
+    Release(particles_[i].root, 0);
+    LL_[i] = 0;
+  }
+  std::swap(particles_, back_);
+  frame_++;
+}
+
+bool FastSLAM::SaveLandmarks(const char *filename, int min_seen) const {
+  const SLAMParticle &p = particles_[best_];
+  GatherLandmarks(p.root, 0, 0, scratch_);
+  int n = 0;
+  for (int k = 0; k < p.n_landmarks; k++) {
+    if (scratch_[k].n_seen >= min_seen) n++;
+  }
+
+  FILE *fp = fopen(filename, "w");
+  if (!fp) {
+    perror(filename);
+    return false;
+  }
+  fprintf(fp, "%d\n", n);
+  for (int k = 0; k < p.n_landmarks; k++) {
+    if (scratch_[k].n_seen >= min_seen) {
+      fprintf(fp, "%f %f\n", scratch_[k].x, scratch_[k].y);
+    }
+  }
+  bool ok = !ferror(fp);
+  fclose(fp);
+  return ok;
+}
+
+}  // namespace coneslam
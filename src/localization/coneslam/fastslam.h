@@ -0,0 +1,154 @@
+#ifndef CONESLAM_FASTSLAM_H_
+#define CONESLAM_FASTSLAM_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "localization/coneslam/localize.h"
+#include "localization/coneslam/rng.h"
+
+namespace coneslam {
+
+// a cone position estimate and its covariance
+struct LandmarkEKF {
+  float x, y;
+  float p11, p12, p22;
+  int n_seen;
+  int last_frame;  // so one frame's cones can't all pile onto one landmark
+};
+
+// Rao-Blackwellized particle filter SLAM (FastSLAM 1.0) with bearing-only
+// cone observations, for building an lm.txt from scratch instead of
+// surveying the track.
+//
+// Each particle carries a car pose and its own map of independent landmark
+// EKFs. The maps are stored as persistent balanced binary trees indexed by
+// landmark number, with reference counted nodes: resampling just copies a
+// root pointer, and updating a landmark copies only the O(log M) nodes on the
+// path down to it if anyone else still shares them, instead of the O(M) of
+// copying every map on resample.
+//
+// Each interior node also keeps the bounding box of the landmarks under it,
+// and data association searches the tree in place, skipping subtrees that
+// are entirely out of SetMaxLandmarkRange(). Landmarks are numbered in the
+// order they're found, so neighboring subtrees are nearby stretches of
+// track, and an observation costs O(log M) plus the landmarks in range per
+// particle rather than a visit to all M of them.
+//
+// Not thread safe; the node pool and reference counts are shared by all
+// particles.
+class FastSLAM {
+ public:
+  // max_landmarks is rounded up to a power of two
+  FastSLAM(int n_particles, int max_landmarks);
+  ~FastSLAM();
+
+  void Seed(long seed);
+
+  // drop all maps and put every particle at (x, y, theta); the map's frame
+  // is the starting pose, so there's no pose noise here
+  void Reset(float x = 0, float y = 0, float theta = 0);
+
+  // predict after encoder / gyro measurement
+  // ds is in meters, w in rad/sec, dt in sec
+  void Predict(float ds, float w, float dt);
+
+  // update after a cone is seen at lm_bearing (same convention as
+  // Localizer::UpdateLM) with the given standard deviation in radians. each
+  // particle associates it with its likeliest landmark not already matched
+  // since the last Resample(), or starts a new one if none is within the gate
+  void UpdateLM(float lm_bearing, float sigma);
+
+  void Resample();  // implicitly resets internal likelihoods
+
+  // UpdateLM() won't associate observations with landmarks further away than
+  // this, which would be out of the cone detector's reach anyway. bearings
+  // alone can't tell a near cone from a far one behind it, so set this to
+  // the detection range. unlimited by default
+  void SetMaxLandmarkRange(float range) { max_range_ = range; }
+
+  int NumParticles() const { return n_particles_; }
+  void GetParticle(int i, Particle *p) const;
+  // particle with the highest likelihood going into the last Resample()
+  int BestParticle() const { return best_; }
+
+  int NumLandmarks(int particle) const {
+    return particles_[particle].n_landmarks;
+  }
+  // copy particle's map into out[0..NumLandmarks(particle))
+  void GetLandmarks(int particle, LandmarkEKF *out) const;
+
+  // write BestParticle()'s map in the format Localizer::LoadLandmarks reads;
+  // landmarks seen fewer than min_seen times are left out
+  bool SaveLandmarks(const char *filename, int min_seen = 1) const;
+
+  // tree nodes currently referenced by any particle
+  int NumNodes() const { return nodes_.size() - free_.size(); }
+  // landmarks UpdateLM() has considered for association since Reset()
+  int64_t NumLandmarksSearched() const { return n_searched_; }
+
+ private:
+  struct Node {
+    int32_t refs;
+    union {
+      // interior nodes: children, -1 for an empty subtree, and the bounding
+      // box of the landmarks under them
+      struct {
+        int32_t child[2];
+        float lo[2], hi[2];
+      };
+      LandmarkEKF lm;  // leaves
+    };
+  };
+
+  // UpdateLM()'s best association so far for one particle
+  struct Association {
+    float x, y, S, C;  // particle pose
+    float bearing, R, maxr2;
+    int best;
+    const LandmarkEKF *lm;  // in nodes_
+    float LL, y_innov, Sk, H1, H2;
+  };
+
+  struct SLAMParticle {
+    float x, y, theta;
+    int32_t root;
+    int n_landmarks;
+  };
+
+  int NewNode();
+  void Retain(int32_t node) { if (node >= 0) nodes_[node].refs++; }
+  void Release(int32_t node, int level);
+
+  // path-copy any shared nodes between root and landmark k, creating it if
+  // needed, and set it to lm, growing the bounding boxes above it to match
+  void SetLandmark(int32_t *root, int k, const LandmarkEKF &lm);
+  // fold the landmarks under node into a's best association, skipping
+  // subtrees out of range
+  void Associate(int32_t node, int level, int base, Association *a);
+  // landmark number k for a
+  void Consider(const LandmarkEKF &l, int k, Association *a);
+  // copy the landmarks under node, the first of which is number base
+  void GatherLandmarks(int32_t node, int level, int base,
+                       LandmarkEKF *out) const;
+
+  int n_particles_;
+  SLAMParticle *particles_, *back_;
+  float *LL_;
+  float *noise_;  // three arrays of per-particle gaussian noise
+  LandmarkEKF *scratch_;  // one particle's map, for SaveLandmarks()
+  int best_;
+  float max_range_;
+  int frame_;  // number of Resample()s, for LandmarkEKF::last_frame
+  int64_t n_searched_;
+  RNG rng_;
+
+  int max_landmarks_;
+  int depth_;  // leaves are this many levels below the root
+  std::vector<Node> nodes_;
+  std::vector<int32_t> free_;
+};
+
+}  // namespace coneslam
+
+#endif  // CONESLAM_FASTSLAM_H_
@@ -0,0 +1,152 @@
+// drive a simulated car around a course of cones, observing only noisy
+// bearings, and check FastSLAM builds a map of them from nothing
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "localization/coneslam/fastslam.h"
+#include "localization/coneslam/localize.h"
+
+using coneslam::FastSLAM;
+using coneslam::LandmarkEKF;
+using coneslam::Localizer;
+
+// a ring track: cones on the inside and outside of a circle
+static const int kInnerCones = 8, kOuterCones = 20;
+static const int kNumCones = kInnerCones + kOuterCones;
+static const float kInnerRadius = 1.2, kOuterRadius = 3.2;
+static float kCones[kNumCones][2];
+
+static const char *kMapFile = "/tmp/fastslam_test_lm.txt";
+
+static float randn() {
+  // sum of twelve uniforms is close enough here
+  float s = -6;
+  for (int i = 0; i < 12; i++) s += drand48();
+  return s;
+}
+
+int main() {
+  const int kParticles = 300, kMaxLandmarks = 64;
+  const float dt = 1.0 / 30, v = 1.5, radius = 2.2, cx = 3, cy = 0;
+  const float kBearingSigma = 0.02, kMaxRange = 2;
+
+  for (int j = 0; j < kNumCones; j++) {
+    float r = j < kInnerCones ? kInnerRadius : kOuterRadius;
+    float a = j < kInnerCones ? 2 * M_PI * j / kInnerCones :
+        2 * M_PI * (j - kInnerCones) / kOuterCones;
+    kCones[j][0] = cx + r * cos(a);
+    kCones[j][1] = cy + r * sin(a);
+  }
+
+  FastSLAM slam(kParticles, kMaxLandmarks);
+  slam.SetMaxLandmarkRange(kMaxRange * 1.25);
+  slam.Seed(1);
+  srand48(1);
+
+  // counterclockwise around the circle, starting at its bottom
+  float x = cx, y = cy - radius, theta = 0;
+  slam.Reset(x, y, theta);
+  int frames = 2 * 2 * M_PI * radius / (v * dt);
+  double slam_us = 0;
+  int max_nodes = 0;
+  int64_t nobs_total = 0;
+  for (int frame = 0; frame < frames; frame++) {
+    float w = v / radius;
+    theta += w * dt;
+    x += v * dt * cos(theta);
+    y += v * dt * sin(theta);
+
+    timeval t0, t1;
+    gettimeofday(&t0, NULL);
+    slam.Predict(v * dt * (1 + 0.02 * randn()), w + 0.02 * randn(), dt);
+    int nobs = 0;
+    for (int j = 0; j < kNumCones; j++) {
+      float dx = kCones[j][0] - x, dy = kCones[j][1] - y;
+      if (dx * dx + dy * dy > kMaxRange * kMaxRange) {
+        continue;
+      }
+      float S = sin(theta), C = cos(theta);
+      float bearing = atan2(dx * S - dy * C, dx * C + dy * S) +
+                      kBearingSigma * randn();
+      slam.UpdateLM(bearing, 2 * kBearingSigma);
+      nobs++;
+    }
+    nobs_total += nobs;
+    if (nobs > 0) {
+      slam.Resample();
+    }
+    gettimeofday(&t1, NULL);
+    slam_us += (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_usec - t0.tv_usec);
+    if (slam.NumNodes() > max_nodes) {
+      max_nodes = slam.NumNodes();
+    }
+  }
+
+  int best = slam.BestParticle();
+  coneslam::Particle p;
+  slam.GetParticle(best, &p);
+  printf("%d frames, %0.1f us/frame; final pose %f %f %f (true %f %f %f)\n",
+         frames, slam_us / frames, p.x, p.y, p.theta, x, y, theta);
+
+  // the map spans the whole ring but only a part of it is ever in range,
+  // so association shouldn't look at most of it
+  double searched =
+      (double)slam.NumLandmarksSearched() / (nobs_total * kParticles);
+  printf("%0.1f landmarks searched per observation per particle, of %d\n",
+         searched, slam.NumLandmarks(best));
+  if (searched > 0.6 * slam.NumLandmarks(best)) {
+    fprintf(stderr, "data association isn't pruning out of range landmarks\n");
+    return 1;
+  }
+
+  // every particle's map, unshared, would be a full tree of 2M-1 nodes
+  printf("%d tree nodes live at most, vs %d unshared\n", max_nodes,
+         kParticles * (2 * kMaxLandmarks - 1));
+  if (max_nodes > kParticles * (2 * kMaxLandmarks - 1) / 4) {
+    fprintf(stderr, "landmark maps aren't being shared\n");
+    return 1;
+  }
+
+  int nlm = slam.NumLandmarks(best);
+  LandmarkEKF lms[kMaxLandmarks];
+  slam.GetLandmarks(best, lms);
+  for (int k = 0; k < nlm; k++) {
+    printf("landmark %d: %f %f +- %f %f, seen %d times\n", k, lms[k].x,
+           lms[k].y, sqrt(lms[k].p11), sqrt(lms[k].p22), lms[k].n_seen);
+  }
+  for (int j = 0; j < kNumCones; j++) {
+    float mind = 1e6;
+    for (int k = 0; k < nlm; k++) {
+      float d = hypot(lms[k].x - kCones[j][0], lms[k].y - kCones[j][1]);
+      if (lms[k].n_seen >= 10 && d < mind) mind = d;
+    }
+    if (mind > 0.3) {
+      fprintf(stderr, "cone %d at %f %f not mapped (nearest %f m)\n", j,
+              kCones[j][0], kCones[j][1], mind);
+      return 1;
+    }
+  }
+
+  // the map should load straight into the localizer
+  if (!slam.SaveLandmarks(kMapFile, 10)) {
+    return 1;
+  }
+  Localizer loc(100);
+  if (!loc.LoadLandmarks(kMapFile) || loc.NumLandmarks() < kNumCones) {
+    fprintf(stderr, "saved map didn't load\n");
+    return 1;
+  }
+  unlink(kMapFile);
+
+  // nothing may leak once every map is dropped
+  slam.Reset();
+  if (slam.NumNodes() != 0) {
+    fprintf(stderr, "%d tree nodes leaked\n", slam.NumNodes());
+    return 1;
+  }
+  return 0;
+}
@@ -2,11 +2,18 @@
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
 
+#include "localization/coneslam/fastmath.h"
 #include "localization/coneslam/localize.h"
+#include "lens/fisheye.h"
 
 namespace coneslam {
 
+namespace fm = fastmath;
+
 // const float NOISE_ANGULAR = 0.4;
 // const float NOISE_LONG = 16;
 // const float NOISE_LAT = 8;
@@ -17,37 +24,135 @@ const float NOISE_LONG = 8*3.3;
 const float NOISE_LAT = 8*3.3;
 const float NOISE_STEER_u = 0.3*3.3;
 const float NOISE_STEER_s = 0.3*3.3;
-
-static double randn() {
-  // #include <random> doesn't work in my ARM cross-compiler so I'm just
-  // doing something dumb here
-  // it's slightly heavier-tailed than a gaussian and cuts off at -6..6, but
-  // that's OK
-  double n = drand48();
-  for (int i = 1; i < 6; i++) n += drand48();
-  return 2*n - 6;
+const float LANDMARK_GRID_SIZE = 4;  // meters
+
+// the original sum-of-six-uniforms randn() had a standard deviation of
+// sqrt(2); the noise constants above were tuned with that
+const float RANDN_SIGMA = M_SQRT2;
+
+Localizer::Localizer(int n_particles, int n_threads) : pool_(n_threads) {
+  n_particles_ = max_particles_ = min_particles_ = n_particles;
+  x_ = AllocParticles(n_particles);
+  y_ = x_ + PaddedParticles();
+  theta_ = y_ + PaddedParticles();
+  heading_ = theta_ + PaddedParticles();
+  back_ = AllocParticles(n_particles);
+  noise_ = new float[3 * PaddedParticles()];
+  n_landmarks_ = 0;
+  landmarks_ = NULL;
+  grid_x0_ = grid_y0_ = 0;
+  grid_cell_ = LANDMARK_GRID_SIZE;
+  grid_w_ = grid_h_ = 0;
+  grid_start_ = grid_lm_ = NULL;
+  // half a LUT column
+  max_range_ = CONE_RADIUS / sin(M_PI / kFisheyeLUT_w);
+  visible_ = NULL;
+  n_visible_ = 0;
+  log_level_ = LOG_FULL;
+  log_topk_ = 16;
+  n_ring_ = 0;
+  ring_src_ = NULL;
+  ring_col_ = NULL;
+  memset(ring_bias_, 0, sizeof(ring_bias_));
+  LL_ = new float[PaddedParticles()];
+  order_ = new int[n_particles];
+  kld_epsilon_ = kld_bin_xy_ = kld_bin_theta_ = 0;
+  n_bins_occupied_ = -1;
+  bins_ = NULL;
+  bins_size_ = 0;
+  c0_ = c1_ = NULL;
+  home_x_ = home_y_ = home_theta_ = 0;
+  threads_ = new ThreadState[pool_.NumThreads()];
+  Seed(0);
+  Reset();
 }
 
 Localizer::~Localizer() {
-  delete[] particles_;
+  delete[] threads_;
+  delete[] x_;
+  delete[] back_;
+  delete[] noise_;
+  delete[] bins_;
   delete[] landmarks_;
+  delete[] grid_start_;
+  delete[] grid_lm_;
+  delete[] visible_;
+  delete[] ring_src_;
+  delete[] ring_col_;
   delete[] LL_;
+  delete[] order_;
   delete[] c0_;
   delete[] c1_;
 }
 
-void Localizer::Reset() {
-  for (int i = 0; i < n_particles_; i++) {
-    particles_[i].x = 0.025*randn() + home_x_;
-    particles_[i].y = 0.025*randn() + home_y_;
-    particles_[i].theta = randn() * 0.1 + home_theta_;
-    particles_[i].heading = particles_[i].theta;
+float *Localizer::AllocParticles(int n) {
+  int padded = (n + 3) & ~3;
+  float *buf = new float[4 * padded];
+  memset(buf, 0, 4 * padded * sizeof(float));
+  return buf;
+}
+
+void Localizer::ParticleRange(int n, int t, int *begin, int *end) const {
+  int nt = pool_.NumThreads();
+  *begin = (n * t / nt) & ~3;
+  *end = t == nt - 1 ? n : (n * (t + 1) / nt) & ~3;
+}
+
+void Localizer::SetAdaptiveParticleCount(int min_particles, float epsilon,
+                                         float bin_xy, float bin_theta) {
+  min_particles_ = std::min(std::max(min_particles, 1), max_particles_);
+  kld_epsilon_ = epsilon;
+  kld_bin_xy_ = bin_xy;
+  kld_bin_theta_ = bin_theta;
+  if (bins_ == NULL) {
+    bins_size_ = 1;
+    while (bins_size_ < 2 * max_particles_) {
+      bins_size_ <<= 1;
+    }
+    bins_ = new uint64_t[bins_size_];
   }
+}
+
+void Localizer::Seed(long seed) {
+  // give each thread its own stream
+  for (int t = 0; t < pool_.NumThreads(); t++) {
+    threads_[t].rng.Seed(static_cast<uint64_t>(seed) ^
+                         (static_cast<uint64_t>(t) << 48));
+  }
+}
+
+void Localizer::Reset() {
+  // start over with as many particles as we can afford, and keep them
+  // through the first Resample(): the reset spread says nothing about how
+  // many the first measurements will call for
+  n_particles_ = max_particles_;
+  n_bins_occupied_ = -1;
+  pool_.Run([](void *self, int t) {
+    reinterpret_cast<Localizer*>(self)->ResetChunk(t);
+  }, this);
   ResetLikelihood();
 }
 
+void Localizer::ResetChunk(int t) {
+  int begin, end;
+  ParticleRange(n_particles_, t, &begin, &end);
+  int n = end - begin;
+  float *nx = noise_ + begin,
+        *ny = nx + PaddedParticles(),
+        *ntheta = ny + PaddedParticles();
+  threads_[t].rng.FillNormal(nx, n, 0.025 * RANDN_SIGMA);
+  threads_[t].rng.FillNormal(ny, n, 0.025 * RANDN_SIGMA);
+  threads_[t].rng.FillNormal(ntheta, n, 0.1 * RANDN_SIGMA);
+  for (int i = begin; i < end; i++) {
+    x_[i] = nx[i - begin] + home_x_;
+    y_[i] = ny[i - begin] + home_y_;
+    theta_[i] = ntheta[i - begin] + home_theta_;
+    heading_[i] = theta_[i];
+  }
+}
+
 void Localizer::ResetLikelihood() {
-  for (int i = 0; i < n_particles_; i++) {
+  for (int i = 0; i < PaddedParticles(); i++) {
     LL_[i] = -1e6;
   }
   LLmax_ = -1e6;
@@ -81,100 +186,257 @@ bool Localizer::LoadLandmarks(const char *filename) {
         home_x_, home_y_, home_theta_);
   }
   fclose(fp);
-  c0_ = new uint16_t[n_particles_ * n_landmarks_];
-  c1_ = new uint16_t[n_particles_ * n_landmarks_];
+  BuildLandmarkGrid();
+  visible_ = new int[n_landmarks_];
+  n_visible_ = 0;
+  c0_ = new uint16_t[max_particles_ * n_landmarks_];
+  c1_ = new uint16_t[max_particles_ * n_landmarks_];
   Reset();
   return true;
 }
 
-void Localizer::Predict(float ds, float w, float dt) {
-  for (int i = 0; i < n_particles_; i++) {
-    float t = particles_[i].theta + w*dt + randn()*NOISE_ANGULAR*ds*dt;
-
-    // low-pass filter the forward direction to determine the car's travel
-    // direction (heading); this way we spread out the particles in a turn
-    // assuming some unknown amount of understeer
-    float alpha = randn() * NOISE_STEER_s + NOISE_STEER_u;
-    float h = particles_[i].heading;
-    h += alpha*(t - h);
+void Localizer::BuildLandmarkGrid() {
+  float xmin = 0, xmax = 0, ymin = 0, ymax = 0;
+  for (int j = 0; j < n_landmarks_; j++) {
+    const Landmark &l = landmarks_[j];
+    if (j == 0 || l.x < xmin) xmin = l.x;
+    if (j == 0 || l.x > xmax) xmax = l.x;
+    if (j == 0 || l.y < ymin) ymin = l.y;
+    if (j == 0 || l.y > ymax) ymax = l.y;
+  }
+  grid_x0_ = xmin;
+  grid_y0_ = ymin;
+  grid_w_ = 1 + static_cast<int>((xmax - xmin) / grid_cell_);
+  grid_h_ = 1 + static_cast<int>((ymax - ymin) / grid_cell_);
+
+  // counting sort of landmarks by cell
+  int ncells = grid_w_ * grid_h_;
+  int *cell = new int[n_landmarks_];
+  delete[] grid_start_;
+  delete[] grid_lm_;
+  grid_start_ = new int[ncells + 1];
+  grid_lm_ = new int[n_landmarks_];
+  memset(grid_start_, 0, (ncells + 1) * sizeof(int));
+  for (int j = 0; j < n_landmarks_; j++) {
+    // -ffast-math can round a landmark on the far edge one cell past the
+    // grid size computed above, so clamp
+    int cx = (landmarks_[j].x - grid_x0_) / grid_cell_;
+    int cy = (landmarks_[j].y - grid_y0_) / grid_cell_;
+    cx = std::min(std::max(cx, 0), grid_w_ - 1);
+    cy = std::min(std::max(cy, 0), grid_h_ - 1);
+    cell[j] = cy * grid_w_ + cx;
+    grid_start_[cell[j] + 1]++;
+  }
+  for (int c = 0; c < ncells; c++) {
+    grid_start_[c + 1] += grid_start_[c];
+  }
+  int *fill = new int[ncells];
+  memcpy(fill, grid_start_, ncells * sizeof(int));
+  for (int j = 0; j < n_landmarks_; j++) {
+    grid_lm_[fill[cell[j]]++] = j;
+  }
+  delete[] fill;
+  delete[] cell;
+}
 
-    // disable for now
-    h = t;
+void Localizer::CullLandmarks() {
+  // the fisheye ring sees all the way around, so there's no culling by
+  // heading; only by distance from the particle cloud
+  float xmin = x_[0], xmax = x_[0], ymin = y_[0], ymax = y_[0];
+  for (int i = 1; i < n_particles_; i++) {
+    xmin = std::min(xmin, x_[i]);
+    xmax = std::max(xmax, x_[i]);
+    ymin = std::min(ymin, y_[i]);
+    ymax = std::max(ymax, y_[i]);
+  }
 
-    float S = sin(h);
-    float C = cos(h);
+  int cx0 = floorf((xmin - max_range_ - grid_x0_) / grid_cell_);
+  int cx1 = floorf((xmax + max_range_ - grid_x0_) / grid_cell_);
+  int cy0 = floorf((ymin - max_range_ - grid_y0_) / grid_cell_);
+  int cy1 = floorf((ymax + max_range_ - grid_y0_) / grid_cell_);
+  cx0 = std::max(cx0, 0);
+  cy0 = std::max(cy0, 0);
+  cx1 = std::min(cx1, grid_w_ - 1);
+  cy1 = std::min(cy1, grid_h_ - 1);
+
+  n_visible_ = 0;
+  for (int cy = cy0; cy <= cy1; cy++) {
+    for (int cx = cx0; cx <= cx1; cx++) {
+      int c = cy * grid_w_ + cx;
+      for (int k = grid_start_[c]; k < grid_start_[c + 1]; k++) {
+        int j = grid_lm_[k];
+        const Landmark &l = landmarks_[j];
+        // distance from the landmark to the particles' bounding box
+        float dx = std::max(std::max(xmin - l.x, l.x - xmax), 0.0f);
+        float dy = std::max(std::max(ymin - l.y, l.y - ymax), 0.0f);
+        if (dx*dx + dy*dy <= max_range_*max_range_) {
+          visible_[n_visible_++] = j;
+        }
+      }
+    }
+  }
+}
 
-    float dx = ds + randn()*NOISE_LONG*ds*dt;
-    float dy = randn()*NOISE_LAT*ds*dt;
+void Localizer::Predict(float ds, float w, float dt) {
+  struct {
+    Localizer *self;
+    float ds, w, dt;
+  } args = {this, ds, w, dt};
+  pool_.Run([](void *arg, int t) {
+    auto a = reinterpret_cast<decltype(args)*>(arg);
+    a->self->PredictChunk(t, a->ds, a->w, a->dt);
+  }, &args);
+}
 
-    particles_[i].x += dx*C - dy*S;
-    particles_[i].y += dx*S + dy*C;
-    particles_[i].theta = t;
-    particles_[i].heading = h;
+void Localizer::PredictChunk(int thread, float ds, float w, float dt) {
+  int begin, end;
+  ParticleRange(n_particles_, thread, &begin, &end);
+  // the last chunk runs on into the padding so we can go four at a time
+  int n = ((end + 3) & ~3) - begin;
+  float *nangular = noise_ + begin,
+        *nlong = nangular + PaddedParticles(),
+        *nlat = nlong + PaddedParticles();
+  RNG &rng = threads_[thread].rng;
+  rng.FillNormal(nangular, n, RANDN_SIGMA*NOISE_ANGULAR*ds*dt);
+  rng.FillNormal(nlong, n, RANDN_SIGMA*NOISE_LONG*ds*dt);
+  rng.FillNormal(nlat, n, RANDN_SIGMA*NOISE_LAT*ds*dt);
+
+  // the understeer model (low-pass filtering heading towards theta by a
+  // random gain NOISE_STEER_u +- NOISE_STEER_s, to spread out the particles
+  // in a turn) is disabled for now, so heading just tracks theta
+  const fm::v4f wdt = fm::set1(w*dt), vds = fm::set1(ds);
+  for (int i = 0; i < n; i += 4) {
+    int k = begin + i;
+    fm::v4f t = fm::add(fm::add(fm::load(theta_ + k), wdt),
+                        fm::load(nangular + i));
+    fm::v4f S, C;
+    fm::sincos(t, &S, &C);
+
+    fm::v4f dx = fm::add(vds, fm::load(nlong + i));
+    fm::v4f dy = fm::load(nlat + i);
+
+    fm::store(x_ + k, fm::add(fm::load(x_ + k),
+                              fm::sub(fm::mul(dx, C), fm::mul(dy, S))));
+    fm::store(y_ + k, fm::add(fm::load(y_ + k),
+                              fm::add(fm::mul(dx, S), fm::mul(dy, C))));
+    fm::store(theta_ + k, t);
+    fm::store(heading_ + k, t);
   }
 }
 
 void Localizer::UpdateLM(float lm_bearing, float precision,
                          float bogon_thresh) {
-  float mindiffsqr = bogon_thresh*bogon_thresh;
-
-  // for each particle, find likeliest landmark and its likelihood
-  for (int i = 0; i < n_particles_; i++) {
-    const Particle &p = particles_[i];
-    float S = sin(p.theta),
-          C = cos(p.theta);
+  struct {
+    Localizer *self;
+    float lm_bearing, precision, bogon_thresh;
+  } args = {this, lm_bearing, precision, bogon_thresh};
+  pool_.Run([](void *arg, int t) {
+    auto a = reinterpret_cast<decltype(args)*>(arg);
+    a->self->UpdateLMChunk(t, a->lm_bearing, a->precision, a->bogon_thresh);
+  }, &args);
+  for (int t = 0; t < pool_.NumThreads(); t++) {
+    if (threads_[t].LLmax > LLmax_) {
+      LLmax_ = threads_[t].LLmax;
+    }
+  }
 #ifdef PF_DEBUG
-    printf("%d: ", i);
+  printf("LLmax=%f (%d landmarks)\n", LLmax_, n_landmarks_);
 #endif
+}
+
+void Localizer::UpdateLMChunk(int t, float lm_bearing, float precision,
+                              float bogon_thresh) {
+  const fm::v4f mindiffsqr = fm::set1(bogon_thresh*bogon_thresh);
+  const fm::v4f bearing = fm::set1(lm_bearing);
+  const fm::v4f negprecision = fm::set1(-precision);
+  const fm::v4f zero = fm::set1(0);
+
+  // for each particle, find likeliest landmark and its likelihood, four
+  // particles at a time; padding particles are evaluated but ignored
+  int begin, end;
+  ParticleRange(n_particles_, t, &begin, &end);
+  for (int i = begin; i < end; i += 4) {
+    fm::v4f px = fm::load(x_ + i), py = fm::load(y_ + i);
+    fm::v4f S, C;
+    fm::sincos(fm::load(theta_ + i), &S, &C);
+    fm::v4f LL = fm::load(LL_ + i);
     for (int j = 0; j < n_landmarks_; j++) {
       const Landmark &l = landmarks_[j];
-      float dx = l.x - p.x,
-            dy = l.y - p.y;
-      float z = dx*C + dy*S,
-            y = dx*S - dy*C;
-      float d = sqrt(dx*dx + dy*dy);
-      float coneangle = 2*asin(fmin(CONE_RADIUS / d, 1));
-      float diff = fmax(fabs(atan2f(y, z) - lm_bearing) - coneangle, 0);
-      float L = -precision*fmin(mindiffsqr, diff*diff);
-#ifdef PF_DEBUG
-      printf("[%d]%f %f ", j, diff, L);
-#endif
-      if (L > LL_[i]) {
-        LL_[i] = L;
-      }
+      fm::v4f dx = fm::sub(fm::set1(l.x), px),
+              dy = fm::sub(fm::set1(l.y), py);
+      fm::v4f z = fm::add(fm::mul(dx, C), fm::mul(dy, S)),
+              y = fm::sub(fm::mul(dx, S), fm::mul(dy, C));
+      fm::v4f d2 = fm::add(fm::mul(dx, dx), fm::mul(dy, dy));
+      fm::v4f r = fm::min(fm::mul(fm::set1(CONE_RADIUS), fm::rsqrt(d2)),
+                          fm::set1(1));
+      fm::v4f coneangle = fm::mul(fm::set1(2), fm::asin_pos(r));
+      fm::v4f diff = fm::max(
+          fm::sub(fm::abs(fm::sub(fm::atan2(y, z), bearing)), coneangle),
+          zero);
+      fm::v4f L = fm::mul(negprecision, fm::min(mindiffsqr,
+                                                fm::mul(diff, diff)));
+      LL = fm::max(LL, L);
     }
-#ifdef PF_DEBUG
-    printf("LL[i]=%f\n", LL_[i]);
-#endif
-    if (LL_[i] > LLmax_) {
-      LLmax_ = LL_[i];
+    fm::store(LL_ + i, LL);
+  }
+  float LLmax = -1e6;
+  for (int i = begin; i < end; i++) {
+    if (LL_[i] > LLmax) {
+      LLmax = LL_[i];
     }
   }
-#ifdef PF_DEBUG
-  printf("LLmax=%f (%d landmarks)\n", LLmax_, n_landmarks_);
-#endif
+  threads_[t].LLmax = LLmax;
 }
 
-// FIXME: this is all hardcoded from OpenCV until we can integrate with the
-// fisheye class and just load the calibration params off disk
-static const int16_t fisheyeLUT[] = {
-#include "uvmap1.txt"
-};
-
-void Localizer::Update(const uint8_t *yuvimg, float temperature) {
-  const uint8_t *V = yuvimg+(640*480 + 320*240);
-  memset(activations_, 0, sizeof(activations_));
-  int idx = 0;
-  // remap fisheye into an array of pixel activations
+void Localizer::InitRing(const FisheyeLens &lens, float camtilt,
+                         float azimuth0) {
+  // rows are spaced one chroma pixel apart, from 10 pixels inside the horizon
+  // to 3 outside it
+  const float fx = lens.FocalLengthX() / 2;
+  const float S = sin(camtilt), C = cos(camtilt);
+  std::vector<std::pair<uint32_t, uint16_t> > samples;
+  memset(ring_bias_, 0, sizeof(ring_bias_));
   for (int j = 0; j < kFisheyeLUT_h; j++) {
+    float polar = M_PI_2 + (j - 10) / fx;
     for (int i = 0; i < kFisheyeLUT_w; i++) {
-      int16_t x = fisheyeLUT[idx++];
-      int16_t y = fisheyeLUT[idx++];
-      if (x < 0 || x >= 320 || y < 0 || y >= 240) continue;
-      // an activation is just the signed V channel magnitude
-      activations_[i] += static_cast<int32_t>(V[y*320 + x]) - 128;
+      float az = azimuth0 + i * 2 * M_PI / kFisheyeLUT_w;
+      // ray in the frame of an upward-facing camera, then un-rotated into the
+      // real camera frame by the tilt
+      float wx = sin(polar) * sin(az), wy = -sin(polar) * cos(az),
+            wz = cos(polar);
+      float px = C * wx - S * wz, py = wy, pz = S * wx + C * wz;
+      float u, v;
+      lens.DistortPoint(px, py, pz, &u, &v);
+      // lens is calibrated at 640x480, V plane is 320x240
+      int x = floorf(u / 2), y = floorf(v / 2);
+      if (x < 0 || x >= 320 || y < 0 || y >= 240) {
+        continue;
+      }
+      samples.push_back(std::make_pair(y * 320 + x, i));
+      ring_bias_[i] -= 128;
     }
   }
+  std::sort(samples.begin(), samples.end());
+
+  delete[] ring_src_;
+  delete[] ring_col_;
+  n_ring_ = samples.size();
+  ring_src_ = new uint32_t[n_ring_];
+  ring_col_ = new uint16_t[n_ring_];
+  for (int k = 0; k < n_ring_; k++) {
+    ring_src_[k] = samples[k].first;
+    ring_col_[k] = samples[k].second;
+  }
+}
+
+void Localizer::Update(const uint8_t *yuvimg, float temperature) {
+  const uint8_t *V = yuvimg+(640*480 + 320*240);
+  // remap fisheye into an array of pixel activations; an activation is just
+  // the signed V channel magnitude
+  memcpy(activations_, ring_bias_, sizeof(ring_bias_));
+  for (int k = 0; k < n_ring_; k++) {
+    activations_[ring_col_[k]] += V[ring_src_[k]];
+  }
   // make a second copy of the activations to handle angular wraparound
   for (int i = 0; i < kFisheyeLUT_w; i++) {
     activations_[kFisheyeLUT_w + i] = activations_[i];
@@ -184,91 +446,230 @@ void Localizer::Update(const uint8_t *yuvimg, float temperature) {
     activations_[i] += activations_[i-1];
   }
 
+  CullLandmarks();
+
+  struct {
+    Localizer *self;
+    float temperature;
+  } args = {this, temperature};
+  pool_.Run([](void *arg, int t) {
+    auto a = reinterpret_cast<decltype(args)*>(arg);
+    a->self->UpdateChunk(t, a->temperature);
+  }, &args);
+  for (int t = 0; t < pool_.NumThreads(); t++) {
+    if (threads_[t].LLmax > LLmax_) {
+      LLmax_ = threads_[t].LLmax;
+    }
+  }
+}
+
+void Localizer::UpdateChunk(int t, float temperature) {
   const float angratio = kFisheyeLUT_w / (2*M_PI);
+  const fm::v4f vangratio = fm::set1(angratio);
+  const fm::v4f lutw = fm::set1(kFisheyeLUT_w);
+  const fm::v4f zero = fm::set1(0);
   // next, get the likelihood of each particle by looking up the expected
-  // position of each cone and adding up the summed activations
-  int c0idx = 0;
-  for (int i = 0; i < n_particles_; i++) {
-    const Particle &p = particles_[i];
-    float S = sin(p.theta),
-          C = cos(p.theta);
-
-    LL_[i] = 0;
-    for (int j = 0; j < n_landmarks_; j++) {
-      const Landmark &l = landmarks_[j];
-      float dx = l.x - p.x,
-            dy = l.y - p.y;
-      float z = dx*C + dy*S,
-            y = -dx*S + dy*C;
-      float d = sqrt(dx*dx + dy*dy);
-      float visibleradius = angratio * asin(fmin(CONE_RADIUS / d, 1));
-      float coneangle = angratio * atan2f(y, z);
-      int c0 = roundf(coneangle - visibleradius);
-      int c1 = roundf(coneangle + visibleradius);
-      if (c0 < 0) {
-        c0 += kFisheyeLUT_w;
-        c1 += kFisheyeLUT_w;
+  // position of each cone and adding up the summed activations; bearings are
+  // computed four particles at a time, and the activation lookups are
+  // gathered per particle
+  int begin, end;
+  ParticleRange(n_particles_, t, &begin, &end);
+  float LLmax = -1e6;
+  for (int i = begin; i < end; i += 4) {
+    fm::v4f px = fm::load(x_ + i), py = fm::load(y_ + i);
+    fm::v4f S, C;
+    fm::sincos(fm::load(theta_ + i), &S, &C);
+    int32_t LLsum[4] = {0, 0, 0, 0};
+    int nlanes = end - i < 4 ? end - i : 4;
+    for (int v = 0; v < n_visible_; v++) {
+      const Landmark &l = landmarks_[visible_[v]];
+      fm::v4f dx = fm::sub(fm::set1(l.x), px),
+              dy = fm::sub(fm::set1(l.y), py);
+      fm::v4f z = fm::add(fm::mul(dx, C), fm::mul(dy, S)),
+              y = fm::sub(fm::mul(dy, C), fm::mul(dx, S));
+      fm::v4f d2 = fm::add(fm::mul(dx, dx), fm::mul(dy, dy));
+      fm::v4f r = fm::min(fm::mul(fm::set1(CONE_RADIUS), fm::rsqrt(d2)),
+                          fm::set1(1));
+      fm::v4f visibleradius = fm::mul(vangratio, fm::asin_pos(r));
+      fm::v4f coneangle = fm::mul(vangratio, fm::atan2(y, z));
+      // coneangle is within +-w/2 and visibleradius within w/4, so after
+      // wrapping negative angles around both ends are always within the
+      // doubled-up activation array
+      fm::v4f c0f = fm::round(fm::sub(coneangle, visibleradius));
+      fm::v4f wrap = fm::select(fm::lt(c0f, zero), lutw, zero);
+      int32_t c0[4], c1[4];
+      fm::store_int(c0, fm::add(c0f, wrap));
+      fm::store_int(c1, fm::add(fm::round(fm::add(coneangle, visibleradius)),
+                                wrap));
+      for (int k = 0; k < nlanes; k++) {
+        c0_[(i + k) * n_visible_ + v] = c0[k];
+        c1_[(i + k) * n_visible_ + v] = c1[k];
+        LLsum[k] += activations_[c1[k]] - activations_[c0[k]];
       }
-      assert(c0 >= 0);
-      assert(c0 < kFisheyeLUT_w*2);
-      assert(c1 >= 0);
-      assert(c1 < kFisheyeLUT_w*2);
-      c0_[c0idx] = c0;
-      c1_[c0idx] = c1;
-      c0idx++;
-      LL_[i] += (activations_[c1] - activations_[c0]) * temperature;
     }
-    if (LL_[i] > LLmax_) {
-      LLmax_ = LL_[i];
+    for (int k = 0; k < nlanes; k++) {
+      LL_[i + k] = LLsum[k] * temperature;
+      if (LL_[i + k] > LLmax) {
+        LLmax = LL_[i + k];
+      }
     }
   }
+  threads_[t].LLmax = LLmax;
 }
 
 void Localizer::Resample() {
-  // now, normalize the distribution and resample particles
+  // now, normalize the distribution and turn LL_ into a cumulative
+  // distribution; each thread sums its own chunk, then the chunk totals are
+  // scanned and added back on in parallel
+  pool_.Run([](void *self, int t) {
+    reinterpret_cast<Localizer*>(self)->WeightChunk(t);
+  }, this);
   float totalP = 0;
-  for (int i = 0; i < n_particles_; i++) {
-    LL_[i] = exp(LL_[i] - LLmax_);
-    totalP += LL_[i];
-#ifdef PF_DEBUG
-    printf("%0.3f ", LL_[i]);
-#endif
+  for (int t = 0; t < pool_.NumThreads(); t++) {
+    float p = threads_[t].Psum;
+    threads_[t].Psum = totalP;
+    totalP += p;
   }
+  pool_.Run([](void *self, int t) {
+    Localizer *l = reinterpret_cast<Localizer*>(self);
+    float offset = l->threads_[t].Psum;
+    int begin, end;
+    l->ParticleRange(l->n_particles_, t, &begin, &end);
+    for (int i = begin; i < end; i++) {
+      l->LL_[i] += offset;
+    }
+  }, this);
 #ifdef PF_DEBUG
-  printf(" | total=%f\nresample: ", totalP);
+  printf("total=%f\n", totalP);
 #endif
-  float deltaP = totalP / n_particles_;
-  // pick a random starting location weighted by particle likelihood
-  float randP = drand48() * totalP;
-  Particle *newp = new Particle[n_particles_];
-  int j = 0;
+
+  // with KLD-sampling, draw as many particles as the spread of the last
+  // resampled set called for, or all of them if there hasn't been one since
+  // Reset()
+  int n_out = n_particles_;
+  if (min_particles_ < max_particles_) {
+    n_out = n_bins_occupied_ < 0 ? max_particles_ :
+        KLDParticleCount(n_bins_occupied_);
+  }
+
+  // systematic resampling: particle i is drawn at randP + i*deltaP along the
+  // CDF, so each thread can binary search for the start of its chunk
+  float deltaP = totalP / n_out;
+  float randP = threads_[0].rng.UniformScalar() * deltaP;
+  struct {
+    Localizer *self;
+    int n_out;
+    float randP, deltaP;
+    float *newx;
+  } args = {this, n_out, randP, deltaP, back_};
+  pool_.Run([](void *arg, int t) {
+    auto a = reinterpret_cast<decltype(args)*>(arg);
+    a->self->ResampleChunk(t, a->n_out, a->randP, a->deltaP, a->newx);
+  }, &args);
+  n_particles_ = n_out;
+
+  ResetLikelihood();
+
+  std::swap(x_, back_);
+  y_ = x_ + PaddedParticles();
+  theta_ = y_ + PaddedParticles();
+  heading_ = theta_ + PaddedParticles();
+
+  if (min_particles_ < max_particles_) {
+    n_bins_occupied_ = CountOccupiedBins();
+  }
+}
+
+int Localizer::KLDParticleCount(int k) const {
+  if (k < 2) {
+    return min_particles_;
+  }
+  // Fox 2003, using the Wilson-Hilferty approximation to the chi-square
+  // quantile; z is the upper 1% quantile of the standard normal
+  const float z = 2.326;
+  float a = 2.0 / (9 * (k - 1));
+  float b = 1 - a + sqrt(a) * z;
+  float n = (k - 1) / (2 * kld_epsilon_) * b * b * b;
+  if (n >= max_particles_) {
+    return max_particles_;
+  }
+  return std::max(static_cast<int>(n), min_particles_);
+}
+
+int Localizer::CountOccupiedBins() {
+  const uint64_t kEmpty = ~0ULL;
+  for (int i = 0; i < bins_size_; i++) {
+    bins_[i] = kEmpty;
+  }
+  int k = 0;
   for (int i = 0; i < n_particles_; i++) {
-    while (randP > LL_[j]) {
-      randP -= LL_[j];
-      j++;
-      if (j == n_particles_) {
-        j = 0;
+    float theta = fmodf(theta_[i], 2 * M_PI);
+    if (theta < 0) {
+      theta += 2 * M_PI;
+    }
+    uint64_t bx = static_cast<int>(floorf(x_[i] / kld_bin_xy_)) & 0x1fffff;
+    uint64_t by = static_cast<int>(floorf(y_[i] / kld_bin_xy_)) & 0x1fffff;
+    uint64_t bt = static_cast<int>(theta / kld_bin_theta_) & 0x1fffff;
+    uint64_t key = bx | (by << 21) | (bt << 42);
+    uint32_t h = (key * 0x9e3779b97f4a7c15ULL) >> 32;
+    for (;;) {
+      h &= bins_size_ - 1;
+      if (bins_[h] == key) {
+        break;
+      }
+      if (bins_[h] == kEmpty) {
+        bins_[h] = key;
+        k++;
+        break;
       }
+      h++;
     }
-    newp[i] = particles_[j];
+  }
+  return k;
+}
+
+void Localizer::WeightChunk(int t) {
+  int begin, end;
+  ParticleRange(n_particles_, t, &begin, &end);
+  float sum = 0;
+  for (int i = begin; i < end; i++) {
+    sum += exp(LL_[i] - LLmax_);
+    LL_[i] = sum;
+  }
+  threads_[t].Psum = sum;
+}
+
+void Localizer::ResampleChunk(int t, int n_out, float randP, float deltaP,
+                              float *newx) {
+  float *newy = newx + PaddedParticles();
+  float *newtheta = newy + PaddedParticles();
+  float *newheading = newtheta + PaddedParticles();
+  int begin, end;
+  ParticleRange(n_out, t, &begin, &end);
+  if (begin == end) {
+    return;
+  }
+  // first particle whose cumulative probability exceeds our starting point
+  float P = randP + begin * deltaP;
+  int j = std::upper_bound(LL_, LL_ + n_particles_, P) - LL_;
+  for (int i = begin; i < end; i++) {
+    while (j < n_particles_ - 1 && LL_[j] <= P) {
+      j++;
+    }
+    if (j > n_particles_ - 1) {
+      j = n_particles_ - 1;
+    }
+    newx[i] = x_[j];
+    newy[i] = y_[j];
+    newtheta[i] = theta_[j];
+    newheading[i] = heading_[j];
 
     // canonicalize angles while resampling
     // newp[i].theta = fmodf(newp[i].theta + M_PI, 2*M_PI) - M_PI;
     // NO! we can't do this if we then go around and average theta!
 
-#ifdef PF_DEBUG
-    printf("%d ", j);
-#endif
-    randP += deltaP;
+    P = randP + (i + 1) * deltaP;
   }
-#ifdef PF_DEBUG
-  printf("\n");
-#endif
-
-  ResetLikelihood();
-
-  delete[] particles_;
-  particles_ = newp;
 }
 
 bool Localizer::GetLocationEstimate(Particle *mean) const {
@@ -279,10 +680,10 @@ bool Localizer::GetLocationEstimate(Particle *mean) const {
   mean->theta = 0;
   mean->heading = 0;
   for (int i = 0; i < n_particles_; i++) {
-    mean->x += particles_[i].x;
-    mean->y += particles_[i].y;
-    mean->theta += particles_[i].theta;
-    mean->heading += particles_[i].heading;
+    mean->x += x_[i];
+    mean->y += y_[i];
+    mean->theta += theta_[i];
+    mean->heading += heading_[i];
   }
   mean->x /= n_particles_;
   mean->y /= n_particles_;
@@ -291,25 +692,129 @@ bool Localizer::GetLocationEstimate(Particle *mean) const {
   return true;
 }
 
-int Localizer::SerializedSize() const {
-  // Saves two chunks out: particle positions and activations
-  // we should also show the particle lookups done...?
-  int len = 8 + n_particles_ * sizeof(Particle);  // IFF header + particles
-  len += 8 + kFisheyeLUT_w * sizeof(int32_t);  // IFF header + activations
+// quantization of the delta-coded particle chunk
+const float MCLD_XY_QUANTUM = 1e-3;      // meters
+const float MCLD_THETA_QUANTUM = 1e-4;   // radians
 
-  // IFF header + #landmarks + per-particle expectations
-  len += 8 + 1 + 2 * n_landmarks_ * n_particles_ * sizeof(uint16_t);
+static inline uint8_t *PutVarint(uint8_t *buf, int32_t v) {
+  // zigzag so small negative numbers are short too
+  uint32_t u = (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31);
+  while (u >= 0x80) {
+    *buf++ = u | 0x80;
+    u >>= 7;
+  }
+  *buf++ = u;
+  return buf;
+}
+
+static inline const uint8_t *GetVarint(const uint8_t *buf, const uint8_t *end,
+                                       int32_t *v) {
+  uint32_t u = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (buf == end) {
+      return NULL;
+    }
+    uint8_t b = *buf++;
+    u |= static_cast<uint32_t>(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *v = static_cast<int32_t>(u >> 1) ^ -static_cast<int32_t>(u & 1);
+      return buf;
+    }
+  }
+  return NULL;
+}
+
+void Localizer::SetLogLevel(LogLevel level, int topk) {
+  log_level_ = level;
+  log_topk_ = topk;
+}
+
+int Localizer::NumLoggedParticles() const {
+  switch (log_level_) {
+    case LOG_FULL:
+      return n_particles_;
+    case LOG_TOPK:
+      return std::min(log_topk_, n_particles_);
+    default:
+      return 0;
+  }
+}
+
+int Localizer::SerializedSize() const {
+  // IFF header + activations
+  int len = 8 + kFisheyeLUT_w * sizeof(int32_t);
+  if (log_level_ == LOG_FULL) {
+    len += 8 + n_particles_ * sizeof(Particle);  // IFF header + particles
+  } else if (log_level_ == LOG_TOPK) {
+    // IFF header + count + quanta + up to 5 varint bytes per field
+    len += 8 + 12 + NumLoggedParticles() * 4 * 5;
+  }
+  if (log_level_ == LOG_SUMMARY) {
+    len += 8 + 4 + 4 * 4 + 9 * 4;  // count, mean, x/y/theta covariance
+  } else {
+    // IFF header + #landmarks + per-particle expectations
+    len += 8 + 1 + 2 * n_landmarks_ * NumLoggedParticles() * sizeof(uint16_t);
+  }
   return len;
 }
 
 int Localizer::Serialize(uint8_t *buf, int buflen) const {
-  int totallen = SerializedSize();
-  assert(buflen > totallen);
-  uint32_t len = n_particles_ * sizeof(Particle) + 8;
-  memcpy(buf, "MCL4", 4);  // monte carlo localizer, 4-dim particles
-  memcpy(buf+4, &len, 4);
-  memcpy(buf+8, particles_, n_particles_ * sizeof(Particle));
-  buf += 8 + n_particles_ * sizeof(Particle);
+  assert(buflen > SerializedSize());
+  uint8_t *start = buf;
+
+  // particles in log order: in top-K mode, the K likeliest, so that the
+  // MCLd and LM01 rows line up
+  int *order = order_;
+  for (int i = 0; i < n_particles_; i++) {
+    order[i] = i;
+  }
+  int nlogged = NumLoggedParticles();
+  if (log_level_ == LOG_TOPK) {
+    const float *LL = LL_;
+    std::partial_sort(order, order + nlogged, order + n_particles_,
+                      [LL](int a, int b) { return LL[a] > LL[b]; });
+  }
+
+  uint32_t len;
+  if (log_level_ == LOG_FULL) {
+    len = n_particles_ * sizeof(Particle) + 8;
+    memcpy(buf, "MCL4", 4);  // monte carlo localizer, 4-dim particles
+    memcpy(buf+4, &len, 4);
+    // the log format is still an array of Particle structs
+    for (int i = 0; i < n_particles_; i++) {
+      float p[4] = {x_[i], y_[i], theta_[i], heading_[i]};
+      memcpy(buf + 8 + i * sizeof(Particle), p, sizeof(Particle));
+    }
+    buf += len;
+  } else if (log_level_ == LOG_TOPK) {
+    // quantized, delta coded against the previous particle, and varint
+    // encoded; resampled particles are often exact copies of their neighbors
+    // and heading is coded relative to theta
+    uint8_t *chunk = buf;
+    memcpy(buf, "MCLd", 4);
+    uint32_t n = nlogged;
+    memcpy(buf+8, &n, 4);
+    memcpy(buf+12, &MCLD_XY_QUANTUM, 4);
+    memcpy(buf+16, &MCLD_THETA_QUANTUM, 4);
+    buf += 20;
+    int32_t prev[3] = {0, 0, 0};
+    for (int k = 0; k < nlogged; k++) {
+      int i = order[k];
+      int32_t q[3] = {
+        static_cast<int32_t>(lroundf(x_[i] / MCLD_XY_QUANTUM)),
+        static_cast<int32_t>(lroundf(y_[i] / MCLD_XY_QUANTUM)),
+        static_cast<int32_t>(lroundf(theta_[i] / MCLD_THETA_QUANTUM))
+      };
+      for (int f = 0; f < 3; f++) {
+        buf = PutVarint(buf, q[f] - prev[f]);
+        prev[f] = q[f];
+      }
+      buf = PutVarint(buf, static_cast<int32_t>(
+              lroundf(heading_[i] / MCLD_THETA_QUANTUM)) - q[2]);
+    }
+    len = buf - chunk;
+    memcpy(chunk+4, &len, 4);
+  }
 
   len = kFisheyeLUT_w * sizeof(int32_t) + 8;
   memcpy(buf, "aCDF", 4);  // activation cumulative distribution function
@@ -317,17 +822,93 @@ int Localizer::Serialize(uint8_t *buf, int buflen) const {
   memcpy(buf+8, activations_, kFisheyeLUT_w * sizeof(int32_t));
   buf += 8 + kFisheyeLUT_w * sizeof(int32_t);
 
-  len = 8 + 1 + 2 * n_landmarks_ * n_particles_* sizeof(uint16_t);
-  memcpy(buf, "LM01", 4);  // landmark location
-  memcpy(buf+4, &len, 4);
-  buf[8] = n_landmarks_;
-  buf += 9;
-  memcpy(buf, c0_, n_landmarks_ * n_particles_ * sizeof(uint16_t));
-  buf += n_landmarks_ * n_particles_ * 2;
-  memcpy(buf, c1_, n_landmarks_ * n_particles_ * sizeof(uint16_t));
-  buf += n_landmarks_ * n_particles_ * 2;
+  if (log_level_ == LOG_SUMMARY) {
+    // mean and covariance of x, y, theta
+    double sum[3] = {0, 0, 0}, sum2[3][3] = {{0}};
+    float mean[4] = {0, 0, 0, 0};
+    for (int i = 0; i < n_particles_; i++) {
+      double v[3] = {x_[i], y_[i], theta_[i]};
+      for (int a = 0; a < 3; a++) {
+        sum[a] += v[a];
+        for (int b = 0; b < 3; b++) {
+          sum2[a][b] += v[a] * v[b];
+        }
+      }
+      mean[3] += heading_[i];
+    }
+    float cov[9];
+    for (int a = 0; a < 3; a++) {
+      mean[a] = sum[a] / n_particles_;
+      for (int b = 0; b < 3; b++) {
+        cov[a*3 + b] = sum2[a][b] / n_particles_ -
+            sum[a] * sum[b] / (static_cast<double>(n_particles_) * n_particles_);
+      }
+    }
+    mean[3] /= n_particles_;
+
+    len = 8 + 4 + sizeof(mean) + sizeof(cov);
+    memcpy(buf, "MCLs", 4);  // particle cloud summary
+    memcpy(buf+4, &len, 4);
+    uint32_t n = n_particles_;
+    memcpy(buf+8, &n, 4);
+    memcpy(buf+12, mean, sizeof(mean));
+    memcpy(buf+12+sizeof(mean), cov, sizeof(cov));
+    buf += len;
+  } else {
+    len = 8 + 1 + 2 * n_landmarks_ * nlogged * sizeof(uint16_t);
+    memcpy(buf, "LM01", 4);  // landmark location
+    memcpy(buf+4, &len, 4);
+    buf[8] = n_landmarks_;
+    buf += 9;
+    // expand back out to every landmark; culled ones get c0 = c1 = 0
+    uint8_t *c0 = buf, *c1 = buf + n_landmarks_ * nlogged * 2;
+    memset(buf, 0, 2 * n_landmarks_ * nlogged * sizeof(uint16_t));
+    for (int k = 0; k < nlogged; k++) {
+      int i = order[k];
+      for (int v = 0; v < n_visible_; v++) {
+        int o = k * n_landmarks_ + visible_[v];
+        memcpy(c0 + 2*o, &c0_[i * n_visible_ + v], sizeof(uint16_t));
+        memcpy(c1 + 2*o, &c1_[i * n_visible_ + v], sizeof(uint16_t));
+      }
+    }
+    buf += 2 * n_landmarks_ * nlogged * sizeof(uint16_t);
+  }
 
-  return totallen;
+  return buf - start;
+}
+
+int Localizer::DecodeParticles(const uint8_t *buf, int len, Particle *out,
+                               int max_particles) {
+  if (len < 20 || memcmp(buf, "MCLd", 4) != 0) {
+    return -1;
+  }
+  uint32_t n;
+  float qxy, qtheta;
+  memcpy(&n, buf+8, 4);
+  memcpy(&qxy, buf+12, 4);
+  memcpy(&qtheta, buf+16, 4);
+  if (n > static_cast<uint32_t>(max_particles)) {
+    return -1;
+  }
+  const uint8_t *p = buf + 20, *end = buf + len;
+  int32_t prev[3] = {0, 0, 0};
+  for (uint32_t i = 0; i < n; i++) {
+    int32_t d[4];
+    for (int f = 0; f < 4; f++) {
+      p = GetVarint(p, end, &d[f]);
+      if (!p) {
+        return -1;
+      }
+    }
+    for (int f = 0; f < 3; f++) {
+      prev[f] += d[f];
+    }
+    out[i].x = prev[0] * qxy;
+    out[i].y = prev[1] * qxy;
+    out[i].theta = prev[2] * qtheta;
+    out[i].heading = (prev[2] + d[3]) * qtheta;
+  }
+  return n;
 }
 
 int Localizer::HeaderSize() const {
@@ -1,12 +1,19 @@
 #ifndef CONESLAM_LOCALIZE_H_
 #define CONESLAM_LOCALIZE_H_
 
+#include <math.h>
 #include <stdlib.h>
 #include <stdint.h>
 
+#include "localization/coneslam/rng.h"
+#include "util/threadpool.h"
+
+class FisheyeLens;
+
 namespace coneslam {
 
-// hack hack hack
+// the activation ring: kFisheyeLUT_w columns around the horizon, each summing
+// kFisheyeLUT_h rows of V-plane samples just above and below it
 static const int kFisheyeLUT_w = 947;
 static const int kFisheyeLUT_h = 14;
 
@@ -22,20 +29,36 @@ struct Landmark {
 // Localization, assuming cone locations are all known
 class Localizer {
  public:
-  explicit Localizer(int n_particles) {
-    n_particles_ = n_particles;
-    particles_ = new Particle[n_particles];
-    n_landmarks_ = 0;
-    landmarks_ = NULL;
-    LL_ = new float[n_particles];
-    home_x_ = home_y_ = home_theta_ = 0;
-    Reset();
-  }
+  // particles are split into n_threads contiguous chunks, each with its own
+  // random number stream; results are repeatable for a given seed and
+  // thread count
+  explicit Localizer(int n_particles, int n_threads = 1);
+
+  // KLD-sampling: after each Resample() the particle count for the next
+  // frame is chosen, between min_particles and the n_particles we were
+  // constructed with, so that the KL divergence between the particle set and
+  // the true posterior stays below epsilon with 99% probability. The
+  // posterior's spread is measured by how many bin_xy x bin_xy x bin_theta
+  // histogram bins the particles occupy. The first Resample() after a
+  // Reset() keeps all n_particles.
+  void SetAdaptiveParticleCount(int min_particles, float epsilon,
+                                float bin_xy, float bin_theta);
 
   ~Localizer();
 
   bool LoadLandmarks(const char *filename);
 
+  // generate the activation ring lookup from the camera model; must be called
+  // before Update(). camtilt is as for CeilingTracker, and azimuth0 is the
+  // image-space direction of ring column 0 (i.e. straight ahead)
+  void InitRing(const FisheyeLens &lens, float camtilt,
+                float azimuth0 = -M_PI/4);
+  int RingSize() const { return n_ring_; }
+
+  // reseed the per-thread random number streams; call Reset() afterwards to
+  // get a repeatable run
+  void Seed(long seed);
+
   void Reset();
 
   // predict after encoder / gyro measurement
@@ -54,29 +77,132 @@ class Localizer {
   const Landmark *GetLandmarks() const { return landmarks_; }
   int NumLandmarks() const { return n_landmarks_; }
 
-  const Particle *GetParticles() const { return particles_; }
+  // Update() skips landmarks further than this from every particle. the
+  // default is where a cone shrinks to under one LUT column and so barely
+  // moves the likelihood
+  void SetMaxLandmarkRange(float range) { max_range_ = range; }
+  // number of landmarks evaluated in the last Update()
+  int NumVisibleLandmarks() const { return n_visible_; }
+
+  // particles are stored as separate x, y, theta, heading arrays
+  void GetParticle(int i, Particle *p) const {
+    p->x = x_[i];
+    p->y = y_[i];
+    p->theta = theta_[i];
+    p->heading = heading_[i];
+  }
+  const float *GetParticleX() const { return x_; }
+  const float *GetParticleY() const { return y_; }
+  const float *GetParticleTheta() const { return theta_; }
   int NumParticles() const { return n_particles_; }
-
+  int MaxParticles() const { return max_particles_; }
+  // log-likelihood of each particle accumulated since the last Resample()
+  const float *GetLikelihoods() const { return LL_; }
+
+  // what Serialize() writes each frame, besides the aCDF activations:
+  //   LOG_FULL: every particle raw (MCL4) and all their cone expectations
+  //     (LM01)
+  //   LOG_TOPK: the K likeliest particles delta+varint coded (MCLd),
+  //     likeliest first, and their cone expectations (LM01)
+  //   LOG_SUMMARY: just particle mean and covariance (MCLs)
+  // top-K uses the likelihoods from the last Update(), so serialize before
+  // Resample()
+  enum LogLevel { LOG_FULL, LOG_TOPK, LOG_SUMMARY };
+  void SetLogLevel(LogLevel level, int topk = 16);
+
+  // SerializedSize() is an upper bound; Serialize() returns the number of
+  // bytes actually written
   int SerializedSize() const;
   int Serialize(uint8_t *buf, int buflen) const;
+  // decode an MCLd chunk (including its IFF header); returns the number of
+  // particles or -1 if it's malformed or holds more than max_particles
+  static int DecodeParticles(const uint8_t *buf, int len, Particle *out,
+                             int max_particles);
   int HeaderSize() const;
   int SerializeHeader(uint8_t *buf, int buflen) const;
 
  private:
   void ResetLikelihood();
 
-  int n_particles_;
-  Particle *particles_;
+  // particle arrays are sized for max_particles_ and padded to a multiple of
+  // the SIMD width; x, y, theta and heading are carved out of one allocation
+  int PaddedParticles() const { return (max_particles_ + 3) & ~3; }
+  static float *AllocParticles(int n);
+
+  // index range [*begin, *end) of n particles handled by thread t; every
+  // chunk but the last starts and ends on a multiple of four
+  void ParticleRange(int n, int t, int *begin, int *end) const;
+
+  void ResetChunk(int t);
+  void PredictChunk(int t, float ds, float w, float dt);
+  void UpdateLMChunk(int t, float lm_bearing, float precision,
+                     float bogon_thresh);
+  void UpdateChunk(int t, float temperature);
+  void WeightChunk(int t);
+  void ResampleChunk(int t, int n_out, float randP, float deltaP,
+                     float *newx);
+
+  // bucket landmarks into a uniform grid of grid_cell_ sized cells
+  void BuildLandmarkGrid();
+  // fill visible_ with landmarks within max_range_ of the particles'
+  // bounding box
+  void CullLandmarks();
+
+  int KLDParticleCount(int k) const;
+  int NumLoggedParticles() const;
+  int CountOccupiedBins();
+
+  // per-thread state, padded out to cache lines so threads don't contend
+  struct ThreadState {
+    RNG rng;
+    float LLmax;
+    float Psum;
+    char pad[56];
+  };
+
+  ThreadPool pool_;
+  ThreadState *threads_;
+
+  int n_particles_, max_particles_;
+  float *x_, *y_, *theta_, *heading_;
+  float *back_;  // Resample() writes here and then swaps with x_
+  float *noise_;  // three arrays of per-particle gaussian noise
+
+  // KLD-sampling parameters; min_particles_ == max_particles_ disables it
+  int min_particles_;
+  float kld_epsilon_, kld_bin_xy_, kld_bin_theta_;
+  int n_bins_occupied_;  // by the last resampled set; -1 since Reset()
+  uint64_t *bins_;  // open addressing hash set of occupied bins
+  int bins_size_;   // power of two, at least twice max_particles_
 
   int n_landmarks_;
   Landmark *landmarks_;
 
+  // landmark spatial index: grid_lm_[grid_start_[c]..grid_start_[c+1]) are
+  // the landmarks in cell c
+  float grid_x0_, grid_y0_, grid_cell_;
+  int grid_w_, grid_h_;
+  int *grid_start_, *grid_lm_;
+  float max_range_;
+  int *visible_;  // landmarks evaluated in this frame's Update()
+  int n_visible_;
+
   float home_x_, home_y_, home_theta_;
 
+  LogLevel log_level_;
+  int log_topk_;
+
   float *LL_;  // particle log-likelihood
+  int *order_;  // Serialize()'s scratch particle ordering
   float LLmax_;
   int32_t activations_[kFisheyeLUT_w*2];
-  uint16_t *c0_, *c1_;
+
+  // in-bounds ring samples, sorted by V-plane offset
+  int n_ring_;
+  uint32_t *ring_src_;
+  uint16_t *ring_col_;
+  int32_t ring_bias_[kFisheyeLUT_w];  // -128 * samples in each column
+  uint16_t *c0_, *c1_;  // per particle, per visible landmark
 };
 
 }  // namespace coneslam
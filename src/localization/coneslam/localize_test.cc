@@ -1,38 +1,966 @@
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "lens/fisheye.h"
+#include "localization/coneslam/fastmath.h"
 #include "localization/coneslam/localize.h"
+#include "localization/coneslam/rng.h"
 
 using coneslam::Localizer;
 using coneslam::Particle;
+namespace fm = coneslam::fastmath;
 
-const char *testdata_file = "../src/coneslam/testdata/194625.txt";
+const char *testdata_file = TESTDATA_PATH "/194625.txt";
+const char *landmark_file = TESTDATA_PATH "/lm.txt";
 
-int main() {
-  Localizer loc(300);
-  if (!loc.LoadLandmarks("../src/coneslam/testdata/lm.txt")) {
-    return 1;
+static bool CheckFastMath() {
+  float maxerr_atan2 = 0, maxerr_asin = 0, maxerr_sincos = 0, maxerr_log = 0;
+  srand48(1);
+  for (int i = 0; i < 100000; i += 4) {
+    float y[4], x[4], a[4], t[4];
+    for (int k = 0; k < 4; k++) {
+      y[k] = drand48() * 20 - 10;
+      x[k] = drand48() * 20 - 10;
+      a[k] = drand48();
+      t[k] = drand48() * 200 - 100;
+    }
+    float r_log[4];
+    fm::store(r_log, fm::log(fm::load(a)));
+    for (int k = 0; k < 4; k++) {
+      if (a[k] > 0) {
+        maxerr_log = fmax(maxerr_log, fabs(r_log[k] / log(a[k]) - 1));
+      }
+    }
+    float r_atan2[4], r_asin[4], r_s[4], r_c[4];
+    fm::v4f s, c;
+    fm::store(r_atan2, fm::atan2(fm::load(y), fm::load(x)));
+    fm::store(r_asin, fm::asin_pos(fm::load(a)));
+    fm::sincos(fm::load(t), &s, &c);
+    fm::store(r_s, s);
+    fm::store(r_c, c);
+    for (int k = 0; k < 4; k++) {
+      maxerr_atan2 = fmax(maxerr_atan2, fabs(r_atan2[k] - atan2(y[k], x[k])));
+      maxerr_asin = fmax(maxerr_asin, fabs(r_asin[k] - asin(a[k])));
+      maxerr_sincos = fmax(maxerr_sincos, fabs(r_s[k] - sin(t[k])));
+      maxerr_sincos = fmax(maxerr_sincos, fabs(r_c[k] - cos(t[k])));
+    }
+  }
+  printf("fastmath max error: atan2 %g asin %g sincos %g log %g\n",
+         maxerr_atan2, maxerr_asin, maxerr_sincos, maxerr_log);
+  // asin loses precision near 1 because of the sqrt(1-x^2); that's still well
+  // under a LUT column
+  return maxerr_atan2 < 2e-5 && maxerr_asin < 1e-3 && maxerr_sincos < 1e-5 &&
+      maxerr_log < 1e-5;
+}
+
+// -ffast-math lets the compiler assume isfinite(), so look at the exponent
+static bool Finite(float x) {
+  uint32_t bits;
+  memcpy(&bits, &x, 4);
+  return (bits & 0x7f800000) != 0x7f800000;
+}
+
+static bool CheckRNG() {
+  static const int N = 1000003;  // odd, to exercise the tail
+  float *buf = new float[N];
+  coneslam::RNG rng;
+  rng.Seed(42);
+  rng.FillNormal(buf, N, 2.0);
+  double sum = 0, sum2 = 0, sum4 = 0;
+  for (int i = 0; i < N; i++) {
+    sum += buf[i];
+    sum2 += buf[i] * buf[i];
+    sum4 += buf[i] * buf[i] * buf[i] * buf[i];
+  }
+  delete[] buf;
+  double mean = sum / N, var = sum2 / N - mean * mean;
+  double kurtosis = sum4 / N / (var * var);
+  printf("normal rng: mean %f variance %f kurtosis %f\n", mean, var, kurtosis);
+  if (fabs(mean) >= 0.01 || fabs(var - 4) >= 0.05 ||
+      fabs(kurtosis - 3) >= 0.05) {
+    return false;
+  }
+
+  // the extremes of the generator's output have to stay inside (0, 1) and
+  // give finite normals
+  static const uint32_t extremes[] = {0xffffffff, 0};
+  for (int k = 0; k < 2; k++) {
+    uint32_t u[4] = {extremes[k], extremes[k], extremes[k], extremes[k]};
+    float x[4], a[4], b[4];
+    fm::v4f uniform = coneslam::RNG::ToUniform(u), va, vb;
+    fm::store(x, uniform);
+    coneslam::RNG::BoxMuller(uniform, uniform, 2.0, &va, &vb);
+    fm::store(a, va);
+    fm::store(b, vb);
+    if (!(x[0] > 0 && x[0] < 1) || !Finite(a[0]) || !Finite(b[0])) {
+      printf("rng output %08x: uniform %g normals %g %g\n", extremes[k], x[0],
+             a[0], b[0]);
+      return false;
+    }
+  }
+  return true;
+}
+
+// must match localize.cc
+static const float kConeRadius = 44.5/M_PI/200.;
+
+// libm version of the UpdateLM likelihood for one particle / bearing
+static float ReferenceLL(const Localizer &loc, const Particle &p,
+                         float lm_bearing, float precision,
+                         float bogon_thresh) {
+  float S = sin(p.theta), C = cos(p.theta);
+  float LL = -1e6;
+  for (int j = 0; j < loc.NumLandmarks(); j++) {
+    const coneslam::Landmark &l = loc.GetLandmarks()[j];
+    float dx = l.x - p.x, dy = l.y - p.y;
+    float z = dx*C + dy*S, y = dx*S - dy*C;
+    float d = sqrt(dx*dx + dy*dy);
+    float coneangle = 2*asin(fmin(kConeRadius / d, 1));
+    float diff = fmax(fabs(atan2(y, z) - lm_bearing) - coneangle, 0);
+    LL = fmax(LL, -precision*fmin(bogon_thresh*bogon_thresh, diff*diff));
+  }
+  return LL;
+}
+
+// KLD-sampling histogram bins; the log is in centimeters
+static const float kBinXY = 10, kBinTheta = 10 * M_PI / 180;
+
+// run the recorded landmark bearings (the first max_frames of them, if
+// that's > 0) through the filter; returns the final location estimate, the
+// time spent filtering per frame, and the largest difference between the
+// vectorized and libm likelihoods
+static bool RunLog(int n_particles, int n_threads, bool verbose, bool resample,
+                   Particle *p, float *us, float *maxerr,
+                   int min_particles = 0, float *mean_particles = NULL,
+                   int max_frames = 0) {
+  Localizer loc(n_particles, n_threads);
+  if (!loc.LoadLandmarks(landmark_file)) {
+    return false;
+  }
+  if (min_particles > 0) {
+    loc.SetAdaptiveParticleCount(min_particles, 0.05, kBinXY, kBinTheta);
   }
+  double sum_particles = 0;
 
   FILE *fp = fopen(testdata_file, "r");
   if (!fp) {
     perror(testdata_file);
-    return 1;
+    return false;
   }
 
-  Particle p;
-  loc.GetLocationEstimate(&p);
-  printf("initial location %f %f %f\n", p.x, p.y, p.theta);
+  loc.Seed(1);
+  loc.Reset();
+  loc.GetLocationEstimate(p);
+  if (verbose) {
+    printf("initial location %f %f %f\n", p->x, p->y, p->theta);
+  }
 
+  float *refLL = new float[n_particles];
+  double filter_us = 0;
+  *maxerr = 0;
   float dt, ds, w;
   int nLM;
   int frame = 0;
-  while (fscanf(fp, "%f %f %f %d\n", &dt, &ds, &w, &nLM) == 4) {
+  while ((max_frames <= 0 || frame < max_frames) &&
+         fscanf(fp, "%f %f %f %d\n", &dt, &ds, &w, &nLM) == 4) {
+    // check every tenth frame against libm; the reference is slow
+    bool check = resample && frame % 10 == 0;
+    for (int i = 0; check && i < loc.NumParticles(); i++) {
+      refLL[i] = -1e6;
+    }
+    timeval t0, t1;
+    gettimeofday(&t0, NULL);
     loc.Predict(ds, w, dt);
+    gettimeofday(&t1, NULL);
+    filter_us += (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_usec - t0.tv_usec);
     for (int j = 0; j < nLM; j++) {
       float lm_bearing;
-      fscanf(fp, "%f\n", &lm_bearing);
+      if (fscanf(fp, "%f\n", &lm_bearing) != 1) {
+        break;
+      }
+      gettimeofday(&t0, NULL);
       loc.UpdateLM(lm_bearing, 1.0, 0.2);
+      gettimeofday(&t1, NULL);
+      filter_us += (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_usec - t0.tv_usec);
+      for (int i = 0; check && i < loc.NumParticles(); i++) {
+        Particle pi;
+        loc.GetParticle(i, &pi);
+        refLL[i] = fmax(refLL[i], ReferenceLL(loc, pi, lm_bearing, 1.0, 0.2));
+      }
+    }
+    if (resample && nLM > 0) {
+      for (int i = 0; check && i < loc.NumParticles(); i++) {
+        *maxerr = fmax(*maxerr, fabs(loc.GetLikelihoods()[i] - refLL[i]));
+      }
+      gettimeofday(&t0, NULL);
+      loc.Resample();
+      gettimeofday(&t1, NULL);
+      filter_us += (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_usec - t0.tv_usec);
     }
-    loc.GetLocationEstimate(&p);
-    printf("%d: %f %f %f\n", frame++, p.x, p.y, p.theta);
+    sum_particles += loc.NumParticles();
+    if (loc.NumParticles() < min_particles ||
+        loc.NumParticles() > loc.MaxParticles()) {
+      fprintf(stderr, "particle count %d out of range\n", loc.NumParticles());
+      return false;
+    }
+    if (verbose) {
+      loc.GetLocationEstimate(p);
+      printf("%d: %f %f %f\n", frame, p->x, p->y, p->theta);
+    }
+    frame++;
+  }
+  fclose(fp);
+  delete[] refLL;
+  loc.GetLocationEstimate(p);
+  *us = filter_us / frame;
+  if (mean_particles != NULL) {
+    *mean_particles = sum_particles / frame;
+  }
+  return true;
+}
+
+static void InitTestLens(FisheyeLens *lens) {
+  lens->SetCalibration(188.16, 188.16, 319.7, 241.0, 0.00675);
+}
+
+// the generated ring should mostly land inside the V plane, and a stripe
+// along the bottom edge should only show up in the columns which cross it
+static bool CheckRing() {
+  FisheyeLens lens;
+  InitTestLens(&lens);
+  Localizer loc(4);
+  loc.InitRing(lens, 0);
+  uint8_t *yuv = new uint8_t[640*480 + 320*240*2];
+  // light up only the bottom row of the V plane: the ring crosses it in two
+  // places, and every other column should come out as exactly zero
+  memset(yuv, 128, 640*480 + 320*240*2);
+  memset(yuv + 640*480 + 320*240 + 320*239, 255, 320);
+  loc.Update(yuv, 1);
+  delete[] yuv;
+  // the aCDF chunk holds the cumulative activations
+  uint8_t *buf = new uint8_t[loc.SerializedSize() + 1];
+  loc.Serialize(buf, loc.SerializedSize() + 1);
+  int32_t cdf[coneslam::kFisheyeLUT_w];
+  memcpy(cdf, buf + 8 + 4 * sizeof(Particle) + 8, sizeof(cdf));
+  delete[] buf;
+  int lit = 0;
+  for (int i = 0; i < coneslam::kFisheyeLUT_w; i++) {
+    if (cdf[i] != (i > 0 ? cdf[i-1] : 0)) {
+      lit++;
+    }
+  }
+  printf("ring: %d samples, %d columns see the bottom edge\n", loc.RingSize(),
+         lit);
+  return loc.RingSize() > coneslam::kFisheyeLUT_w * 8 &&
+      loc.RingSize() < coneslam::kFisheyeLUT_w * coneslam::kFisheyeLUT_h &&
+      lit > 0 && lit < 100;
+}
+
+// find the chunk with the given tag in a Serialize()d buffer
+static const uint8_t *FindChunk(const uint8_t *buf, int len, const char *tag,
+                                uint32_t *chunklen) {
+  const uint8_t *end = buf + len;
+  while (buf + 8 <= end) {
+    memcpy(chunklen, buf + 4, 4);
+    if (memcmp(buf, tag, 4) == 0) {
+      return buf;
+    }
+    buf += *chunklen;
+  }
+  return NULL;
+}
+
+static bool CheckLogLevels() {
+  FisheyeLens lens;
+  InitTestLens(&lens);
+  Localizer loc(1000);
+  if (!loc.LoadLandmarks(landmark_file)) {
+    return false;
+  }
+  loc.InitRing(lens, 0);
+  uint8_t *yuv = new uint8_t[640*480 + 320*240*2];
+  srand48(4);
+  for (int i = 0; i < 640*480 + 320*240*2; i++) {
+    yuv[i] = drand48() * 256;
+  }
+  // a few frames of motion so the particles spread out, resampling in
+  // between so that there are duplicates as there would be in practice
+  for (int i = 0; i < 5; i++) {
+    loc.Predict(0.1, 0.5, 1.0/30);
+    loc.Update(yuv, 0.01);
+    loc.Resample();
+  }
+  loc.Predict(0.1, 0.5, 1.0/30);
+  loc.Update(yuv, 0.01);
+  delete[] yuv;
+
+  int best = 0;
+  for (int i = 0; i < loc.NumParticles(); i++) {
+    if (loc.GetLikelihoods()[i] > loc.GetLikelihoods()[best]) {
+      best = i;
+    }
+  }
+
+  static const Localizer::LogLevel levels[] = {
+    Localizer::LOG_FULL, Localizer::LOG_TOPK, Localizer::LOG_SUMMARY
+  };
+  static const char *names[] = {"full", "top-16", "summary"};
+  int sizes[3];
+  for (int l = 0; l < 3; l++) {
+    loc.SetLogLevel(levels[l], 16);
+    int bound = loc.SerializedSize();
+    uint8_t *buf = new uint8_t[bound + 1];
+    sizes[l] = loc.Serialize(buf, bound + 1);
+    printf("%s log: %d bytes (bound %d)\n", names[l], sizes[l], bound);
+    if (sizes[l] > bound) {
+      return false;
+    }
+    uint32_t len;
+    if (!FindChunk(buf, sizes[l], "aCDF", &len)) {
+      fprintf(stderr, "%s log is missing aCDF\n", names[l]);
+      return false;
+    }
+    const uint8_t *lm = FindChunk(buf, sizes[l], "LM01", &len);
+    if (levels[l] != Localizer::LOG_SUMMARY &&
+        (!lm || len != 9 + 2u * 2 * loc.NumLandmarks() *
+                       (l == 0 ? loc.NumParticles() : 16))) {
+      fprintf(stderr, "%s log has a bad LM01 chunk\n", names[l]);
+      return false;
+    }
+    if (levels[l] == Localizer::LOG_SUMMARY &&
+        !FindChunk(buf, sizes[l], "MCLs", &len)) {
+      fprintf(stderr, "summary log is missing MCLs\n");
+      return false;
+    }
+    const uint8_t *mcld = FindChunk(buf, sizes[l], "MCLd", &len);
+    if (levels[l] == Localizer::LOG_TOPK) {
+      Particle *ps = new Particle[loc.NumParticles()];
+      int n = mcld ?
+          Localizer::DecodeParticles(mcld, len, ps, loc.NumParticles()) : -1;
+      // just the top 16
+      if (n != 16) {
+        fprintf(stderr, "couldn't decode MCLd chunk\n");
+        return false;
+      }
+      // the likeliest particle (or one tied with it) goes first
+      Particle p;
+      bool found = false;
+      for (int j = 0; j < loc.NumParticles() && !found; j++) {
+        loc.GetParticle(j, &p);
+        found = loc.GetLikelihoods()[j] == loc.GetLikelihoods()[best] &&
+            fabs(ps[0].x - p.x) <= 5e-4 && fabs(ps[0].y - p.y) <= 5e-4;
+      }
+      if (!found) {
+        fprintf(stderr, "top particle mismatch\n");
+        return false;
+      }
+      // and every decoded particle is one of ours to within quantization
+      for (int i = 0; i < n; i++) {
+        bool found = false;
+        for (int j = 0; j < loc.NumParticles() && !found; j++) {
+          loc.GetParticle(j, &p);
+          found = fabs(ps[i].x - p.x) <= 5e-4 && fabs(ps[i].y - p.y) <= 5e-4 &&
+              fabs(ps[i].theta - p.theta) <= 5e-5 &&
+              fabs(ps[i].heading - p.heading) <= 1e-4;
+        }
+        if (!found) {
+          fprintf(stderr, "decoded particle %d doesn't match\n", i);
+          return false;
+        }
+      }
+      delete[] ps;
+    }
+    delete[] buf;
+  }
+  return sizes[1] < sizes[0] / 4 && sizes[2] < sizes[1];
+}
+
+// a Reset() spreads the particles out from home again, so the first
+// Resample() after one has to keep all of them, however few the last
+// frames before it needed
+static bool CheckResetParticleCount() {
+  Localizer loc(2000);
+  if (!loc.LoadLandmarks(landmark_file)) {
+    return false;
+  }
+  loc.SetAdaptiveParticleCount(100, 0.05, kBinXY, kBinTheta);
+  FILE *fp = fopen(testdata_file, "r");
+  if (!fp) {
+    perror(testdata_file);
+    return false;
+  }
+  loc.Seed(1);
+  loc.Reset();
+  int after_reset = -1, settled = -1;
+  for (int frame = 0; frame < 21; frame++) {
+    float dt, ds, w, lm_bearing;
+    int nLM;
+    if (fscanf(fp, "%f %f %f %d\n", &dt, &ds, &w, &nLM) != 4) {
+      break;
+    }
+    loc.Predict(ds, w, dt);
+    for (int j = 0; j < nLM && fscanf(fp, "%f\n", &lm_bearing) == 1; j++) {
+      loc.UpdateLM(lm_bearing, 1.0, 0.2);
+    }
+    loc.Resample();
+    // settle for twenty frames, then reset, then one more
+    if (frame == 19) {
+      settled = loc.NumParticles();
+      loc.Reset();
+    } else if (frame == 20) {
+      after_reset = loc.NumParticles();
+    }
+  }
+  fclose(fp);
+  printf("KLD-sampling: %d particles before reset, %d one frame after\n",
+         settled, after_reset);
+  return settled < loc.MaxParticles() && after_reset == loc.MaxParticles();
+}
+
+static double Now() {
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// a big cone course should only cost as much as the cones near the car: the
+// culled Update must give exactly the same likelihoods as an Update over
+// just the nearby cones
+static bool CheckLandmarkCulling() {
+  static const char *kCourseFile = "/tmp/localize_test_course.txt";
+  static const char *kNearbyFile = "/tmp/localize_test_nearby.txt";
+  static const int kCourseSize = 40;  // 40x40 cones at 5m spacing
+  static const float kRange = 20;
+
+  FILE *fp = fopen(kCourseFile, "w");
+  if (!fp) {
+    perror(kCourseFile);
+    return false;
+  }
+  fprintf(fp, "%d\n", kCourseSize * kCourseSize);
+  for (int i = 0; i < kCourseSize * kCourseSize; i++) {
+    fprintf(fp, "%f %f\n", 5.0 * (i % kCourseSize) + 1.3,
+            5.0 * (i / kCourseSize) + 2.7);
+  }
+  fprintf(fp, "home 100 100 0.5\n");
+  fclose(fp);
+
+  uint8_t *yuv = new uint8_t[640*480 + 320*240*2];
+  srand48(3);
+  for (int i = 0; i < 640*480 + 320*240*2; i++) {
+    yuv[i] = drand48() * 256;
+  }
+
+  FisheyeLens lens;
+  InitTestLens(&lens);
+  Localizer course(5000), everything(5000);
+  course.LoadLandmarks(kCourseFile);
+  everything.LoadLandmarks(kCourseFile);
+  course.InitRing(lens, 0);
+  everything.InitRing(lens, 0);
+  course.SetMaxLandmarkRange(kRange);
+  everything.SetMaxLandmarkRange(1e9);
+
+  double t0 = Now();
+  course.Update(yuv, 0.01);
+  double t1 = Now();
+  everything.Update(yuv, 0.01);
+  double t2 = Now();
+  printf("culled update: %d of %d landmarks, %.0f us vs %.0f us\n",
+         course.NumVisibleLandmarks(), course.NumLandmarks(),
+         (t1 - t0) * 1e6, (t2 - t1) * 1e6);
+
+  // write out just the landmarks within range of the particles' bounding box
+  float xmin = 1e9, xmax = -1e9, ymin = 1e9, ymax = -1e9;
+  for (int i = 0; i < course.NumParticles(); i++) {
+    xmin = fmin(xmin, course.GetParticleX()[i]);
+    xmax = fmax(xmax, course.GetParticleX()[i]);
+    ymin = fmin(ymin, course.GetParticleY()[i]);
+    ymax = fmax(ymax, course.GetParticleY()[i]);
+  }
+  int nnearby = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    fp = fopen(kNearbyFile, "w");
+    fprintf(fp, "%d\n", nnearby);
+    nnearby = 0;
+    for (int j = 0; j < course.NumLandmarks(); j++) {
+      const coneslam::Landmark &l = course.GetLandmarks()[j];
+      float dx = fmax(fmax(xmin - l.x, l.x - xmax), 0);
+      float dy = fmax(fmax(ymin - l.y, l.y - ymax), 0);
+      if (dx*dx + dy*dy <= kRange*kRange) {
+        fprintf(fp, "%f %f\n", l.x, l.y);
+        nnearby++;
+      }
+    }
+    fprintf(fp, "home 100 100 0.5\n");
+    fclose(fp);
+  }
+
+  Localizer nearby(5000);
+  nearby.LoadLandmarks(kNearbyFile);
+  nearby.InitRing(lens, 0);
+  nearby.SetMaxLandmarkRange(1e9);
+  nearby.Update(yuv, 0.01);
+  delete[] yuv;
+  unlink(kCourseFile);
+  unlink(kNearbyFile);
+
+  if (nearby.NumVisibleLandmarks() != course.NumVisibleLandmarks() ||
+      memcmp(nearby.GetLikelihoods(), course.GetLikelihoods(),
+             course.NumParticles() * sizeof(float)) != 0) {
+    fprintf(stderr, "culled likelihoods differ from nearby-only ones\n");
+    return false;
+  }
+  return course.NumVisibleLandmarks() < course.NumLandmarks() / 10;
+}
+
+// a landmark span that's an exact multiple of the grid cell puts the far
+// landmarks right on the grid's edge; they must still land inside it
+static bool CheckLandmarkGridEdge() {
+  static const char *kEdgeFile = "/tmp/localize_test_edge.txt";
+  FILE *fp = fopen(kEdgeFile, "w");
+  if (!fp) {
+    perror(kEdgeFile);
+    return false;
+  }
+  // 3m x 4m span; the grid cell is 4m
+  fprintf(fp, "3\n1.5 0.5\n-1 2\n2 -2\nhome 0 0 0\n");
+  fclose(fp);
+
+  uint8_t *yuv = new uint8_t[640*480 + 320*240*2];
+  memset(yuv, 128, 640*480 + 320*240*2);
+  FisheyeLens lens;
+  InitTestLens(&lens);
+  Localizer loc(100);
+  bool ok = loc.LoadLandmarks(kEdgeFile);
+  unlink(kEdgeFile);
+  loc.InitRing(lens, 0);
+  loc.SetMaxLandmarkRange(1e9);
+  loc.Update(yuv, 0.01);
+  delete[] yuv;
+  if (!ok || loc.NumVisibleLandmarks() != 3) {
+    fprintf(stderr, "landmark grid edge: %d of 3 landmarks visible\n",
+            loc.NumVisibleLandmarks());
+    return false;
+  }
+  return true;
+}
+
+// the V plane pixel and ring column of every ring sample, worked out the
+// same way as Localizer::InitRing(lens, 0)
+static void RingSamples(const FisheyeLens &lens, std::vector<int> *pixel,
+                        std::vector<int> *column) {
+  const float fx = lens.FocalLengthX() / 2, azimuth0 = -M_PI/4;
+  for (int j = 0; j < coneslam::kFisheyeLUT_h; j++) {
+    float polar = M_PI_2 + (j - 10) / fx;
+    for (int i = 0; i < coneslam::kFisheyeLUT_w; i++) {
+      float az = azimuth0 + i * 2 * M_PI / coneslam::kFisheyeLUT_w;
+      float u, v;
+      lens.DistortPoint(sin(polar) * sin(az), -sin(polar) * cos(az),
+                        cos(polar), &u, &v);
+      int x = floorf(u / 2), y = floorf(v / 2);
+      if (x >= 0 && x < 320 && y >= 0 && y < 240) {
+        pixel->push_back(y * 320 + x);
+        column->push_back(i);
+      }
+    }
+  }
+}
+
+// libm expectation of landmark l from a particle, as ring columns; the
+// pre-SoA Update() did exactly this per particle
+static void ReferenceColumns(float px, float py, float theta,
+                             const coneslam::Landmark &l, int *c0, int *c1) {
+  const float angratio = coneslam::kFisheyeLUT_w / (2*M_PI);
+  float S = sin(theta), C = cos(theta);
+  float dx = l.x - px, dy = l.y - py;
+  float z = dx*C + dy*S, y = -dx*S + dy*C;
+  float d = sqrt(dx*dx + dy*dy);
+  float visibleradius = angratio * asin(fmin(kConeRadius / d, 1));
+  float coneangle = angratio * atan2f(y, z);
+  *c0 = roundf(coneangle - visibleradius);
+  *c1 = roundf(coneangle + visibleradius);
+  if (*c0 < 0) {
+    *c0 += coneslam::kFisheyeLUT_w;
+    *c1 += coneslam::kFisheyeLUT_w;
+  }
+}
+
+// the particle filter as it was before the particles went SoA: one
+// Particle struct each, libm throughout, and the old sum-of-uniforms noise
+class ReferenceLocalizer {
+ public:
+  ReferenceLocalizer(int n, const std::vector<coneslam::Landmark> &lm,
+                     const Particle &home)
+      : p_(n), LL_(n), lm_(lm) {
+    for (int i = 0; i < n; i++) {
+      p_[i].x = 0.025*randn() + home.x;
+      p_[i].y = 0.025*randn() + home.y;
+      p_[i].theta = p_[i].heading = 0.1*randn() + home.theta;
+    }
+  }
+
+  void Predict(float ds, float w, float dt) {
+    // must match localize.cc
+    const float NOISE_ANGULAR = 0.8*3.3, NOISE_LONG = 8*3.3,
+                NOISE_LAT = 8*3.3;
+    for (size_t i = 0; i < p_.size(); i++) {
+      float t = p_[i].theta + w*dt + randn()*NOISE_ANGULAR*ds*dt;
+      float dx = ds + randn()*NOISE_LONG*ds*dt;
+      float dy = randn()*NOISE_LAT*ds*dt;
+      p_[i].x += dx*cos(t) - dy*sin(t);
+      p_[i].y += dx*sin(t) + dy*cos(t);
+      p_[i].theta = p_[i].heading = t;
+    }
+  }
+
+  // cdf is the doubled-up cumulative activation array
+  void Update(const int32_t *cdf, float temperature) {
+    LLmax_ = -1e6;
+    for (size_t i = 0; i < p_.size(); i++) {
+      int32_t sum = 0;
+      for (size_t j = 0; j < lm_.size(); j++) {
+        int c0, c1;
+        ReferenceColumns(p_[i].x, p_[i].y, p_[i].theta, lm_[j], &c0, &c1);
+        sum += cdf[c1] - cdf[c0];
+      }
+      LL_[i] = sum * temperature;
+      LLmax_ = fmax(LLmax_, LL_[i]);
+    }
+  }
+
+  void Resample() {
+    int n = p_.size();
+    float totalP = 0;
+    for (int i = 0; i < n; i++) {
+      LL_[i] = exp(LL_[i] - LLmax_);
+      totalP += LL_[i];
+    }
+    float deltaP = totalP / n;
+    float randP = drand48() * totalP;
+    std::vector<Particle> newp(n);
+    int j = 0;
+    for (int i = 0; i < n; i++) {
+      while (randP > LL_[j]) {
+        randP -= LL_[j];
+        j = j + 1 == n ? 0 : j + 1;
+      }
+      newp[i] = p_[j];
+      randP += deltaP;
+    }
+    p_.swap(newp);
+  }
+
+  void GetLocationEstimate(Particle *mean) const {
+    mean->x = mean->y = mean->theta = mean->heading = 0;
+    for (size_t i = 0; i < p_.size(); i++) {
+      mean->x += p_[i].x;
+      mean->y += p_[i].y;
+      mean->theta += p_[i].theta;
+    }
+    mean->x /= p_.size();
+    mean->y /= p_.size();
+    mean->theta /= p_.size();
+  }
+
+ private:
+  static double randn() {
+    double n = drand48();
+    for (int i = 1; i < 6; i++) n += drand48();
+    return 2*n - 6;
+  }
+
+  std::vector<Particle> p_;
+  std::vector<float> LL_;
+  float LLmax_;
+  std::vector<coneslam::Landmark> lm_;
+};
+
+// drive the log's odometry through Update() on frames rendered from the
+// noise-free dead reckoned path, checking every particle's cone
+// expectations and likelihood against libm each frame, and the final
+// estimate against the pre-SoA filter's. The log and lm.txt are in cm, so
+// they're scaled to meters first, or the cones would all be under a column
+// wide; the course is doubled in size and the path started where dead
+// reckoning keeps it 2m clear of the cones, since standing on one the
+// filter would see it covering half the ring and get stuck there
+static bool CheckUpdate() {
+  static const char *kScaledFile = "/tmp/localize_test_lm.txt";
+  static const int kParticles = 1000;
+  static const float kTemperature = 0.01;
+  static const float kCourseScale = 0.02;
+  static const Particle kHome = {1, -4.5, 0, 0};
+  const int w = coneslam::kFisheyeLUT_w;
+
+  FILE *fp = fopen(landmark_file, "r");
+  if (!fp) {
+    perror(landmark_file);
+    return false;
+  }
+  int nlm;
+  std::vector<coneslam::Landmark> lm;
+  if (fscanf(fp, "%d\n", &nlm) != 1) {
+    fclose(fp);
+    return false;
+  }
+  for (int j = 0; j < nlm; j++) {
+    coneslam::Landmark l;
+    if (fscanf(fp, "%f %f\n", &l.x, &l.y) != 2) {
+      fclose(fp);
+      return false;
+    }
+    l.x *= kCourseScale;
+    l.y *= kCourseScale;
+    lm.push_back(l);
+  }
+  fclose(fp);
+  fp = fopen(kScaledFile, "w");
+  fprintf(fp, "%d\n", nlm);
+  for (int j = 0; j < nlm; j++) {
+    fprintf(fp, "%.9g %.9g\n", lm[j].x, lm[j].y);
+  }
+  fprintf(fp, "home %f %f %f\n", kHome.x, kHome.y, kHome.theta);
+  fclose(fp);
+
+  FisheyeLens lens;
+  InitTestLens(&lens);
+  std::vector<int> pixel, column;
+  RingSamples(lens, &pixel, &column);
+  Localizer loc(kParticles);
+  bool ok = loc.LoadLandmarks(kScaledFile);
+  unlink(kScaledFile);
+  if (!ok) {
+    return false;
+  }
+  loc.InitRing(lens, 0);
+  loc.SetMaxLandmarkRange(1e9);
+  loc.Seed(1);
+  loc.Reset();
+  srand48(1);
+  ReferenceLocalizer ref(kParticles, lm, kHome);
+  if (loc.RingSize() != static_cast<int>(pixel.size())) {
+    fprintf(stderr, "ring has %d samples, expected %zu\n", loc.RingSize(),
+            pixel.size());
+    return false;
+  }
+
+  fp = fopen(testdata_file, "r");
+  if (!fp) {
+    perror(testdata_file);
+    return false;
+  }
+  uint8_t *yuv = new uint8_t[640*480 + 320*240*2];
+  memset(yuv, 128, 640*480 + 320*240*2);
+  uint8_t *V = yuv + 640*480 + 320*240;
+  int32_t *cdf = new int32_t[2 * w];
+  uint8_t *buf = new uint8_t[loc.SerializedSize() + 1];
+  int lit[coneslam::kFisheyeLUT_w];
+  float x = kHome.x, y = kHome.y, theta = kHome.theta;
+  int frames = 0;
+  long expectations = 0, off_by_one = 0;
+  float maxLLerr = 0;
+  float dt, ds, wz;
+  int nbearings;
+  ok = true;
+  while (ok && fscanf(fp, "%f %f %f %d\n", &dt, &ds, &wz, &nbearings) == 4) {
+    for (int j = 0; j < nbearings; j++) {
+      float b;
+      if (fscanf(fp, "%f\n", &b) != 1) {
+        break;
+      }
+    }
+    ds *= 0.01;
+    theta += wz*dt;
+    x += ds*cos(theta);
+    y += ds*sin(theta);
+
+    // light up each cone as seen from the true pose
+    memset(lit, 0, sizeof(lit));
+    for (int j = 0; j < nlm; j++) {
+      int c0, c1;
+      ReferenceColumns(x, y, theta, lm[j], &c0, &c1);
+      for (int c = c0 + 1; c <= c1; c++) {
+        lit[c % w] = 1;
+      }
+    }
+    memset(V, 128, 320*240);
+    for (size_t k = 0; k < pixel.size(); k++) {
+      if (lit[column[k]]) {
+        V[pixel[k]] = 255;
+      }
+    }
+
+    loc.Predict(ds, wz, dt);
+    ref.Predict(ds, wz, dt);
+    loc.Update(yuv, kTemperature);
+
+    // pull the particles, activations and expectations back out of the log
+    int len = loc.Serialize(buf, loc.SerializedSize() + 1);
+    uint32_t chunklen;
+    const uint8_t *mcl = FindChunk(buf, len, "MCL4", &chunklen);
+    const uint8_t *acdf = FindChunk(buf, len, "aCDF", &chunklen);
+    const uint8_t *lm01 = FindChunk(buf, len, "LM01", &chunklen);
+    if (!mcl || !acdf || !lm01) {
+      fprintf(stderr, "frame %d: missing log chunks\n", frames);
+      ok = false;
+      break;
+    }
+    memcpy(cdf, acdf + 8, w * sizeof(int32_t));
+    for (int i = 0; i < w; i++) {
+      cdf[w + i] = cdf[w - 1] + cdf[i];
+    }
+    const uint8_t *c0s = lm01 + 9, *c1s = c0s + 2 * nlm * kParticles;
+    for (int i = 0; i < kParticles && ok; i++) {
+      float p[4];
+      memcpy(p, mcl + 8 + i * sizeof(Particle), sizeof(p));
+      int32_t sum = 0;
+      bool exact = true;
+      for (int j = 0; j < nlm; j++) {
+        int c0, c1;
+        uint16_t v0, v1;
+        ReferenceColumns(p[0], p[1], p[2], lm[j], &c0, &c1);
+        memcpy(&v0, c0s + 2 * (i * nlm + j), 2);
+        memcpy(&v1, c1s + 2 * (i * nlm + j), 2);
+        sum += cdf[c1] - cdf[c0];
+        expectations++;
+        if (v0 == c0 && v1 == c1) {
+          continue;
+        }
+        // fastmath's atan2 is good to ~1e-5 rad, a few thousandths of a
+        // column, so it only rounds differently right on the boundary
+        exact = false;
+        off_by_one++;
+        if (abs(v0 - c0) > 1 || abs(v1 - c1) > 1) {
+          fprintf(stderr, "frame %d particle %d cone %d: expected at "
+                  "%d..%d, libm says %d..%d\n", frames, i, j, v0, v1, c0, c1);
+          ok = false;
+        }
+      }
+      float LL = loc.GetLikelihoods()[i];
+      if (exact && LL != sum * kTemperature) {
+        fprintf(stderr, "frame %d particle %d: likelihood %f, libm says %f\n",
+                frames, i, LL, sum * kTemperature);
+        ok = false;
+      }
+      maxLLerr = fmax(maxLLerr, fabs(LL - sum * kTemperature));
+    }
+    ref.Update(cdf, kTemperature);
+
+    loc.Resample();
+    ref.Resample();
+    frames++;
+  }
+  fclose(fp);
+  delete[] yuv;
+  delete[] cdf;
+  delete[] buf;
+
+  Particle p, pref;
+  loc.GetLocationEstimate(&p);
+  ref.GetLocationEstimate(&pref);
+  printf("update vs libm: %ld of %ld expectations a column off, max LL "
+         "error %g\n", off_by_one, expectations, maxLLerr);
+  printf("final estimate %f %f %f, pre-SoA %f %f %f, true %f %f %f\n",
+         p.x, p.y, p.theta, pref.x, pref.y, pref.theta, x, y, theta);
+  // the two filters draw different noise, so they only agree to within a
+  // few cm
+  return ok && off_by_one * 1000 < expectations &&
+      hypot(p.x - pref.x, p.y - pref.y) < 0.15 &&
+      fabs(p.theta - pref.theta) < 0.02;
+}
+
+int main() {
+  if (!CheckFastMath()) {
+    fprintf(stderr, "fastmath out of tolerance\n");
+    return 1;
+  }
+  if (!CheckRNG()) {
+    fprintf(stderr, "normal rng check failed\n");
+    return 1;
+  }
+  if (!CheckRing()) {
+    fprintf(stderr, "generated ring LUT looks wrong\n");
+    return 1;
+  }
+  if (!CheckLogLevels()) {
+    fprintf(stderr, "log level check failed\n");
+    return 1;
+  }
+  if (!CheckLandmarkCulling()) {
+    return 1;
+  }
+  if (!CheckLandmarkGridEdge()) {
+    return 1;
+  }
+  if (!CheckUpdate()) {
+    fprintf(stderr, "Update() doesn't match the libm reference\n");
+    return 1;
+  }
+
+  // without resampling the likelihoods don't feed back into the particles,
+  // so this trajectory only depends on the motion model
+  Particle p;
+  float us, maxerr;
+  if (!RunLog(300, 1, false, false, &p, &us, &maxerr)) {
+    return 1;
+  }
+  printf("no resampling: final location %f %f %f\n", p.x, p.y, p.theta);
+
+  // benchmark the full predict / update / resample loop with larger particle
+  // counts and more threads, checking the vectorized likelihoods against libm
+  // as we go
+  static const int counts[] = {1000, 2000, 5000, 10000};
+  static const int threads[] = {1, 4};
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    for (size_t k = 0; k < sizeof(threads) / sizeof(threads[0]); k++) {
+      if (!RunLog(counts[i], threads[k], false, true, &p, &us, &maxerr)) {
+        return 1;
+      }
+      printf("%5d particles %d threads: %8.1f us/frame, max LL error %g\n",
+             counts[i], threads[k], us, maxerr);
+      if (maxerr > 1e-3) {
+        fprintf(stderr, "likelihood mismatch with %d particles\n", counts[i]);
+        return 1;
+      }
+    }
+  }
+
+  // KLD-sampling should drop well below the maximum while the posterior is
+  // tight, over the first couple of seconds, and climb back up as the
+  // particles spread out over the rest of the log; RunLog fails if it ever
+  // leaves [min, max]
+  float mean_tight, mean_particles;
+  if (!RunLog(10000, 4, false, true, &p, &us, &maxerr, 500, &mean_tight,
+              60) ||
+      !RunLog(10000, 4, false, true, &p, &us, &maxerr, 500, &mean_particles)) {
+    return 1;
+  }
+  printf("adaptive 500-10000 particles: %8.1f us/frame, mean %.0f particles "
+         "(%.0f over the first 60 frames), max LL error %g\n", us,
+         mean_particles, mean_tight, maxerr);
+  if (mean_tight >= 10000 / 2 || mean_particles <= mean_tight ||
+      maxerr > 1e-3) {
+    fprintf(stderr, "adaptive particle count didn't adapt\n");
+    return 1;
+  }
+  if (!CheckResetParticleCount()) {
+    fprintf(stderr, "particle count not restored by Reset()\n");
+    return 1;
+  }
+
+  // same seed and thread count, same answer
+  Particle p2;
+  RunLog(2000, 3, false, true, &p, &us, &maxerr);
+  RunLog(2000, 3, false, true, &p2, &us, &maxerr);
+  if (p.x != p2.x || p.y != p2.y || p.theta != p2.theta) {
+    fprintf(stderr, "multithreaded run not repeatable: %f %f %f vs %f %f %f\n",
+            p.x, p.y, p.theta, p2.x, p2.y, p2.theta);
+    return 1;
   }
+  return 0;
 }
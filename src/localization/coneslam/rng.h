@@ -0,0 +1,109 @@
+#ifndef CONESLAM_RNG_H_
+#define CONESLAM_RNG_H_
+
+#include <stdint.h>
+
+#include "localization/coneslam/fastmath.h"
+
+namespace coneslam {
+
+// Four interleaved xoshiro128+ generators, so each step yields one 32-bit
+// number per SIMD lane, plus a Box-Muller transform to fill whole arrays with
+// gaussian noise at once.
+class RNG {
+ public:
+  RNG() { Seed(0); }
+
+  void Seed(uint64_t seed) {
+    // expand the seed with splitmix64 so nearby seeds give unrelated streams
+    for (int k = 0; k < 4; k++) {
+      for (int lane = 0; lane < 4; lane += 2) {
+        seed += 0x9e3779b97f4a7c15ULL;
+        uint64_t z = seed;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z ^= z >> 31;
+        s_[k][lane] = z;
+        s_[k][lane + 1] = z >> 32;
+      }
+    }
+  }
+
+  void Next(uint32_t *out) {
+    for (int i = 0; i < 4; i++) {
+      out[i] = s_[0][i] + s_[3][i];
+      uint32_t t = s_[1][i] << 9;
+      s_[2][i] ^= s_[0][i];
+      s_[3][i] ^= s_[1][i];
+      s_[1][i] ^= s_[2][i];
+      s_[0][i] ^= s_[3][i];
+      s_[2][i] ^= t;
+      s_[3][i] = (s_[3][i] << 11) | (s_[3][i] >> 21);
+    }
+  }
+
+  // four uniforms in (0, 1)
+  fastmath::v4f Uniform() {
+    uint32_t u[4];
+    Next(u);
+    return ToUniform(u);
+  }
+
+  float UniformScalar() {
+    float u[4];
+    fastmath::store(u, Uniform());
+    return u[0];
+  }
+
+  // fill out[0..n) with normally distributed noise of standard deviation
+  // sigma
+  void FillNormal(float *out, int n, float sigma) {
+    namespace fm = fastmath;
+    for (int i = 0; i < n; i += 8) {
+      fm::v4f a, b;
+      BoxMuller(Uniform(), Uniform(), sigma, &a, &b);
+      if (n - i >= 8) {
+        fm::store(out + i, a);
+        fm::store(out + i + 4, b);
+      } else {
+        float tmp[8];
+        fm::store(tmp, a);
+        fm::store(tmp + 4, b);
+        for (int k = 0; k < n - i; k++) {
+          out[i + k] = tmp[k];
+        }
+      }
+    }
+  }
+
+  // xoshiro128+'s low bits are weak, so only the top 23 are used: with 24,
+  // (2^24 - 1 + .5) / 2^24 rounds up to 1.0f and Box-Muller takes log(1) = 0
+  // to a NaN. The result is in [2^-24, 1 - 2^-24].
+  static fastmath::v4f ToUniform(const uint32_t *u) {
+    int32_t i[4] = {int32_t(u[0] >> 9), int32_t(u[1] >> 9),
+                    int32_t(u[2] >> 9), int32_t(u[3] >> 9)};
+    return fastmath::mul(
+        fastmath::add(fastmath::load_int(i), fastmath::set1(0.5f)),
+        fastmath::set1(1.0f / 8388608));
+  }
+
+  // two sets of four normals from two sets of uniforms in (0, 1)
+  static void BoxMuller(fastmath::v4f u1, fastmath::v4f u2, float sigma,
+                        fastmath::v4f *a, fastmath::v4f *b) {
+    namespace fm = fastmath;
+    // u1 < 1 so r2 is never 0
+    fm::v4f r2 = fm::mul(fm::set1(-2), fm::log(u1));
+    fm::v4f r = fm::mul(fm::set1(sigma), fm::mul(r2, fm::rsqrt(r2)));
+    fm::v4f s, c;
+    fm::sincos(fm::mul(fm::set1(2 * M_PI), u2), &s, &c);
+    *a = fm::mul(r, c);
+    *b = fm::mul(r, s);
+  }
+
+ private:
+  uint32_t s_[4][4];  // state word, lane
+};
+
+}  // namespace coneslam
+
+#endif  // CONESLAM_RNG_H_
@@ -0,0 +1,192 @@
+// time the generated EKFs at the 100Hz control rate with measurements at
+// camera rate, check that they converge, and that no step touches the heap
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "localization/ekf/localize_ekf.h"
+#include "localization/ekf/pose_ekf.h"
+
+// count every heap allocation in the process; operator new and Eigen's
+// aligned_malloc both end up here. __libc_malloc is glibc's.
+static int n_allocs = 0;
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *malloc(size_t size) {
+  n_allocs++;
+  return __libc_malloc(size);
+}
+
+static const float kLandmarks[][2] = {
+  {3, 0}, {0, 3}, {-3, 0}, {0, -3},
+};
+static const int kNumLandmarks = sizeof(kLandmarks) / sizeof(kLandmarks[0]);
+
+// deterministic +-1/2 noise
+static float Noise() {
+  static uint32_t s = 1;
+  s = s * 1103515245 + 12345;
+  return ((s >> 8) & 0xffff) / 65536.0 - 0.5;
+}
+
+static const float kDt = 0.01;
+static const float kSpeed = 1.0, kRadius = 1.5;
+static const int kSteps = 100000;
+static const int kCameraEvery = 3;  // ~33Hz
+
+static bool CheckCovariance(const Eigen::MatrixXf &P) {
+  float asym = (P - P.transpose()).cwiseAbs().maxCoeff();
+  Eigen::LLT<Eigen::MatrixXf> llt(P);
+  if (llt.info() != Eigen::Success || asym > 1e-6) {
+    fprintf(stderr, "covariance degenerated; asymmetry %g\n", asym);
+    return false;
+  }
+  return true;
+}
+
+// bearings to known landmarks
+static bool BenchLocalize() {
+  LocalizeEKF ekf;
+  Eigen::Matrix3f Rz = Eigen::Matrix3f::Zero();
+  Rz(0, 0) = 0.02 * 0.02;  // bearing, radians
+  Rz(1, 1) = Rz(2, 2) = 0.05 * 0.05;  // landmark position, meters
+
+  // start out somewhat off the true pose on a circle around the origin
+  float x = 0, y = -kRadius, theta = 0;
+  ekf.GetState() << 0.1, -kRadius - 0.1, 0.05;
+
+  int allocs0 = n_allocs;
+  int nupdates = 0, nrejected = 0;
+  float maxerr = 0;
+  timeval t0, t1;
+  gettimeofday(&t0, NULL);
+  for (int i = 0; i < kSteps; i++) {
+    float ds = kSpeed * kDt, w = kSpeed / kRadius;
+    float theta1 = theta + w * kDt / 2;
+    x += ds * cos(theta1);
+    y += ds * sin(theta1);
+    theta += w * kDt;
+    ekf.Predict(kDt, ds * (1 + 0.05 * Noise()), w + 0.01 * Noise());
+
+    if (i % kCameraEvery == 0) {
+      const float *l = kLandmarks[(i / kCameraEvery) % kNumLandmarks];
+      float dx = l[0] - x, dy = l[1] - y;
+      float bearing = atan2(-sin(theta) * dx + cos(theta) * dy,
+                            cos(theta) * dx + sin(theta) * dy);
+      // keep the residual in [-pi, pi); the generated update doesn't wrap
+      const LocalizeEKF::State &s = ekf.GetState();
+      float ex = l[0] - s[0], ey = l[1] - s[1];
+      float expected = atan2(-sin(s[2]) * ex + cos(s[2]) * ey,
+                             cos(s[2]) * ex + sin(s[2]) * ey);
+      bearing = expected + remainderf(bearing + 0.02 * Noise() - expected,
+                                      2 * M_PI);
+      if (ekf.UpdateLm_bearing(bearing, l[0], l[1], Rz)) {
+        nupdates++;
+      } else {
+        nrejected++;
+      }
+    }
+
+    if (i >= kSteps / 2) {
+      const LocalizeEKF::State &s = ekf.GetState();
+      maxerr = fmaxf(maxerr, hypotf(s[0] - x, s[1] - y));
+    }
+  }
+  gettimeofday(&t1, NULL);
+  int allocs = n_allocs - allocs0;
+
+  float us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_usec - t0.tv_usec);
+  printf("localize: %d predicts + %d updates: %0.3f us/step, "
+         "%d heap allocations, max position error %f\n",
+         kSteps, nupdates, us / kSteps, allocs, maxerr);
+
+  if (allocs != 0) {
+    fprintf(stderr, "EKF steps allocated memory\n");
+    return false;
+  }
+  if (nrejected != 0 || !CheckCovariance(ekf.GetCovariance())) {
+    return false;
+  }
+  if (!(maxerr < 0.1)) {
+    fprintf(stderr, "EKF didn't track the true pose\n");
+    return false;
+  }
+  return true;
+}
+
+// noisy absolute poses and a biased gyro
+static bool BenchPose() {
+  const float kGyroBias = 0.05;
+  PoseEKF ekf;
+  Eigen::Matrix3f R = Eigen::Matrix3f::Zero();
+  R(0, 0) = R(1, 1) = 0.03 * 0.03;
+  R(2, 2) = 0.02 * 0.02;
+
+  float x = 0, y = -kRadius, theta = 0;
+  ekf.GetState() << 0.1, -kRadius - 0.1, 0.05, 0;
+
+  int allocs0 = n_allocs;
+  int nupdates = 0, nrejected = 0;
+  float maxerr = 0;
+  timeval t0, t1;
+  gettimeofday(&t0, NULL);
+  for (int i = 0; i < kSteps; i++) {
+    float v = kSpeed, w = kSpeed / kRadius;
+    float theta1 = theta + w * kDt / 2;
+    x += v * kDt * cos(theta1);
+    y += v * kDt * sin(theta1);
+    theta += w * kDt;
+    ekf.Predict(kDt, v * (1 + 0.05 * Noise()), w + kGyroBias + 0.01 * Noise());
+
+    if (i % kCameraEvery == 0) {
+      // the localizers wrap their heading; the caller has to unwrap it
+      const PoseEKF::State &s = ekf.GetState();
+      float mtheta = remainderf(theta + 0.02 * Noise(), 2 * M_PI);
+      mtheta = s[2] + remainderf(mtheta - s[2], 2 * M_PI);
+      if (ekf.UpdatePose(x + 0.03 * Noise(), y + 0.03 * Noise(), mtheta, R)) {
+        nupdates++;
+      } else {
+        nrejected++;
+      }
+    }
+
+    // the estimate in between camera frames is what the controller sees
+    if (i >= kSteps / 2) {
+      const PoseEKF::State &s = ekf.GetState();
+      maxerr = fmaxf(maxerr, hypotf(s[0] - x, s[1] - y));
+    }
+  }
+  gettimeofday(&t1, NULL);
+  int allocs = n_allocs - allocs0;
+
+  float us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_usec - t0.tv_usec);
+  float bias = ekf.GetState()[3];
+  printf("pose: %d predicts + %d updates: %0.3f us/step, "
+         "%d heap allocations, max position error %f, gyro bias %f\n",
+         kSteps, nupdates, us / kSteps, allocs, maxerr, bias);
+
+  if (allocs != 0) {
+    fprintf(stderr, "EKF steps allocated memory\n");
+    return false;
+  }
+  if (nrejected != 0 || !CheckCovariance(ekf.GetCovariance())) {
+    return false;
+  }
+  if (!(maxerr < 0.05) || !(fabsf(bias - kGyroBias) < 0.01)) {
+    fprintf(stderr, "EKF didn't track the true pose\n");
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  if (!BenchLocalize()) {
+    return 1;
+  }
+  if (!BenchPose()) {
+    return 1;
+  }
+  return 0;
+}
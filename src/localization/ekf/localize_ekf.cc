@@ -0,0 +1,105 @@
+#include <math.h>
+#include <Eigen/Dense>
+#include "localize_ekf.h"
+
+// This file is auto-generated by ekf/codegen.py. DO NOT EDIT.
+
+static inline float Heaviside(float x, float h0 = 1) {
+  return x < 0 ? 0 : x > 0 ? 1 : h0;
+}
+
+static inline float DiracDelta(float x) {
+  return x == 0;
+}
+
+LocalizeEKF::LocalizeEKF() {
+  Reset();
+}
+
+void LocalizeEKF::Reset() {
+  x_ << 0,
+        0,
+        0;
+  P_.setZero();
+  P_.diagonal() << 0.0100000007F,
+    0.0100000007F,
+    0.0100000007F;
+}
+
+void LocalizeEKF::Predict(float Delta_t, float u_x, float u_theta) {
+  float theta = x_[2];
+
+  float tmp0 = Delta_t*u_theta;
+  float tmp1 = theta + (1.0F/2.0F)*tmp0;
+  float tmp2 = sinf(tmp1);
+  float tmp3 = tmp2*u_x;
+  float tmp4 = cosf(tmp1);
+  float tmp5 = tmp4*u_x;
+  float tmp6 = powf(tmp2, 2);
+  float tmp7 = 0.25F*u_theta;
+  float tmp8 = powf(tmp4, 2);
+  float tmp9 = 200*u_x;
+  float tmp10 = -1.0F/2.0F*(tmp7 - tmp9)*sinf(2*theta + tmp0);
+
+  float F_0_2 = -tmp3;
+  float F_1_2 = tmp5;
+  Covariance FP = P_;
+  FP.row(0) += F_0_2 * P_.row(2);
+  FP.row(1) += F_1_2 * P_.row(2);
+  P_ = FP;
+  P_.col(0) += F_0_2 * FP.col(2);
+  P_.col(1) += F_1_2 * FP.col(2);
+
+  P_(0, 0) += Delta_t*(tmp6*tmp7 + tmp8*tmp9);
+  P_(0, 1) += Delta_t*tmp10;
+  P_(1, 0) += Delta_t*tmp10;
+  P_(1, 1) += Delta_t*(tmp6*tmp9 + tmp7*tmp8);
+  P_(2, 2) += 0.02F*Delta_t;
+
+  x_[0] += tmp5;
+  x_[1] += tmp3;
+  x_[2] += tmp0;
+}
+
+bool LocalizeEKF::UpdateLm_bearing(float l_px, float l_x, float l_y, const Eigen::Matrix<float, 3, 3> &Rz) {
+  float p_x = x_[0];
+  float p_y = x_[1];
+  float theta = x_[2];
+  float tmp0 = sinf(theta);
+  float tmp1 = l_x - p_x;
+  float tmp2 = cosf(theta);
+  float tmp3 = l_y - p_y;
+  float tmp4 = tmp0*tmp1 - tmp2*tmp3;
+  float tmp5 = tmp0*tmp3 + tmp1*tmp2;
+  float tmp6 = 1.0F/(powf(tmp4, 2) + powf(tmp5, 2));
+  float tmp7 = -tmp0*tmp5 + tmp2*tmp4;
+  float tmp8 = tmp6*(tmp0*tmp4 + tmp2*tmp5);
+
+  Eigen::Matrix<float, 1, 1> yk;
+  yk << l_px - atan2f(-tmp4, tmp5);
+
+  Eigen::Matrix<float, 1, 3> Hk;
+  Hk << -tmp6*tmp7, -tmp8, -1;
+
+  Eigen::Matrix<float, 1, 3> Mk;
+  Mk << 1, tmp6*tmp7, tmp8;
+  Eigen::Matrix<float, 1, 1> Rk = Mk * Rz * Mk.transpose();
+
+  Eigen::Matrix<float, 3, 1> PHt = P_ * Hk.transpose();
+  Eigen::Matrix<float, 1, 1> S = Hk * PHt + Rk;
+  Eigen::Matrix<float, 3, 1> K;
+  Eigen::LLT<Eigen::Matrix<float, 1, 1> > llt(S);
+  if (llt.info() != Eigen::Success) {
+    return false;
+  }
+  K.noalias() = llt.solve(PHt.transpose()).transpose();
+
+  x_.noalias() += K * yk;
+  Covariance IKH = Covariance::Identity();
+  IKH.noalias() -= K * Hk;
+  Covariance P = IKH * P_ * IKH.transpose();
+  P.noalias() += K * Rk * K.transpose();
+  P_ = P;
+  return true;
+}
+
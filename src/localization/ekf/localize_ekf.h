@@ -0,0 +1,31 @@
+#ifndef LOCALIZATION_EKF_LOCALIZE_EKF_H_
+#define LOCALIZATION_EKF_LOCALIZE_EKF_H_
+#include <Eigen/Dense>
+
+// This file is auto-generated by ekf/codegen.py. DO NOT EDIT.
+
+
+class LocalizeEKF {
+ public:
+  typedef Eigen::Matrix<float, 3, 1> State;
+  typedef Eigen::Matrix<float, 3, 3> Covariance;
+
+  LocalizeEKF();
+
+  void Reset();
+
+  void Predict(float Delta_t, float u_x, float u_theta);
+  bool UpdateLm_bearing(float l_px, float l_x, float l_y, const Eigen::Matrix<float, 3, 3> &Rz);
+
+  State& GetState() { return x_; }
+  Covariance& GetCovariance() { return P_; }
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+ private:
+  State x_;
+  Covariance P_;
+};
+
+#endif  // LOCALIZATION_EKF_LOCALIZE_EKF_H_
+
@@ -0,0 +1,105 @@
+#include <math.h>
+#include <Eigen/Dense>
+#include "pose_ekf.h"
+
+// This file is auto-generated by ekf/codegen.py. DO NOT EDIT.
+
+static inline float Heaviside(float x, float h0 = 1) {
+  return x < 0 ? 0 : x > 0 ? 1 : h0;
+}
+
+static inline float DiracDelta(float x) {
+  return x == 0;
+}
+
+PoseEKF::PoseEKF() {
+  Reset();
+}
+
+void PoseEKF::Reset() {
+  x_ << 0,
+        0,
+        0,
+        0;
+  P_.setZero();
+  P_.diagonal() << 0.0100000007F,
+    0.0100000007F,
+    0.0100000007F,
+    0.00039999999F;
+}
+
+void PoseEKF::Predict(float Delta_t, float u_v, float u_w) {
+  float theta = x_[2];
+  float b_w = x_[3];
+
+  float tmp0 = Delta_t*(b_w - u_w);
+  float tmp1 = -theta + (1.0F/2.0F)*tmp0;
+  float tmp2 = sinf(tmp1);
+  float tmp3 = Delta_t*u_v;
+  float tmp4 = tmp2*tmp3;
+  float tmp5 = (1.0F/2.0F)*powf(Delta_t, 2)*u_v;
+  float tmp6 = cosf(tmp1);
+  float tmp7 = tmp3*tmp6;
+  float tmp8 = 0.1F*u_v + 0.01F;
+
+  float F_0_2 = tmp4;
+  float F_0_3 = -tmp2*tmp5;
+  float F_1_2 = tmp7;
+  float F_1_3 = -tmp5*tmp6;
+  float F_2_3 = -Delta_t;
+  Covariance FP = P_;
+  FP.row(0) += F_0_2 * P_.row(2);
+  FP.row(0) += F_0_3 * P_.row(3);
+  FP.row(1) += F_1_2 * P_.row(2);
+  FP.row(1) += F_1_3 * P_.row(3);
+  FP.row(2) += F_2_3 * P_.row(3);
+  P_ = FP;
+  P_.col(0) += F_0_2 * FP.col(2);
+  P_.col(0) += F_0_3 * FP.col(3);
+  P_.col(1) += F_1_2 * FP.col(2);
+  P_.col(1) += F_1_3 * FP.col(3);
+  P_.col(2) += F_2_3 * FP.col(3);
+
+  P_(0, 0) += Delta_t*powf(tmp8, 2);
+  P_(1, 1) += Delta_t*powf(tmp8, 2);
+  P_(2, 2) += 0.0025F*Delta_t;
+  P_(3, 3) += 4.0e-6F*Delta_t;
+
+  x_[0] += tmp7;
+  x_[1] += -tmp4;
+  x_[2] += -tmp0;
+}
+
+bool PoseEKF::UpdatePose(float m_x, float m_y, float m_theta, const Eigen::Matrix<float, 3, 3> &Rk) {
+  float p_x = x_[0];
+  float p_y = x_[1];
+  float theta = x_[2];
+
+  Eigen::Matrix<float, 3, 1> yk;
+  yk << m_x - p_x,
+        m_y - p_y,
+        m_theta - theta;
+
+  Eigen::Matrix<float, 3, 4> Hk;
+  Hk << 1, 0, 0, 0,
+        0, 1, 0, 0,
+        0, 0, 1, 0;
+
+  Eigen::Matrix<float, 4, 3> PHt = P_ * Hk.transpose();
+  Eigen::Matrix<float, 3, 3> S = Hk * PHt + Rk;
+  Eigen::Matrix<float, 4, 3> K;
+  Eigen::LLT<Eigen::Matrix<float, 3, 3> > llt(S);
+  if (llt.info() != Eigen::Success) {
+    return false;
+  }
+  K.noalias() = llt.solve(PHt.transpose()).transpose();
+
+  x_.noalias() += K * yk;
+  Covariance IKH = Covariance::Identity();
+  IKH.noalias() -= K * Hk;
+  Covariance P = IKH * P_ * IKH.transpose();
+  P.noalias() += K * Rk * K.transpose();
+  P_ = P;
+  return true;
+}
+
@@ -0,0 +1,31 @@
+#ifndef LOCALIZATION_EKF_POSE_EKF_H_
+#define LOCALIZATION_EKF_POSE_EKF_H_
+#include <Eigen/Dense>
+
+// This file is auto-generated by ekf/codegen.py. DO NOT EDIT.
+
+
+class PoseEKF {
+ public:
+  typedef Eigen::Matrix<float, 4, 1> State;
+  typedef Eigen::Matrix<float, 4, 4> Covariance;
+
+  PoseEKF();
+
+  void Reset();
+
+  void Predict(float Delta_t, float u_v, float u_w);
+  bool UpdatePose(float m_x, float m_y, float m_theta, const Eigen::Matrix<float, 3, 3> &Rk);
+
+  State& GetState() { return x_; }
+  Covariance& GetCovariance() { return P_; }
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+ private:
+  State x_;
+  Covariance P_;
+};
+
+#endif  // LOCALIZATION_EKF_POSE_EKF_H_
+
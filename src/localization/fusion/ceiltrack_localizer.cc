@@ -0,0 +1,85 @@
+#include "localization/fusion/ceiltrack_localizer.h"
+
+#include <math.h>
+
+// light pixel threshold and Gauss-Newton iterations per frame
+const uint8_t CEILTRACK_THRESH = 240;
+const int CEILTRACK_ITERS = 2;
+
+// below this many light pixels the fit is meaningless
+const int CEILTRACK_MIN_PIXELS = 100;
+
+// the pixels of one light aren't independent measurements; inflate the
+// covariance by about how many there are per light
+const float CEILTRACK_PIXEL_CORRELATION = 30;
+
+// dead reckoning noise: per meter travelled, and gyro noise in rad/sec
+const float CEILTRACK_NOISE_XY = 0.1;
+const float CEILTRACK_NOISE_THETA = 0.05;
+
+CeilTrackLocalizer::CeilTrackLocalizer(float ceil_height, float xgrid,
+                                       float ygrid, float home_x,
+                                       float home_y, float home_theta) {
+  ceil_height_ = ceil_height;
+  xgrid_ = xgrid / ceil_height;
+  ygrid_ = ygrid / ceil_height;
+  // the tracker's frame is the track frame upside down, in ceiling heights
+  home_[0] = -home_x / ceil_height;
+  home_[1] = -home_y / ceil_height;
+  home_[2] = -home_theta;
+  residual_ = -1;
+  Reset();
+}
+
+bool CeilTrackLocalizer::Init(const FisheyeLens &lens, float camtilt) {
+  return ceiltrack_.Init(lens, camtilt);
+}
+
+void CeilTrackLocalizer::Reset() {
+  pos_[0] = home_[0];
+  pos_[1] = home_[1];
+  pos_[2] = home_[2];
+  // we're told exactly where we are
+  cov_ = Eigen::Matrix3f::Identity() * 1e-4;
+}
+
+void CeilTrackLocalizer::Predict(float ds, float w, float dt) {
+  float theta = -pos_[2] + w * dt;
+  pos_[0] -= ds * cos(theta) / ceil_height_;
+  pos_[1] -= ds * sin(theta) / ceil_height_;
+  pos_[2] = -theta;
+  float sxy = CEILTRACK_NOISE_XY * ds, st = CEILTRACK_NOISE_THETA * dt;
+  cov_(0, 0) += sxy * sxy;
+  cov_(1, 1) += sxy * sxy;
+  cov_(2, 2) += st * st;
+}
+
+bool CeilTrackLocalizer::Update(const uint8_t *yuv) {
+  float cost = ceiltrack_.Update(yuv, CEILTRACK_THRESH, xgrid_, ygrid_, pos_,
+                                 CEILTRACK_ITERS, false);
+  float JTJ[9];
+  int n = ceiltrack_.GetInformation(JTJ);
+  if (n < CEILTRACK_MIN_PIXELS) {
+    residual_ = -1;
+    return false;
+  }
+  // residual variance per coordinate; cost is half the sum of squares over
+  // both coordinates of every pixel
+  float sigma2 = cost / n;
+  residual_ = sigma2;
+  Eigen::Matrix3f info =
+      Eigen::Map<Eigen::Matrix<float, 3, 3, Eigen::RowMajor>>(JTJ);
+  Eigen::Matrix3f cov = info.inverse() * sigma2 * CEILTRACK_PIXEL_CORRELATION;
+  // to meters on the ground; the sign flips cancel out
+  Eigen::Vector3f scale(ceil_height_, ceil_height_, 1);
+  cov_ = scale.asDiagonal() * cov * scale.asDiagonal();
+  return true;
+}
+
+void CeilTrackLocalizer::GetPose(Eigen::Vector3f *xytheta,
+                                 Eigen::Matrix3f *cov) const {
+  (*xytheta)[0] = -pos_[0] * ceil_height_;
+  (*xytheta)[1] = -pos_[1] * ceil_height_;
+  (*xytheta)[2] = -pos_[2];
+  *cov = cov_;
+}
@@ -0,0 +1,50 @@
+#ifndef LOCALIZATION_FUSION_CEILTRACK_LOCALIZER_H_
+#define LOCALIZATION_FUSION_CEILTRACK_LOCALIZER_H_
+
+#include <utility>
+#include <vector>
+
+#include "lens/fisheye.h"
+#include "localization/ceiltrack/ceiltrack.h"
+#include "localization/fusion/localizer.h"
+
+// CeilingTracker behind the Localizer interface. The tracker works in
+// ceiling-height-normalized, bottom-up coordinates; this converts to and from
+// meters on the ground, and turns its Gauss-Newton information matrix into a
+// covariance.
+class CeilTrackLocalizer : public Localizer {
+ public:
+  // ceiling lights on an xgrid x ygrid meter grid ceil_height meters above
+  // the camera; home is the starting line pose in track coordinates
+  CeilTrackLocalizer(float ceil_height, float xgrid, float ygrid,
+                     float home_x, float home_y, float home_theta);
+
+  bool Init(const FisheyeLens &lens, float camtilt);
+
+  virtual const char *Name() const { return "ceiltrack"; }
+  virtual void Reset();
+  virtual void Predict(float ds, float w, float dt);
+  virtual bool Update(const uint8_t *yuv);
+  virtual void GetPose(Eigen::Vector3f *xytheta, Eigen::Matrix3f *cov) const;
+
+  // the last Update()'s residual variance per light pixel coordinate, or
+  // -1 if it saw too few lights to fit
+  float Residual() const { return residual_; }
+
+  // the ceiling grid as the camera should see it, for the display
+  void GetMatchedGrid(const FisheyeLens &lens,
+                      std::vector<std::pair<float, float>> *out) const {
+    ceiltrack_.GetMatchedGrid(lens, pos_, xgrid_, ygrid_, out);
+  }
+
+ private:
+  CeilingTracker ceiltrack_;
+  float ceil_height_;
+  float xgrid_, ygrid_;  // in ceiling heights
+  float home_[3];
+  float pos_[3];  // in CeilingTracker's coordinates
+  Eigen::Matrix3f cov_;
+  float residual_;
+};
+
+#endif  // LOCALIZATION_FUSION_CEILTRACK_LOCALIZER_H_
@@ -0,0 +1,86 @@
+#include "localization/fusion/coneslam_localizer.h"
+
+#include <math.h>
+
+const float ConeSLAMLocalizer::kDefaultMaxSpread = 1.0;
+
+ConeSLAMLocalizer::ConeSLAMLocalizer(int n_particles, int n_threads,
+                                     float temperature)
+    : loc_(n_particles, n_threads), temperature_(temperature),
+      max_spread_(kDefaultMaxSpread) {
+  log_ = NULL;
+  log_size_ = log_len_ = 0;
+}
+
+ConeSLAMLocalizer::~ConeSLAMLocalizer() {
+  delete[] log_;
+}
+
+bool ConeSLAMLocalizer::Init(const FisheyeLens &lens, float camtilt,
+                             const char *landmarks) {
+  if (!loc_.LoadLandmarks(landmarks)) {
+    return false;
+  }
+  loc_.InitRing(lens, camtilt);
+  return true;
+}
+
+void ConeSLAMLocalizer::SetLogLevel(coneslam::Localizer::LogLevel level,
+                                    int topk) {
+  loc_.SetLogLevel(level, topk);
+  delete[] log_;
+  // Serialize() wants a byte to spare
+  log_size_ = loc_.SerializedSize();
+  log_ = new uint8_t[log_size_ + 1];
+  log_len_ = 0;
+}
+
+void ConeSLAMLocalizer::Reset() {
+  loc_.Reset();
+  log_len_ = 0;
+}
+
+void ConeSLAMLocalizer::Predict(float ds, float w, float dt) {
+  loc_.Predict(ds, w, dt);
+}
+
+bool ConeSLAMLocalizer::Update(const uint8_t *yuv) {
+  loc_.Update(yuv, temperature_);
+  if (log_ != NULL) {
+    log_len_ = loc_.Serialize(log_, log_size_ + 1);
+  }
+  if (loc_.NumVisibleLandmarks() == 0) {
+    // nothing to weigh the particles by; resampling would only lose some
+    return false;
+  }
+  loc_.Resample();
+  Eigen::Vector3f pose;
+  Eigen::Matrix3f cov;
+  GetPose(&pose, &cov);
+  return cov(0, 0) + cov(1, 1) <= max_spread_ * max_spread_;
+}
+
+void ConeSLAMLocalizer::GetPose(Eigen::Vector3f *xytheta,
+                                Eigen::Matrix3f *cov) const {
+  int n = loc_.NumParticles();
+  const float *x = loc_.GetParticleX(), *y = loc_.GetParticleY(),
+              *theta = loc_.GetParticleTheta();
+  // circular mean for theta, then everything relative to the mean so angles
+  // near +-pi don't blow up the covariance
+  double sx = 0, sy = 0, ss = 0, sc = 0;
+  for (int i = 0; i < n; i++) {
+    sx += x[i];
+    sy += y[i];
+    ss += sin(theta[i]);
+    sc += cos(theta[i]);
+  }
+  Eigen::Vector3f mean(sx / n, sy / n, atan2(ss, sc));
+  Eigen::Matrix3d C = Eigen::Matrix3d::Zero();
+  for (int i = 0; i < n; i++) {
+    Eigen::Vector3d d(x[i] - mean[0], y[i] - mean[1],
+                      remainder(theta[i] - mean[2], 2 * M_PI));
+    C += d * d.transpose();
+  }
+  *xytheta = mean;
+  *cov = (C / n).cast<float>();
+}
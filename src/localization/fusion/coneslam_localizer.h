@@ -0,0 +1,62 @@
+#ifndef LOCALIZATION_FUSION_CONESLAM_LOCALIZER_H_
+#define LOCALIZATION_FUSION_CONESLAM_LOCALIZER_H_
+
+#include "lens/fisheye.h"
+#include "localization/coneslam/localize.h"
+#include "localization/fusion/localizer.h"
+
+// coneslam's particle filter behind the Localizer interface; the pose is the
+// particle cloud's mean and covariance. the landmark file's coordinates must
+// be in the same track frame as any other localizer it's fused with.
+//
+// Seeing cones isn't enough for a fix, as a filter that's lost them still
+// sees some nearly every frame: Update() reports one only if, after
+// resampling, the cloud's RMS distance from its mean is within max_spread
+// meters.
+class ConeSLAMLocalizer : public Localizer {
+ public:
+  // temperature scales the likelihoods as in coneslam::Localizer::Update()
+  ConeSLAMLocalizer(int n_particles, int n_threads, float temperature);
+  ~ConeSLAMLocalizer();
+
+  static const float kDefaultMaxSpread;  // meters
+  void SetMaxSpread(float meters) { max_spread_ = meters; }
+
+  bool Init(const FisheyeLens &lens, float camtilt, const char *landmarks);
+
+  // adapt the particle count to the posterior's spread, between
+  // min_particles and n_particles; see
+  // coneslam::Localizer::SetAdaptiveParticleCount()
+  void SetAdaptiveParticleCount(int min_particles, float epsilon,
+                                float bin_xy, float bin_theta) {
+    loc_.SetAdaptiveParticleCount(min_particles, epsilon, bin_xy, bin_theta);
+  }
+
+  virtual const char *Name() const { return "coneslam"; }
+  virtual void Reset();
+  virtual void Predict(float ds, float w, float dt);
+  virtual bool Update(const uint8_t *yuv);
+  virtual void GetPose(Eigen::Vector3f *xytheta, Eigen::Matrix3f *cov) const;
+
+  const coneslam::Localizer &GetLocalizer() const { return loc_; }
+
+  // keep what coneslam::Localizer::Serialize() writes at level after each
+  // Update(), taken before resampling so top-K ranks by that frame's
+  // likelihoods. off until called, after Init().
+  void SetLogLevel(coneslam::Localizer::LogLevel level, int topk);
+  // LogSize() bounds the length of every Log()
+  int LogSize() const { return log_size_; }
+  const uint8_t *Log(int *len) const {
+    *len = log_len_;
+    return log_;
+  }
+
+ private:
+  coneslam::Localizer loc_;
+  float temperature_;
+  float max_spread_;
+  uint8_t *log_;
+  int log_size_, log_len_;
+};
+
+#endif  // LOCALIZATION_FUSION_CONESLAM_LOCALIZER_H_
@@ -0,0 +1,140 @@
+#include "localization/fusion/fusion.h"
+
+#include <math.h>
+#include <stdio.h>
+
+#include "util/threadpool.h"
+
+// 99th percentile of chi-squared with 3 degrees of freedom: estimates further
+// than this from the most confident one are treated as outliers
+const float FUSION_OUTLIER_GATE = 11.34;
+
+static float WrapAngle(float a) {
+  while (a > M_PI) a -= 2 * M_PI;
+  while (a < -M_PI) a += 2 * M_PI;
+  return a;
+}
+
+LocalizerFusion::LocalizerFusion(Mode mode)
+    : mode_(mode), n_localizers_(0), pool_(NULL), used_mask_(0) {
+  xytheta_.setZero();
+  cov_.setIdentity();
+}
+
+LocalizerFusion::~LocalizerFusion() {
+  delete pool_;
+}
+
+bool LocalizerFusion::Add(Localizer *loc) {
+  if (n_localizers_ >= kMaxLocalizers) {
+    fprintf(stderr, "LocalizerFusion: too many localizers\n");
+    return false;
+  }
+  localizers_[n_localizers_] = loc;
+  fix_[n_localizers_] = false;
+  n_localizers_++;
+  return true;
+}
+
+void LocalizerFusion::Reset() {
+  for (int i = 0; i < n_localizers_; i++) {
+    localizers_[i]->Reset();
+    fix_[i] = false;
+  }
+  Fuse();
+}
+
+void LocalizerFusion::Predict(float ds, float w, float dt) {
+  for (int i = 0; i < n_localizers_; i++) {
+    localizers_[i]->Predict(ds, w, dt);
+  }
+}
+
+bool LocalizerFusion::Update(const uint8_t *yuv) {
+  if (pool_ == NULL) {
+    pool_ = new ThreadPool(n_localizers_ > 0 ? n_localizers_ : 1);
+  }
+  struct {
+    LocalizerFusion *self;
+    const uint8_t *yuv;
+  } args = {this, yuv};
+  pool_->Run([](void *arg, int t) {
+    auto a = reinterpret_cast<decltype(args)*>(arg);
+    if (t < a->self->n_localizers_) {
+      a->self->fix_[t] = a->self->localizers_[t]->Update(a->yuv);
+    }
+  }, &args);
+
+  Fuse();
+  bool any = false;
+  for (int i = 0; i < n_localizers_; i++) {
+    any = any || fix_[i];
+  }
+  return any;
+}
+
+void LocalizerFusion::Fuse() {
+  Eigen::Vector3f x[kMaxLocalizers];
+  Eigen::Matrix3f P[kMaxLocalizers];
+  bool any_fix = false;
+  for (int i = 0; i < n_localizers_; i++) {
+    localizers_[i]->GetPose(&x[i], &P[i]);
+    any_fix = any_fix || fix_[i];
+  }
+
+  // candidates are the ones with a fix this frame, or everyone's dead
+  // reckoning if nobody has one; the most confident is the one with the
+  // smallest uncertainty volume
+  uint32_t candidates = 0;
+  int best = -1;
+  float bestdet = 0;
+  for (int i = 0; i < n_localizers_; i++) {
+    if (any_fix && !fix_[i]) {
+      continue;
+    }
+    float det = P[i].determinant();
+    if (!(det > 0)) {
+      continue;  // degenerate or NaN
+    }
+    candidates |= 1 << i;
+    if (best == -1 || det < bestdet) {
+      best = i;
+      bestdet = det;
+    }
+  }
+  if (best == -1) {
+    used_mask_ = 0;
+    return;
+  }
+
+  used_mask_ = 1 << best;
+  if (mode_ == FUSE_PICK) {
+    xytheta_ = x[best];
+    cov_ = P[best];
+    return;
+  }
+
+  // inverse covariance weighted mean of everything consistent with the best
+  // estimate, with angles unwrapped around it
+  Eigen::Matrix3f info = P[best].inverse();
+  Eigen::Vector3f infox = info * x[best];
+  for (int i = 0; i < n_localizers_; i++) {
+    if (i == best || !(candidates & (1 << i))) {
+      continue;
+    }
+    Eigen::Vector3f d = x[i] - x[best];
+    d[2] = WrapAngle(d[2]);
+    float m2 = d.dot((P[i] + P[best]).ldlt().solve(d));
+    if (m2 > FUSION_OUTLIER_GATE) {
+      continue;
+    }
+    Eigen::Vector3f xi = x[best] + d;
+    Eigen::Matrix3f infoi = P[i].inverse();
+    info += infoi;
+    infox += infoi * xi;
+    used_mask_ |= 1 << i;
+  }
+  cov_ = info.inverse();
+  xytheta_ = cov_ * infox;
+  xytheta_[2] = WrapAngle(xytheta_[2]);
+}
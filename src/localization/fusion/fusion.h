@@ -0,0 +1,63 @@
+#ifndef LOCALIZATION_FUSION_FUSION_H_
+#define LOCALIZATION_FUSION_FUSION_H_
+
+#include <stdint.h>
+
+#include <Eigen/Dense>
+
+#include "localization/fusion/localizer.h"
+
+class ThreadPool;
+
+// Runs several localizers on each camera frame, each on its own core, and
+// combines their estimates.
+//
+// Estimates which are wildly inconsistent with the most confident one (e.g.
+// ceiltrack snapping to the wrong grid cell) are dropped first; the rest
+// are either blended by inverse covariance or the most confident one is
+// picked outright.
+class LocalizerFusion {
+ public:
+  enum Mode { FUSE_BLEND, FUSE_PICK };
+
+  explicit LocalizerFusion(Mode mode = FUSE_BLEND);
+  ~LocalizerFusion();
+
+  // add a localizer (not owned); all of them must be added before the first
+  // Update(). returns false if there are already kMaxLocalizers
+  bool Add(Localizer *loc);
+  int NumLocalizers() const { return n_localizers_; }
+
+  void Reset();
+  void Predict(float ds, float w, float dt);
+
+  // update every localizer from the frame concurrently, then fuse; returns
+  // false if none of them got a fix, in which case the fused pose is their
+  // dead reckoning
+  bool Update(const uint8_t *yuv);
+
+  void GetPose(Eigen::Vector3f *xytheta, Eigen::Matrix3f *cov) const {
+    *xytheta = xytheta_;
+    *cov = cov_;
+  }
+
+  // bit i is set if localizer i went into the last fused pose
+  uint32_t UsedMask() const { return used_mask_; }
+
+  static const int kMaxLocalizers = 8;
+
+ private:
+  void Fuse();
+
+  Mode mode_;
+  int n_localizers_;
+  Localizer *localizers_[kMaxLocalizers];
+  bool fix_[kMaxLocalizers];
+  ThreadPool *pool_;
+
+  Eigen::Vector3f xytheta_;
+  Eigen::Matrix3f cov_;
+  uint32_t used_mask_;
+};
+
+#endif  // LOCALIZATION_FUSION_FUSION_H_
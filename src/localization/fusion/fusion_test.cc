@@ -0,0 +1,276 @@
+// check the fusion rules on canned estimates, that localizers really run
+// concurrently, that ceiltrack's covariance is sane on recorded frames, and
+// that coneslam's log is taken before it resamples
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "localization/fusion/ceiltrack_localizer.h"
+#include "localization/fusion/coneslam_localizer.h"
+#include "localization/fusion/fusion.h"
+
+class FakeLocalizer : public Localizer {
+ public:
+  FakeLocalizer(float x, float y, float theta, float sigma, bool fix)
+      : x_(x, y, theta), fix_(fix), sleep_us_(0) {
+    cov_ = Eigen::Matrix3f::Identity() * sigma * sigma;
+  }
+
+  virtual const char *Name() const { return "fake"; }
+  virtual void Reset() {}
+  virtual void Predict(float ds, float w, float dt) {}
+  virtual bool Update(const uint8_t *yuv) {
+    if (sleep_us_) usleep(sleep_us_);
+    return fix_;
+  }
+  virtual void GetPose(Eigen::Vector3f *xytheta, Eigen::Matrix3f *cov) const {
+    *xytheta = x_;
+    *cov = cov_;
+  }
+
+  Eigen::Vector3f x_;
+  Eigen::Matrix3f cov_;
+  bool fix_;
+  int sleep_us_;
+};
+
+static bool Near(const Eigen::Vector3f &a, float x, float y, float theta) {
+  return fabsf(a[0] - x) < 1e-4 && fabsf(a[1] - y) < 1e-4 &&
+      fabsf(remainderf(a[2] - theta, 2 * M_PI)) < 1e-4;
+}
+
+static bool CheckRules() {
+  Eigen::Vector3f x;
+  Eigen::Matrix3f P;
+
+  // equal confidence: the midpoint, with half the variance; the angles are
+  // either side of +-pi
+  FakeLocalizer a(1, 0, 3.1, 1, true), b(3, 0, -3.1, 1, true);
+  LocalizerFusion blend;
+  blend.Add(&a);
+  blend.Add(&b);
+  blend.Update(NULL);
+  blend.GetPose(&x, &P);
+  if (!Near(x, 2, 0, M_PI) || fabsf(P(0, 0) - 0.5) > 1e-5 ||
+      blend.UsedMask() != 3) {
+    fprintf(stderr, "blend: %f %f %f var %f mask %x\n", x[0], x[1], x[2],
+            P(0, 0), blend.UsedMask());
+    return false;
+  }
+
+  // way off: dropped
+  FakeLocalizer c(50, 0, 0, 1, true);
+  blend.Add(&c);
+  blend.Update(NULL);
+  blend.GetPose(&x, &P);
+  if (!Near(x, 2, 0, M_PI) || blend.UsedMask() != 3) {
+    fprintf(stderr, "outlier: %f %f %f mask %x\n", x[0], x[1], x[2],
+            blend.UsedMask());
+    return false;
+  }
+
+  // pick mode takes the tightest estimate
+  FakeLocalizer d(1, 1, 0, 0.1, true), e(1.2, 1, 0, 1, true);
+  LocalizerFusion pick(LocalizerFusion::FUSE_PICK);
+  pick.Add(&e);
+  pick.Add(&d);
+  pick.Update(NULL);
+  pick.GetPose(&x, &P);
+  if (!Near(x, 1, 1, 0) || pick.UsedMask() != 2) {
+    fprintf(stderr, "pick: %f %f %f mask %x\n", x[0], x[1], x[2],
+            pick.UsedMask());
+    return false;
+  }
+
+  // a localizer without a fix is ignored, unless nobody has one
+  d.fix_ = false;
+  pick.Update(NULL);
+  pick.GetPose(&x, &P);
+  if (!Near(x, 1.2, 1, 0) || pick.UsedMask() != 1) {
+    fprintf(stderr, "no fix: %f %f %f mask %x\n", x[0], x[1], x[2],
+            pick.UsedMask());
+    return false;
+  }
+  e.fix_ = false;
+  if (pick.Update(NULL)) {
+    fprintf(stderr, "nobody had a fix\n");
+    return false;
+  }
+  pick.GetPose(&x, &P);
+  if (!Near(x, 1, 1, 0)) {
+    fprintf(stderr, "dead reckoning: %f %f %f\n", x[0], x[1], x[2]);
+    return false;
+  }
+  return true;
+}
+
+static bool CheckConcurrency() {
+  const int kSleep = 20000;
+  FakeLocalizer a(0, 0, 0, 1, true), b(0, 0, 0, 1, true),
+      c(0, 0, 0, 1, true);
+  a.sleep_us_ = b.sleep_us_ = c.sleep_us_ = kSleep;
+  LocalizerFusion fusion;
+  fusion.Add(&a);
+  fusion.Add(&b);
+  fusion.Add(&c);
+  fusion.Update(NULL);  // start the threads
+  timeval t0, t1;
+  gettimeofday(&t0, NULL);
+  fusion.Update(NULL);
+  gettimeofday(&t1, NULL);
+  float us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_usec - t0.tv_usec);
+  printf("3 x %d us localizers took %0.0f us\n", kSleep, us);
+  return us < 2 * kSleep;
+}
+
+static bool CheckCeilTrack() {
+  FisheyeLens lens;
+  lens.SetCalibration(765./4.05, 765./4.05, 1280./4.05, 920./4.05, 0.015);
+  // the test data is in feet
+  CeilTrackLocalizer ceiltrack(8.25, 10, 12, 0, 0, 0);
+  if (!ceiltrack.Init(lens, 22 * M_PI / 180.0)) {
+    return false;
+  }
+  gzFile zf = gzopen(TESTDATA_PATH "/data.raw.gz", "rb");
+  FILE *gf = fopen(TESTDATA_PATH "/golden.txt", "r");
+  if (zf == NULL || gf == NULL) {
+    perror("ceiltrack testdata");
+    return false;
+  }
+  static uint8_t y[640*480];
+  int frame = 0, nfix = 0;
+  float maxsigma = 0, maxerr = 0;
+  float gx, gy, gt;
+  while (gzread(zf, y, sizeof(y)) == sizeof(y) &&
+         fscanf(gf, "%f %f %f\n", &gx, &gy, &gt) == 3) {
+    if (ceiltrack.Update(y)) {
+      nfix++;
+    }
+    Eigen::Vector3f x;
+    Eigen::Matrix3f P;
+    ceiltrack.GetPose(&x, &P);
+    if (!(P.determinant() > 0)) {
+      fprintf(stderr, "frame %d: covariance not positive definite\n", frame);
+      return false;
+    }
+    if (frame >= 10) {
+      maxsigma = fmaxf(maxsigma, sqrtf(fmaxf(P(0, 0), P(1, 1))));
+      maxerr = fmaxf(maxerr, hypotf(x[0] + gx * 8.25, x[1] + gy * 8.25));
+    }
+    frame++;
+  }
+  gzclose(zf);
+  fclose(gf);
+  printf("ceiltrack: %d/%d frames with a fix, max xy sigma %f, max error "
+         "vs golden %f (feet)\n", nfix, frame, maxsigma, maxerr);
+  return nfix > frame / 2 && maxsigma < 1 && maxerr < 1;
+}
+
+// the top-K log has to rank the particles by the frame's likelihoods, so
+// it should match what a bare coneslam filter serializes between Update()
+// and Resample()
+static bool CheckConeSLAMLog() {
+  const char *lmfile = "fusion_test_lm.tmp";
+  FILE *fp = fopen(lmfile, "w");
+  if (fp == NULL) {
+    perror(lmfile);
+    return false;
+  }
+  fprintf(fp, "3\n1.5 0.5\n-1 2\n2 -2\n");
+  fclose(fp);
+  FisheyeLens lens;
+  lens.SetCalibration(188.16, 188.16, 319.7, 241.0, 0.00675);
+  ConeSLAMLocalizer cs(500, 1, 0.01);
+  coneslam::Localizer ref(500, 1);
+  bool ok = cs.Init(lens, 0, lmfile) && ref.LoadLandmarks(lmfile);
+  unlink(lmfile);
+  if (!ok) {
+    return false;
+  }
+  ref.InitRing(lens, 0);
+  ref.SetLogLevel(coneslam::Localizer::LOG_TOPK, 8);
+  cs.SetLogLevel(coneslam::Localizer::LOG_TOPK, 8);
+
+  static uint8_t yuv[640*480 + 320*240*2];
+  uint8_t *buf = new uint8_t[ref.SerializedSize() + 1];
+  srand48(7);
+  for (int frame = 0; frame < 5 && ok; frame++) {
+    for (size_t i = 0; i < sizeof(yuv); i++) {
+      yuv[i] = drand48() * 256;
+    }
+    cs.Predict(0.1, 0.5, 1.0/30);
+    ref.Predict(0.1, 0.5, 1.0/30);
+    cs.Update(yuv);
+    ref.Update(yuv, 0.01);
+    int len = ref.Serialize(buf, ref.SerializedSize() + 1), loglen;
+    const uint8_t *log = cs.Log(&loglen);
+    ok = ref.NumVisibleLandmarks() > 0 && loglen == len &&
+        loglen <= cs.LogSize() && !memcmp(log, buf, len);
+    if (!ok) {
+      fprintf(stderr, "coneslam log differs on frame %d\n", frame);
+    }
+    ref.Resample();
+  }
+  delete[] buf;
+  return ok;
+}
+
+// a fix needs a tight particle cloud, not just cones in view
+static bool CheckConeSLAMFix() {
+  const char *lmfile = "fusion_test_lm.tmp";
+  FILE *fp = fopen(lmfile, "w");
+  if (fp == NULL) {
+    perror(lmfile);
+    return false;
+  }
+  fprintf(fp, "3\n1.5 0.5\n-1 2\n2 -2\n");
+  fclose(fp);
+  FisheyeLens lens;
+  lens.SetCalibration(188.16, 188.16, 319.7, 241.0, 0.00675);
+  ConeSLAMLocalizer tight(500, 1, 0.01), lost(500, 1, 0.01);
+  bool ok = tight.Init(lens, 0, lmfile) && lost.Init(lens, 0, lmfile);
+  unlink(lmfile);
+  if (!ok) {
+    return false;
+  }
+  // the reset cloud is a few centimeters across, and a blank frame weighs
+  // every particle the same, so resampling keeps it that way
+  lost.SetMaxSpread(0.001);
+  tight.Reset();
+  lost.Reset();
+  static uint8_t yuv[640*480 + 320*240*2];
+  memset(yuv, 128, sizeof(yuv));
+  bool tightfix = tight.Update(yuv), lostfix = lost.Update(yuv);
+  if (tight.GetLocalizer().NumVisibleLandmarks() == 0 || !tightfix ||
+      lostfix) {
+    fprintf(stderr, "coneslam fix: %d landmarks visible, tight %d lost %d\n",
+            tight.GetLocalizer().NumVisibleLandmarks(), tightfix, lostfix);
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  if (!CheckRules()) {
+    return 1;
+  }
+  if (!CheckConcurrency()) {
+    fprintf(stderr, "localizers didn't run concurrently\n");
+    return 1;
+  }
+  if (!CheckCeilTrack()) {
+    return 1;
+  }
+  if (!CheckConeSLAMLog()) {
+    return 1;
+  }
+  if (!CheckConeSLAMFix()) {
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef LOCALIZATION_FUSION_LOCALIZER_H_
+#define LOCALIZATION_FUSION_LOCALIZER_H_
+
+#include <stdint.h>
+
+#include <Eigen/Dense>
+
+// Common interface for anything which tracks the car's pose from camera
+// frames (ceiling lights, cones, ...), so the driver can run whichever ones
+// suit the venue and fuse them with LocalizerFusion.
+//
+// Poses are x, y in meters and theta in radians, all in the track frame the
+// planner uses; every localizer in use must be set up to agree on it.
+class Localizer {
+ public:
+  virtual ~Localizer() {}
+
+  virtual const char *Name() const = 0;
+
+  // go back to the starting line
+  virtual void Reset() = 0;
+
+  // dead reckoning since the last call: ds meters travelled and w rad/sec
+  // yaw rate over dt seconds
+  virtual void Predict(float ds, float w, float dt) = 0;
+
+  // update from a 640x480 YUV420 camera frame; returns true only if the
+  // pose is now a fix worth correcting the controller with: false if the
+  // frame told us nothing (ceiling lights off, no cones in view, ...), or if
+  // the estimate is too uncertain to trust (a particle filter's cloud spread
+  // wider than its limit, as after losing track)
+  virtual bool Update(const uint8_t *yuv) = 0;
+
+  // current estimate of x, y, theta and its 3x3 covariance
+  virtual void GetPose(Eigen::Vector3f *xytheta,
+                       Eigen::Matrix3f *cov) const = 0;
+};
+
+#endif  // LOCALIZATION_FUSION_LOCALIZER_H_
@@ -0,0 +1,35 @@
+#include "timing/clock.h"
+
+ClockMapper::ClockMapper(double ticks_per_sec, int64_t wrap) {
+  us_per_tick_ = 1e6 / ticks_per_sec;
+  wrap_ = wrap;
+  Reset();
+}
+
+void ClockMapper::Reset() {
+  last_native_ = 0;
+  epoch_ = 0;
+  n_diffs_ = next_diff_ = 0;
+  offset_ = 0;
+}
+
+int64_t ClockMapper::Map(int64_t native, int64_t arrival, int64_t min_delay) {
+  if (wrap_ && n_diffs_ > 0 && native < last_native_ - wrap_ / 2) {
+    epoch_ += wrap_;
+  }
+  last_native_ = native;
+  int64_t native_us = (epoch_ + native) * us_per_tick_;
+
+  diffs_[next_diff_] = arrival - min_delay - native_us;
+  next_diff_ = (next_diff_ + 1) % kWindow;
+  if (n_diffs_ < kWindow) {
+    n_diffs_++;
+  }
+  offset_ = diffs_[0];
+  for (int i = 1; i < n_diffs_; i++) {
+    if (diffs_[i] < offset_) {
+      offset_ = diffs_[i];
+    }
+  }
+  return native_us + offset_;
+}
@@ -0,0 +1,55 @@
+#ifndef TIMING_CLOCK_H_
+#define TIMING_CLOCK_H_
+
+#include <stdint.h>
+#include <time.h>
+
+// Every sample on the car is timestamped in microseconds on CLOCK_MONOTONIC,
+// which unlike gettimeofday() never jumps when NTP or the GPS sets the wall
+// clock. Sensors with a clock of their own get their timestamps mapped onto
+// it, so a sample's time is when it was measured rather than when we got
+// around to reading it.
+inline int64_t MonotonicMicros() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * (int64_t)1000000 + ts.tv_nsec / 1000;
+}
+
+// Maps a sensor's native timestamps onto CLOCK_MONOTONIC.
+//
+// A sample's arrival time minus its native timestamp is the offset between
+// the two clocks plus a transport delay which is never negative, so the
+// smallest difference seen over a recent window tracks the offset (plus the
+// minimum delay) while following the slow drift between the two clocks.
+//
+// Whatever part of the minimum delay the caller can't account for ends up
+// in the offset, so mapped times come out late by it and latencies measured
+// from them only show the jitter above it. Pass what is known, e.g. the
+// message's length at the link's baud rate, as min_delay.
+class ClockMapper {
+ public:
+  // ticks_per_sec: native clock rate; wrap: the native clock's period in
+  // ticks if it rolls over, or 0
+  ClockMapper(double ticks_per_sec, int64_t wrap);
+
+  void Reset();
+
+  // the monotonic time of a sample stamped native which arrived at arrival,
+  // having taken at least min_delay microseconds to get here
+  int64_t Map(int64_t native, int64_t arrival, int64_t min_delay = 0);
+
+  // current estimate of (monotonic - native) in microseconds
+  int64_t Offset() const { return offset_; }
+
+ private:
+  static const int kWindow = 64;
+
+  double us_per_tick_;
+  int64_t wrap_;
+  int64_t last_native_, epoch_;  // unwrapping state
+  int64_t diffs_[kWindow];
+  int n_diffs_, next_diff_;
+  int64_t offset_;
+};
+
+#endif  // TIMING_CLOCK_H_
@@ -0,0 +1,65 @@
+#include "timing/latency.h"
+
+#include <string.h>
+
+LatencyHistogram::LatencyHistogram(const char *name) {
+  name_ = name;
+  Clear();
+}
+
+void LatencyHistogram::Clear() {
+  memset(buckets_, 0, sizeof(buckets_));
+  n_ = sum_ = max_ = 0;
+}
+
+// values under 4us get a bucket each; above that, the exponent picks the
+// octave and the next two bits below the leading one the quarter
+int LatencyHistogram::Bucket(int64_t us) {
+  if (us < 4) {
+    return us < 0 ? 0 : us;
+  }
+  int e = 63 - __builtin_clzll(us);
+  int b = 4 * (e - 1) + ((us >> (e - 2)) & 3);
+  return b < kBuckets ? b : kBuckets - 1;
+}
+
+int64_t LatencyHistogram::BucketStart(int b) {
+  if (b < 4) {
+    return b;
+  }
+  int e = b / 4 + 1;
+  return (int64_t)(4 + b % 4) << (e - 2);
+}
+
+void LatencyHistogram::Add(int64_t us) {
+  buckets_[Bucket(us)]++;
+  n_++;
+  sum_ += us;
+  if (us > max_) {
+    max_ = us;
+  }
+}
+
+int64_t LatencyHistogram::Percentile(float p) const {
+  int64_t target = p * n_;
+  int64_t seen = 0;
+  for (int b = 0; b < kBuckets; b++) {
+    seen += buckets_[b];
+    if (seen > target) {
+      int64_t end = BucketStart(b + 1);
+      return end < max_ ? end : max_;
+    }
+  }
+  return max_;
+}
+
+void LatencyHistogram::Report(FILE *fp) const {
+  if (n_ == 0) {
+    fprintf(fp, "%s: no samples\n", name_);
+    return;
+  }
+  fprintf(fp, "%s: n=%lld mean %0.2fms p50 %0.2fms p90 %0.2fms "
+          "p99 %0.2fms max %0.2fms\n", name_, (long long) n_,
+          sum_ * 1e-3 / n_, Percentile(0.5) * 1e-3, Percentile(0.9) * 1e-3,
+          Percentile(0.99) * 1e-3, max_ * 1e-3);
+}
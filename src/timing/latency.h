@@ -0,0 +1,37 @@
+#ifndef TIMING_LATENCY_H_
+#define TIMING_LATENCY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Histogram of latencies in microseconds, with four buckets per octave
+// (within 19% of the true value) from 1us out to about half an hour. Adding
+// a sample is a handful of instructions and never allocates, so it's safe to
+// call from the camera and control threads; there must be only one writer
+// per histogram, though.
+class LatencyHistogram {
+ public:
+  explicit LatencyHistogram(const char *name);
+
+  void Clear();
+  void Add(int64_t us);
+
+  int64_t Count() const { return n_; }
+  // upper bound of the bucket containing the given fraction of samples
+  int64_t Percentile(float p) const;
+
+  // one line: name, count, mean, p50/p90/p99 and max in milliseconds
+  void Report(FILE *fp) const;
+
+ private:
+  static const int kBuckets = 4 * 31;
+
+  static int Bucket(int64_t us);
+  static int64_t BucketStart(int b);
+
+  const char *name_;
+  uint32_t buckets_[kBuckets];
+  int64_t n_, sum_, max_;
+};
+
+#endif  // TIMING_LATENCY_H_
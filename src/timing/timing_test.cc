@@ -0,0 +1,82 @@
+// check that ClockMapper recovers a sensor clock's offset through jittery
+// transport delays and counter wraparound, and that LatencyHistogram's
+// percentiles land in the right buckets
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include "timing/clock.h"
+#include "timing/latency.h"
+
+// deterministic delays: 2ms minimum, up to 12ms
+static int64_t Delay() {
+  static uint32_t s = 1;
+  s = s * 1103515245 + 12345;
+  return 2000 + ((s >> 8) & 0xffff) * 10000 / 65536;
+}
+
+static bool TestMapper() {
+  // a GPS-like clock in milliseconds wrapping at one week, starting just
+  // before the wrap, running 50ppm fast and 123s behind the monotonic clock
+  const int64_t kWrap = 604800000;
+  // one mapper is told about the minimum delay and one isn't, which comes
+  // out late by it
+  ClockMapper mapper(1000, kWrap), known(1000, kWrap);
+  int64_t native0 = kWrap - 30000;
+  int64_t offset = 123000000 - native0 * 1000;
+  int64_t maxerr = 0;
+  for (int i = 0; i < 600; i++) {
+    int64_t t = i * 100000;  // 10Hz epochs
+    int64_t native = (native0 + (t + t / 20000) / 1000) % kWrap;
+    int64_t arrival = t + offset + Delay();
+    int64_t mapped = mapper.Map(native, arrival);
+    int64_t exact = known.Map(native, arrival, 2000);
+    if (i >= 64) {  // once the window has filled
+      int64_t err = std::max(llabs(mapped - (t + offset) - 2000),
+                             llabs(exact - (t + offset)));
+      if (err > maxerr) {
+        maxerr = err;
+      }
+    }
+  }
+  printf("ClockMapper: max error %lld us after wraparound and drift\n",
+         (long long) maxerr);
+  if (maxerr > 1500) {
+    fprintf(stderr, "ClockMapper didn't track the sensor clock\n");
+    return false;
+  }
+  return true;
+}
+
+static bool TestHistogram() {
+  LatencyHistogram h("test");
+  for (int i = 1; i <= 1000; i++) {
+    h.Add(i * 100);  // 0.1 .. 100ms, uniform
+  }
+  h.Report(stdout);
+  int64_t p50 = h.Percentile(0.5), p99 = h.Percentile(0.99);
+  // buckets are a quarter octave, so within 19% above
+  if (p50 < 50000 || p50 > 50000 * 1.19 || p99 < 99000 || p99 > 100000) {
+    fprintf(stderr, "bad percentiles: p50 %lld p99 %lld\n", (long long) p50,
+            (long long) p99);
+    return false;
+  }
+  h.Clear();
+  if (h.Count() != 0 || h.Percentile(0.5) != 0) {
+    fprintf(stderr, "Clear() didn't\n");
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  if (!TestMapper()) {
+    return 1;
+  }
+  if (!TestHistogram()) {
+    return 1;
+  }
+  return 0;
+}
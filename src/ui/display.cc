@@ -160,9 +160,8 @@ void UIDisplay::UpdateParticleView(const coneslam::Localizer *l) {
 
   static const uint16_t yellow = (31<<11) + (63<<5) + (0);
   for (int i = 0; i < l->NumParticles(); i++) {
-    const coneslam::Particle &p = l->GetParticles()[i];
-    int x = x0 + scale * p.x;
-    int y = y0 - scale * p.y;
+    int x = x0 + scale * l->GetParticleX()[i];
+    int y = y0 - scale * l->GetParticleY()[i];
     if (x >= 0 && x < 320 && y >= 0 && y < 112) {
       buf[320*y + x] = yellow;
     }
@@ -0,0 +1,108 @@
+#include <stdio.h>
+
+#include "util/threadpool.h"
+
+namespace {
+
+struct WorkerArg {
+  ThreadPool *pool;
+  int t;
+};
+
+}  // namespace
+
+ThreadPool::ThreadPool(int n_threads) {
+  n_threads_ = n_threads < 1 ? 1 : n_threads;
+  threads_ = new pthread_t[n_threads_];
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&start_cond_, NULL);
+  pthread_cond_init(&done_cond_, NULL);
+  generation_ = 0;
+  n_running_ = 0;
+  quit_ = false;
+  fn_ = NULL;
+  arg_ = NULL;
+
+  for (int t = 1; t < n_threads_; t++) {
+    WorkerArg *wa = new WorkerArg;
+    wa->pool = this;
+    wa->t = t;
+    if (pthread_create(&threads_[t], NULL, thread_entry, wa) != 0) {
+      perror("ThreadPool: pthread_create");
+      delete wa;
+      // run with however many threads we managed to start
+      n_threads_ = t;
+      break;
+    }
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  pthread_mutex_lock(&mutex_);
+  quit_ = true;
+  pthread_cond_broadcast(&start_cond_);
+  pthread_mutex_unlock(&mutex_);
+  for (int t = 1; t < n_threads_; t++) {
+    pthread_join(threads_[t], NULL);
+  }
+  delete[] threads_;
+  pthread_cond_destroy(&done_cond_);
+  pthread_cond_destroy(&start_cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void *ThreadPool::thread_entry(void *arg) {
+  WorkerArg *wa = reinterpret_cast<WorkerArg*>(arg);
+  ThreadPool *self = wa->pool;
+  int t = wa->t;
+  delete wa;
+  self->WorkerLoop(t);
+  return NULL;
+}
+
+void ThreadPool::WorkerLoop(int t) {
+  unsigned seen = 0;
+  pthread_mutex_lock(&mutex_);
+  for (;;) {
+    while (!quit_ && generation_ == seen) {
+      pthread_cond_wait(&start_cond_, &mutex_);
+    }
+    if (quit_) {
+      break;
+    }
+    seen = generation_;
+    void (*fn)(void *, int) = fn_;
+    void *arg = arg_;
+    pthread_mutex_unlock(&mutex_);
+
+    fn(arg, t);
+
+    pthread_mutex_lock(&mutex_);
+    if (--n_running_ == 0) {
+      pthread_cond_signal(&done_cond_);
+    }
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+void ThreadPool::Run(void (*fn)(void *arg, int t), void *arg) {
+  if (n_threads_ > 1) {
+    pthread_mutex_lock(&mutex_);
+    fn_ = fn;
+    arg_ = arg;
+    n_running_ = n_threads_ - 1;
+    generation_++;
+    pthread_cond_broadcast(&start_cond_);
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  fn(arg, 0);
+
+  if (n_threads_ > 1) {
+    pthread_mutex_lock(&mutex_);
+    while (n_running_ > 0) {
+      pthread_cond_wait(&done_cond_, &mutex_);
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+}
@@ -0,0 +1,36 @@
+#ifndef UTIL_THREADPOOL_H_
+#define UTIL_THREADPOOL_H_
+
+#include <pthread.h>
+
+// A fixed set of worker threads which all run the same job on their own
+// slice of the data, fork-join style. The calling thread does slice 0 itself
+// so a pool of one thread never starts any threads at all.
+class ThreadPool {
+ public:
+  explicit ThreadPool(int n_threads);
+  ~ThreadPool();
+
+  int NumThreads() const { return n_threads_; }
+
+  // run fn(arg, t) for each t in [0, NumThreads()) and wait for all of them
+  void Run(void (*fn)(void *arg, int t), void *arg);
+
+ private:
+  static void *thread_entry(void *arg);
+  void WorkerLoop(int t);
+
+  int n_threads_;
+  pthread_t *threads_;
+
+  pthread_mutex_t mutex_;
+  pthread_cond_t start_cond_, done_cond_;
+  unsigned generation_;  // bumped for every Run()
+  int n_running_;
+  bool quit_;
+
+  void (*fn_)(void *, int);
+  void *arg_;
+};
+
+#endif  // UTIL_THREADPOOL_H_
@@ -0,0 +1,117 @@
+""" Convert a binary log from gpsdrive or cf (src/io/binlog.h) back into the
+text those tools used to write, e.g.
+
+    python log2txt.py gpsdrive-20190501-120000.bin > gpsdrive-20190501-120000.log
+
+The control loop and GPS samples are logged through separate rings, so
+they're merged back by timestamp; a fix therefore comes out at its
+navigation epoch rather than when it arrived.
+"""
+
+import struct
+import sys
+
+CONTROL = struct.Struct("=q17fI")  # GPSControlSample
+NAV_PVT = struct.Struct("=IHBBBBBBIiBBBBiiiiIIiiiiiIIH6xihH")
+NAV = struct.Struct("=q92s5f")  # GPSNavSample
+CF = struct.Struct("=f2h10f")  # CFSample
+
+NAV_FIELDS = ("iTOW year month day hour min sec valid tAcc nano fixType flags "
+              "flags2 numSV lon lat height hMSL hAcc vAcc velN velE velD "
+              "gSpeed headMot sAcc headAcc pDOP headVeh magDec "
+              "magAcc").split()
+
+
+def read_chunks(f):
+    """ yield (tag, body) for each chunk in the file """
+    while True:
+        hdr = f.read(8)
+        if len(hdr) < 8:
+            return
+        tag, n = struct.unpack("=4sI", hdr)
+        body = f.read(n - 8)
+        if len(body) < n - 8:
+            sys.stderr.write("log truncated in %s chunk\n" % tag)
+            return
+        yield tag, body
+
+
+def samples(body, st):
+    """ the samples in a ring chunk (see src/io/telemetryring.h) """
+    size, _, dropped = struct.unpack("=HHI", body[:8])
+    if size != st.size:
+        raise Exception("sample size %d, expected %d" % (size, st.size))
+    for i in range(8, len(body) - size + 1, size):
+        yield st.unpack_from(body, i)
+
+
+def stamp(t):
+    return "%d.%06d" % (t // 1000000, t % 1000000)
+
+
+def cdiv(a, b):
+    """ a / b rounding toward zero, like C """
+    q = abs(a) // b
+    return -q if a < 0 else q
+
+
+def control_line(s):
+    return (stamp(s[0]) +
+            " control %f %f wheel %f %f imu %f %f %f %f %f %f "
+            "mag %f %f %f windup_vk %f %f input %f %f\n" % s[1:18])
+
+
+def nav_lines(s):
+    t = s[0]
+    m = dict(zip(NAV_FIELDS, NAV_PVT.unpack(s[1])))
+    gps = ("%s gps %04d-%02d-%02dT%02d:%02d:%02d.%09d " % (
+        stamp(t), m['year'], m['month'], m['day'], m['hour'], m['min'],
+        m['sec'], m['nano']))
+    gps += ("fix:%d numSV:%d %d.%07d +-%dmm %d.%07d +-%dmm height %dmm "
+            "vel %d %d %d +-%d mm/s "
+            "heading motion %d.%05d vehicle %d +- %d.%05d\n" % (
+                m['fixType'], m['numSV'], cdiv(m['lon'], 10000000),
+                abs(m['lon']) % 10000000, m['hAcc'], cdiv(m['lat'], 10000000),
+                abs(m['lat']) % 10000000, m['vAcc'], m['height'], m['velN'],
+                m['velE'], m['velD'], m['sAcc'], cdiv(m['headMot'], 100000),
+                abs(m['headMot']) % 100000, m['headVeh'],
+                m['headAcc'] // 100000, m['headAcc'] % 100000))
+    nav = "%s nav %0.4f %0.4f %f kv %0.5f %0.4f\n" % ((stamp(t),) + s[2:7])
+    return gps + nav
+
+
+def convert(f, out):
+    clock = None
+    lines = []  # (t, order, text)
+    cf = False
+    for tag, body in read_chunks(f):
+        if tag == b'CLK1':
+            wall, mono = struct.unpack("=qq", body[:16])
+            clock = "%s clock monotonic %s\n" % (stamp(wall), stamp(mono))
+        elif tag == b'GCTL':
+            for s in samples(body, CONTROL):
+                lines.append((s[0], len(lines), control_line(s)))
+        elif tag == b'GNAV':
+            for s in samples(body, NAV):
+                lines.append((s[0], len(lines), nav_lines(s)))
+        elif tag == b'CFL1':
+            if not cf:
+                out.write("# dt u_esc u_steer dw wperiod gx gy gz ax ay az\n")
+                cf = True
+            for s in samples(body, CF):
+                out.write("%0.3f %d %d %f %f %f %f %f %f %f %f %f %f\n" % s)
+    if cf:
+        # cf's text logs had no clock line
+        return
+    if clock is not None:
+        out.write(clock)
+    for _, _, text in sorted(lines):
+        out.write(text)
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 2:
+        print("usage: %s <log.bin>" % sys.argv[0])
+        sys.exit(1)
+    with open(sys.argv[1], 'rb') as f:
+        convert(f, sys.stdout)
@@ -0,0 +1,151 @@
+""" Fast access to .rec recordings through librecfile.so (src/io/recordfile.h)
+
+The file is memory-mapped by the library; chunk() hands back numpy arrays
+viewing the mapping directly, and images() decodes camera frames on several
+threads at once. RecordFile.frame(i) returns the same dict as
+recordreader.read_frame, so it can stand in for recordreader.RecordScanner.
+
+The library is looked for in $RECFILE_LIB, then next to this file, then in
+src/build/io, then on the usual library path.
+"""
+
+import ctypes
+import ctypes.util
+import io
+import os
+
+import numpy as np
+
+import recordreader
+
+FRAME_SHAPE = (720, 640)  # 640x480 I420, as the Y420 chunk reshapes
+
+_lib = None
+
+
+def _load():
+    global _lib
+    if _lib is not None:
+        return _lib
+    here = os.path.dirname(os.path.abspath(__file__))
+    candidates = [
+        os.environ.get('RECFILE_LIB'),
+        os.path.join(here, 'librecfile.so'),
+        os.path.join(here, '..', '..', 'src', 'build', 'io', 'librecfile.so'),
+        ctypes.util.find_library('recfile'),
+    ]
+    for path in candidates:
+        if path and (os.path.exists(path) or not os.path.isabs(path)):
+            try:
+                lib = ctypes.CDLL(path)
+                break
+            except OSError:
+                pass
+    else:
+        raise ImportError("librecfile.so not found; build src/io or set "
+                          "RECFILE_LIB")
+
+    u8p = ctypes.POINTER(ctypes.c_uint8)
+    lib.rec_open.restype = ctypes.c_void_p
+    lib.rec_open.argtypes = [ctypes.c_char_p]
+    lib.rec_close.argtypes = [ctypes.c_void_p]
+    lib.rec_num_frames.argtypes = [ctypes.c_void_p]
+    lib.rec_indexed.argtypes = [ctypes.c_void_p]
+    lib.rec_find_time.argtypes = [ctypes.c_void_p, ctypes.c_double]
+    lib.rec_header.restype = ctypes.c_int64
+    lib.rec_header.argtypes = [ctypes.c_void_p, ctypes.POINTER(u8p)]
+    lib.rec_frame.restype = ctypes.c_int64
+    lib.rec_frame.argtypes = [ctypes.c_void_p, ctypes.c_int,
+                              ctypes.POINTER(u8p),
+                              ctypes.POINTER(ctypes.c_double)]
+    lib.rec_chunk.restype = ctypes.c_int64
+    lib.rec_chunk.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_char_p,
+                              ctypes.POINTER(u8p)]
+    lib.rec_decode_frames.argtypes = [ctypes.c_void_p, ctypes.c_int,
+                                      ctypes.c_int, ctypes.c_int, u8p]
+    _lib = lib
+    return lib
+
+
+class RecordFile:
+    def __init__(self, path):
+        self.lib = _load()
+        self.h = self.lib.rec_open(path.encode())
+        if not self.h:
+            raise IOError("can't open recording " + path)
+        data = ctypes.POINTER(ctypes.c_uint8)()
+        n = self.lib.rec_header(self.h, ctypes.byref(data))
+        self.header = ctypes.string_at(data, n) if n >= 0 else None
+
+    def close(self):
+        if self.h:
+            self.lib.rec_close(self.h)
+            self.h = None
+
+    def __del__(self):
+        self.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def num_frames(self):
+        return self.lib.rec_num_frames(self.h)
+
+    def indexed(self):
+        """ whether the file has its index footer """
+        return bool(self.lib.rec_indexed(self.h))
+
+    def find_time(self, t):
+        """ the last frame stamped at or before t (seconds since the epoch) """
+        return self.lib.rec_find_time(self.h, t)
+
+    def _view(self, data, n, dtype):
+        # a numpy array over the mapped file, no copy; only good while the
+        # RecordFile is open
+        buf = (ctypes.c_uint8 * n).from_address(
+            ctypes.addressof(data.contents))
+        return np.frombuffer(buf, dtype)
+
+    def raw_frame(self, i):
+        """ frame i's CYCF chunk as a uint8 array, and its timestamp """
+        data = ctypes.POINTER(ctypes.c_uint8)()
+        t = ctypes.c_double()
+        n = self.lib.rec_frame(self.h, i, ctypes.byref(data), ctypes.byref(t))
+        if n < 0:
+            raise IndexError("no frame %d" % i)
+        return self._view(data, n, np.uint8), t.value
+
+    def chunk(self, i, tag, dtype=np.uint8):
+        """ the body of frame i's chunk tagged tag (e.g. b'CTL2') as an array
+        of dtype viewing the file, or None if it hasn't got one """
+        data = ctypes.POINTER(ctypes.c_uint8)()
+        n = self.lib.rec_chunk(self.h, i, tag, ctypes.byref(data))
+        if n < 0:
+            return None
+        if n == 0:
+            return np.zeros(0, dtype)
+        n -= n % np.dtype(dtype).itemsize
+        return self._view(data, n, dtype)
+
+    def frame(self, i):
+        """ frame i decoded into a dict, as recordreader.read_frame does """
+        raw, _ = self.raw_frame(i)
+        ok, data = recordreader.read_frame(io.BytesIO(raw.tobytes()))
+        if not ok:
+            raise Exception("failed reading frame %d" % i)
+        return data
+
+    def frame_at(self, t):
+        return self.frame(self.find_time(t))
+
+    def images(self, begin, end, nthreads=os.cpu_count()):
+        """ camera frames [begin, end) as an (n, 720, 640) I420 array,
+        decoded in parallel """
+        out = np.empty((end - begin,) + FRAME_SHAPE, np.uint8)
+        ptr = out.ctypes.data_as(ctypes.POINTER(ctypes.c_uint8))
+        if self.lib.rec_decode_frames(self.h, begin, end, nthreads, ptr) != 0:
+            raise Exception("failed decoding frames %d-%d" % (begin, end))
+        return out
@@ -1,6 +1,7 @@
 import chunk
 import numpy as np
 import struct
+import zlib
 
 
 def read_header(f):
@@ -20,11 +21,101 @@ def read_header(f):
         return False, None
 
 
+def decode_mcld(dat):
+    """ decode an MCLd chunk into an Nx4 array of (x, y, theta, heading) """
+    n, qxy, qtheta = struct.unpack("=Iff", dat[:12])
+    vals = []
+    u, shift = 0, 0
+    for b in bytearray(dat[12:]):
+        u |= (b & 0x7f) << shift
+        shift += 7
+        if not (b & 0x80):
+            vals.append((u >> 1) ^ -(u & 1))
+            u, shift = 0, 0
+    d = np.array(vals[:4*n], np.int64).reshape((n, 4))
+    q = np.cumsum(d[:, :3], axis=0)
+    p = np.zeros((n, 4), np.float32)
+    p[:, 0:2] = q[:, 0:2] * qxy
+    p[:, 2] = q[:, 2] * qtheta
+    p[:, 3] = (q[:, 2] + d[:, 3]) * qtheta
+    return p
+
+
+def decode_yuvz(dat, framewidth=640, frameheight=480):
+    """ decode a YUVz chunk (a region of the frame, maybe luma only, maybe
+    row-delta + zlib compressed) into a whole I420 frame as Y420 would have
+    it, with zeros where there's no luma and grey where there's no chroma;
+    also returns the region as (x0, y0, width, height) """
+    w, h, x0, y0, planes, codec, rawlen = struct.unpack("=HHHHBBI", dat[:14])
+    pix = dat[14:]
+    if codec == 1:
+        pix = zlib.decompress(pix)
+    elif codec != 0:
+        raise ValueError("unknown YUVz codec %d" % codec)
+    pix = np.frombuffer(pix, np.uint8)
+    if len(pix) != rawlen:
+        raise ValueError("YUVz frame is %d bytes, expected %d" % (
+            len(pix), rawlen))
+    y = pix[:w*h].reshape((h, w))
+    if planes == 3:
+        # U and V rows follow, each half the width
+        uv = pix[w*h:].reshape((h, w//2))
+    if codec == 1:
+        # undo the left-neighbour deltas, mod 256
+        y = np.cumsum(y, axis=1, dtype=np.uint8)
+        if planes == 3:
+            uv = np.cumsum(uv, axis=1, dtype=np.uint8)
+
+    cw, ch = framewidth // 2, frameheight // 2
+    yuv = np.zeros(framewidth*frameheight + 2*cw*ch, np.uint8)
+    yuv[framewidth*frameheight:] = 128
+    yuv[:framewidth*frameheight].reshape(
+        (frameheight, framewidth))[y0:y0+h, x0:x0+w] = y
+    if planes == 3:
+        for i in range(2):
+            start = framewidth*frameheight + i*cw*ch
+            yuv[start:start+cw*ch].reshape((ch, cw))[
+                y0//2:y0//2+h//2, x0//2:x0//2+w//2] = uv[i*h//2:(i+1)*h//2]
+    return yuv.reshape((-1, framewidth)), (x0, y0, w, h)
+
+
+# one control loop tick, as Driver records it in TLM1 chunks (ControlSample
+# in src/drive/driver.h)
+CONTROL_SAMPLE = np.dtype([
+    ('t', '<i8'), ('t_actuated', '<i8'), ('dt', '<f4'),
+    ('accel', '<f4', 3), ('gyro', '<f4', 3),
+    ('wheel_ds', '<f4'), ('wheel_v', '<f4'),
+    ('u_throttle', '<f4'), ('u_steering', '<f4'),
+    ('js_throttle', '<i2'), ('js_steering', '<i2'),
+    ('flags', 'u1'), ('pad', 'u1', 7)])
+
+
+def decode_tlm1(dat):
+    """ decode a TLM1 chunk into an array of CONTROL_SAMPLE and the count of
+    samples dropped so far """
+    size, _, dropped = struct.unpack("=HHI", dat[:8])
+    if size != CONTROL_SAMPLE.itemsize:
+        raise ValueError("TLM1 samples are %d bytes, expected %d" % (
+            size, CONTROL_SAMPLE.itemsize))
+    n = (len(dat) - 8) // size
+    return np.frombuffer(dat[8:8 + n*size], CONTROL_SAMPLE), dropped
+
+
 def read_frame(f):
-    try:
-        ck = chunk.Chunk(f, False, False, True)
-    except EOFError:
-        return False, None
+    telemetry = []
+    while True:
+        try:
+            ck = chunk.Chunk(f, False, False, True)
+        except EOFError:
+            return False, None
+        if ck.getname() == b'TLM1':  # control ticks since the last frame
+            try:
+                telemetry.append(decode_tlm1(ck.read())[0])
+            except (ValueError, struct.error):
+                return False, None  # torn
+        elif ck.getname() not in (b'CIDX', b'CEND'):  # index, see below
+            break
+        ck.skip()
     if ck.getname() != b'CYCF':
         print("Not a cycloid IFF log file (got ", ck.getname(), "?)")
         return False, None
@@ -35,6 +126,8 @@ def read_frame(f):
     framedata = {
         'tstamp': ts[0] + ts[1] / 1000000.
     }
+    if telemetry:
+        framedata['telemetry'] = np.concatenate(telemetry)
 
     # read all embedded chunks
     while True:
@@ -66,6 +159,13 @@ def read_frame(f):
         elif n == b'MCL4':
             framedata['particles'] = np.frombuffer(
                 ick.read(), np.float32).reshape((-1, 4))
+        elif n == b'MCLd':  # delta+varint coded particles, likeliest first
+            framedata['particles'] = decode_mcld(ick.read())
+        elif n == b'MCLs':  # particle cloud summary
+            dat = struct.unpack("=I13f", ick.read())
+            framedata['particle_count'] = dat[0]
+            framedata['particle_mean'] = np.float32(dat[1:5])
+            framedata['particle_cov'] = np.float32(dat[5:14]).reshape((3, 3))
         elif n == b'aCDF':  # activation CDF, new thing
             framedata['activations'] = np.frombuffer(ick.read(), np.int32)
         elif n == b'LM01':  # expected landmark location
@@ -74,6 +174,10 @@ def read_frame(f):
             nP = c0c1.shape[0] // 2
             framedata['c0'] = c0c1[:nP]
             framedata['c1'] = c0c1[nP:]
+        elif n == b'TMon':  # exposure and arrival, CLOCK_MONOTONIC us
+            t_capture, t_arrival = struct.unpack("=qq", ick.read())
+            framedata['t_capture'] = t_capture / 1000000.
+            framedata['t_arrival'] = t_arrival / 1000000.
         elif n == b'CTLs':  # controller state
             framedata['controldata'] = struct.unpack("=17f", ick.read())
         elif n == b'CTL2':  # controller state
@@ -87,6 +191,13 @@ def read_frame(f):
                 break
             framedata['yuv420'] = np.frombuffer(
                 dat, np.uint8).reshape((-1, w))
+        elif n == b'YUVz':  # cropped and/or compressed frame
+            dat = ick.read()
+            try:
+                framedata['yuv420'], framedata['roi'] = decode_yuvz(dat)
+            except (ValueError, zlib.error, struct.error):
+                # short read or torn frame, just truncate file
+                break
         else:
             ick.skip()
 
@@ -114,28 +225,175 @@ class RecordIterator:
         return self.__next__()
 
 
+def read_telemetry(f):
+    """ every control loop tick in a recording, as one CONTROL_SAMPLE array,
+    and how many were dropped for want of room """
+    f.seek(0)
+    samples, dropped = [], 0
+    while True:
+        try:
+            ck = chunk.Chunk(f, False, False, True)
+        except EOFError:
+            break
+        if ck.getname() == b'TLM1':
+            try:
+                s, dropped = decode_tlm1(ck.read())
+            except (ValueError, struct.error):
+                break  # torn
+            samples.append(s)
+        ck.skip()
+    if not samples:
+        return np.zeros(0, CONTROL_SAMPLE), dropped
+    return np.concatenate(samples), dropped
+
+
+INDEX_ENTRY = np.dtype([('offset', '<i8'), ('sec', '<u4'), ('usec', '<u4')])
+
+
+def read_cidx(f, offset, size):
+    """ read the CIDX index chunk at offset, returning (prev, first, entries)
+    or None if there isn't a whole one there """
+    f.seek(offset)
+    hdr = f.read(20)
+    if len(hdr) < 20 or hdr[:4] != b'CIDX':
+        return None
+    length, prev, first = struct.unpack("=IqI", hdr[4:])
+    if length < 20 or (length - 20) % 16 or offset + length > size:
+        return None
+    n = (length - 20) // 16
+    entries = np.frombuffer(f.read(n * 16), INDEX_ENTRY)
+    if len(entries) != n or (entries['offset'] >= offset).any():
+        return None
+    return prev, first, entries
+
+
 class RecordScanner:
+    """ random access to the frames of a recording, by number or time.
+
+    The recorder writes a CIDX chunk listing the offset and timestamp of
+    every 64 frames, a CIDX listing all of them when it stops, and a CEND
+    chunk pointing at that. Files without the footer (torn by a crash or a
+    dead battery) are indexed from the last periodic CIDX and its
+    predecessors plus a scan of the frames after it, and files with no
+    index at all by scanning every chunk header. """
+
+    # how far back from the end of a torn file to look for a CIDX chunk
+    RECOVERY_SEARCH = 256 << 20
+
     def ScanIndex(self):
-        idx = []
-        while True:
-            idx.append(self.f.tell())
-            try:
-                ck = chunk.Chunk(self.f, False, False, True)
-            except EOFError:
-                return idx[:-1]
-            if ck.getname() != b'CYCF':
+        self.f.seek(0, 2)
+        size = self.f.tell()
+        entries = self.read_footer(size)
+        if entries is None:
+            entries = self.recover(size)
+        self.idx = entries['offset'].tolist()
+        self.tstamps = entries['sec'] + entries['usec'] / 1000000.
+        return self.idx
+
+    def read_footer(self, size):
+        if size < 16:
+            return None
+        self.f.seek(size - 16)
+        end = self.f.read(16)
+        if end[:8] != b'CEND\x10\x00\x00\x00':
+            return None
+        offset, = struct.unpack("=q", end[8:])
+        cidx = read_cidx(self.f, offset, size)
+        if cidx is None or cidx[1] != 0:
+            return None
+        return cidx[2]
+
+    def recover(self, size):
+        """ index a file with no footer: periodic index chunks, if any can
+        be found near the end, then a scan of the frames after them """
+        print("recordreader: no index footer, recovering")
+        chain, offset = [], self.find_last_cidx(size)
+        last = offset
+        while offset is not None and offset != -1:
+            cidx = read_cidx(self.f, offset, size)
+            if cidx is None:
+                break
+            chain.append(cidx)
+            offset = cidx[0]
+        chain.reverse()
+        # each chunk has to carry on where the one before left off
+        n = 0
+        for _, first, entries in chain:
+            if first != n:
+                chain = []
+                break
+            n += len(entries)
+        if chain:
+            self.f.seek(last + 4)
+            scan_from = last + struct.unpack("=I", self.f.read(4))[0]
+        else:
+            scan_from = self.start
+        pieces = [entries for _, _, entries in chain]
+        pieces.append(self.scan_frames(scan_from, size))
+        return np.concatenate(pieces)
+
+    def find_last_cidx(self, size):
+        """ offset of the last intact CIDX chunk, or None """
+        blocksize = 1 << 20
+        end = size
+        while end > 0 and size - end < self.RECOVERY_SEARCH:
+            start = max(0, end - blocksize)
+            self.f.seek(start)
+            # overlap blocks so a tag straddling the boundary is seen
+            buf = self.f.read(min(end + 3, size) - start)
+            i = len(buf)
+            while True:
+                i = buf.rfind(b'CIDX', 0, i)
+                if i == -1:
+                    break
+                # the tag could turn up inside compressed pixels; make sure
+                cidx = read_cidx(self.f, start + i, size)
+                if cidx is not None and (
+                        len(cidx[2]) == 0 or
+                        self.is_frame(cidx[2]['offset'][0])):
+                    return start + i
+            end = start
+        return None
+
+    def is_frame(self, offset):
+        if offset < 0:
+            return False
+        self.f.seek(offset)
+        return self.f.read(4) == b'CYCF'
+
+    def scan_frames(self, offset, size):
+        """ walk the chunk headers from offset, stopping at the first chunk
+        that runs off the end of the file """
+        f, entries = self.f, []
+        while offset + 16 <= size:
+            f.seek(offset)
+            hdr = f.read(16)
+            length, = struct.unpack("=I", hdr[4:8])
+            if length < 8 or offset + length > size:
+                break
+            if hdr[:4] == b'CYCF':
+                sec, usec = struct.unpack("=II", hdr[8:16])
+                entries.append((offset, sec, usec))
+            elif hdr[:4] not in (b'CIDX', b'CEND', b'TLM1'):
                 raise Exception("Not a cycloid IFF log file (got " +
-                                ck.getname() + "?)")
-            ck.skip()
+                                str(hdr[:4]) + "?)")
+            offset += length
+        return np.array(entries, INDEX_ENTRY)
 
     def __init__(self, f):
         self.f = f
         _, self.header = read_header(f)
-        self.idx = self.ScanIndex()
+        self.start = f.tell()  # the first frame, or where it would be
+        self.ScanIndex()
 
     def num_frames(self):
         return len(self.idx)
 
+    def find_time(self, t):
+        """ number of the last frame stamped at or before t (seconds since
+        the epoch, like a frame's 'tstamp'), or 0 """
+        return max(0, int(np.searchsorted(self.tstamps, t, 'right')) - 1)
+
     def frame(self, i):
         self.f.seek(self.idx[i], 0)
         ok, data = read_frame(self.f)
@@ -143,3 +401,6 @@ class RecordScanner:
             raise Exception("failed reading frame %d @ offset %d?" % (
                 i, self.idx[i]))
         return data
+
+    def frame_at(self, t):
+        return self.frame(self.find_time(t))